@@ -0,0 +1,621 @@
+/**
+ * loadgen - connection scale load generator.
+ *
+ * Opens thousands of synthetic peer connections against a running
+ * urtorrent from one epoll driven thread. Every peer performs the
+ * handshake of the torrent and then behaves as the mode says:
+ * - handshake: close and reconnect at once, connection churn
+ * - idle:      hold connection without sending anything
+ * - have:      flood HAVE messages of random pieces
+ * - request:   keep a window of block requests in flight
+ * - slowloris: dribble the handshake one byte per interval
+ *
+ * Reported: connect (accept queue) and handshake latency
+ * percentiles, served MB/s, messages sent and the thread count
+ * and resident memory of the target process when its pid is given.
+ *
+ * usage: loadgen -t torrent [-H host] [-P port] [-c connections]
+ *                [-m mode] [-d seconds] [-r connects per second]
+ *                [-w request window] [-i drip interval] [-p target pid]
+ *
+ */
+
+#include <metainfo.h>       /* metainfo file handle */
+#include <types.h>          /* PWP message helpers */
+#include <fstream>          /* std::ifstream */
+#include <algorithm>        /* std::sort() */
+#include <random>           /* std::mt19937 */
+#include <chrono>           /* std::chrono::steady_clock */
+#include <csignal>          /* signal() */
+#include <cerrno>           /* errno */
+#include <fcntl.h>          /* fcntl() */
+#include <netdb.h>          /* getaddrinfo() */
+#include <sys/epoll.h>      /* epoll syscalls */
+#include <sys/socket.h>     /* socket syscalls */
+#include <sys/resource.h>   /* setrlimit() */
+
+using namespace std;
+using namespace std::chrono;
+
+/***************** Constants *****************/
+static const string HANDSHAKE_MODE = "handshake"; /* connection churn */
+static const string IDLE_MODE = "idle";           /* idle connections */
+static const string HAVE_MODE = "have";           /* HAVE storm */
+static const string REQUEST_MODE = "request";     /* request flood */
+static const string SLOW_MODE = "slowloris";      /* dribbled handshake */
+static const int MAX_EVENTS = 1024;               /* events per epoll_wait() */
+static const int TICK_MS = 100;                   /* loop period */
+static const int ID_SUFFIX = 8;                   /* peer id bytes unique per peer */
+static const int HAVE_BATCH = 64;                 /* HAVE messages queued at a time */
+static const int BUFF_SIZE = 65536;               /* receive buffer */
+static const double BYTES_PER_MB = 1048576;       /* bytes in a megabyte */
+static const double SEC_PER_MS = 1000;            /* milliseconds in a second */
+
+/************** Global Variables **************/
+string port;          /* port reported by error_handle() */
+
+//State of a synthetic peer
+enum State {
+  S_CONNECTING,       /* non-blocking connect in progress */
+  S_HANDSHAKE,        /* handshake sent, waiting reply */
+  S_READY             /* handshake done, running mode */
+};
+
+//Synthetic peer connection
+struct Conn {
+  int fd;                           /* socket */
+  State state;                      /* connection state */
+  steady_clock::time_point start;   /* connect time */
+  steady_clock::time_point sent;    /* handshake sent time */
+  steady_clock::time_point drip;    /* next dribbled byte */
+  string handshake;                 /* handshake with own peer id */
+  string out;                       /* bytes to send */
+  size_t out_off;                   /* bytes of out sent */
+  string in;                        /* bytes received, unparsed */
+  size_t dripped;                   /* handshake bytes dribbled */
+  int window;                       /* requests in flight */
+};
+
+//Load generator settings and counters
+struct Load {
+  string mode;                      /* peer behaviour */
+  struct sockaddr_storage addr;     /* target address */
+  socklen_t addrlen;                /* target address length */
+  int epfd;                         /* epoll instance */
+  string handshake;                 /* handshake of torrent */
+  uint32_t pnum;                    /* number of pieces */
+  uint32_t plen;                    /* piece length */
+  uint32_t lplen;                   /* length of last piece */
+  int window;                       /* requests kept in flight */
+  int drip_ms;                      /* ms between dribbled bytes */
+  mt19937 rng;                      /* piece and id generator */
+  vector<double> connect_ms;        /* connect latencies */
+  vector<double> handshake_ms;      /* handshake latencies */
+  long long opened;                 /* connections attempted */
+  long long failed;                 /* connections failed */
+  long long closed;                 /* connections closed by target */
+  long long messages;               /* messages sent */
+  long long piece_bytes;            /* block bytes received */
+};
+
+/************ Internal Functions **************/
+static void open_conn(Load& load, vector<Conn*>& conns);
+static bool on_event(Load& load, Conn* conn, uint32_t events);
+static bool on_ready(Load& load, Conn* conn);
+static bool parse_messages(Load& load, Conn* conn);
+static void queue_mode(Load& load, Conn* conn);
+static void queue_request(Load& load, Conn* conn);
+static bool flush(Conn* conn);
+static void watch(Load& load, Conn* conn);
+static void close_conn(Load& load, Conn* conn);
+static void sample_target(pid_t pid, int& threads, long long& rss_kb);
+static double percentile(vector<double> v, double p);
+
+/**
+ * main - load generator driver function
+ *
+ * @argc: argument count
+ * @argv: argument vector
+ *
+ * return: 0 on success, 1 on usage error
+ */
+int main(int argc, char **argv)
+{
+  Load load;                       //settings and counters
+  string torrent;                  //metainfo file of target
+  string host = "127.0.0.1";       //target host
+  string tport = "6881";           //target port
+  int target = 1000;               //connections to hold
+  int secs = 30;                   //seconds of load
+  int rate = 1000;                 //connects per second
+  pid_t pid = 0;                   //target process, 0 if unknown
+  vector<Conn*> conns;             //open connections
+  struct epoll_event events[MAX_EVENTS]; //ready events
+  struct rlimit lim;               //descriptor limit
+  addrinfo hint = {};              //hint of getaddrinfo()
+  addrinfo *result;                //target address
+  steady_clock::time_point epoch;  //load start time
+  steady_clock::time_point sample; //next target sample
+  double elapsed;                  //seconds since start
+  long long budget = 0;            //connects allowed so far
+  int threads = 0;                 //max threads of target
+  long long rss = 0;               //max resident KB of target
+  int opt;                         //option character
+  int nev;                         //number of events
+
+  load.mode = IDLE_MODE;
+  load.window = 4;
+  load.drip_ms = 10000;
+  load.opened = load.failed = load.closed = 0;
+  load.messages = load.piece_bytes = 0;
+
+  while ((opt = getopt(argc, argv, "t:H:P:c:m:d:r:w:i:p:")) != -1) {
+    switch (opt) {
+      case 't': torrent = optarg; break;
+      case 'H': host = optarg; break;
+      case 'P': tport = optarg; break;
+      case 'c': target = atoi(optarg); break;
+      case 'm': load.mode = optarg; break;
+      case 'd': secs = atoi(optarg); break;
+      case 'r': rate = atoi(optarg); break;
+      case 'w': load.window = atoi(optarg); break;
+      case 'i': load.drip_ms = atoi(optarg); break;
+      case 'p': pid = atoi(optarg); break;
+      default: torrent.clear(); optind = argc; break;
+    }
+  }
+  if (torrent.empty() || target < 1 || rate < 1 || load.window < 1 ||
+      (load.mode != HANDSHAKE_MODE && load.mode != IDLE_MODE &&
+       load.mode != HAVE_MODE && load.mode != REQUEST_MODE &&
+       load.mode != SLOW_MODE)) {
+    cerr << "usage: loadgen -t torrent [-H host] [-P port] [-c connections]\n"
+         << "               [-m handshake|idle|have|request|slowloris]\n"
+         << "               [-d seconds] [-r connects per second]\n"
+         << "               [-w request window] [-i drip interval ms]\n"
+         << "               [-p target pid]\n";
+    return 1;
+  }
+
+  //torrent of target, peer id is generated by metainfo
+  port = tport;
+  metainfo mi(torrent, tport);
+  load.handshake.resize(HS_LEN);
+  hs_message(&load.handshake[0], mi.get_infohash(), mi.get_peerid());
+  load.pnum = mi.get_piece_num();
+  load.plen = mi.get_piece_size();
+  load.lplen = mi.get_last_psize();
+  load.rng.seed(getpid());
+
+  //target address
+  hint.ai_family = AF_INET;
+  hint.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), tport.c_str(), &hint, &result))
+    error_handle(ERR_IP);
+  memcpy(&load.addr, result->ai_addr, result->ai_addrlen);
+  load.addrlen = result->ai_addrlen;
+  freeaddrinfo(result);
+
+  //one descriptor per connection
+  if (!getrlimit(RLIMIT_NOFILE, &lim)) {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  load.epfd = epoll_create1(0);
+  if (load.epfd < 0)
+    error_handle(ERR_SYS);
+
+  epoch = steady_clock::now();
+  sample = epoch;
+  for (;;) {
+    elapsed = duration_cast<duration<double>>(steady_clock::now()-epoch).count();
+    if (elapsed >= secs)
+      break;
+
+    //ramp up at connect rate, churned peers count too
+    budget = max(budget, (long long)(elapsed*rate)+1);
+    while ((int)conns.size() < target && load.opened < budget)
+      open_conn(load, conns);
+
+    nev = epoll_wait(load.epfd, events, MAX_EVENTS, TICK_MS);
+    for (int i = 0; i < nev; i++) {
+      Conn* conn = (Conn*)events[i].data.ptr;
+
+      if (!on_event(load, conn, events[i].events))
+        close_conn(load, conn);
+    }
+
+    //dribbled handshakes and closed connections
+    for (unsigned int i = 0; i < conns.size(); ) {
+      Conn* conn = conns[i];
+
+      if (conn->fd >= 0 && load.mode == SLOW_MODE &&
+          conn->state == S_HANDSHAKE && conn->dripped < (size_t)HS_LEN &&
+          steady_clock::now() >= conn->drip) {
+        conn->out.push_back(conn->handshake[conn->dripped++]);
+        conn->drip = steady_clock::now()+milliseconds(load.drip_ms);
+        if (!flush(conn))
+          close_conn(load, conn);
+      }
+
+      if (conn->fd < 0) {
+        delete conn;
+        conns[i] = conns.back();
+        conns.pop_back();
+      }
+      else {
+        i++;
+      }
+    }
+
+    //target footprint once a second
+    if (pid && steady_clock::now() >= sample) {
+      int th = 0;        //threads now
+      long long kb = 0;  //resident KB now
+
+      sample_target(pid, th, kb);
+      threads = max(threads, th);
+      rss = max(rss, kb);
+      sample += seconds(1);
+    }
+  }
+
+  //report
+  cout << fixed << setprecision(2);
+  cout << "mode " << load.mode << ", " << conns.size() << " open, "
+       << load.opened << " opened, " << load.failed << " failed, "
+       << load.closed << " closed by target" << endl;
+  if (!load.connect_ms.empty())
+    cout << "connect ms p50 " << percentile(load.connect_ms, 50)
+         << ", p99 " << percentile(load.connect_ms, 99)
+         << ", max " << percentile(load.connect_ms, 100) << endl;
+  if (!load.handshake_ms.empty())
+    cout << "handshake ms p50 " << percentile(load.handshake_ms, 50)
+         << ", p99 " << percentile(load.handshake_ms, 99)
+         << ", max " << percentile(load.handshake_ms, 100)
+         << " (" << load.handshake_ms.size() << " handshakes)" << endl;
+  cout << "messages sent " << load.messages << ", served "
+       << load.piece_bytes/BYTES_PER_MB/elapsed << " MB/s" << endl;
+  if (pid)
+    cout << "target max threads " << threads << ", max rss "
+         << rss/1024.0 << " MB" << endl;
+
+  for (unsigned int i = 0; i < conns.size(); i++) {
+    close_conn(load, conns[i]);
+    delete conns[i];
+  }
+  close(load.epfd);
+  return 0;
+}
+
+/**
+ * Start a non-blocking connect of a new peer
+ *
+ * @load: settings and counters
+ * @conns: open connections
+ */
+static void open_conn(Load& load, vector<Conn*>& conns)
+{
+  Conn* conn = new Conn();  //new peer
+  char suffix[ID_SUFFIX+1]; //unique end of peer id
+
+  //every peer has its own id, the target keys peers by id
+  load.opened++;
+  snprintf(suffix, sizeof(suffix), "%08llx", load.opened);
+  conn->handshake = load.handshake;
+  conn->handshake.replace(HS_LEN-ID_SUFFIX, ID_SUFFIX, suffix);
+  conn->start = steady_clock::now();
+  conn->state = S_CONNECTING;
+  conn->window = 0;
+  conn->fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0);
+  if (conn->fd < 0) {
+    load.failed++;
+    delete conn;
+    return;
+  }
+
+  if (connect(conn->fd, (struct sockaddr*)&load.addr, load.addrlen) &&
+      errno != EINPROGRESS) {
+    load.failed++;
+    close(conn->fd);
+    delete conn;
+    return;
+  }
+
+  conns.push_back(conn);
+  watch(load, conn);
+}
+
+/**
+ * Handle readiness of a peer socket
+ *
+ * @load: settings and counters
+ * @conn: peer
+ * @events: epoll events
+ *
+ * Return: false if connection is to be closed
+ */
+static bool on_event(Load& load, Conn* conn, uint32_t events)
+{
+  char buff[BUFF_SIZE];  //receive buffer
+  ssize_t len;           //bytes read
+  int err = 0;           //connect result
+  socklen_t elen = sizeof(err);
+
+  if (conn->fd < 0)
+    return true;
+
+  //connect completed
+  if (conn->state == S_CONNECTING) {
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &elen) || err) {
+      load.failed++;
+      return false;
+    }
+
+    load.connect_ms.push_back(duration_cast<duration<double>>(
+      steady_clock::now()-conn->start).count()*SEC_PER_MS);
+    conn->state = S_HANDSHAKE;
+    conn->sent = steady_clock::now();
+    conn->drip = conn->sent;
+    if (load.mode != SLOW_MODE)
+      conn->out = conn->handshake;
+  }
+
+  if (events & EPOLLIN) {
+    while ((len = read(conn->fd, buff, BUFF_SIZE)) > 0)
+      conn->in.append(buff, len);
+    if (!len || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      load.closed++;
+      return false;
+    }
+    if (!parse_messages(load, conn))
+      return false;
+  }
+
+  if (events & (EPOLLERR|EPOLLHUP)) {
+    load.closed++;
+    return false;
+  }
+
+  if (!flush(conn))
+    return false;
+  watch(load, conn);
+  return true;
+}
+
+/**
+ * Peer finished handshake, record latency and
+ * start mode behaviour.
+ *
+ * @load: settings and counters
+ * @conn: peer
+ *
+ * Return: false if connection is to be closed
+ */
+static bool on_ready(Load& load, Conn* conn)
+{
+  load.handshake_ms.push_back(duration_cast<duration<double>>(
+    steady_clock::now()-conn->sent).count()*SEC_PER_MS);
+  conn->state = S_READY;
+
+  //churn: a new peer takes the place
+  if (load.mode == HANDSHAKE_MODE)
+    return false;
+
+  if (load.mode == REQUEST_MODE) {
+    char buff[PF_LEN+ID_LEN];            //interested message
+    uint32_t len_prefix = htonl(COMM_LEN); //length prefix
+
+    memcpy(buff, &len_prefix, PF_LEN);
+    buff[PF_LEN] = INTERESTED;
+    conn->out.append(buff, PF_LEN+ID_LEN);
+    load.messages++;
+  }
+
+  queue_mode(load, conn);
+  return true;
+}
+
+/**
+ * Consume handshake reply and complete messages
+ *
+ * @load: settings and counters
+ * @conn: peer
+ *
+ * Return: false if connection is to be closed
+ */
+static bool parse_messages(Load& load, Conn* conn)
+{
+  size_t pos = 0;     //parsed bytes
+  uint32_t size;      //message length
+
+  if (conn->state == S_HANDSHAKE) {
+    if (conn->in.size() < (size_t)HS_LEN)
+      return true;
+    if (conn->in.compare(HASH_OFFSET, SHA_DIGEST_LENGTH, load.handshake,
+                         HASH_OFFSET, SHA_DIGEST_LENGTH)) {
+      load.failed++;
+      return false;
+    }
+    pos = HS_LEN;
+    if (!on_ready(load, conn))
+      return false;
+  }
+
+  while (conn->in.size()-pos >= (size_t)PF_LEN) {
+    memcpy(&size, conn->in.data()+pos, PF_LEN);
+    size = ntohl(size);
+    if (conn->in.size()-pos-PF_LEN < size)
+      break;
+
+    //count served blocks, ask for the next one
+    if (size > PIC_LEN && conn->in[pos+PF_LEN] == PIECE) {
+      load.piece_bytes += size-PIC_LEN;
+      conn->window--;
+      queue_mode(load, conn);
+    }
+    pos += PF_LEN+size;
+  }
+
+  conn->in.erase(0, pos);
+  return true;
+}
+
+/**
+ * Queue messages of mode behaviour
+ *
+ * @load: settings and counters
+ * @conn: peer
+ */
+static void queue_mode(Load& load, Conn* conn)
+{
+  char buff[PF_LEN+HAV_LEN];  //have message
+  uint32_t val;               //integer in network order
+
+  if (conn->state != S_READY)
+    return;
+
+  if (load.mode == REQUEST_MODE) {
+    while (conn->window < load.window)
+      queue_request(load, conn);
+  }
+  else if (load.mode == HAVE_MODE && conn->out_off >= conn->out.size()) {
+    conn->out.clear();
+    conn->out_off = 0;
+    for (int i = 0; i < HAVE_BATCH; i++) {
+      val = htonl(HAV_LEN);
+      memcpy(buff, &val, PF_LEN);
+      buff[PF_LEN] = HAVE;
+      val = htonl(load.rng()%load.pnum);
+      memcpy(buff+HD_LEN, &val, IBL_LEN);
+      conn->out.append(buff, PF_LEN+HAV_LEN);
+    }
+    load.messages += HAVE_BATCH;
+  }
+}
+
+/**
+ * Queue request of a random block
+ *
+ * @load: settings and counters
+ * @conn: peer
+ */
+static void queue_request(Load& load, Conn* conn)
+{
+  char buff[PF_LEN+REQ_LEN];  //request message
+  uint32_t index;             //piece index
+  uint32_t begin;             //block offset
+  uint32_t psize;             //size of piece
+  size_t len;                 //message length
+
+  index = load.rng()%load.pnum;
+  psize = (index == load.pnum-1) ? load.lplen : load.plen;
+  begin = (load.rng()%((psize+BLOCK_SIZE-1)/BLOCK_SIZE))*BLOCK_SIZE;
+
+  len = request_message(buff, index, begin, min(BLOCK_SIZE, psize-begin));
+  conn->out.append(buff, len);
+  conn->window++;
+  load.messages++;
+}
+
+/**
+ * Send queued bytes until socket would block
+ *
+ * @conn: peer
+ *
+ * Return: false on socket error
+ */
+static bool flush(Conn* conn)
+{
+  ssize_t len;  //bytes sent
+
+  while (conn->out_off < conn->out.size()) {
+    len = send(conn->fd, conn->out.data()+conn->out_off,
+               conn->out.size()-conn->out_off, MSG_NOSIGNAL);
+    if (len < 0)
+      return (errno == EAGAIN || errno == EWOULDBLOCK);
+    conn->out_off += len;
+  }
+
+  conn->out.clear();
+  conn->out_off = 0;
+  return true;
+}
+
+/**
+ * Register interest of a peer socket, writability is
+ * watched while connecting, sending or storming.
+ *
+ * @load: settings and counters
+ * @conn: peer
+ */
+static void watch(Load& load, Conn* conn)
+{
+  struct epoll_event ev = {};  //interest
+
+  ev.data.ptr = conn;
+  ev.events = EPOLLIN;
+  if (conn->state == S_CONNECTING || !conn->out.empty() ||
+      (load.mode == HAVE_MODE && conn->state == S_READY))
+    ev.events |= EPOLLOUT;
+
+  if (epoll_ctl(load.epfd, EPOLL_CTL_MOD, conn->fd, &ev) &&
+      epoll_ctl(load.epfd, EPOLL_CTL_ADD, conn->fd, &ev))
+    error_handle(ERR_SYS);
+
+  //a storm refills its queue on every writable event
+  if (load.mode == HAVE_MODE)
+    queue_mode(load, conn);
+}
+
+/**
+ * Close a peer socket, the peer is released by main loop
+ *
+ * @load: settings and counters
+ * @conn: peer
+ */
+static void close_conn(Load& load, Conn* conn)
+{
+  if (conn->fd < 0)
+    return;
+  epoll_ctl(load.epfd, EPOLL_CTL_DEL, conn->fd, nullptr);
+  close(conn->fd);
+  conn->fd = -1;
+}
+
+/**
+ * Read thread count and resident memory of a process
+ *
+ * @pid: process id
+ * @threads: number of threads
+ * @rss_kb: resident set size in KB
+ */
+static void sample_target(pid_t pid, int& threads, long long& rss_kb)
+{
+  ifstream status("/proc/"+to_string(pid)+"/status");  //process status
+  string key;                                           //field name
+
+  while (status >> key) {
+    if (key == "Threads:")
+      status >> threads;
+    else if (key == "VmRSS:")
+      status >> rss_kb;
+  }
+}
+
+/**
+ * Nearest rank percentile
+ *
+ * @v: samples
+ * @p: percentile in (0, 100]
+ */
+static double percentile(vector<double> v, double p)
+{
+  size_t rank;  //rank of percentile
+
+  sort(v.begin(), v.end());
+  rank = (size_t)(p/100*v.size()+0.999999);
+  if (rank < 1) rank = 1;
+  return v[min(rank, v.size())-1];
+}
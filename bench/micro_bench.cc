@@ -0,0 +1,439 @@
+/**
+ * micro_bench - micro-benchmarks of hot kernels.
+ *
+ * Kernels are run in batches, doubling the batch until it lasts
+ * at least the minimal time, and results are written as JSON
+ * with ns/op and bytes/op so that they can be compared across
+ * releases. Kernels measured:
+ * - be_decoden on a metainfo file and on a tracker reply
+ * - metainfo parsing
+ * - SHA1 piece verification
+ * - piece count update and rarest first selection of core
+ * - request and piece message encoding and decoding
+ * - piece read cache lookup and fill
+ * - timer start and stop
+ * - metrics counter and histogram recording
+ * - trace event recording
+ *
+ * The metainfo file is created from a random payload unless
+ * one is given, its pieces size the piece count kernels.
+ *
+ * usage: micro_bench [-b payload bytes] [-t torrent] [-m min seconds]
+ *                    [-f name filter] [-o json file]
+ *
+ */
+
+#include <core.h>           /* metainfo, timer and PWP message kernels */
+#include <creator.h>        /* metainfo file creator */
+#include <fstream>          /* std::ifstream and std::ofstream */
+#include <sstream>          /* std::ostringstream */
+#include <climits>          /* INT_MAX and LLONG_MAX */
+#include <random>           /* std::mt19937 */
+#include <cstdlib>          /* mkdtemp() */
+
+using namespace std;
+using namespace std::chrono;
+
+/***************** Constants *****************/
+static const string PAYLOAD = "payload.bin";     /* payload file name */
+static const string TORRENT = "bench.torrent";   /* metainfo file name */
+static const string ANNOUNCE = "http://127.0.0.1:6969/announce"; /* announce URL */
+static const string PORT = "6881";               /* port of parsed metainfo */
+static const int REPLY_PEERS = 50;               /* peers in tracker reply */
+static const int PEER_LEN = 6;                   /* bytes of compact peer */
+static const int SWARM = 50;                     /* peers counted by rarest first */
+static const long long TIMER_CAP = 2000;         /* timer ops per batch, each spawns a thread */
+static const int BUFF_SIZE = 1048576;            /* payload generation buffer */
+static const int CACHED = 64;                    /* pieces read cache holds */
+
+/************** Global Variables **************/
+string port;           /* port reported by error_handle() */
+
+//Timeout target of timer benchmark
+struct Tick {
+  void fire() {}
+};
+
+//Result of a benchmark
+struct Result {
+  string name;         /* kernel name */
+  long long iters;     /* operations in final batch */
+  double ns;           /* nanoseconds per operation */
+  double bytes;        /* bytes processed per operation */
+};
+
+static vector<Result> results;  /* finished benchmarks */
+static double min_time = 0.5;   /* seconds a batch must last */
+static string filter;           /* run names containing filter */
+static volatile long long sink; /* keeps results alive */
+
+/************ Internal Functions **************/
+static string read_file(string file);
+static void make_payload(string file, long long size);
+static string tracker_reply(int npeers);
+static void write_json(ostream& out, const metainfo& mi, size_t torrent_len);
+
+/**
+ * Run a kernel in growing batches until a batch lasts
+ * min_time, and record time per operation of that batch.
+ *
+ * @name: kernel name
+ * @bytes: bytes processed by an operation
+ * @op: callable running n operations
+ * @cap: maximum batch size
+ */
+template<typename F>
+static void run(string name, double bytes, F&& op, long long cap = LLONG_MAX)
+{
+  long long iters = 1;  //batch size
+  double elapsed;       //seconds of batch
+
+  if (!filter.empty() && name.find(filter) == string::npos)
+    return;
+
+  //warm up caches and allocator
+  op(1);
+
+  for (;;) {
+    steady_clock::time_point epoch = steady_clock::now();
+    op(iters);
+    elapsed = duration_cast<duration<double>>(steady_clock::now()-epoch).count();
+    if (elapsed >= min_time || iters >= cap)
+      break;
+
+    //aim past min_time, at least double
+    iters = min(cap, max(iters*2,
+                (long long)(iters*min_time*1.2/max(elapsed, 1e-9))));
+  }
+
+  results.push_back({name, iters, elapsed*1e9/iters, bytes});
+  cerr << name << ": " << elapsed*1e9/iters << " ns/op ("
+       << iters << " ops)" << endl;
+}
+
+/**
+ * main - micro-benchmark driver function
+ *
+ * @argc: argument count
+ * @argv: argument vector
+ *
+ * return: 0 on success, 1 on usage error
+ */
+int main(int argc, char **argv)
+{
+  long long bytes = 32*1048576LL;  //payload size
+  string torrent;                  //metainfo file to decode
+  string output;                   //JSON file, empty for stdout
+  char dir[] = "/tmp/micro_benchXXXXXX"; //scratch directory
+  string meta;                     //bytes of metainfo file
+  string reply;                    //bytes of tracker reply
+  string piece;                    //first piece of payload
+  int opt;                         //option character
+
+  while ((opt = getopt(argc, argv, "b:t:m:f:o:")) != -1) {
+    switch (opt) {
+      case 'b': bytes = atoll(optarg); break;
+      case 't': torrent = optarg; break;
+      case 'm': min_time = atof(optarg); break;
+      case 'f': filter = optarg; break;
+      case 'o': output = optarg; break;
+      default:
+        cerr << "usage: micro_bench [-b payload bytes] [-t torrent] "
+             << "[-m min seconds] [-f name filter] [-o json file]\n";
+        return 1;
+    }
+  }
+  if (bytes <= 0 || min_time <= 0)
+    error_handle(ERR_USAGE);
+
+  //payload and its metainfo
+  if (!mkdtemp(dir))
+    error_handle(ERR_SYS);
+  make_payload(string(dir)+"/"+PAYLOAD, bytes);
+  creator maker(string(dir)+"/"+PAYLOAD, ANNOUNCE, 0);
+  maker.make(string(dir)+"/"+TORRENT);
+  if (torrent.empty())
+    torrent = string(dir)+"/"+TORRENT;
+
+  metainfo mi(string(dir)+"/"+TORRENT, PORT);
+  meta = read_file(torrent);
+  reply = tracker_reply(REPLY_PEERS);
+  piece = read_file(string(dir)+"/"+PAYLOAD).substr(0, mi.get_piece_size());
+
+  //bencode decoding
+  run("be_decoden/torrent", meta.size(), [&](long long n) {
+    for (long long i = 0; i < n; i++) {
+      be_node* node = be_decoden(meta.data(), meta.size());
+      sink += node->type;
+      be_free(node);
+    }
+  });
+
+  run("be_decoden/tracker_reply", reply.size(), [&](long long n) {
+    for (long long i = 0; i < n; i++) {
+      be_node* node = be_decoden(reply.data(), reply.size());
+      sink += node->type;
+      be_free(node);
+    }
+  });
+
+  //metainfo parsing, as done at start up
+  run("metainfo/parse", meta.size(), [&](long long n) {
+    for (long long i = 0; i < n; i++) {
+      metainfo parsed(torrent, PORT);
+      sink += parsed.get_piece_num();
+    }
+  });
+
+  //piece verification of receiver::validate_piece()
+  run("sha1/verify_piece", piece.size(), [&](long long n) {
+    unsigned char hash[SHA_DIGEST_LENGTH];  //piece digest
+
+    for (long long i = 0; i < n; i++) {
+      SHA1((const unsigned char*)piece.data(), piece.size(), hash);
+      sink += mi.match_piecehash(0, hash);
+    }
+  });
+
+  //piece counts of core, locked as core does
+  {
+    uint32_t pnum = mi.get_piece_num();       //number of pieces
+    size_t bflen = (pnum+BYTE_LEN-1)/BYTE_LEN; //bytes of bitfield
+    vector<vector<char>> bfs(SWARM, vector<char>(bflen)); //peer bitfields
+    vector<int> pcount(pnum);                 //count of each piece
+    vector<uint32_t> seqs;                    //rarest pieces
+    pthread_rwlock_t bflock;                  //bitfield lock
+    pthread_rwlock_t pclock;                  //piece count lock
+    mt19937 rng(pnum);                        //deterministic generator
+
+    pthread_rwlock_init(&bflock, nullptr);
+    pthread_rwlock_init(&pclock, nullptr);
+    for (unsigned int p = 0; p < bfs.size(); p++)
+      for (size_t i = 0; i < bflen; i++)
+        bfs[p][i] = (char)rng();
+
+    run("core/update_pcount", bflen, [&](long long n) {
+      for (long long i = 0; i < n; i++) {
+        acquire_reader(&bflock);
+        acquire_writer(&pclock);
+        count_pieces(pcount.data(), bfs[i%SWARM].data(), pnum);
+        release_rwlock(&pclock);
+        release_rwlock(&bflock);
+      }
+    });
+
+    //a swarm of counts, a quarter of pieces at local
+    for (uint32_t i = 0; i < pnum; i++)
+      pcount[i] = (rng()%4) ? (int)(rng()%SWARM) : INT_MAX;
+
+    run("core/rarest_first", pnum*sizeof(int), [&](long long n) {
+      for (long long i = 0; i < n; i++) {
+        acquire_reader(&pclock);
+        rarest_pieces(pcount.data(), pnum, seqs);
+        release_rwlock(&pclock);
+        srand(time(nullptr));
+        sink += seqs[rand()%seqs.size()];
+      }
+    });
+
+    pthread_rwlock_destroy(&bflock);
+    pthread_rwlock_destroy(&pclock);
+  }
+
+  //peer wire messages
+  {
+    vector<char> buff(PF_LEN+PIC_LEN+BLOCK_SIZE); //message buffer
+    uint32_t index;   //decoded piece index
+    uint32_t begin;   //decoded block offset
+    uint32_t length;  //decoded block length
+
+    run("receiver/send_request_encode", PF_LEN+REQ_LEN, [&](long long n) {
+      for (long long i = 0; i < n; i++)
+        sink += request_message(buff.data(), i, 0, BLOCK_SIZE);
+    });
+
+    request_message(buff.data(), 1, BLOCK_SIZE, BLOCK_SIZE);
+    run("sender/request_decode", REQ_LEN-ID_LEN, [&](long long n) {
+      for (long long i = 0; i < n; i++) {
+        parse_request(buff.data()+HD_LEN, index, begin, length);
+        sink += index+begin+length;
+      }
+    });
+
+    run("sender/upload_encode", PF_LEN+PIC_LEN+BLOCK_SIZE, [&](long long n) {
+      for (long long i = 0; i < n; i++)
+        sink += piece_message(buff.data(), 0, 0,
+                              (const unsigned char*)piece.data(),
+                              min((size_t)BLOCK_SIZE, piece.size()));
+    });
+  }
+
+  //read cache looked up for every uploaded block
+  {
+    piece_cache cache(CACHED*piece.size());        //cache under test
+    piece_cache::Piece data(new string(piece));    //piece cached
+
+    for (uint32_t i = 0; i < CACHED; i++)
+      cache.put(0, i, data);
+
+    run("piece_cache/get_hit", BLOCK_SIZE, [&](long long n) {
+      for (long long i = 0; i < n; i++)
+        sink += cache.get(0, i%CACHED)->size();
+    });
+
+    //pieces streamed through, every put evicts
+    run("piece_cache/put_evict", 0, [&](long long n) {
+      for (long long i = 0; i < n; i++)
+        cache.put(0, CACHED+i, data);
+    });
+  }
+
+  //keep alive timer around every select() of receiver
+  {
+    Tick tick;                 //timeout target
+    timer t(&Tick::fire, &tick); //timer under test
+
+    run("timer/start_stop", 0, [&](long long n) {
+      for (long long i = 0; i < n; i++) {
+        t.start((int)core::ALIVE_PERD_);
+        t.stop();
+      }
+    }, TIMER_CAP);
+  }
+
+  //recorded around every peer wire message
+  run("metrics/add", 0, [&](long long n) {
+    for (long long i = 0; i < n; i++)
+      metrics::add(metrics::BYTES_DOWN, BLOCK_SIZE);
+  });
+
+  run("metrics/observe", 0, [&](long long n) {
+    for (long long i = 0; i < n; i++)
+      metrics::observe(metrics::REQUEST_RTT, nanoseconds(i));
+  });
+
+  //recorded at every step of a piece
+  trace::enable(true);
+  run("trace/record", 0, [&](long long n) {
+    for (long long i = 0; i < n; i++)
+      trace::record(trace::REQUESTED, i, BLOCK_SIZE);
+  });
+  trace::enable(false);
+
+  //report
+  if (output.empty()) {
+    write_json(cout, mi, meta.size());
+  }
+  else {
+    ofstream out(output);
+    write_json(out, mi, meta.size());
+    if (!out.good())
+      error_handle(ERR_WRITE);
+  }
+
+  remove((string(dir)+"/"+PAYLOAD).c_str());
+  remove((string(dir)+"/"+TORRENT).c_str());
+  rmdir(dir);
+  return 0;
+}
+
+/**
+ * Read whole file into a string
+ *
+ * @file: file path
+ */
+static string read_file(string file)
+{
+  ifstream in(file, ifstream::binary);  //file stream
+  ostringstream data;                   //file content
+
+  if (!in)
+    error_handle(ERR_SYS);
+  data << in.rdbuf();
+  return data.str();
+}
+
+/**
+ * Write random bytes to payload file
+ *
+ * @file: payload path
+ * @size: payload size
+ */
+static void make_payload(string file, long long size)
+{
+  mt19937_64 rng(size);                   //deterministic generator
+  vector<unsigned long long> buff(BUFF_SIZE/sizeof(unsigned long long));
+  ofstream out(file, (ofstream::out|ofstream::binary|ofstream::trunc));
+  long long left = size;                  //bytes left to write
+  long long chunk;                        //bytes written at a time
+
+  while (left > 0) {
+    for (unsigned int i = 0; i < buff.size(); i++)
+      buff[i] = rng();
+    chunk = min(left, (long long)BUFF_SIZE);
+    out.write((const char*)buff.data(), chunk);
+    left -= chunk;
+  }
+
+  out.close();
+  if (!out.good())
+    error_handle(ERR_WRITE);
+}
+
+/**
+ * Bencode a compact announce reply as sent by trackers
+ *
+ * @npeers: number of peers in reply
+ */
+static string tracker_reply(int npeers)
+{
+  be_node* dict = be_create_dict();  //reply dictionary
+  string peers;                      //compact peers
+  string retval;                     //encoded reply
+  char* buff;                        //encoded bytes
+  long long len;                     //encoded length
+
+  for (int i = 0; i < npeers; i++) {
+    char addr[PEER_LEN] = {10, 0, (char)(i >> 8), (char)i, 0x1a, (char)0xe1};
+    peers.append(addr, PEER_LEN);
+  }
+
+  be_dict_add(dict, "interval", be_create_int(1800));
+  be_dict_add(dict, "min interval", be_create_int(900));
+  be_dict_add(dict, "complete", be_create_int(npeers/2));
+  be_dict_add(dict, "incomplete", be_create_int(npeers-npeers/2));
+  be_dict_add(dict, "peers", be_create_str(peers.data(), peers.size()));
+
+  buff = be_encode(dict, &len);
+  retval.assign(buff, len);
+  free(buff);
+  be_free(dict);
+  return retval;
+}
+
+/**
+ * Write results and their context as JSON
+ *
+ * @out: output stream
+ * @mi: metainfo of generated payload
+ * @torrent_len: bytes of decoded metainfo file
+ */
+static void write_json(ostream& out, const metainfo& mi, size_t torrent_len)
+{
+  metainfo& m = const_cast<metainfo&>(mi);  //getters are not const
+
+  out << "{\n  \"context\": {\"pieces\": " << m.get_piece_num()
+      << ", \"piece_length\": " << m.get_piece_size()
+      << ", \"torrent_bytes\": " << torrent_len
+      << ", \"min_time\": " << min_time << "},\n";
+  out << "  \"benchmarks\": [";
+  for (unsigned int i = 0; i < results.size(); i++) {
+    out << (i ? ",\n" : "\n") << "    {\"name\": \"" << results[i].name
+        << "\", \"iterations\": " << results[i].iters
+        << ", \"ns_per_op\": " << fixed << setprecision(2) << results[i].ns
+        << ", \"bytes_per_op\": " << setprecision(0) << results[i].bytes << "}";
+    out.unsetf(ios_base::floatfield);
+    out << setprecision(6);
+  }
+  out << "\n  ]\n}" << endl;
+}
@@ -0,0 +1,465 @@
+/**
+ * swarm_bench - loopback swarm throughput benchmark.
+ *
+ * Generates a random payload, creates its metainfo file and
+ * runs an embedded tracker in this process. Seeders and then
+ * leechers are started as child urtorrent processes on the
+ * loopback interface, each in its own working directory.
+ *
+ * Reported once every leecher holds a verified copy:
+ * - aggregate download throughput in MB/s
+ * - time to complete percentiles of leechers
+ * - CPU time of all clients (wait4 rusage) per MB
+ * - read/write syscalls of all clients (/proc/<pid>/io) per MB
+ *
+ * A scenario file puts every client behind an emulated link
+ * (see netem.h), one line per target, later lines override:
+ *
+ *   # target  settings
+ *   *         latency=40 rate=1024 loss=0.1
+ *   seed      rate=4096
+ *   3         latency=150
+ *
+ * target is '*', 'seed', 'leech' or a client index (seeders
+ * first), latency in ms, rate and burst in KB/s and KB, loss
+ * in percent of segments.
+ *
+ * usage: swarm_bench [-s seeders] [-l leechers] [-b bytes]
+ *                    [-p piece length] [-P base port] [-t timeout]
+ *                    [-u urtorrent binary] [-d work dir]
+ *                    [-n scenario file]
+ *
+ */
+
+#include <creator.h>        /* metainfo file creator */
+#include <tracker_server.h> /* embedded tracker */
+#include <netem.h>          /* network emulator */
+#include <iostream>         /* std::cout */
+#include <iomanip>          /* std::setprecision() */
+#include <fstream>          /* std::ifstream and std::ofstream */
+#include <sstream>          /* std::istringstream */
+#include <algorithm>        /* std::sort() */
+#include <random>           /* std::mt19937_64 */
+#include <chrono>           /* std::chrono::steady_clock */
+#include <thread>           /* std::this_thread::sleep_for() */
+#include <climits>          /* PATH_MAX */
+#include <cstdlib>          /* realpath() */
+#include <unistd.h>         /* fork(), execl(), pipe() and getopt() */
+#include <fcntl.h>          /* open() */
+#include <signal.h>         /* kill() */
+#include <sys/stat.h>       /* stat() and mkdir() */
+#include <sys/wait.h>       /* wait4() */
+#include <sys/resource.h>   /* struct rusage */
+
+using namespace std;
+using namespace std::chrono;
+
+/***************** Constants *****************/
+static const string TORRENT = "bench.torrent";   /* metainfo file name */
+static const string PAYLOAD = "payload.bin";     /* payload file name */
+static const string LOG = "client.log";          /* client output file */
+static const string QUIT = "quit\n";             /* client quit command */
+static const string ALL = "*";                   /* scenario target of all clients */
+static const string SEEDS = "seed";              /* scenario target of seeders */
+static const string LEECHES = "leech";           /* scenario target of leechers */
+static const double BYTES_PER_MB = 1048576;      /* bytes in a megabyte */
+static const int POLL_MS = 10;                   /* completion polling period */
+static const int ANNOUNCE_WAIT = 10;             /* seconds seeders may take to announce */
+static const int QUIT_WAIT = 10;                 /* seconds clients may take to quit */
+static const int BUFF_SIZE = 1048576;            /* payload generation buffer */
+
+/************** Global Variables **************/
+string port;          /* port reported by error_handle() */
+
+//A urtorrent child process
+struct Node {
+  pid_t pid;          /* process id */
+  int cmd;            /* write end of its standard input */
+  string dir;         /* working directory */
+  bool seeder;        /* started with whole payload */
+  bool done;          /* leecher completed */
+  double ttc;         /* seconds to complete */
+  time_point<steady_clock> start; /* spawn time */
+  long long syscalls; /* read and write syscalls */
+  double cpu;         /* user and system seconds */
+};
+
+/************ Internal Functions **************/
+static void make_payload(string file, long long size);
+static void load_scenario(string file, vector<Node>& nodes,
+                          vector<netem::Shape>& shapes);
+static void spawn(Node& node, string binary, int port, int advert);
+static long long read_syscalls(pid_t pid);
+static bool same_file(string a, string b);
+static double percentile(vector<double> v, double p);
+
+/**
+ * main - benchmark driver function
+ *
+ * @argc: argument count
+ * @argv: argument vector
+ *
+ * return: 0 when every leecher completed, 1 otherwise
+ */
+int main(int argc, char **argv)
+{
+  int seeders = 1;                 //number of seeders
+  int leechers = 4;                //number of leechers
+  long long bytes = 64*1048576LL;  //payload size
+  long long plen = 0;              //piece length, 0 for automatic
+  int base = 17000;                //tracker port, clients follow
+  int timeout = 300;               //seconds allowed for transfer
+  string binary = "./urtorrent";   //client binary
+  string work = "bench_run";       //work directory
+  string scenario;                 //scenario file, empty for loopback
+  vector<netem::Shape> shapes;     //link of each client
+  vector<netem::Link> links;       //emulated links
+  netem* net = nullptr;            //network emulator
+  int advert;                      //port announced by client
+  char path[PATH_MAX];             //resolved path
+  vector<Node> nodes;              //client processes
+  vector<double> ttcs;             //times to complete
+  time_point<steady_clock> epoch;  //leechers start time
+  double wall = 0;                 //seconds until last completion
+  double cpu = 0;                  //CPU seconds of all clients
+  long long syscalls = 0;          //syscalls of all clients
+  int finished = 0;                //leechers completed
+  int verified = 0;                //leechers with identical payload
+  double mb;                       //payload size in MB
+  int opt;                         //option character
+  struct rusage usage;             //resource usage of client
+  int status;                      //exit status of client
+
+  while ((opt = getopt(argc, argv, "s:l:b:p:P:t:u:d:n:")) != -1) {
+    switch (opt) {
+      case 's': seeders = atoi(optarg); break;
+      case 'l': leechers = atoi(optarg); break;
+      case 'b': bytes = atoll(optarg); break;
+      case 'p': plen = atoll(optarg); break;
+      case 'P': base = atoi(optarg); break;
+      case 't': timeout = atoi(optarg); break;
+      case 'u': binary = optarg; break;
+      case 'd': work = optarg; break;
+      case 'n': scenario = optarg; break;
+      default:
+        cerr << "usage: swarm_bench [-s seeders] [-l leechers] [-b bytes] "
+             << "[-p piece length] [-P base port] [-t timeout] "
+             << "[-u urtorrent binary] [-d work dir] [-n scenario file]\n";
+        return 1;
+    }
+  }
+  if (seeders < 1 || leechers < 1 || bytes <= 0)
+    error_handle(ERR_USAGE);
+
+  //children run in their own directories
+  if (!realpath(binary.c_str(), path))
+    error_handle(ERR_SYS);
+  binary = path;
+  mkdir(work.c_str(), 0755);
+  if (!realpath(work.c_str(), path))
+    error_handle(ERR_SYS);
+  work = path;
+  signal(SIGPIPE, SIG_IGN);
+
+  //payload and metainfo
+  make_payload(work+"/"+PAYLOAD, bytes);
+  creator maker(work+"/"+PAYLOAD,
+                "http://127.0.0.1:"+to_string(base)+"/announce", plen);
+  maker.make(work+"/"+TORRENT);
+  mb = bytes/BYTES_PER_MB;
+
+  cout << "payload " << fixed << setprecision(1) << mb << " MB, "
+       << maker.get_piece_num() << " pieces of "
+       << maker.get_piece_size() << " bytes, "
+       << seeders << " seeders, " << leechers << " leechers" << endl;
+
+  //tracker in this process
+  port = to_string(base);
+  tracker_server tracker(port, 0);
+
+  //seeders share the generated payload
+  for (int i = 0; i < seeders+leechers; i++) {
+    Node node = {};
+
+    node.seeder = (i < seeders);
+    node.dir = work+"/"+(node.seeder ? "seed" : "leech")+to_string(i);
+    mkdir(node.dir.c_str(), 0755);
+    remove((node.dir+"/"+PAYLOAD).c_str());
+    if (system(("cp "+work+"/"+TORRENT+" "+node.dir+"/").c_str()) ||
+        (node.seeder && link((work+"/"+PAYLOAD).c_str(),
+                             (node.dir+"/"+PAYLOAD).c_str())))
+      error_handle(ERR_SYS);
+    nodes.push_back(node);
+  }
+
+  //proxies follow client ports, clients announce them
+  if (!scenario.empty()) {
+    load_scenario(scenario, nodes, shapes);
+    for (unsigned int i = 0; i < nodes.size(); i++)
+      links.push_back({to_string(base+1+nodes.size()+i),
+                       to_string(base+1+i), shapes[i]});
+    net = new netem(links);
+  }
+
+  for (int i = 0; i < seeders; i++) {
+    advert = net ? base+1+seeders+leechers+i : base+1+i;
+    spawn(nodes[i], binary, base+1+i, advert);
+  }
+
+  //leechers start once every seeder announced
+  for (int i = 0; i < ANNOUNCE_WAIT*1000/POLL_MS &&
+       tracker.get_announces() < seeders; i++)
+    this_thread::sleep_for(milliseconds(POLL_MS));
+
+  epoch = steady_clock::now();
+  for (int i = seeders; i < seeders+leechers; i++) {
+    advert = net ? base+1+seeders+leechers+i : base+1+i;
+    spawn(nodes[i], binary, base+1+i, advert);
+  }
+
+  //wait for payloads to appear
+  while (finished < leechers &&
+         steady_clock::now()-epoch < seconds(timeout)) {
+    this_thread::sleep_for(milliseconds(POLL_MS));
+
+    for (int i = seeders; i < seeders+leechers; i++) {
+      struct stat buff = {};  //payload info
+
+      if (nodes[i].done ||
+          stat((nodes[i].dir+"/"+PAYLOAD).c_str(), &buff) ||
+          buff.st_size != bytes)
+        continue;
+
+      nodes[i].done = true;
+      nodes[i].ttc = duration_cast<duration<double>>(
+                     steady_clock::now()-nodes[i].start).count();
+      ttcs.push_back(nodes[i].ttc);
+      finished++;
+    }
+  }
+  wall = duration_cast<duration<double>>(steady_clock::now()-epoch).count();
+
+  //collect syscall counters while clients are alive, then stop them
+  for (unsigned int i = 0; i < nodes.size(); i++) {
+    nodes[i].syscalls = read_syscalls(nodes[i].pid);
+    if (write(nodes[i].cmd, QUIT.c_str(), QUIT.size()) < 0)
+      kill(nodes[i].pid, SIGTERM);
+    close(nodes[i].cmd);
+  }
+
+  for (unsigned int i = 0; i < nodes.size(); i++) {
+    for (int t = 0; t < QUIT_WAIT*1000/POLL_MS; t++) {
+      if (wait4(nodes[i].pid, &status, WNOHANG, &usage) == nodes[i].pid)
+        goto _REAPED;
+      this_thread::sleep_for(milliseconds(POLL_MS));
+    }
+    kill(nodes[i].pid, SIGKILL);
+    wait4(nodes[i].pid, &status, 0, &usage);
+
+_REAPED:
+    nodes[i].cpu = usage.ru_utime.tv_sec+usage.ru_utime.tv_usec/1e6+
+                   usage.ru_stime.tv_sec+usage.ru_stime.tv_usec/1e6;
+    cpu += nodes[i].cpu;
+    syscalls += nodes[i].syscalls;
+  }
+
+  //check copies
+  for (int i = seeders; i < seeders+leechers; i++)
+    if (nodes[i].done &&
+        same_file(work+"/"+PAYLOAD, nodes[i].dir+"/"+PAYLOAD))
+      verified++;
+
+  //report
+  cout << "completed " << finished << "/" << leechers
+       << ", verified " << verified << "/" << leechers << endl;
+  if (!finished)
+    return 1;
+
+  cout << setprecision(3);
+  cout << "wall " << wall << " s, aggregate "
+       << setprecision(1) << finished*mb/wall << " MB/s" << endl;
+  cout << setprecision(3)
+       << "ttc p50 " << percentile(ttcs, 50) << " s, p90 "
+       << percentile(ttcs, 90) << " s, p99 "
+       << percentile(ttcs, 99) << " s, max "
+       << percentile(ttcs, 100) << " s" << endl;
+  cout << "cpu " << cpu << " s, " << cpu*1000/(finished*mb)
+       << " ms/MB" << endl;
+  cout << setprecision(1)
+       << "syscalls " << syscalls << ", "
+       << syscalls/(finished*mb) << " /MB" << endl;
+  if (net) {
+    cout << "netem " << net->get_bytes()/BYTES_PER_MB << " MB forwarded, "
+         << net->get_losses() << " losses" << endl;
+    delete net;
+  }
+
+  return (verified == leechers) ? 0 : 1;
+}
+
+/**
+ * Write random bytes to payload file
+ *
+ * @file: payload path
+ * @size: payload size
+ */
+static void make_payload(string file, long long size)
+{
+  mt19937_64 rng(size);                   //deterministic generator
+  vector<unsigned long long> buff(BUFF_SIZE/sizeof(unsigned long long));
+  ofstream out(file, (ofstream::out|ofstream::binary|ofstream::trunc));
+  long long left = size;                  //bytes left to write
+  long long chunk;                        //bytes written at a time
+
+  while (left > 0) {
+    for (unsigned int i = 0; i < buff.size(); i++)
+      buff[i] = rng();
+    chunk = min(left, (long long)BUFF_SIZE);
+    out.write((const char*)buff.data(), chunk);
+    left -= chunk;
+  }
+
+  out.close();
+  if (!out.good())
+    error_handle(ERR_WRITE);
+}
+
+/**
+ * Read link of every client from scenario file,
+ * clients not matched run on plain loopback.
+ *
+ * @file: scenario file
+ * @nodes: clients, seeders first
+ * @shapes: link of each client
+ */
+static void load_scenario(string file, vector<Node>& nodes,
+                          vector<netem::Shape>& shapes)
+{
+  ifstream in(file);  //scenario stream
+  string line;        //scenario line
+  string target;      //clients of line
+  string spec;        //link settings
+  int lineno = 0;     //line number
+
+  if (!in)
+    error_handle(ERR_SYS);
+  shapes.assign(nodes.size(), netem::Shape());
+
+  while (getline(in, line)) {
+    istringstream fields(line);  //line stream
+
+    lineno++;
+    if (!(fields >> target) || target[0] == '#')
+      continue;
+    getline(fields, spec);
+
+    for (unsigned int i = 0; i < nodes.size(); i++) {
+      if (target != ALL &&
+          !(target == SEEDS && nodes[i].seeder) &&
+          !(target == LEECHES && !nodes[i].seeder) &&
+          target != to_string(i))
+        continue;
+
+      if (!netem::parse_shape(spec, shapes[i])) {
+        cerr << file << ":" << lineno << ": invalid settings\n";
+        exit(1);
+      }
+    }
+  }
+}
+
+/**
+ * Start a client in its directory, standard input is
+ * a pipe used to send the quit command, output goes to
+ * a log file.
+ *
+ * @node: client to start
+ * @binary: urtorrent binary
+ * @port: client port
+ * @advert: port announced to tracker
+ */
+static void spawn(Node& node, string binary, int port, int advert)
+{
+  int cmd[2];  //command pipe
+  int log;     //log file
+
+  if (pipe(cmd))
+    error_handle(ERR_SYS);
+
+  node.start = steady_clock::now();
+  node.pid = fork();
+  if (node.pid < 0)
+    error_handle(ERR_SYS);
+
+  if (!node.pid) {
+    log = open((node.dir+"/"+LOG).c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (chdir(node.dir.c_str()) || log < 0)
+      _exit(1);
+    dup2(cmd[0], STDIN_FILENO);
+    dup2(log, STDOUT_FILENO);
+    dup2(log, STDERR_FILENO);
+    close(cmd[1]);
+    execl(binary.c_str(), "urtorrent", "-a", to_string(advert).c_str(),
+          to_string(port).c_str(), TORRENT.c_str(), (char*)nullptr);
+    _exit(1);
+  }
+
+  close(cmd[0]);
+  node.cmd = cmd[1];
+}
+
+/**
+ * Read syscr and syscw counters of a process
+ *
+ * @pid: process id
+ *
+ * Return: read and write syscalls, 0 if unavailable
+ */
+static long long read_syscalls(pid_t pid)
+{
+  ifstream io("/proc/"+to_string(pid)+"/io");  //io accounting file
+  string key;                                  //counter name
+  long long val;                               //counter value
+  long long total = 0;                         //syscalls counted
+
+  while (io >> key >> val)
+    if (key == "syscr:" || key == "syscw:")
+      total += val;
+  return total;
+}
+
+/**
+ * Compare two files byte by byte
+ */
+static bool same_file(string a, string b)
+{
+  ifstream fa(a, ifstream::binary);  //first file
+  ifstream fb(b, ifstream::binary);  //second file
+  vector<char> ba(BUFF_SIZE);        //buffer of first file
+  vector<char> bb(BUFF_SIZE);        //buffer of second file
+
+  while (fa && fb) {
+    fa.read(ba.data(), BUFF_SIZE);
+    fb.read(bb.data(), BUFF_SIZE);
+    if (fa.gcount() != fb.gcount() ||
+        memcmp(ba.data(), bb.data(), fa.gcount()))
+      return false;
+  }
+  return fa.eof() && fb.eof();
+}
+
+/**
+ * Nearest rank percentile
+ *
+ * @v: samples
+ * @p: percentile in (0, 100]
+ */
+static double percentile(vector<double> v, double p)
+{
+  size_t rank;  //rank of percentile
+
+  sort(v.begin(), v.end());
+  rank = (size_t)(p/100*v.size()+0.999999);
+  if (rank < 1) rank = 1;
+  return v[min(rank, v.size())-1];
+}
@@ -1,5 +1,5 @@
 /*
- * C implementation of a bencode decoder.
+ * C implementation of a bencode decoder and encoder.
  * This is the format defined by BitTorrent:
  *  http://wiki.theory.org/BitTorrentSpecification#bencoding
  *
@@ -19,8 +19,9 @@
  * your changes into the public domain as well).
  */
 
+#include <stdio.h>  /* snprintf() */
 #include <stdlib.h> /* malloc() realloc() free() strtoll() */
-#include <string.h> /* memset() */
+#include <string.h> /* memset() memcpy() memcmp() strlen() */
 
 #include "bencode.h"
 
@@ -88,55 +89,76 @@ static char *_be_decode_str(const char **data, long long *data_len)
 	return ret;
 }
 
+static be_node *_be_decode(const char **data, long long *data_len);
+
+/*
+ * Decode the members of a list or dictionary up to the closing 'e'.
+ * The member arrays are kept NULL terminated at every step so that a
+ * truncated or malformed container can be released with be_free().
+ * Returns 0 on success and -1 on malformed input.
+ */
+static int _be_decode_members(be_node *ret, const char **data, long long *data_len)
+{
+	unsigned int i = 0;
+
+	--(*data_len);
+	++(*data);
+	while (*data_len > 0 && **data != 'e') {
+		if (ret->type == BE_LIST) {
+			ret->val.l = realloc(ret->val.l, (i + 2) * sizeof(*ret->val.l));
+			ret->val.l[i + 1] = NULL;
+			ret->val.l[i] = _be_decode(data, data_len);
+			if (!ret->val.l[i])
+				return -1;
+		} else {
+			ret->val.d = realloc(ret->val.d, (i + 2) * sizeof(*ret->val.d));
+			ret->val.d[i + 1].val = NULL;
+			ret->val.d[i].val = NULL;
+			ret->val.d[i].key = _be_decode_str(data, data_len);
+			if (!ret->val.d[i].key)
+				return -1;
+			ret->val.d[i].val = _be_decode(data, data_len);
+			if (!ret->val.d[i].val) {
+				free(ret->val.d[i].key - sizeof(long long));
+				return -1;
+			}
+		}
+		++i;
+	}
+	if (*data_len <= 0)
+		return -1;
+	--(*data_len);
+	++(*data);
+
+	return 0;
+}
+
 static be_node *_be_decode(const char **data, long long *data_len)
 {
 	be_node *ret = NULL;
+	const char *start = *data;
 
-	if (!*data_len)
+	if (*data_len <= 0)
 		return ret;
 
 	switch (**data) {
 		/* lists */
-		case 'l': {
-			unsigned int i = 0;
-
-			ret = be_alloc(BE_LIST);
-
-			--(*data_len);
-			++(*data);
-			while (**data != 'e') {
-				ret->val.l = realloc(ret->val.l, (i + 2) * sizeof(*ret->val.l));
-				ret->val.l[i] = _be_decode(data, data_len);
-				++i;
-			}
-			--(*data_len);
-			++(*data);
-
-			ret->val.l[i] = NULL;
-
-			return ret;
-		}
-
+		case 'l':
 		/* dictionaries */
 		case 'd': {
-			unsigned int i = 0;
+			ret = be_alloc(**data == 'l' ? BE_LIST : BE_DICT);
 
-			ret = be_alloc(BE_DICT);
+			/* empty containers still need their terminator */
+			if (ret->type == BE_LIST)
+				ret->val.l = calloc(1, sizeof(*ret->val.l));
+			else
+				ret->val.d = calloc(1, sizeof(*ret->val.d));
 
-			--(*data_len);
-			++(*data);
-			while (**data != 'e') {
-				ret->val.d = realloc(ret->val.d, (i + 2) * sizeof(*ret->val.d));
-				ret->val.d[i].key = _be_decode_str(data, data_len);
-				ret->val.d[i].val = _be_decode(data, data_len);
-				++i;
+			if (_be_decode_members(ret, data, data_len)) {
+				be_free(ret);
+				return NULL;
 			}
-			--(*data_len);
-			++(*data);
-
-			ret->val.d[i].val = NULL;
-
-			return ret;
+			break;
 		}
 
 		/* integers */
@@ -146,12 +168,13 @@ static be_node *_be_decode(const char **data, long long *data_len)
 			--(*data_len);
 			++(*data);
 			ret->val.i = _be_decode_int(data, data_len);
-			if (**data != 'e')
+			if (*data_len <= 0 || **data != 'e') {
+				free(ret);
 				return NULL;
+			}
 			--(*data_len);
 			++(*data);
-
-			return ret;
+			break;
 		}
 
 		/* byte strings */
@@ -159,15 +182,22 @@ static be_node *_be_decode(const char **data, long long *data_len)
 			ret = be_alloc(BE_STR);
 
 			ret->val.s = _be_decode_str(data, data_len);
-
-			return ret;
+			if (!ret->val.s) {
+				free(ret);
+				return NULL;
+			}
+			break;
 		}
 
 		/* invalid */
 		default:
-			break;
+			return ret;
 	}
 
+	/* remember the exact source span of this node */
+	ret->src = start;
+	ret->src_len = *data - start;
+
 	return ret;
 }
 
@@ -217,8 +247,274 @@ void be_free(be_node *node)
 	free(node);
 }
 
+/*
+ * Allocate a string with the same layout _be_decode_str() produces:
+ * the length is stored just before the returned pointer so that
+ * be_str_len() and _be_free_str() work on it.
+ */
+static char *_be_alloc_str(const char *str, long long len)
+{
+	char *_ret, *ret;
+
+	if (len < 0)
+		return NULL;
+
+	_ret = malloc(sizeof(len) + len + 1);
+	if (!_ret)
+		return NULL;
+	memcpy(_ret, &len, sizeof(len));
+	ret = _ret + sizeof(len);
+	memcpy(ret, str, len);
+	ret[len] = '\0';
+	return ret;
+}
+
+static long long _be_raw_len(const char *str)
+{
+	long long ret;
+	memcpy(&ret, str - sizeof(ret), sizeof(ret));
+	return ret;
+}
+
+long long be_key_len(const char *key)
+{
+	return key ? _be_raw_len(key) : 0;
+}
+
+be_node *be_create_str(const char *str, long long len)
+{
+	be_node *ret = be_alloc(BE_STR);
+	if (ret) {
+		ret->val.s = _be_alloc_str(str, len);
+		if (!ret->val.s) {
+			free(ret);
+			ret = NULL;
+		}
+	}
+	return ret;
+}
+
+be_node *be_create_int(long long num)
+{
+	be_node *ret = be_alloc(BE_INT);
+	if (ret)
+		ret->val.i = num;
+	return ret;
+}
+
+be_node *be_create_list(void)
+{
+	be_node *ret = be_alloc(BE_LIST);
+	if (ret) {
+		ret->val.l = calloc(1, sizeof(*ret->val.l));
+		if (!ret->val.l) {
+			free(ret);
+			ret = NULL;
+		}
+	}
+	return ret;
+}
+
+be_node *be_create_dict(void)
+{
+	be_node *ret = be_alloc(BE_DICT);
+	if (ret) {
+		ret->val.d = calloc(1, sizeof(*ret->val.d));
+		if (!ret->val.d) {
+			free(ret);
+			ret = NULL;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Append node to the list; the list takes ownership of node.
+ * Returns 0 on success and -1 on failure.
+ */
+int be_list_add(be_node *list, be_node *node)
+{
+	unsigned int i;
+	be_node **l;
+
+	if (!list || list->type != BE_LIST || !node)
+		return -1;
+
+	for (i = 0; list->val.l[i]; ++i)
+		continue;
+
+	l = realloc(list->val.l, (i + 2) * sizeof(*l));
+	if (!l)
+		return -1;
+	l[i] = node;
+	l[i + 1] = NULL;
+	list->val.l = l;
+	return 0;
+}
+
+/*
+ * Insert val under key, keeping the keys sorted as the spec requires;
+ * the dictionary takes ownership of val.
+ * Returns 0 on success and -1 on failure.
+ */
+int be_dict_add(be_node *dict, const char *key, be_node *val)
+{
+	if (!key)
+		return -1;
+	return be_dict_addn(dict, key, strlen(key), val);
+}
+
+/*
+ * Same as be_dict_add() for keys which may hold NUL bytes,
+ * such as raw info hashes in scrape replies.
+ */
+int be_dict_addn(be_node *dict, const char *key, long long klen, be_node *val)
+{
+	unsigned int i, n;
+	long long len;
+	int cmp;
+	char *k;
+	be_dict *d;
+
+	if (!dict || dict->type != BE_DICT || !key || klen < 0 || !val)
+		return -1;
+
+	for (n = 0; dict->val.d[n].val; ++n)
+		continue;
+
+	/* find the insertion point by raw byte order */
+	for (i = 0; i < n; ++i) {
+		len = _be_raw_len(dict->val.d[i].key);
+		cmp = memcmp(dict->val.d[i].key, key, len < klen ? len : klen);
+		if (cmp > 0 || (cmp == 0 && len > klen))
+			break;
+	}
+
+	k = _be_alloc_str(key, klen);
+	if (!k)
+		return -1;
+
+	d = realloc(dict->val.d, (n + 2) * sizeof(*d));
+	if (!d) {
+		free(k - sizeof(klen));
+		return -1;
+	}
+	memmove(&d[i + 1], &d[i], (n - i + 1) * sizeof(*d));
+	d[i].key = k;
+	d[i].val = val;
+	dict->val.d = d;
+	return 0;
+}
+
+static long long _be_digits(long long num)
+{
+	char buf[24];
+	return snprintf(buf, sizeof(buf), "%lli", num);
+}
+
+long long be_encoded_len(be_node *node)
+{
+	long long ret = 0, len;
+	unsigned int i;
+
+	switch (node->type) {
+		case BE_STR:
+			len = be_str_len(node);
+			ret = _be_digits(len) + 1 + len;
+			break;
+
+		case BE_INT:
+			ret = _be_digits(node->val.i) + 2;
+			break;
+
+		case BE_LIST:
+			ret = 2;
+			for (i = 0; node->val.l[i]; ++i)
+				ret += be_encoded_len(node->val.l[i]);
+			break;
+
+		case BE_DICT:
+			ret = 2;
+			for (i = 0; node->val.d[i].val; ++i) {
+				len = _be_raw_len(node->val.d[i].key);
+				ret += _be_digits(len) + 1 + len;
+				ret += be_encoded_len(node->val.d[i].val);
+			}
+			break;
+	}
+
+	return ret;
+}
+
+static char *_be_encode_str(const char *str, long long len, char *out)
+{
+	out += sprintf(out, "%lli:", len);
+	memcpy(out, str, len);
+	return out + len;
+}
+
+static char *_be_encode(be_node *node, char *out)
+{
+	unsigned int i;
+
+	switch (node->type) {
+		case BE_STR:
+			out = _be_encode_str(node->val.s, be_str_len(node), out);
+			break;
+
+		case BE_INT:
+			out += sprintf(out, "i%llie", node->val.i);
+			break;
+
+		case BE_LIST:
+			*out++ = 'l';
+			for (i = 0; node->val.l[i]; ++i)
+				out = _be_encode(node->val.l[i], out);
+			*out++ = 'e';
+			break;
+
+		case BE_DICT:
+			*out++ = 'd';
+			for (i = 0; node->val.d[i].val; ++i) {
+				out = _be_encode_str(node->val.d[i].key,
+				                     _be_raw_len(node->val.d[i].key), out);
+				out = _be_encode(node->val.d[i].val, out);
+			}
+			*out++ = 'e';
+			break;
+	}
+
+	return out;
+}
+
+/*
+ * Encode the tree into a newly malloc()ed buffer which the caller
+ * must free().  The buffer is NUL terminated for convenience, the
+ * terminator is not counted in *len.
+ */
+char *be_encode(be_node *node, long long *len)
+{
+	long long ret_len;
+	char *ret;
+
+	if (!node)
+		return NULL;
+
+	ret_len = be_encoded_len(node);
+	/* sprintf() needs room for its terminator */
+	ret = malloc(ret_len + 1);
+	if (!ret)
+		return NULL;
+
+	_be_encode(node, ret);
+	ret[ret_len] = '\0';
+
+	if (len)
+		*len = ret_len;
+	return ret;
+}
+
 #ifdef BE_DEBUG
-#include <stdio.h>
 #include <stdint.h>
 
 static void _be_dump_indent(ssize_t indent)
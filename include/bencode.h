@@ -1,5 +1,5 @@
 /*
- * C implementation of a bencode decoder.
+ * C implementation of a bencode decoder and encoder.
  * This is the format defined by BitTorrent:
  *  http://wiki.theory.org/BitTorrentSpecification#bencoding
  *
@@ -14,6 +14,10 @@
  *  - pass the string full of the bencoded data to be_decode()
  *  - parse the resulting tree however you like
  *  - call be_free() on the tree to release resources
+ *
+ *  - build a tree with be_create_*() and be_list_add()/be_dict_add()
+ *  - pass the tree to be_encode() to get a malloc()ed bencoded buffer
+ *  - call be_free() on the tree and free() on the buffer
  */
 
 #ifndef _BENCODE_H
@@ -50,14 +54,28 @@ typedef struct be_node {
 		struct be_node **l;
 		struct be_dict *d;
 	} val;
+	/* bytes this node was decoded from, NULL for built nodes */
+	const char *src;
+	long long src_len;
 } be_node;
 
 extern long long be_str_len(be_node *node);
+extern long long be_key_len(const char *key);
 extern be_node *be_decode(const char *bencode);
 extern be_node *be_decoden(const char *bencode, long long bencode_len);
 extern void be_free(be_node *node);
 extern void be_dump(be_node *node);
 
+extern be_node *be_create_str(const char *str, long long len);
+extern be_node *be_create_int(long long num);
+extern be_node *be_create_list(void);
+extern be_node *be_create_dict(void);
+extern int be_list_add(be_node *list, be_node *node);
+extern int be_dict_add(be_node *dict, const char *key, be_node *val);
+extern int be_dict_addn(be_node *dict, const char *key, long long klen, be_node *val);
+extern long long be_encoded_len(be_node *node);
+extern char *be_encode(be_node *node, long long *len);
+
 #ifdef __cplusplus
 }
 #endif
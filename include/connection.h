@@ -0,0 +1,234 @@
+/**
+ * Peer Wire Protocol connection.
+ * One TCP connection per peer carries both directions of the
+ * protocol: its receiver downloads from the peer, its sender
+ * uploads to the peer. No thread is kept per connection: the
+ * reactor reads whole messages off the socket and the connection
+ * handles them one at a time on the executor, handing each to
+ * the side it belongs to. Writes of both sides and of other
+ * threads are serialized on the connection.
+ *
+ * Writes never block: a message is queued on the connection and
+ * written as far as the socket takes it, the reactor writes the
+ * rest once the socket drains. Executor jobs sending to a slow
+ * peer return at once.
+ *
+ * When two connections reach the same peer, e.g. both peers
+ * connected at once, the one initiated by the smaller peer id
+ * is kept on both ends.
+ *
+ * Peers flagging the extension protocol (BEP 10) in their
+ * handshake exchange an extended handshake telling their
+ * listening port, then addresses of connected peers by peer
+ * exchange (BEP 11) at most once every PEX_PERD_ seconds.
+ *
+ */
+
+#ifndef _CONNECTION_H_
+#define _CONNECTION_H_
+
+#include <deque>         /* std::deque */
+#include <mutex>         /* std::mutex */
+#include <functional>    /* std::function */
+#include <atomic>        /* std::atomic */
+#include <chrono>        /* std::chrono::steady_clock */
+#include <bencode.h>     /* be_node */
+#include <metainfo.h>    /* metainfo handle */
+#include <timer.h>       /* countdown timer */
+#include <receiver.h>    /* downloading side */
+#include <sender.h>      /* uploading side */
+#include <types.h>       /* PWP message types, helper functions */
+
+using namespace std;
+
+class core;   //urtorrent core component class
+
+class connection
+{
+  friend class reactor;
+
+  public:
+    /* constructor of outgoing connection */
+    connection(string remote, core* core);
+
+    /* constructor of incoming connection */
+    connection(int sock, string ip, string handshake, core* core);
+
+    /* destructor */
+    ~connection();
+
+    /* queue a whole message to peer, never blocks */
+    bool send(const void* buff, size_t len);
+
+    /* check if every queued byte is written */
+    bool writable();
+
+    /* read part of message being handled */
+    ssize_t receive(void* buff, size_t len);
+
+    /* stop connection after current message */
+    void stop();
+
+    /* get socket with peer */
+    int get_sock();
+
+    /* get peer's ip */
+    string get_ip();
+
+    /* get downloading side */
+    receiver* get_receiver();
+
+    /* get uploading side */
+    sender* get_sender();
+
+    /* get listening address of registered peer */
+    string get_addr();
+
+    /* get id of remote peer */
+    string get_id();
+
+    /* peer exchange of peers changed since last one */
+    string pex_message(const addr_set& live);
+
+  private:
+    int sock_;          /* socket with remote peer */
+    bool outgoing_;     /* connection initiated by client */
+    atomic<bool> running_; /* connection executing status */
+    bool ext_;          /* peer supports extension protocol */
+    atomic<bool> registered_; /* peer registered, both sides created */
+    atomic<char> pex_id_;     /* peer's extended id of ut_pex, 0 if none */
+
+    string ip_;         /* ip of remote peer */
+    string port_;       /* port of remote peer, outgoing only */
+    string addr_;       /* entry in peer address set, empty if none */
+    string hs_;         /* handshake of peer, read by session or reactor */
+    string peer_id_;    /* id of remote peer */
+
+    core* core_;        /* urtorrent core component */
+    metainfo* mi_;      /* metainfo handle */
+    receiver* recv_;    /* downloading side, nullptr before handshake */
+    sender* send_;      /* uploading side, nullptr before handshake */
+
+    mutex wlock_;       /* lock to write socket and out_ */
+    string out_;        /* bytes queued, not yet taken by socket */
+    timer* timer_;      /* timer to trigger keep alive */
+    timer* retry_;      /* timer to retry a deferred request */
+
+    //reactor thread only
+    string in_;         /* bytes read, no whole message yet */
+    bool connecting_;   /* outgoing connect in progress */
+    bool shaken_;       /* handshake of peer cut from in_ */
+    steady_clock::time_point last_in_; /* time bytes of peer last arrived */
+    atomic<bool> throttled_; /* reading paused on backlog */
+    atomic<size_t> backlog_; /* bytes of messages not yet handled */
+
+    //jobs of connection, run one at a time on executor
+    mutex jlock_;       /* lock to access jobs_, draining_ and closed_ */
+    deque<function<void ()>> jobs_; /* jobs waiting */
+    bool draining_;     /* a worker runs jobs */
+    bool closed_;       /* let go by reactor, ends after jobs */
+    string mesg_;       /* message being handled */
+    size_t mesg_pos_;   /* bytes of message read */
+
+    mutex pxlock_;      /* lock to access pex_sent_ and pex_out_ */
+    addr_set pex_sent_; /* addresses peer knows from client */
+    steady_clock::time_point pex_out_; /* time of last exchange sent */
+    steady_clock::time_point pex_in_;  /* time of last exchange received */
+
+    static const int PEX_PERD_ = 60;  /* seconds between exchanges sent */
+    static const int PEX_MIN_ = 30;   /* seconds between exchanges accepted */
+    static const int PEX_MAX_ = 50;   /* addresses added or dropped per exchange */
+    static const int EXT_MAX_ = 16384; /* payload size limit of extended message */
+    static const size_t OUT_MAX_ = 64*BLOCK_SIZE; /* bytes queued before peer is dropped */
+    static const size_t IN_MAX_ = 64*BLOCK_SIZE;  /* backlog before reading pauses */
+    static const int READ_SIZE_ = 65536;          /* bytes read from socket at once */
+    static const int RETRY_MS_ = 20;  /* ms before a deferred request is retried */
+
+    /* first job, connect peer or check handshake */
+    void start();
+
+    /* connect peer without waiting */
+    bool peer_connect();
+
+    /* handshake and register peer, then tell pieces */
+    bool establish();
+
+    /* check handshake of peer */
+    bool handshake();
+
+    /* register peer, resolving duplicate connections */
+    bool register_peer();
+
+    /* check if connection is kept over another to same peer */
+    bool wins(connection* other);
+
+    /* peer id initiating connection */
+    string initiator();
+
+    /* write queued bytes socket takes, write lock held */
+    bool write_out();
+
+    /* write queued bytes socket takes */
+    bool flush();
+
+    /* queue a job of connection */
+    void post(function<void ()> job);
+
+    /* run jobs until none is queued */
+    void drain();
+
+    /* let go by reactor, end after queued jobs */
+    void close();
+
+    /* socket writable or connect finished, reactor only */
+    void on_writable();
+
+    /* socket readable, reactor only */
+    void on_readable();
+
+    /* check silence and backlog, reactor only */
+    void on_timer(steady_clock::time_point now);
+
+    /* cut whole messages read, reactor only */
+    void cut();
+
+    /* handle a whole message of peer */
+    void process(string& mesg);
+
+    /* request a block, unless download limits defer it */
+    void request();
+
+    /* retry deferred request */
+    void retry();
+
+    /* handle incomming message */
+    bool mesg_handle();
+
+    /* check payload size of message */
+    bool valid_size(char id, uint32_t size);
+
+    /* record piece announced by peer */
+    void peer_has(uint32_t index);
+
+    /* send extended handshake */
+    bool send_ext_handshake();
+
+    /* handle extended message */
+    bool ext_handle(uint32_t size);
+
+    /* read extended handshake of peer */
+    void ext_handshake(be_node* dict);
+
+    /* connect peers sent by peer exchange */
+    void pex_handle(be_node* dict);
+
+    /* discard message payload */
+    bool skip(uint32_t size);
+
+    /* sending keep alive message */
+    void keep_alive();
+
+    /* terminate connection, false if it must stay alive */
+    bool terminate();
+};
+#endif
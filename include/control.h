@@ -0,0 +1,117 @@
+/**
+ * Control socket of a client running as a daemon.
+ *
+ * A UNIX domain stream socket takes the place of the prompt,
+ * any number of local clients send commands as text lines:
+ *
+ *   torrents                          list hosted torrents
+ *   add <torrent>                     host one more torrent
+ *   remove <index>                    stop and remove a torrent
+ *   pause <index>                     drop peers of a torrent
+ *   resume <index>                    reconnect peers of a torrent
+ *   limit <up|down> global <KB/s>     set a rate limit, 0 for
+ *   limit <up|down> <torrent|peer> <KB/s> <index>       unlimited
+ *   stats                             metrics snapshot
+ *   quit                              stop the daemon
+ *
+ * Each reply is zero or more lines followed by 'ok' or by
+ * 'error <reason>'. The control thread multiplexes the listening
+ * socket and clients and answers stats and quit itself, other
+ * commands run in arrival order on the command thread. A client
+ * gets the reply of a command before its next one runs.
+ * Stats are read from the session snapshot, a stats query
+ * never waits on the transfer engine nor on a slow add.
+ *
+ * Usage: - 'urtorrent -d <socket> <port> [<torrent> ...]'
+ *        - e.g. 'echo stats | nc -U <socket>'
+ *
+ */
+
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+#include <string>          /* std::string */
+#include <thread>          /* std::thread */
+#include <atomic>          /* std::atomic */
+#include <deque>           /* std::deque */
+#include <mutex>           /* std::mutex */
+#include <unordered_map>   /* std::unordered_map */
+#include <condition_variable> /* std::condition_variable */
+#include <session.h>       /* session of torrents */
+
+using namespace std;
+
+class control
+{
+  public:
+    /* constructor */
+    control(string path, session* sess);
+    /* destructor */
+    ~control();
+
+  private:
+    //Client connection
+    struct Client {
+      string in;      /* bytes of command lines not yet run */
+      string out;     /* reply bytes not yet sent */
+      bool closing;   /* hang up once reply is sent */
+      bool busy;      /* a command runs on command thread */
+      unsigned long serial; /* client number, fds are reused */
+    };
+
+    //Command run on command thread
+    struct Job {
+      int fd;               /* client socket */
+      unsigned long serial; /* client number */
+      string line;          /* command line */
+      string reply;         /* reply once done */
+    };
+
+    string path_;            /* path of control socket */
+    session* sess_;          /* session commanded */
+    int sockfd_;             /* listening socket */
+    int wake_[2];            /* self pipe waking up control thread */
+    thread worker_;          /* control thread */
+    thread commander_;       /* command thread */
+    atomic<bool> running_;   /* control thread running status */
+    unordered_map<int, Client> clients_; /* clients, control thread only */
+    unsigned long serial_;   /* number of next client, control thread only */
+    mutex jlock_;            /* lock to access jobs_ and done_ */
+    condition_variable jcv_; /* signaled when a job is queued */
+    deque<Job> jobs_;        /* commands waiting for command thread */
+    deque<Job> done_;        /* commands replied, not yet collected */
+
+    static const int POLL_WAIT_ = 1000;  /* ms of idle poll */
+    static const int QUEUE_LEN_ = 16;    /* accept queue size */
+    static const int MAX_LINE_ = 4096;   /* command line size limit */
+    static const int BUFF_SIZE_ = 4096;  /* receive buffer size */
+
+    /* setup sockets */
+    void setup();
+    /* control thread main loop */
+    void run_service();
+    /* command thread main loop */
+    void run_commands();
+    /* hand replies of command thread to clients */
+    void collect();
+    /* run or queue command lines of a client */
+    void run_lines(int fd, Client& client);
+    /* accept clients */
+    void accept_clients();
+    /* read commands of a client and queue replies */
+    bool read_client(int fd, Client& client);
+    /* send queued reply bytes */
+    bool write_client(int fd, Client& client);
+    /* run a command line, return its reply */
+    string execute(const string& line);
+
+    /* commands */
+    void do_torrents(ostream& os);
+    bool do_add(istream& is, ostream& os, string& reason);
+    bool do_remove(istream& is, string& reason);
+    bool do_pause(istream& is, bool pause, string& reason);
+    bool do_limit(istream& is, string& reason);
+    /* read a torrent index argument */
+    bool read_index(istream& is, int& index, string& reason);
+};
+#endif
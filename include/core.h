@@ -1,30 +1,60 @@
 /**
  * Peer Wire Protocol core class.
+ * One torrent of a session, the session accepts incoming
+ * peers and drives the periodic work of its torrents.
+ *
+ * Block requests queued by peers are served in deficit round
+ * robin by upload rounds running on the executor, one round
+ * of a torrent at a time: each turn a peer earns QUANTUM_
+ * bytes and is sent the queued blocks they pay for, a peer
+ * pipelining many requests gets no more than the others.
+ * Sends never wait, a peer whose limits have no tokens or
+ * whose connection still holds unsent bytes is resumed in a
+ * later round. Blocks of a round are sent in file order after
+ * their ranges, merged when adjacent, and ranges of requests
+ * still queued are read ahead into the read cache, each run
+ * of adjacent pieces by one read.
  *
  */
 
 #ifndef _CORE_H_
 #define _CORE_H_
 
-#include <server.h>        /* TCP server */
 #include <metainfo.h>      /* metainfo file handle */
 #include <tracker_agent.h> /* remote tracker handle */
 #include <timer.h>         /* count down timer */
 #include <types.h>         /* PWP message types helper functions */
 #include <receiver.h>      /* downloader */
 #include <sender.h>        /* uploader */
+#include <metrics.h>       /* metrics registry */
+#include <trace.h>         /* piece lifecycle tracer */
+#include <rate_limit.h>    /* token bucket rate limiter */
+#include <piece_cache.h>   /* piece read cache */
+#include <deque>             /* std::deque */
+#include <condition_variable> /* std::condition_variable */
+
+class session;   //session hosting torrents
 
 class core
 {
   public:
     friend class receiver;
     friend class sender;
+    friend class connection;
+    friend class session;
 
     static const int ALIVE_PERD_ = 120;   /* period in sec sending keep alive message */
 
+    //Rate limits owned by core
+    enum Limit {
+      TORRENT_UP,    /* upload of torrent */
+      TORRENT_DOWN,  /* download of torrent */
+      PEER_UP,       /* upload to each peer */
+      PEER_DOWN      /* download from each peer */
+    };
+
     /* constructor */
-    core(server* serv, metainfo* mi, 
-         tracker_agent* agent);
+    core(session* sess, metainfo* mi, tracker_agent* agent);
 
     /* destructor */
     ~core();
@@ -35,6 +65,9 @@ class core
     /* command status */
     void do_status();
 
+    /* gauges of torrents, Prometheus text format */
+    static void write_gauges(ostream& os, const vector<core*>& cores);
+
     /* retrieve current locl bitfield */
     string get_bf();
 
@@ -50,29 +83,66 @@ class core
     /* modify temporary file name to target file */
     void name_target();
 
+    /* set rate limit in bytes per second, 0 for unlimited */
+    void set_limit(Limit limit, long long rate);
+
+    /* get rate limit in bytes per second */
+    long long get_limit(Limit limit);
+
+    /* serve a peer connected to session */
+    void accept_peer(int sock, string ip, string handshake);
+
+    /* connect a peer found on local network */
+    void add_lan_peer(string addr);
+
+    /* drop peer connections and refuse new ones */
+    void pause();
+
+    /* connect and accept peers again */
+    void resume();
+
+    /* check whether torrent is paused */
+    bool paused();
+
   private:
+    typedef pair<sender*, sender::Request> Upload;  /* block to send to peer */
+    typedef pair<uint64_t, uint64_t> Extent;        /* file range, offset and end */
+
+    //Piece revealed to a peer while super seeding
+    struct Reveal {
+      uint32_t piece;                /* piece index told by have */
+      steady_clock::time_point at;   /* time piece was told */
+    };
+
     Role role_;            /* client role: seeder or leecher */
     int fd_;               /* file descriptor of temporary|target file */
     unsigned char* file_;  /* pointer to memory mapped temporary|target file */
+    piece_cache* cache_;   /* read cache of session, nullptr if off */
+    uint32_t owner_;       /* key of torrent in read cache */
     
-    server* server_;       /* TCP server */
+    session* session_;     /* session hosting torrent */
     metainfo* mi_;         /* metainfo handler */
     tracker_agent* agent_; /* tracker handler */
-    timer* timer_;         /* protocol timer */
     peer* opp_;            /* optimistic unchoked peer */
 
     pthread_rwlock_t bflock_; /* reader writer lock to access bitfield */
     pthread_rwlock_t pclock_; /* reader writer lock to access piece count array */
     pthread_rwlock_t rmlock_; /* reader writer lock to access peer hash map */
     pthread_rwlock_t smlock_; /* reader writer lock to access peer hash map */
-    mutex rslock_;            /* lock to access receiver set */
-    mutex sslock_;            /* lock to access sender set */
+    mutex cnlock_;            /* lock to access connection and peer address sets */
     mutex cklock_;            /* lock to access unchoked peer set */
     mutex relock_;            /* lock to access requesting piece set */
+    mutex lnlock_;            /* lock to access local network set */
+    mutex sslock_;            /* lock to access revealed pieces */
+    mutex uplock_;            /* lock to access upload queues */
+    condition_variable upcv_; /* upload round done */
 
     char* bitfield_;       /* pieces bitfield */
     int* pcount_;          /* array of count for each piece */
     bool finish_;          /* flag to show whether downloading finished */
+    bool super_;           /* super seeding, pieces revealed one by one */
+    atomic<bool> named_;   /* target file named */
+    atomic<bool> paused_;  /* peers refused while paused */
 
     uint32_t pnum_;        /* number of pieces */
     uint32_t lplen_;       /* length of last piece */
@@ -82,23 +152,51 @@ class core
     int actime_;           /* accumulative time */
     string local_addr_;    /* client local address ip:port */
 
+    rate_limit up_limit_;   /* upload limit of torrent */
+    rate_limit down_limit_; /* download limit of torrent */
+    atomic<long long> peer_up_rate_;   /* upload rate limit per peer */
+    atomic<long long> peer_down_rate_; /* download rate limit per peer */
+
     addr_set pset_;        /* IP set of current peers */
+    addr_set lan_;         /* IPs of peers found on local network */
     piece_set req_set;     /* set of requested pieces */
     peer_set unchoked_;    /* set of peers unchoked by client */
     recv_map rmap_;        /* hash map <peer_id, receiver> */
     send_map smap_;        /* hash map <peer_id, sender> */
-    recv_set receivers_;   /* receiver set */
-    sender_set senders_;   /* sender set */
+    conn_set conns_;       /* connections with peers */
+
+    timer* up_timer_;      /* timer resuming skipped peers */
+    bool uploading_;       /* upload rounds allowed, upload lock held */
+    bool round_;           /* upload round queued or running, upload lock held */
+    deque<sender*> upq_;   /* peers with requests in turn order */
+    unordered_set<sender*> serving_; /* peers of round being sent */
+    atomic<int> queued_;   /* requests queued by every peer */
 
     vector<uint32_t> progress_;     /* downloaded size for each piece */
+    vector<int> shown_;             /* times each piece was revealed */
+    unordered_map<string, Reveal> reveals_; /* <peer_id, piece revealed> */
 
     static const unsigned int RECIP_ = 4; /* number of total unchoking peers */
     static const int RE_UNCHK_ = 3;       /* number of regular unchoking peers */
     static const int OU_PERD_ = 30;       /* period in sec performing optimistic unchoke */ 
     static const int TO_UNIT_ = 10;       /* timeout unit in sec */
+    static const int REVEAL_WAIT_ = 30;   /* sec a revealed piece may stay with one peer */
+    static const unsigned int QUEUE_MAX_ = 64; /* requests queued per peer */
+    static const long long QUANTUM_ = BLOCK_SIZE; /* bytes a peer earns per turn */
+    static const int UP_WAIT_ = 10;       /* ms before next round when no peer is ready */
+    static const int AHEAD_SHARE_ = 8;    /* a round reads ahead 1/AHEAD_SHARE_ of read cache */
+
+    /* tracker reply consumer updating peer's address set */
+    void peer_updater(const tracker_agent::Message& mesg);
+
+    /* connect peers not known yet */
+    int add_peers(const vector<string>& peers);
+
+    /* send connected peers by peer exchange */
+    void share_peers(connection* to = nullptr);
 
-    /* a worker thread updating peer's address set */
-    void peer_updater();
+    /* check if a peer is on local network */
+    bool on_lan(const string& ip);
 
     /* allcate temporary file */
     void temp_alloc();
@@ -106,17 +204,65 @@ class core
     /* connect to other peers */
     void conn_peers();
 
-    /* dispatch incomming request */
-    void dispatch();
+    /* connect a peer within connection budget */
+    bool connect_peer(string addr);
 
     /* interface to update piece count */
     bool update_pcount(char* pbf);
 
+    /* count a piece announced by peer */
+    bool update_pcount(uint32_t index);
+
+    /* discount pieces of a leaving peer */
+    bool remove_pcount(char* pbf);
+
     /* interface to update local bitfield */
     bool update_bf(uint32_t index);
 
     /* set interest to peer containing the rarest piece */
     void rarest_first();
+
+    /* start an upload round unless one is queued */
+    void kick_upload();
+
+    /* serve one upload round */
+    void upload_round();
+
+    /* queue a block request, false if queue is full */
+    bool queue_upload(sender* s, const sender::Request& req);
+
+    /* remove a queued block request */
+    void cancel_upload(sender* s, const sender::Request& req);
+
+    /* forget requests of a leaving peer */
+    void drop_uploads(sender* s);
+
+    /* file range of a requested block */
+    Extent extent(const sender::Request& req);
+
+    /* sort blocks of a round and read ahead file ranges */
+    void read_ahead(vector<Upload>& batch, vector<Extent>& ahead);
+
+    /* read a run of pieces by one read into read cache */
+    void read_run(uint32_t first, uint32_t last);
+
+    /* check if a piece could be served from read cache */
+    bool cacheable(uint32_t index);
+
+    /* verified piece from read cache, nullptr if not cached */
+    piece_cache::Piece read_piece(uint32_t index);
+
+    /* super seeding, reveal a piece to a new peer */
+    void reveal(const string& id);
+
+    /* super seeding, reveal more once a piece spreads */
+    void spread(const string& id, uint32_t index);
+
+    /* super seeding, reveal more to peers kept waiting */
+    void reveal_stalled();
+
+    /* super seeding, tell peer one more piece, locks held */
+    void reveal_to(const string& id);
     
     /* perform regular unchoke */
     void re_unchoke();
@@ -127,6 +273,9 @@ class core
     /* timeout handler */
     void timeout();
 
+    /* announce early when swarm has unknown peers */
+    void check_swarm();
+
     /* helper function to init rw lock */
     void rwlock_init();
 
@@ -0,0 +1,72 @@
+/**
+ * Metainfo file creator, hashes a payload and writes a
+ * bencoded metainfo file (.torrent) which can be read back
+ * by class metainfo.
+ *
+ * Pieces are hashed by jobs on the executor's workers, each job
+ * claims a run of consecutive pieces and reads it sequentially
+ * with read-ahead hints so that the payload is streamed from
+ * disk while the previous chunk is being hashed.
+ *
+ */
+
+#ifndef _CREATOR_H_
+#define _CREATOR_H_
+
+#include <string>         /* std::string */
+#include <atomic>         /* std::atomic */
+#include <openssl/sha.h>  /* SHA1() */
+#include <bencode.h>      /* be_create_*(), be_encode() */
+#include <error_handle.h> /* error_handle() */
+
+using namespace std;
+
+class creator
+{
+  public:
+    /* constructor */
+    creator(string file, string announce, long long piece_len);
+
+    /* destructor */
+    ~creator();
+
+    /* hash payload and write metainfo file */
+    void make(string torrent);
+
+    /* getters */
+    long long get_size();
+    long long get_piece_size();
+    size_t get_piece_num();
+    unsigned int get_threads();
+    double get_seconds();
+
+    static const long long MIN_PLEN_ = 16384;    /* minimum piece length, one block */
+    static const long long MAX_PLEN_ = 16777216; /* maximum automatic piece length, 16MB */
+
+  private:
+    string file_;               /* payload file */
+    string announce_;           /* tracker's URL */
+    string name_;               /* payload name stored in metainfo */
+    long long piece_length_;    /* length for piece */
+    long long file_size_;       /* payload size */
+    size_t pnum_;               /* number of pieces */
+    size_t run_;                /* pieces claimed by a worker at a time */
+    unsigned int nthread_;      /* number of hashing workers */
+    unsigned char* hashes_;     /* SHA1 of each piece, 20 bytes per piece */
+    atomic<size_t> next_;       /* next unclaimed piece */
+    atomic<bool> failed_;       /* a worker hit an I/O error */
+    double seconds_;            /* wall time spent hashing */
+
+    static const long long RUN_BYTES_ = 16777216; /* bytes claimed by a worker at a time */
+    static const int TARGET_PIECES_ = 2048;       /* piece count aimed for by auto sizing */
+
+    /* pick a piece length when none is given */
+    void choose_piece_length();
+
+    /* hashing job */
+    void hash_worker();
+
+    /* bencode metainfo and write it to disk */
+    void write_meta(string torrent);
+};
+#endif
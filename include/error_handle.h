@@ -28,7 +28,11 @@ enum Error {
   ERR_TRACK,   /* error on communication with tracker */
   ERR_IP,      /* error on finding local address */
   ERR_RESP,    /* response message not valid */
-  ERR_CREATE   /* error on creating temporary file */
+  ERR_CREATE,  /* error on creating temporary file */
+  ERR_PAYLOAD, /* payload to share is not a non-empty regular file */
+  ERR_WRITE,   /* error on writing metainfo file */
+  ERR_CTRL,    /* error on binding control socket */
+  ERR_LSD      /* error on joining discovery group */
 };
 
 /* Fail types 
@@ -41,11 +45,13 @@ enum Fail {
   FAL_ADDR,  /* invalid peer address */
   FAL_CONN,  /* cannot connect to peer */
   FAL_HS,    /* handshake failed */
-  FAL_BIT    /* bitfield invalid */
+  FAL_BIT,   /* bitfield invalid */
+  FAL_MESG   /* message invalid */
 };
 
 /*** Handle Functions ***/
 void error_handle(Error error);
+void error_handle(Error error, string info);
 void fail_handle(Fail fail);
 void fail_handle(Fail fail, string info);
 void help();
@@ -0,0 +1,84 @@
+/**
+ * Work-stealing executor of a client.
+ *
+ * One pool of worker threads, sized to the machine unless set,
+ * runs the short jobs of every torrent: timer handlers, piece
+ * hashing and disk work. Each worker keeps a deque per job class,
+ * it takes its own newest job first and steals the oldest jobs of
+ * other workers when idle. Network jobs run before hashing, and
+ * hashing before disk work.
+ *
+ * Jobs of a class pending over its limit make submitters outside
+ * the pool wait, workers never wait on submit.
+ *
+ */
+
+#ifndef _EXECUTOR_H_
+#define _EXECUTOR_H_
+
+#include <deque>              /* std::deque */
+#include <vector>             /* std::vector */
+#include <thread>             /* std::thread */
+#include <mutex>              /* std::mutex */
+#include <atomic>             /* std::atomic */
+#include <functional>         /* std::function */
+#include <algorithm>          /* std::max() */
+#include <condition_variable> /* std::condition_variable */
+
+using namespace std;
+
+class executor
+{
+  public:
+    //Job classes in priority order
+    enum Class {
+      NET,        /* protocol timers and messages */
+      HASH,       /* piece hashing */
+      DISK,       /* file I/O */
+      CLASS_NUM
+    };
+
+    /* size pool before first job, 0 for one worker per core */
+    static void init(unsigned int workers);
+    /* queue a job, waits while class is over its limit */
+    static void submit(Class c, function<void ()> job);
+    /* run a job on pool and wait for it */
+    static void run(Class c, function<void ()> job);
+    /* number of workers */
+    static unsigned int get_workers();
+    /* jobs of a class queued or running */
+    static long long get_pending(Class c);
+
+  private:
+    //Jobs of one worker
+    struct Worker {
+      mutex lock;                          /* lock to access deques */
+      deque<function<void ()>> jobs[CLASS_NUM]; /* jobs by class */
+    };
+
+    //Process wide pool
+    struct Pool {
+      vector<Worker*> workers;         /* workers, index is worker id */
+      atomic<long long> pending[CLASS_NUM]; /* jobs queued or running */
+      atomic<long long> queued;        /* jobs queued */
+      atomic<unsigned int> next;       /* worker fed by next outside job */
+      mutex lock;                      /* lock to sleep and wake */
+      condition_variable work;         /* jobs queued */
+      condition_variable room;         /* class went below limit */
+
+      /* constructor */
+      Pool(unsigned int size);
+    };
+
+    static const long long LIMITS_[CLASS_NUM]; /* pending jobs allowed per class */
+
+    /* process wide pool */
+    static Pool* pool(unsigned int size = 0);
+    /* worker id of calling thread, -1 outside pool */
+    static int& self();
+    /* worker thread job */
+    static void work(Pool* p, int id);
+    /* take a job, own deques first then others */
+    static bool take(Pool* p, int id, function<void ()>& job, Class& c);
+};
+#endif
@@ -0,0 +1,82 @@
+/**
+ * Local service discovery (BEP 14) of a session.
+ *
+ * Every hosted torrent is announced over UDP multicast as its
+ * info hash and the port peers reach the client on, when added
+ * and every ANNOUNCE_PERD_ seconds. Announces heard from other
+ * clients on the group are handed to the session, the peers
+ * found are connected before waiting for any tracker. The first
+ * announce heard from a client is answered at once for torrents
+ * hosted by both, so a client started later learns peers which
+ * announced before it joined.
+ *
+ * Announces carry a cookie unique to the process, so a client
+ * ignores its own announces looped back by the host. Several
+ * clients on one host share the group port.
+ *
+ * Usage: - 'urtorrent -L 239.192.152.143:6771 ...'
+ *
+ */
+
+#ifndef _LSD_H_
+#define _LSD_H_
+
+#include <string>          /* std::string */
+#include <vector>          /* std::vector */
+#include <thread>          /* std::thread */
+#include <atomic>          /* std::atomic */
+#include <chrono>          /* std::chrono::steady_clock */
+#include <functional>      /* std::function */
+#include <unordered_map>   /* std::unordered_map */
+#include <unordered_set>   /* std::unordered_set */
+#include <netinet/in.h>    /* struct sockaddr_in */
+#include <error_handle.h>  /* error_handle() */
+
+using namespace std;
+using namespace std::chrono;
+
+class lsd
+{
+  public:
+    //Info hashes of hosted torrents
+    typedef function<vector<string> ()> Hashes;
+    //Consumer of a peer found, info hash and ip:port
+    typedef function<void (const string&, const string&)> Found;
+
+    /* constructor */
+    lsd(string group, string port, Hashes hashes, Found found);
+    /* destructor */
+    ~lsd();
+
+  private:
+    string group_;           /* multicast group as ip:port */
+    string port_;            /* port announced */
+    string cookie_;          /* tells own announces apart */
+    Hashes hashes_;          /* info hashes to announce */
+    Found found_;            /* consumer of peers found */
+    int sockfd_;             /* UDP socket joined to group */
+    int wake_[2];            /* self pipe waking up discovery thread */
+    struct sockaddr_in addr_; /* group address */
+    thread worker_;          /* discovery thread */
+    atomic<bool> running_;   /* discovery thread running status */
+    unordered_map<string, steady_clock::time_point> next_; /* next announce by info hash */
+    unordered_set<string> cookies_; /* cookies of clients heard */
+
+    static const int ANNOUNCE_PERD_ = 300; /* seconds between announces of a torrent */
+    static const int COOKIES_MAX_ = 256;   /* clients remembered */
+    static const int POLL_WAIT_ = 1000;    /* ms of idle poll */
+    static const int DGRAM_SIZE_ = 1400;   /* datagram buffer size */
+    static const int HASHES_MAX_ = 8;      /* info hashes per announce */
+
+    /* setup socket */
+    void setup();
+    /* discovery thread main loop */
+    void run_service();
+    /* announce torrents due */
+    void announce();
+    /* read announces of other clients */
+    void receive();
+    /* parse an announce and hand its peers over */
+    void parse(const string& mesg, const struct sockaddr_in& from);
+};
+#endif
@@ -28,21 +28,33 @@ using namespace std;
 
 /**
  * Handling metainfo file, parse metainfo and display information.
+ * A file which cannot be read or is malformed leaves the object
+ * invalid, check valid() before use.
  */
 class metainfo
 {
   public:
     /* constructor */
     metainfo(string file, string port);
+    /* destructor */
+    ~metainfo();
     /* print out metainfo */
     void show_meta(string ip);
+    /* metainfo file parsed successfully */
+    bool valid();
+    /* reason parsing failed */
+    string get_error();
     /* getters */
     string get_announce();
+    vector<vector<string>> get_announce_list();
     string get_filename();
     string get_port();
     string get_peerid();
     string get_infohash();
-    string get_piecehash(int index);
+    string get_info();
+    const unsigned char* get_piecehash(int index);
+    /* compare a SHA1 digest against hash of piece */
+    bool match_piecehash(int index, const unsigned char* hash);
     string get_tmpfile();
     long long get_size();
     long long get_piece_size();
@@ -52,15 +64,19 @@ class metainfo
   private:
     string metafile_;           /* metainfo file */
   	string announce_;           /* tracker's URL */
+  	vector<vector<string>> announce_list_; /* tiers of tracker URLs */
   	string filename_;           /* target file name */
   	string port_;               /* local port */
   	string peer_id_;            /* unique ID of peer */
   	string info_hash_;          /* metainfo hash */
+  	string info_raw_;           /* bencoded info dictionary */
   	long long piece_length_;    /* length for piece */
     long long last_size_;       /* size of the last piece */
   	long long file_size_;       /* target file size */
     int bflen_;                 /* bytes needed to construct bitfield */
-  	vector<string> piece_hash_; /* hash for each piece */
+  	unsigned char* piece_hash_; /* hash table, 20 bytes for each piece */
+  	size_t piece_num_;          /* number of pieces */
+    string error_;              /* reason parsing failed, empty if valid */
 
   	static const int MAX_SIZE_ = 8192; /* maximum metainfo file size, 8KB */
   	static const int ID_SIZE_ = 20;    /* size of peer id in byte*/
@@ -71,10 +87,14 @@ class metainfo
   	/* generate peer ID */
   	void generate_peerid();
   	/* metainfo file parser */
-  	void Parser();
+  	bool Parser();
+  	/* check fields parsed from metainfo */
+  	bool validate();
   	/* extract metainfo from be_node */
-  	void _dump_be_node(be_node* node, char* key);
+  	bool _dump_be_node(be_node* node, char* key);
+  	/* extract tiers of announce-list */
+  	bool _dump_announce_list(be_node* node);
   	/* SHA1 hash function for info dictionary */
-  	void _hash_info(char* meta_str, size_t meta_len);
+  	void _hash_info(be_node* info);
 };
 #endif
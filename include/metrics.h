@@ -0,0 +1,120 @@
+/**
+ * Metrics registry of a client.
+ *
+ * Counters and histograms are kept in per-thread shards, a thread
+ * only writes its own shard with relaxed atomics so recording takes
+ * no lock. Shards are summed on demand when exporting, the counts of
+ * exited threads are folded into a retired shard.
+ *
+ * Histograms use log2 buckets of microseconds and are exported in
+ * Prometheus text format together with their sum and count.
+ *
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <string>    /* std::string */
+#include <vector>    /* std::vector */
+#include <atomic>    /* std::atomic */
+#include <mutex>     /* std::mutex */
+#include <chrono>    /* std::chrono::steady_clock */
+#include <ostream>   /* std::ostream */
+
+using namespace std;
+using namespace std::chrono;
+
+class metrics
+{
+  public:
+    //Global counters
+    enum Counter {
+      BYTES_DOWN,     /* payload bytes downloaded */
+      BYTES_UP,       /* payload bytes uploaded */
+      PIECES_DONE,    /* pieces downloaded and verified */
+      HASH_FAILS,     /* pieces failed verification */
+      CHOKES,         /* peers choked by client */
+      UNCHOKES,       /* peers unchoked by client */
+      PEX_PEERS,      /* peers connected from peer exchange */
+      LSD_PEERS,      /* peers connected from local discovery */
+      REVEALS,        /* pieces revealed while super seeding */
+      UPLOAD_DROPS,   /* block requests dropped without upload */
+      READ_RANGES,    /* piece runs read ahead for upload */
+      CACHE_HITS,     /* blocks served from read cache */
+      CACHE_MISSES,   /* blocks whose piece was not cached */
+      COUNTER_NUM
+    };
+
+    //Latency histograms
+    enum Histogram {
+      REQUEST_RTT,    /* block request to piece message */
+      HASH_TIME,      /* SHA-1 of a downloaded piece */
+      BLOCK_WRITE,    /* block read into mapped file */
+      PIECE_TIME,     /* first request to verified piece */
+      HISTOGRAM_NUM
+    };
+
+    //Message direction
+    enum Direction {
+      IN,             /* received from peer */
+      OUT,            /* sent to peer */
+      DIRECTION_NUM
+    };
+
+    static const int MESG_NUM = 11;  /* message ids 0-8, keep alive and extended */
+    static const int KEEP_ALIVE = 9; /* message slot of keep alive */
+    static const int EXTENDED = 10;  /* message slot of extended messages */
+    static const int BUCKETS = 26;   /* buckets of 2^i us, last is +Inf */
+
+    /* increase a counter of calling thread */
+    static void add(Counter c, long long v);
+    /* count a message of calling thread */
+    static void mesg(Direction d, int id);
+    /* record a duration */
+    static void observe(Histogram h, steady_clock::duration d);
+    /* write global metrics in Prometheus text format */
+    static void write_text(ostream& os);
+    /* total value of a counter */
+    static long long total(Counter c);
+
+  private:
+    //Values recorded by one thread
+    struct Shard {
+      atomic<long long> counters[COUNTER_NUM];
+      atomic<long long> mesgs[DIRECTION_NUM][MESG_NUM];
+      atomic<long long> buckets[HISTOGRAM_NUM][BUCKETS];
+      atomic<long long> sums[HISTOGRAM_NUM];   /* sum in ns */
+
+      /* constructor */
+      Shard();
+    };
+
+    //Shard owner, folds shard on thread exit
+    struct Local {
+      Shard* shard;   /* shard of thread */
+
+      /* constructor */
+      Local();
+      /* destructor */
+      ~Local();
+    };
+
+    //Shards of live threads
+    struct Registry {
+      mutex lock;             /* lock to access shards */
+      vector<Shard*> shards;  /* shards of live threads */
+      Shard retired;          /* sum of exited threads */
+    };
+
+    /* shard of calling thread */
+    static Shard* local();
+    /* process wide registry */
+    static Registry* registry();
+    /* bump a value only written by owner thread */
+    static void bump(atomic<long long>& v, long long n);
+    /* sum of every shard into one */
+    static void collect(Shard& sum);
+    /* add values of a shard into another */
+    static void fold(Shard& to, const Shard& from);
+};
+#endif
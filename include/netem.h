@@ -0,0 +1,142 @@
+/**
+ * Network emulator for loopback benchmarks.
+ *
+ * Each link is a TCP proxy listening in front of a peer's port.
+ * Bytes crossing a link are shaped per direction: a token bucket
+ * caps bandwidth, every chunk is held back for the link latency
+ * and a lost segment stalls its direction for a retransmission
+ * timeout, as TCP would in order delivery. Buckets are shared by
+ * every connection of a link, like an access link of the peer.
+ *
+ * Peers announce the proxy port ('urtorrent -a <port>') so that
+ * connections from other peers go through the link.
+ *
+ */
+
+#ifndef _NETEM_H_
+#define _NETEM_H_
+
+#include <string>          /* std::string */
+#include <vector>          /* std::vector */
+#include <deque>           /* std::deque */
+#include <thread>          /* std::thread */
+#include <atomic>          /* std::atomic */
+#include <chrono>          /* std::chrono::steady_clock */
+#include <error_handle.h>  /* error_handle() */
+
+using namespace std;
+using namespace std::chrono;
+
+class netem
+{
+  public:
+    //Link conditions, same in both directions
+    struct Shape {
+      int latency;       /* one way delay in ms */
+      long long rate;    /* bytes per second, 0 for unlimited */
+      long long burst;   /* bucket size in bytes, 0 for default */
+      double loss;       /* segment loss probability */
+    };
+
+    //Proxy in front of a peer
+    struct Link {
+      string port;       /* port peers connect to */
+      string target;     /* port of peer on loopback */
+      Shape shape;       /* link conditions */
+    };
+
+    /* constructor */
+    netem(const vector<Link>& links);
+    /* destructor */
+    ~netem();
+
+    /* getters */
+    long long get_bytes();
+    long long get_losses();
+
+    /* parse 'key=value' settings into shape */
+    static bool parse_shape(const string& spec, Shape& shape);
+
+  private:
+    //Bytes waiting for release
+    struct Chunk {
+      steady_clock::time_point release;  /* time to forward */
+      string data;                       /* payload */
+    };
+
+    //Token bucket of one link direction
+    struct Bucket {
+      double tokens;                     /* bytes may be read */
+      steady_clock::time_point refill;   /* last refill time */
+    };
+
+    //One direction of a proxied connection
+    struct Pipe {
+      int from;                          /* socket read from */
+      int to;                            /* socket written to */
+      Bucket* bucket;                    /* bandwidth of direction */
+      deque<Chunk> queue;                /* chunks in flight */
+      size_t queued;                     /* bytes in queue */
+      size_t offset;                     /* bytes of head written */
+      steady_clock::time_point last;     /* release of last chunk */
+      bool eof;                          /* from reached end of file */
+      bool shut;                         /* end of file passed to target */
+      bool blocked;                      /* to would block */
+    };
+
+    //Proxied connection
+    struct Conn {
+      int link;                          /* index of link */
+      Pipe down;                         /* remote peer to target */
+      Pipe up;                           /* target to remote peer */
+    };
+
+    //Listener and buckets of a link
+    struct Runtime {
+      int fd;                            /* listening socket */
+      Bucket down;                       /* bucket toward target */
+      Bucket up;                         /* bucket from target */
+    };
+
+    vector<Link> links_;        /* emulated links */
+    vector<Runtime> runtime_;   /* listener and buckets per link */
+    vector<Conn*> conns_;       /* connections, service thread only */
+    int wake_[2];               /* self pipe waking up service thread */
+    thread worker_;             /* service thread */
+    atomic<bool> running_;      /* service thread running status */
+    atomic<long long> bytes_;   /* bytes forwarded */
+    atomic<long long> losses_;  /* segments lost */
+    unsigned long long seed_;   /* loss generator state */
+
+    static const int MSS_ = 1448;          /* bytes of a TCP segment */
+    static const int MIN_RTO_ = 200;       /* ms of minimal retransmit timeout */
+    static const int BUFF_SIZE_ = 65536;   /* bytes read at a time */
+    static const int QUEUE_CAP_ = 4194304; /* bytes queued per direction */
+    static const int BURST_MS_ = 10;       /* default bucket in ms of rate */
+    static const int POLL_WAIT_ = 1000;    /* ms of idle poll */
+    static const int QUEUE_LEN_ = 128;     /* TCP accept queue size */
+
+    /* setup listeners */
+    void setup();
+    /* service thread main loop */
+    void run_service();
+    /* accept connections of a link */
+    void accept_conn(int link);
+    /* read from source of pipe */
+    bool fill(Pipe& pipe, const Shape& shape, steady_clock::time_point now);
+    /* forward released chunks */
+    bool flush(Pipe& pipe, steady_clock::time_point now);
+    /* next time pipe needs service */
+    steady_clock::time_point next_event(Pipe& pipe, const Shape& shape);
+    /* check if pipe may read */
+    bool can_read(Pipe& pipe, const Shape& shape);
+    /* refill token bucket */
+    void refill(Bucket& bucket, const Shape& shape, steady_clock::time_point now);
+    /* bucket size of a link */
+    static double bucket_size(const Shape& shape);
+    /* draw a uniform number in [0, 1) */
+    double uniform();
+    /* close connection */
+    void drop(Conn* conn);
+};
+#endif
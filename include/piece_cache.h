@@ -0,0 +1,111 @@
+/**
+ * Read cache of verified pieces, keyed by torrent and piece
+ * index. A session holds one cache shared by its torrents,
+ * the capacity bounds the process.
+ *
+ * Pieces popular in a flash crowd are read from storage once
+ * and served to every peer from memory. Pieces are spread over
+ * SHARDS_ shards by key, each shard has its own lock and its
+ * own share of the capacity.
+ *
+ * A shard follows 2Q: a piece read once enters the FIFO queue
+ * 'in', a piece read again while remembered by the ghost queue
+ * 'out' enters the LRU queue 'hot'. A scan over many pieces only
+ * cycles through 'in' and leaves hot pieces in place.
+ *
+ * Piece data is shared, a piece evicted while being sent stays
+ * alive until its sender is done.
+ *
+ */
+
+#ifndef _PIECE_CACHE_H_
+#define _PIECE_CACHE_H_
+
+#include <string>          /* std::string */
+#include <list>            /* std::list */
+#include <mutex>           /* std::mutex */
+#include <memory>          /* std::shared_ptr */
+#include <unordered_map>   /* std::unordered_map */
+#include <cstdint>         /* uint32_t and uint64_t */
+
+using namespace std;
+
+class piece_cache
+{
+  public:
+    //Data of a piece, kept alive by its holders
+    typedef shared_ptr<const string> Piece;
+
+    /* constructor, capacity in bytes */
+    piece_cache(long long capacity);
+
+    /* piece data, nullptr on miss */
+    Piece get(uint32_t owner, uint32_t index);
+
+    /* keep piece read from storage after a miss */
+    void put(uint32_t owner, uint32_t index, Piece data);
+
+    /* check if a piece is held, not counted as a lookup */
+    bool has(uint32_t owner, uint32_t index);
+
+    /* forget every piece of a torrent */
+    void drop(uint32_t owner);
+
+    /* check if a piece of given size can be held */
+    bool fits(long long size);
+
+    /* bytes of pieces held for a torrent */
+    long long get_bytes(uint32_t owner);
+
+  private:
+    //Torrent in high half, piece index in low half
+    typedef uint64_t Key;
+
+    //Queue a piece is in
+    enum Queue {
+      IN,    /* read once, FIFO */
+      HOT,   /* read again, LRU */
+      OUT    /* evicted from IN, key only */
+    };
+
+    //Entry of a piece
+    struct Entry {
+      Queue queue;                /* queue piece is in */
+      Piece data;                 /* piece data, nullptr in OUT */
+      list<Key>::iterator pos;    /* position in its queue */
+    };
+
+    //Shard of cache
+    struct Shard {
+      mutex lock;                 /* lock to access shard */
+      list<Key> in;               /* FIFO, newest first */
+      list<Key> hot;              /* LRU, most recent first */
+      list<Key> out;              /* ghost FIFO, newest first */
+      unordered_map<Key, Entry> entries; /* <key, entry> */
+      long long in_bytes = 0;     /* bytes of pieces in IN */
+      long long hot_bytes = 0;    /* bytes of pieces in HOT */
+    };
+
+    static const int SHARDS_ = 16;     /* number of shards */
+    static const int IN_SHARE_ = 4;    /* IN holds 1/IN_SHARE_ of a shard */
+    static const int OUT_SHARE_ = 2;   /* OUT remembers 1/OUT_SHARE_ of pieces a shard holds */
+
+    long long capacity_;         /* bytes each shard holds */
+    Shard shards_[SHARDS_];      /* shards by key */
+
+    /* key of a piece */
+    static Key key_of(uint32_t owner, uint32_t index);
+
+    /* shard a key lives in */
+    Shard& shard_of(Key key);
+
+    /* list of a queue */
+    list<Key>& queue_of(Shard& s, Queue q);
+
+    /* evict pieces until shard fits its capacity */
+    void evict(Shard& s);
+
+    /* drop an entry from its queue */
+    void unlink(Shard& s, Key key);
+};
+#endif
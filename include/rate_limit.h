@@ -0,0 +1,70 @@
+/**
+ * Hierarchical token bucket rate limiter.
+ *
+ * A limit may have a parent: bytes consumed from a peer limit are
+ * consumed from the torrent limit and then from the global limit,
+ * so each level caps the sum of its children.
+ *
+ * Callers of a limit are served in arrival order, a peer sharing
+ * a parent with busier peers still gets its turn. A bucket may go
+ * into debt by one request, blocks larger than the burst size never
+ * wait forever. Rates may be changed at any time, waiters recompute
+ * their wait on change.
+ *
+ * Threads which must not wait use try_consume(), bytes pass only
+ * when every level is ready and the caller retries later otherwise.
+ *
+ */
+
+#ifndef _RATE_LIMIT_H_
+#define _RATE_LIMIT_H_
+
+#include <mutex>              /* std::mutex */
+#include <condition_variable> /* std::condition_variable */
+#include <chrono>             /* std::chrono::steady_clock */
+
+using namespace std;
+using namespace std::chrono;
+
+class rate_limit
+{
+  public:
+    /* constructor */
+    rate_limit(rate_limit* parent = nullptr, long long rate = 0);
+
+    /* set rate in bytes per second, 0 for unlimited */
+    void set_rate(long long rate);
+    /* get rate in bytes per second */
+    long long get_rate();
+    /* get bytes passed through limit */
+    long long get_bytes();
+
+    /* wait until bytes may pass this limit and its parents */
+    void consume(long long bytes);
+
+    /* check if bytes pass this limit without waiting, parents aside */
+    bool ready();
+
+    /* pass bytes if this limit and its parents are ready */
+    bool try_consume(long long bytes);
+
+  private:
+    rate_limit* parent_;              /* enclosing limit, nullptr if none */
+    mutex lock_;                      /* lock to access bucket */
+    condition_variable cv_;           /* waiters for turn or tokens */
+    long long rate_;                  /* bytes per second, 0 for unlimited */
+    long long bytes_;                 /* bytes passed */
+    double tokens_;                   /* bytes may pass, negative in debt */
+    steady_clock::time_point refill_; /* last refill time */
+    unsigned long long next_;         /* next ticket to hand out */
+    unsigned long long serving_;      /* ticket being served */
+
+    static const int BURST_MS_ = 100; /* bucket size in ms of rate */
+
+    /* add tokens earned since last refill */
+    void refill(steady_clock::time_point now);
+
+    /* pass bytes through this limit without waiting */
+    void take(long long bytes);
+};
+#endif
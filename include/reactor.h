@@ -0,0 +1,56 @@
+/**
+ * Reactor reading peer connections of a process.
+ *
+ * One thread waits on the sockets of every connection by epoll
+ * instead of a thread per connection. It reads what arrived,
+ * cuts whole messages and hands them to their connection, the
+ * connection handles them one at a time on the executor. Queued
+ * writes are flushed once a socket drains.
+ *
+ * The thread also sweeps connections once every SWEEP_MS_ and
+ * whenever woken, connections stopped or silent too long are
+ * let go and end on the executor.
+ *
+ */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <vector>        /* std::vector */
+#include <mutex>         /* std::mutex */
+#include <thread>        /* std::thread */
+
+using namespace std;
+
+class connection;   //Peer Wire Protocol connection class
+
+class reactor
+{
+  public:
+    /* watch socket of a connection */
+    static void add(connection* conn);
+    /* wake reactor to sweep connections */
+    static void wake();
+
+  private:
+    //Epoll set shared by connections
+    struct Service {
+      int epfd;                    /* epoll instance */
+      int wake;                    /* eventfd waking reactor thread */
+      mutex lock;                  /* lock to access adding */
+      vector<connection*> adding;  /* connections to watch */
+
+      /* constructor */
+      Service();
+    };
+
+    static const int MAX_EVENTS_ = 256;  /* events taken per wait */
+    static const int SWEEP_MS_ = 1000;   /* ms between sweeps */
+
+    /* process wide reactor */
+    static Service* service();
+
+    /* reactor thread job */
+    static void poll(Service* svc);
+};
+#endif
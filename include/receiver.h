@@ -1,55 +1,64 @@
 /**
  * Peer Wire Protocol receiver.
- * Communicate with one peer.
- * Most of the functionality are undertaken by a dedicated thread,
- * 
+ * Downloading side of a connection with one peer, messages
+ * sent by the peer to this side are handed over by the
+ * connection thread.
  *
  */
 
 #ifndef _RECEIVER_H_
 #define _RECEIVER_H_
 
-#include <thread>      /* std::thread */
 #include <mutex>       /* std::mutex */
+#include <chrono>      /* std::chrono::steady_clock */
 #include <metainfo.h>  /* metainfo handle */
-#include <timer.h>     /* countdown timer */
 #include <types.h>     /* PWP message types, helper functions */
+#include <rate_limit.h> /* token bucket rate limiter */
 
 using namespace std;
+using namespace std::chrono;
 
-class core;   //urtorrent core component class
+class core;         //urtorrent core component class
+class connection;   //connection with peer
 
 class receiver
 {
   public:
     /* constructor */
-    receiver(string remote, core* core);
+    receiver(connection* conn, string id, core* core);
 
     /* destructor */
     ~receiver();
 
-    /* URTorrent receiver main logic */
-    void run();
+    /* handle message of downloading side */
+    bool handle(char id, uint32_t size);
+
+    /* send request for blocks to peer, false if deferred */
+    bool send_request();
 
     /* get receiver's peer */
     peer* get_peer();
 
+    /* get connection with peer */
+    connection* get_conn();
+
     /* get peer's ip */
     string get_ip();
 
     /* set piece to request */
     void set_piece(uint32_t p);
 
+    /* get piece requesting */
+    uint32_t get_piece();
+
     /* send interested request to peer */
     void send_interested();
 
-  private:
-    int sock_;          /* socket with remote peer */
-    bool running_;      /* receiver executing status */
-
-    string ip_;         /* ip of remote peer */
-    string port_;       /* port of remote peer */
+    /* get download limit of peer */
+    rate_limit* get_limit();
 
+  private:
+    connection* conn_;  /* connection with peer */
     core* core_;        /* urtorrent core component */
     metainfo* mi_;      /* metainfo handle */
 
@@ -58,30 +67,14 @@ class receiver
     uint32_t piece_;    /* sequence of piece client interested */
     uint32_t size_;     /* requested block size */
 
-    fd_set rfds_;       /* file descriptor set for read */
-    int nfds_;          /* file descriptor number + 1, for select() */
-    struct timeval tv_; /* time interval for keeping alive */
-
-    timer *timer_;      /* timer to trigger keep alive request */
-
-    /* connect peer */
-    void peer_connect();
+    steady_clock::time_point req_time_;   /* time block was requested */
+    steady_clock::time_point piece_time_; /* time piece was first requested */
 
-    /* handshake with peer */
-    bool send_handshake();
-
-    /* create peer for receiver */
-    bool create_peer(string id);
-
-    /* handle incomming message */
-    bool mesg_handle();
+    rate_limit limit_;  /* download limit of peer */
 
     /* receive bitfield of peer */
     bool recv_bitfield(uint32_t size);
 
-    /* send request for blocks to peer */
-    void send_request();
-
     /* downloader thread */
     bool download(uint32_t size);
 
@@ -100,21 +93,10 @@ class receiver
     /* check if piece has been fully downloaded */
     bool complete_piece();
 
-    /* broadcast have message to other peer receivers */
+    /* broadcast have message to every peer */
     void broadcast_have();
 
-    /* handle have message */
-    void do_update_pbf();
-
     /* validate piece */
     bool validate_piece();
-
-    /* sending keep alive message */
-    void keep_alive();
-
-    /* terminate receiver */
-    void terminate();
-
-    void send_bf();
 };
 #endif
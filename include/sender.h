@@ -1,34 +1,60 @@
 /**
  * Peer Wire Protocol sender.
+ * Uploading side of a connection with one peer, messages
+ * sent by the peer to this side are handed over by the
+ * connection thread.
+ *
+ * Block requests wait in a queue of the peer, upload rounds
+ * of core serve queues of unchoked peers in turn. A request
+ * is dropped when the queue is full, when the peer cancels
+ * it or when the peer is choked, a choked peer is told once.
  *
  */
 
 #ifndef _SENDER_H_
 #define _SENDER_H_
 
-#include <thread>        /* std::thread */
 #include <mutex>         /* std::mutex */
+#include <atomic>        /* std::atomic */
+#include <deque>         /* std::deque */
 #include <metainfo.h>    /* metainfo handle */
-#include <timer.h>       /* countdown timer */
 #include <types.h>       /* PWP message types, helper functions */
+#include <rate_limit.h>  /* token bucket rate limiter */
+#include <piece_cache.h> /* piece read cache */
 
-class core;   //urtorrent core component class
+class core;         //urtorrent core component class
+class connection;   //connection with peer
 
 class sender
 {
   public:
+    friend class core;
+
+    //Block requested by peer
+    struct Request {
+      uint32_t piece;  /* piece index */
+      uint32_t begin;  /* block offset in piece */
+      uint32_t size;   /* size of block */
+    };
+
     /* constructor */
-    sender(int sock, string remote, core* core_);
+    sender(connection* conn, string id, core* core_);
 
     /* destructor */
     ~sender();
 
-    /* URTorrent sender main logic */
-    void run();
+    /* handle message of uploading side */
+    void handle(char id, uint32_t size);
+
+    /* inform peer of local pieces */
+    bool send_bitfield();
 
     /* get sender's peer */
     peer* get_peer();
 
+    /* get connection with peer */
+    connection* get_conn();
+
     /* get peer's ip */
     string get_ip();
 
@@ -38,60 +64,43 @@ class sender
     /* send have message to peer */
     void do_send_have(uint32_t index);
 
-  private:
-    int sock_;          /* socket with remote peer */
-    bool running_;      /* sender executing status */
-
-    string ip_;         /* peer's ip */
+    /* get upload limit of peer */
+    rate_limit* get_limit();
 
+  private:
+    connection* conn_;  /* connection with peer */
     core* core_;        /* urtorrent core component */
     metainfo* mi_;      /* metainfo handle */
     peer* peer_;        /* remote peer status */
 
-    uint32_t piece_;    /* peer requested piece index */
-    uint32_t begin_;    /* block offset in piece */
-    uint32_t size_;     /* size of block requested */
+    rate_limit limit_;  /* upload limit of peer */
 
-    fd_set rfds_;       /* file descriptor set for read */
-    int nfds_;          /* file descriptor number + 1, for select() */
-    struct timeval tv_; /* time interval for keeping alive */
+    deque<Request> requests_; /* requests waiting, upload lock held */
+    long long deficit_; /* bytes peer may be sent in its turn */
+    bool queued_;       /* peer waits for its turn */
+    atomic<bool> choke_told_; /* choke sent since last unchoke */
+    steady_clock::time_point last_up_; /* time last block was sent */
 
-    timer *timer_;      /* timer for keep alive */
-
-    /* handle handshake */
-    bool recv_handshake();
-
-    /* handle incomming message */
-    void req_handler();
-
-    /* create peer for sender */
-    bool create_peer(string id);
-
-    /* inform peer of local pieces */
-    bool send_bitfield();
-    
     /* generate bitfied message */
     void compose_bfmesg(char* buff);
 
     /* check if sender can unchoke */
     bool need_unchoke();
 
-    /* send choke message to peer */
+    /* send choke message once per choke */
     void send_choke();
 
-    /* prepare sender to upload */
-    void prepare_upload(char* buff);
-
-    /* upload block */
-    void upload();
+    /* parse and check a block request */
+    bool prepare_upload(char* buff, Request& req);
 
-    /* retrieve block data */
-    unsigned char* find_block(uint32_t offset);
+    /* check if peer can take a block without waiting */
+    bool ready();
 
-    /* sending keep alive message */
-    void keep_alive();
+    /* upload block, false if limits refuse it now */
+    bool upload(const Request& req);
 
-    /* terminate sender */
-    void terminate();
+    /* retrieve block data */
+    const unsigned char* find_block(const Request& req,
+                                    piece_cache::Piece& piece);
 };
 #endif
@@ -30,6 +30,8 @@ class server
 		server(string port);
 		/* incomming connection handler */
 		int accept_peer(string& ip);
+		/* listening socket */
+		int get_sock();
 	
 	private:
 		int sockfd_;  /* socket file descriptor */
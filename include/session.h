@@ -0,0 +1,169 @@
+/**
+ * Session hosting many torrents in one process.
+ *
+ * One listener accepts every incoming peer, the dispatcher thread
+ * polls handshakes of new connections and hands each connection
+ * to the torrent of its info hash.
+ * Torrents share the global rate limits, a budget of connections,
+ * one maintenance timer driving chokers and swarm checks of every
+ * torrent, the metrics file and the curl environment. Swarms of
+ * torrents on the same trackers are scraped by one request.
+ *
+ * Stats are rendered on every timeout into a snapshot, readers
+ * of the snapshot never wait on torrents.
+ *
+ * Usage: - construct with listening and advertised port
+ *        - add torrents, at start or at any time later
+ *        - reach a torrent by index for user commands
+ *        - remove torrents, later ones move down one index
+ *
+ */
+
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <core.h>           /* torrent core */
+#include <server.h>         /* TCP server */
+#include <lsd.h>            /* local service discovery */
+#include <unordered_map>    /* std::unordered_map */
+
+class session
+{
+  public:
+    friend class core;
+
+    /* constructor */
+    session(string port, string advert, string metrics_file = "");
+
+    /* destructor */
+    ~session();
+
+    /* add a torrent, return its index or -1 with reason */
+    int add(string torrent, string& reason);
+
+    /* stop and remove a torrent */
+    void remove(int index);
+
+    /* number of torrents */
+    int size();
+
+    /* getters of a torrent by index */
+    core* get_core(int index);
+    metainfo* get_meta(int index);
+    tracker_agent* get_agent(int index);
+
+    /* global upload and download limits */
+    rate_limit* get_up_limit();
+    rate_limit* get_down_limit();
+
+    /* set connection budget, 0 for unlimited */
+    void set_max_conns(int max);
+    /* get connection budget */
+    int get_max_conns();
+    /* get connections in use */
+    int get_conns();
+    /* take a connection from budget */
+    bool acquire_conn();
+    /* return a connection to budget */
+    void release_conn();
+
+    /* super seed torrents added later which are complete */
+    void set_super_seed(bool on);
+
+    /* read cache shared by torrents, before any is added */
+    void set_cache_size(long long bytes);
+
+    /* command metrics of every torrent, Prometheus text format */
+    void do_metrics(ostream& os);
+
+    /* metrics rendered on last timeout */
+    string get_snapshot();
+
+    /* announce torrents and find peers on local network */
+    void discover(string group);
+
+    /* refresh snapshot, on a disk worker unless waited for */
+    void refresh(bool wait = false);
+
+  private:
+    //Components of a hosted torrent
+    struct Torrent {
+      metainfo* mi;          /* metainfo handler */
+      tracker_agent* agent;  /* tracker handler */
+      core* pwp;             /* peer wire protocol core */
+    };
+
+    //Connection waiting for its torrent to be added
+    struct Waiting {
+      int sock;    /* socket with remote peer */
+      string ip;   /* peer's ip */
+      string hs;   /* handshake sent by peer */
+    };
+
+    //Connection waiting for its handshake
+    struct Greeting {
+      string ip;                   /* peer's ip */
+      string hs;                   /* handshake bytes read */
+      steady_clock::time_point end; /* time handshake is due */
+    };
+
+    server* server_;        /* TCP server shared by torrents */
+    string advert_;         /* port announced to trackers */
+    string metrics_file_;   /* file metrics are written to, empty if none */
+    timer* timer_;          /* maintenance timer */
+    lsd* lsd_;              /* local discovery, nullptr if off */
+    thread dispatcher_;     /* thread accepting incoming peers */
+    atomic<bool> running_;  /* dispatcher keeps accepting */
+
+    rate_limit up_limit_;   /* upload limit of process */
+    rate_limit down_limit_; /* download limit of process */
+    atomic<int> conns_;     /* connections in use */
+    atomic<int> max_conns_; /* connection budget, 0 for unlimited */
+    atomic<bool> dumping_;  /* metrics dump queued or running */
+    atomic<bool> super_seed_; /* torrents complete when added are super seeded */
+    atomic<long long> cache_size_; /* read cache bytes of process, 0 for none */
+    piece_cache* cache_;    /* read cache shared by torrents, nullptr if off */
+    atomic<uint32_t> owners_; /* keys handed to torrents in read cache */
+
+    mutex lock_;                     /* lock to access torrents */
+    mutex drive_;                    /* lock held while torrents are driven */
+    mutex snlock_;                   /* lock to access snapshot */
+    mutex dmlock_;                   /* lock held while a dump renders and writes */
+    condition_variable added_;       /* signaled when a pending torrent is routed */
+    string snapshot_;                /* metrics rendered on last timeout */
+    vector<Torrent*> torrents_;      /* torrents in order added */
+    unordered_map<string, core*> routes_; /* <info hash, core>, nullptr while being added */
+    unordered_map<string, vector<Waiting>> waiting_; /* <info hash, peers> of torrents being added */
+
+    static const int HS_WAIT_ = 30; /* seconds allowed to send handshake */
+    static const int STOP_WAIT_ = 10; /* ms between checks of a stopping torrent */
+
+    /* accept incomming connections */
+    void dispatch();
+
+    /* read handshake bytes, true once connection is done */
+    bool greet(int sock, Greeting& g);
+
+    /* drop peers waiting for a torrent never added */
+    void drop_waiting(const string& infohash);
+
+    /* hand a connection to torrent of its handshake */
+    void route(int sock, string ip, string hs);
+
+    /* hand a peer found on local network to its torrent */
+    void lan_peer(const string& infohash, const string& addr);
+
+    /* pause a torrent and wait for its connections */
+    void stop(core* pwp);
+
+    /* timeout handler */
+    void timeout();
+
+    /* scrape swarms of torrents sharing trackers together */
+    void scrape_swarms();
+
+
+    /* render snapshot and write metrics file */
+    void dump_metrics();
+};
+#endif
@@ -3,26 +3,25 @@
  * A timer can be registered via constructor by setting a time-
  * out handler with the prototype: 
  *       void (*) ()
- * The resolution for this timer is 1 second.
+ * Timers of a process share one countdown thread which sleeps
+ * until the earliest end, timeout handlers run on the executor.
  */
 
 #ifndef _TIMER_H_
 #define _TIMER_H_
 
 #include <chrono>             /* std::chrono::seconds and std::chrono::steady_clock */
-#include <thread>             /* std::thread and sleep_for()*/
+#include <thread>             /* std::thread */
 #include <functional>         /* std::function */
 #include <utility>            /* bind(), make_pair() */
-#include <atomic>             /* atomic<bool> */
+#include <atomic>             /* std::atomic */
 #include <mutex>              /* std::mutex and std::lock_guard */
 #include <condition_variable> /* std::condition_variable */
+#include <map>                /* std::multimap */
 
 using namespace std;
 using namespace std::chrono;
 
-/*** Constants ***/
-static const int INTV_ = 1;      /* count down interval value in seconds */
-
 class timer
 {
   public:
@@ -38,8 +37,8 @@ class timer
     {
       //init class members
       this->started_ = false;
-      this->running_ = false;
-      interv_ = seconds(INTV_);
+      this->dead_ = false;
+      this->running_ = 0;
 
       //set timeout handler
       this->handler_ = bind(forward<F>(f), 
@@ -49,20 +48,35 @@ class timer
     ~timer();
     /* start the timer */
     void start(int dura);
+    /* start the timer for a duration under a second */
+    void start(milliseconds dura);
     /* stop the timer */
     void stop();
 
   private:
+    //Timers counting down, ordered by end
+    typedef multimap<steady_clock::time_point, timer*> Queue;
+
+    //Countdown shared by timers
+    struct Service {
+      mutex lock;              /* lock to access queue and timers */
+      condition_variable cv;   /* earliest end changed */
+      Queue queue;             /* timers started */
+
+      /* constructor */
+      Service();
+    };
+
     bool started_;                   /* timer start status */
-    steady_clock::time_point epoch_; /* start time of a duration */
-    steady_clock::time_point end_;   /* end time of a duration */
-    seconds interv_;                 /* timer count down interval */
-    atomic<bool> running_;           /* flag to show a existing timer is running */
-    condition_variable cv_;          /* timer condition variable */
-    mutex t_lock_;                   /* lock to notify timer */
+    bool dead_;                      /* timer being destroyed */
+    Queue::iterator pos_;            /* entry in queue if started */
+    atomic<int> running_;            /* number of handlers queued or running */
     function<void ()> handler_;      /* timeout handle funtion */
     
-    /* countdown timer */
-    void countdown();
+    /* process wide countdown */
+    static Service* service();
+
+    /* countdown thread job */
+    static void countdown(Service* svc);
 };
 #endif
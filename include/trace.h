@@ -0,0 +1,112 @@
+/**
+ * Piece lifecycle tracer.
+ *
+ * Events are recorded into a ring buffer of the calling thread with
+ * a nanosecond timestamp, the owner thread is the only writer so
+ * recording takes no lock. When a ring is full the oldest events
+ * are overwritten. Rings of exited threads are kept until a number
+ * of newer ones retire.
+ *
+ * Rings are dumped on demand as Chrome trace JSON, readable by
+ * chrome://tracing and Perfetto: a piece is an async slice from
+ * pick to HAVE, its steps are instants on the slice and hashing is
+ * a slice of the hashing thread.
+ *
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <string>    /* std::string */
+#include <vector>    /* std::vector */
+#include <deque>     /* std::deque */
+#include <atomic>    /* std::atomic */
+#include <mutex>     /* std::mutex */
+#include <chrono>    /* std::chrono::steady_clock */
+#include <ostream>   /* std::ostream */
+#include <cstdint>   /* uint32_t and uint64_t */
+
+using namespace std;
+using namespace std::chrono;
+
+class trace
+{
+  public:
+    //Lifecycle events of a piece
+    enum Event {
+      PICKED,       /* piece chosen by rarest first */
+      UNCHOKED,     /* peer unchoked client for piece */
+      REQUESTED,    /* block requested */
+      FIRST_BLOCK,  /* first block of piece arrived */
+      LAST_BLOCK,   /* last block of piece arrived */
+      HASH_START,   /* piece verification started */
+      HASH_END,     /* piece verification finished */
+      BF_UPDATED,   /* local bitfield updated */
+      HAVE_SENT,    /* HAVE sent to peer */
+      EVENT_NUM
+    };
+
+    static const int RING_SIZE = 4096;   /* events per thread, power of 2 */
+    static const int RETIRED_MAX = 64;   /* rings kept of exited threads */
+
+    /* start or stop recording */
+    static void enable(bool on);
+    /* check if recording */
+    static bool enabled();
+    /* record an event of a piece */
+    static void record(Event e, uint32_t piece, uint32_t arg = 0);
+    /* write recorded events as Chrome trace JSON */
+    static void write_json(ostream& os);
+
+  private:
+    //Recorded event
+    struct Entry {
+      uint64_t ns;      /* nanoseconds since tracer epoch */
+      uint32_t piece;   /* piece index */
+      uint32_t arg;     /* block offset when relevant */
+      int event;        /* event type */
+    };
+
+    //Events of one thread
+    struct Ring {
+      int tid;                 /* thread number in trace */
+      atomic<uint64_t> head;   /* events written so far */
+      Entry entries[RING_SIZE];
+
+      /* constructor */
+      Ring(int id);
+    };
+
+    //Ring owner, retires ring on thread exit
+    struct Local {
+      Ring* ring;     /* ring of thread, allocated on first event */
+
+      /* constructor */
+      Local();
+      /* destructor */
+      ~Local();
+    };
+
+    //Rings of live and exited threads
+    struct Registry {
+      mutex lock;                   /* lock to access rings */
+      vector<Ring*> rings;          /* rings of live threads */
+      deque<Ring*> retired;         /* rings of exited threads */
+      int next_tid;                 /* next thread number */
+      steady_clock::time_point epoch; /* time zero of trace */
+      atomic<bool> on;              /* recording status */
+
+      /* constructor */
+      Registry();
+    };
+
+    /* ring of calling thread */
+    static Ring* local();
+    /* process wide registry */
+    static Registry* registry();
+    /* copy events still held by a ring */
+    static void snapshot(Ring* ring, vector<Entry>& out);
+    /* write one event as JSON */
+    static void write_entry(ostream& os, int tid, const Entry& e);
+};
+#endif
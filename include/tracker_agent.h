@@ -1,12 +1,15 @@
 /**
- * Establish a persistent connection with tracker. Periodically request 
+ * Establish a persistent connection with tracker. Periodically request
  * tracker. To get the knowledge of peer who has the file portion missing
  * in local, and informs the tracker for which parts of file this client
- * can share. All the communication are through HTTP GET.
+ * can share. The communication is through HTTP GET, or through the
+ * UDP tracker protocol for udp:// announce URLs.
  *
- * NOTE: The base class "../include/client.h" has setup connection properly 
- * The session handler is assigned to a variable called handle_ 
- * which is inherited by tracker_agent.
+ * NOTE: Requests are driven by a dedicated I/O thread on top of the
+ * curl multi interface, callers only queue announces and never block
+ * on the network unless they explicitly wait for the reply. Parsed
+ * replies are published through a callback registered by the core.
+ * UDP tracker sockets are polled on the same thread.
  *
  */
 
@@ -14,17 +17,25 @@
 #define _TRACKER_AGENT_H_
 
 #include <mutex>         /* std::mutex and std::lock_guard */
+#include <thread>        /* std::thread */
+#include <atomic>        /* std::atomic */
+#include <memory>        /* std::shared_ptr */
+#include <chrono>        /* std::chrono::steady_clock */
+#include <functional>    /* std::function */
+#include <random>        /* std::mt19937 */
 #include <metainfo.h>    /* metainfo handle */
+#include <udp_tracker.h> /* UDP tracker client */
 #include <curl/curl.h>   /* curl_* functions */
-#include <timer.h>       /* class timer */
-#include <unordered_map>
+#include <unordered_set> /* std::unordered_set */
+#include <unordered_map> /* std::unordered_map */
 #include <condition_variable> /* std::condition_variable */
 
+using namespace std::chrono;
+
 /**
  * Handling requests and response with remote P2P tracker.
- * Use the inherited  constructor and destructor to setup
- * and clean connection session.
- * The connection handler is also inherited from base
+ * start() performs the initial announce and returns once the
+ * tracker replied, later announces are asynchronous.
  */
 class tracker_agent
 {
@@ -44,25 +55,53 @@ class tracker_agent
       int interv;            /* suggest request intervals */
       int min_interv;        /* minimum request intervals */
       string track_id;       /* optionally tracker id */
+      string failure;        /* failure reason, empty if none */
       vector<string> peers;  /* vector of 6 bytes peers */
     };
 
+    //Swarm statistics of a scrape reply
+    struct Stats {
+      int seeders;                       /* number of seeders */
+      int completed;                     /* number of completed downloads */
+      int leechers;                      /* number of leechers */
+      steady_clock::time_point fetched;  /* time of scrape */
+    };
+
+    //Consumer of tracker replies
+    typedef function<void (const Message&)> Callback;
+
     /* constructor */
     tracker_agent(metainfo* mi);
     /* destructor */
     ~tracker_agent();
+    /* initial announce, false if no tracker replied */
+    bool start();
     /* trigger request to tracker */
     void do_announce();
     /* print out response info */
     void show_info(bool exclu);
+    /* scrape tracker and print out swarm statistics */
+    void do_scrape();
+    /* queue a scrape of one or many info hashes */
+    bool scrape(const vector<string>& hashes, bool wait);
+    /* cached swarm statistics */
+    bool get_stats(const string& hash, Stats& stats);
+    /* store swarm statistics scraped by another agent */
+    void put_stats(const string& hash, const Stats& stats);
+    /* check if statistics need a scrape */
+    bool stale(const string& hash);
+    /* check if statistics are recent */
+    static bool fresh(const Stats& stats);
+    /* announce early to learn more peers */
+    void reannounce();
+    /* announce late, swarm is already known */
+    void defer();
     /* inform tracker client's completation */
     void complete();
     /* end communication with tracker */
     void terminate();
-    /* waiting peer list */
-    void waiting_peer_update();
-    /* notify thread waiting peer list to wake up */
-    void do_notify();
+    /* register consumer of tracker replies */
+    void set_callback(Callback cb);
 
     /* setters */
     void update_upload(long long bytes);
@@ -76,40 +115,141 @@ class tracker_agent
     vector<string> get_peers();
 
   private:
-    CURL* handle_;          /* curl easy handle */
+    //Outcome of an announce, shared with a waiting caller
+    struct Result {
+      bool done;             /* request finished, successfully or not */
+      bool ok;               /* tracker replied with a valid message */
+      string status;         /* HTTP status line */
+    };
+
+    //Remote tracker of announce-list
+    struct Tracker {
+      string url;                        /* announce URL */
+      string static_info;                /* request static portion */
+      string scrape_url;                 /* scrape URL, empty if unsupported */
+      udp_tracker* udp;                  /* UDP client, null for HTTP */
+      int fails;                         /* consecutive failures */
+      steady_clock::time_point retry_at; /* end of failure backoff */
+    };
+
+    //One announce, sent to every tracker of a tier at once
+    struct Round {
+      Event event;                       /* announce event */
+      bool regular;                      /* periodical announce */
+      int attempt;                       /* passes over all tiers done */
+      size_t tier;                       /* tier being announced to */
+      int waiting;                       /* requests of tier in flight */
+      bool ok;                           /* a tracker of tier replied */
+      steady_clock::time_point due;      /* earliest time to (re)send */
+      Message mesg;                      /* replies merged so far */
+      unordered_set<string> seen;        /* peers already merged */
+      string ip;                         /* local IP seen by tracker */
+      shared_ptr<Result> result;         /* outcome for waiting caller */
+      bool scrape;                       /* scrape instead of announce */
+      vector<string> hashes;             /* info hashes to scrape */
+      unordered_map<string, Stats> stats; /* scrape replies merged so far */
+    };
+
+    //Request to a single tracker
+    struct Request {
+      CURL* easy;                        /* curl easy handle, null for UDP */
+      Tracker* tracker;                  /* tracker requested */
+      Round* round;                      /* announce it belongs to */
+      string body;                       /* response body */
+      string headers;                    /* response headers */
+      char error[CURL_ERROR_SIZE];       /* curl error message */
+      string status;                     /* status line of reply */
+      string ip;                         /* local IP seen by tracker */
+    };
+
+    CURLM* multi_;          /* curl multi handle */
     metainfo* mi_;          /* metainfo handler */
-    string static_info_;    /* request static portion */
-    string headers_;        /* response headers */
+    mt19937 rng_;           /* random engine, I/O thread once started */
+    vector<vector<Tracker*>> tiers_; /* trackers by tier, I/O thread only */
     string filename_;       /* target filename */
-    char* ip_;              /* local IP address */
-    long long upload_;      /* size of bytes uploaded */
-    long long download_;    /* number of bytes downloaded since start */
-    Event event_;           /* request event */
+    string ip_;             /* local IP address */
+    atomic<long long> upload_;   /* size of bytes uploaded */
+    atomic<long long> download_; /* number of bytes downloaded since start */
     Message mesg_ = {};     /* response from tracker */
-    mutex mesg_lock_;       /* lock for accessing mesg_ */
-    mutex pslk_;            /* lock for updating peer address set */
-    condition_variable cv_; /* condition variable to update peer address set*/
-    timer* timer_;          /* countdown timer */
+    mutex mesg_lock_;       /* lock for accessing mesg_ and ip_ */
+    mutex cb_lock_;         /* lock for accessing callback_ */
+    Callback callback_;     /* consumer of tracker replies */
+
+    thread worker_;         /* I/O thread driving curl multi */
+    atomic<bool> running_;  /* I/O thread executing status */
+    mutex queue_lock_;      /* lock for accessing pending_ and results */
+    condition_variable done_cv_;  /* signalled when a request finishes */
+    vector<Round*> pending_;      /* announces waiting to be sent */
+    unordered_set<Request*> inflight_; /* requests added to multi handle */
+    bool regular_busy_;           /* a periodic announce is in flight */
+    steady_clock::time_point next_regular_; /* time of next periodic announce */
+    steady_clock::time_point last_regular_; /* time of last announce */
+    mutex stats_lock_;            /* lock for accessing stats_ and scraping_ */
+    unordered_map<string, Stats> stats_; /* scrape cache by info hash */
+    unordered_set<string> scraping_;     /* info hashes being scraped */
+    unordered_map<string, steady_clock::time_point> scrape_retry_; /* no refresh of hash before, after a failure */
 
     static constexpr const char* CMPAT_ = "1";        /* always accept compact reply */
     static constexpr const char* START_ = "started";  /* option for event start */
     static constexpr const char* COMP_ = "completed"; /* option for event complete */
     static constexpr const char* STOP_ = "stopped";   /* option for event stop */
 
-    /* send request to tracker */
-    void _send(string request);
+    static const long TIMEOUT_ = 30;      /* seconds allowed for one request */
+    static const long CONN_TIMEOUT_ = 10; /* seconds allowed to connect */
+    static const int MAX_RETRY_ = 3;      /* passes over all tiers before giving up */
+    static const int RETRY_BASE_ = 2;     /* seconds of first tracker backoff */
+    static const int MAX_BACKOFF_ = 8;    /* cap of backoff doubling */
+    static const int DEF_INTERV_ = 60;    /* interval when tracker suggests none */
+    static const int STOP_WAIT_ = 5;      /* seconds to wait for stopped reply */
+    static const int IDLE_WAIT_ = 1000;   /* ms of idle poll */
+    static const int STATS_TTL_ = 120;    /* seconds scrape replies stay fresh */
+    static const int DEFER_SHARE_ = 2;    /* defer adds 1/DEFER_SHARE_ of interval */
+    static const int SCRAPE_BATCH_ = udp_tracker::MAX_HASHES_; /* info hashes per scrape round */
+
+    /* queue an announce, optionally wait for its outcome */
+    shared_ptr<Result> announce(Event event, bool wait, int wait_sec);
+    /* send announce to next usable tier */
+    bool start_round(Round* round);
+    /* create easy handle for a tracker request */
+    Request* setup_request(Tracker* tracker, Round* round);
+    /* start UDP announce of a tracker request */
+    Request* setup_udp(Tracker* tracker, Round* round);
     /* generate HTTP GET request */
-    string compose_request();
-    /* update information periodically */
+    string compose_request(Tracker* tracker, Event event);
+    /* generate HTTP scrape request */
+    string compose_scrape(Tracker* tracker, const vector<string>& hashes);
+    /* parse HTTP scrape reply into announce */
+    bool parse_scrape(Round* round, const string& body);
+    /* store merged scrape reply in cache */
+    void store_stats(Round* round);
+    /* I/O thread main loop */
     void run_service();
-    
+    /* start due announces */
+    void launch_due();
+    /* handle finished transfer */
+    void finish_request(Request* req, CURLcode code);
+    /* handle finished UDP transaction */
+    void finish_udp(udp_tracker::Reply& reply);
+    /* account reply of a tracker to its announce */
+    void conclude(Request* req, bool ok, Message& mesg);
+    /* drive UDP trackers, return time of next retransmit */
+    steady_clock::time_point serve_udp();
+    /* merge tracker reply into announce */
+    void merge_reply(Round* round, Message& mesg, Request* req);
+    /* publish merged reply to consumer */
+    void publish(Round* round);
+    /* mark announce done and wake waiters */
+    void settle(Round* round, bool ok);
+    /* compute periodic announce interval */
+    int next_interval();
+
     /* callback getting response status */
     static size_t
     get_header(char *buffer, size_t size,
                size_t nitems, void *userp);
     /* callback getting response body  */
     static size_t
-    _receive(void *buffer, size_t size, 
+    _receive(void *buffer, size_t size,
              size_t nmemb, void *userp);
 };
 #endif
@@ -0,0 +1,125 @@
+/**
+ * Embedded BitTorrent tracker, serves HTTP announces with
+ * compact replies (BEP 23) and UDP announces (BEP 15) on the
+ * same port number, as well as HTTP and UDP scrapes (BEP 48).
+ *
+ * Swarms are kept in memory only, keyed by info hash. Each
+ * swarm stores its peers as packed 6 bytes addresses so that
+ * a reply is assembled by copying slots, peers silent for two
+ * intervals are dropped. A single thread multiplexes the
+ * listening socket, the UDP socket and client connections.
+ *
+ * Usage: - standalone with 'urtorrent tracker <port>'
+ *        - in process of a client with 'urtorrent -t <port> ...'
+ *
+ */
+
+#ifndef _TRACKER_SERVER_H_
+#define _TRACKER_SERVER_H_
+
+#include <string>          /* std::string */
+#include <vector>          /* std::vector */
+#include <mutex>           /* std::mutex */
+#include <thread>          /* std::thread */
+#include <atomic>          /* std::atomic */
+#include <chrono>          /* std::chrono::steady_clock */
+#include <unordered_map>   /* std::unordered_map */
+#include <netinet/in.h>    /* struct sockaddr_in */
+#include <error_handle.h>  /* error_handle() */
+#include <bencode.h>       /* be_node */
+
+using namespace std;
+using namespace std::chrono;
+
+class tracker_server
+{
+  public:
+    /* constructor */
+    tracker_server(string port, int interval);
+    /* destructor */
+    ~tracker_server();
+    /* print out swarms */
+    void show_info();
+
+    /* getters */
+    size_t get_swarms();
+    long long get_announces();
+
+    static const int DEF_INTERV_ = 60;  /* default announce interval */
+
+  private:
+    //Peer slot of a swarm
+    struct Peer {
+      char addr[6];                      /* packed IPv4 address and port */
+      bool seed;                         /* peer has whole file */
+      steady_clock::time_point seen;     /* time of last announce */
+    };
+
+    //Peers sharing one info hash
+    struct Swarm {
+      vector<Peer> peers;                      /* packed peer slots */
+      unordered_map<unsigned long long, size_t> index; /* address to slot */
+      int seeders;                             /* number of seeds */
+      int completed;                           /* completed events seen */
+      size_t cursor;                           /* rotating reply offset */
+    };
+
+    //Announce decoded from HTTP or UDP
+    struct Announce {
+      string info_hash;     /* 20 bytes info hash */
+      unsigned int ip;      /* peer IPv4 address, network order */
+      unsigned short port;  /* peer port, host order */
+      long long left;       /* bytes left */
+      string event;         /* started, completed, stopped or empty */
+      int numwant;          /* peers wanted, negative for default */
+    };
+
+    //HTTP client connection
+    struct Client {
+      string buff;                       /* request received so far */
+      steady_clock::time_point since;    /* connection accepted time */
+    };
+
+    string port_;            /* tracker port */
+    int interval_;           /* announce interval handed out */
+    int tcpfd_;              /* HTTP listening socket */
+    int udpfd_;              /* UDP socket */
+    int wake_[2];            /* self pipe waking up service thread */
+    unsigned long long secret_; /* UDP connection id secret */
+    thread worker_;          /* service thread */
+    atomic<bool> running_;   /* service thread running status */
+    atomic<long long> announces_; /* announces served */
+    mutex swarm_lock_;       /* lock for accessing swarms_ */
+    unordered_map<string, Swarm> swarms_;  /* swarms by info hash */
+    unordered_map<int, Client> clients_;   /* HTTP connections, service thread only */
+
+    static const int MAX_PEERS_ = 50;    /* peers per reply by default */
+    static const int MAX_REQ_ = 8192;    /* HTTP request size limit */
+    static const int CLIENT_TO_ = 10;    /* seconds a HTTP client may idle */
+    static const int POLL_WAIT_ = 1000;  /* ms of idle poll */
+    static const int QUEUE_LEN_ = 128;   /* TCP accept queue size */
+    static const int DGRAM_SIZE_ = 2048; /* UDP datagram buffer size */
+
+    /* setup sockets */
+    void setup();
+    /* service thread main loop */
+    void run_service();
+    /* accept HTTP clients */
+    void accept_clients();
+    /* read HTTP client, reply once the request is complete */
+    bool serve_client(int fd, Client& client);
+    /* answer a HTTP request */
+    string http_reply(const string& request, unsigned int ip);
+    /* build files dictionary of a HTTP scrape */
+    be_node* scrape_files(const string& query);
+    /* read statistics of a swarm */
+    bool swarm_stats(const string& hash, int& seeders,
+                     int& completed, int& leechers);
+    /* answer UDP datagrams */
+    void serve_udp();
+    /* connection id of a UDP peer */
+    unsigned long long conn_id(const struct sockaddr_in& addr, long long epoch);
+    /* record announce and pick peers */
+    int update_swarm(const Announce& ann, string& peers, int& leechers);
+};
+#endif
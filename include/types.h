@@ -10,8 +10,10 @@
 #define _TYPES_H_
 
 #include <string>        /* std::string */
+#include <vector>        /* std::vector */
 #include <unordered_map> /* std::unordered_map */
 #include <unordered_set> /* std::unordered_set */
+#include <atomic>        /* std::atomic */
 #include <pthread.h>     /* for multiple readers single writer lock */
 #include <arpa/inet.h>   /* ntohl() and htonl() */
 
@@ -27,7 +29,15 @@ const char HAVE = 4;
 const char BIT_FIELD = 5;
 const char REQUEST = 6;
 const char PIECE = 7;
-const char CANCEL = 8;   //should not be used
+const char CANCEL = 8;
+const char EXTENDED = 20; //extension protocol, BEP 10
+
+/**** Extension Protocol ****/
+const char EXT_HANDSHAKE = 0;  /* extended message id of handshake */
+const char UT_PEX = 1;         /* extended message id of peer exchange, BEP 11 */
+const int EXT_RESV = 5;        /* reserved byte flagging extension protocol */
+const char EXT_BIT = 0x10;     /* bit of extension protocol in reserved byte */
+const int ADDR_LEN = 6;        /* compact IPv4 address and port */
 
 /***** URTorrent Signature *****/
 const char* const HANDSHAKE = "URTorrent protocol";  /* handshake signature */
@@ -60,6 +70,7 @@ enum Role {
 struct peer {
   uint32_t ip;      /* peer's ip address */
   uint32_t rate;    /* bit rate for downloading from */
+  atomic<long long> bytes;  /* payload bytes exchanged with peer */
   bool choking;     /* uploading choked by client */
   bool interested;  /* client interested in piece hold by peer */
   char* bitfield;   /* peer bitfield */
@@ -77,17 +88,28 @@ struct peer {
 /******** Type Definition ********/
 class receiver;
 class sender;
+class connection;
 typedef unordered_set<string> addr_set;            /* peer's ip:port set */
 typedef unordered_set<int> piece_set;              /* set of sequence of pieces */
 typedef unordered_set<peer*> peer_set;             /* set of peers */
-typedef unordered_set<receiver*> recv_set;         /* set of receivers */
-typedef unordered_set<sender*> sender_set;         /* set of senders */
+typedef unordered_set<connection*> conn_set;       /* set of peer connections */
 typedef unordered_map<string, receiver*> recv_map; /* <peer id, receiver> hash map */
 typedef unordered_map<string, sender*> send_map;   /* <peer id, sender> hash map */
 
 /***** Utility Functions *****/
 void hs_message(char* buff, string info_hash, string id );
-void send_have(int sock, uint32_t index);
+string ext_message(char ext_id, const string& payload);
+string compact_addr(const string& addr);
+string parse_addr(const char* bytes);
+size_t have_message(char* buff, uint32_t index);
+size_t request_message(char* buff, uint32_t index,
+                       uint32_t begin, uint32_t length);
+void parse_request(const char* buff, uint32_t& index,
+                   uint32_t& begin, uint32_t& length);
+size_t piece_message(char* buff, uint32_t index, uint32_t begin,
+                     const unsigned char* block, uint32_t size);
+void count_pieces(int* pcount, const char* pbf, uint32_t pnum);
+int rarest_pieces(const int* pcount, uint32_t pnum, vector<uint32_t>& seqs);
 void update_pbf(uint32_t* index_ptr, char* bf);
 bool acquire_reader(pthread_rwlock_t *lock);
 bool acquire_writer(pthread_rwlock_t *lock);
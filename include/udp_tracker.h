@@ -0,0 +1,173 @@
+/**
+ * Client side of the UDP tracker protocol (BEP 15).
+ *
+ * A udp_tracker owns one non-blocking datagram socket bound to a
+ * single tracker. Transactions (announce or scrape) are started by
+ * the owner and progressed by feeding socket readiness and timer
+ * ticks, so that many trackers can be driven by one I/O thread.
+ * The connection id handed out by the tracker is cached and reused
+ * by later transactions while it is valid.
+ *
+ * The tracker host is resolved on the executor, never on the I/O
+ * thread; transactions started meanwhile wait for the address. A
+ * failed resolution is backed off, transactions fail at once until
+ * the next attempt is due.
+ *
+ */
+
+#ifndef _UDP_TRACKER_H_
+#define _UDP_TRACKER_H_
+
+#include <string>          /* std::string */
+#include <vector>          /* std::vector */
+#include <chrono>          /* std::chrono::steady_clock */
+#include <mutex>           /* std::mutex */
+#include <memory>          /* std::shared_ptr */
+#include <random>          /* std::mt19937 */
+#include <functional>      /* std::function */
+#include <netinet/in.h>    /* struct sockaddr_in */
+
+using namespace std;
+using namespace std::chrono;
+
+class udp_tracker
+{
+  public:
+    //Protocol actions
+    enum Action {
+      ACT_CONNECT = 0,   /* obtain connection id */
+      ACT_ANNOUNCE = 1,  /* announce to swarm */
+      ACT_SCRAPE = 2,    /* query swarm sizes */
+      ACT_ERROR = 3      /* error reply from tracker */
+    };
+
+    //Announce events, values on the wire
+    enum Event {
+      UEVNT_NONE = 0,       /* periodical announce */
+      UEVNT_COMPLETED = 1,  /* downloading completed */
+      UEVNT_STARTED = 2,    /* peer started */
+      UEVNT_STOPPED = 3     /* peer terminated */
+    };
+
+    //Announce parameters
+    struct Announce {
+      string info_hash;      /* 20 bytes info hash */
+      string peer_id;        /* 20 bytes peer id */
+      long long downloaded;  /* bytes downloaded */
+      long long left;        /* bytes left */
+      long long uploaded;    /* bytes uploaded */
+      Event event;           /* announce event */
+      unsigned short port;   /* listening port */
+    };
+
+    //Swarm sizes of one torrent in a scrape reply
+    struct Swarm {
+      int seeders;           /* peers complete */
+      int completed;         /* times downloaded */
+      int leechers;          /* peers incomplete */
+    };
+
+    //Outcome of a transaction
+    struct Reply {
+      void* cookie;          /* owner's handle of transaction */
+      bool ok;               /* tracker replied */
+      string error;          /* reason of failure */
+      int interval;          /* suggest request interval */
+      int leechers;          /* number of leechers */
+      int seeders;           /* number of seeders */
+      vector<string> peers;  /* vector of 6 bytes peers */
+      vector<Swarm> swarms;  /* scrape result per info hash */
+    };
+
+    //Wakes owner's I/O thread once the tracker is resolved
+    typedef function<void ()> Wake;
+
+    /* constructor */
+    udp_tracker(string url, mt19937& rng, Wake wake);
+    /* destructor */
+    ~udp_tracker();
+
+    /* start transactions */
+    void announce(const Announce& para, void* cookie);
+    void scrape(const vector<string>& hashes, void* cookie);
+
+    /* drive transactions */
+    void on_readable();
+    void on_timer();
+    void take_done(vector<Reply>& out);
+
+    /* getters */
+    int get_fd();
+    bool busy();
+    string get_ip();
+    steady_clock::time_point get_deadline();
+
+    /* check if URL is handled by this class */
+    static bool is_udp(const string& url);
+
+    static const int MAX_HASHES_ = 74; /* info hashes per scrape datagram */
+
+  private:
+    //Transaction in progress
+    struct Trans {
+      void* cookie;          /* owner's handle */
+      Action action;         /* ACT_ANNOUNCE or ACT_SCRAPE */
+      bool connecting;       /* waiting for connection id */
+      unsigned int tid;      /* transaction id of last datagram */
+      int attempt;           /* datagrams sent so far */
+      steady_clock::time_point deadline; /* retransmit time */
+      Announce para;         /* announce parameters */
+      vector<string> hashes; /* scrape info hashes */
+    };
+
+    //Resolution of tracker host running on executor
+    struct Resolve {
+      mutex lock;                /* lock to access outcome and wake */
+      bool done;                 /* resolution finished */
+      bool ok;                   /* host resolved */
+      struct sockaddr_in addr;   /* resolved address */
+      Wake wake;                 /* wakes owner, empty once owner is gone */
+    };
+
+    string url_;                 /* tracker URL */
+    string host_;                /* tracker host */
+    string port_;                /* tracker port */
+    int fd_;                     /* datagram socket, -1 unresolved */
+    struct sockaddr_in addr_;    /* resolved tracker address */
+    long long conn_id_;          /* cached connection id */
+    steady_clock::time_point conn_expire_; /* expiry of conn_id_ */
+    unsigned int key_;           /* announce key */
+    mt19937& rng_;               /* random engine of owner, I/O thread only */
+    Wake wake_;                  /* wakes owner's I/O thread */
+    shared_ptr<Resolve> resolve_; /* resolution in flight, nullptr if none */
+    int resolve_fails_;          /* consecutive failed resolutions */
+    steady_clock::time_point resolve_retry_; /* no resolution before */
+    vector<Trans*> trans_;       /* transactions in progress */
+    vector<Reply> done_;         /* finished transactions */
+
+    static const long long PROTOCOL_ID_ = 0x41727101980LL; /* connect magic */
+    static const int CONN_TTL_ = 60;      /* seconds a connection id is valid */
+    static const int RETRANS_BASE_ = 1;   /* seconds before first retransmit */
+    static const int MAX_ATTEMPT_ = 5;    /* datagrams sent before giving up */
+    static const int DGRAM_SIZE_ = 2048;  /* receive buffer size */
+    static const int RESOLVE_BASE_ = 2;   /* seconds of first resolution backoff */
+    static const int MAX_BACKOFF_ = 8;    /* cap of backoff doubling */
+
+    /* send transaction once tracker is resolved */
+    void start(Trans* trans);
+    /* resolve tracker on executor */
+    void resolve();
+    /* open socket once resolution finished */
+    void resolved();
+    /* open connected socket to resolved tracker */
+    bool open_socket(const struct sockaddr_in& addr);
+    /* send datagram of transaction */
+    void transmit(Trans* trans);
+    /* handle a received datagram */
+    void dispatch(const unsigned char* buff, int len);
+    /* finish transaction */
+    void finish(Trans* trans, Reply& reply);
+    /* fail transaction */
+    void fail(Trans* trans, string reason);
+};
+#endif
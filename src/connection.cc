@@ -0,0 +1,1326 @@
+/**
+ * Implementation of Peer Wire Protocol connection.
+ * See class defination: '../include/connection.h'
+ *
+ */
+
+#include <connection.h>
+#include <sys/socket.h> /* socket syscalls*/
+#include <netdb.h>      /* getaddrinfo() and struct addrinfo */
+#include <climits>      /* INT_MAX */
+#include <core.h>       /* class core */
+#include <session.h>    /* class session */
+#include <cstdlib>      /* free() */
+#include <fcntl.h>      /* fcntl() */
+#include <executor.h>   /* work-stealing executor */
+#include <reactor.h>    /* reactor reading connections */
+
+/***************** Constants *****************/
+static const char* M_KEY = "m";            /* extended handshake key of message ids */
+static const char* PORT_KEY = "p";         /* extended handshake key of listening port */
+static const char* PEX_KEY = "ut_pex";     /* extension name of peer exchange */
+static const char* ADDED_KEY = "added";    /* peer exchange key of added peers */
+static const char* FLAGS_KEY = "added.f";  /* peer exchange key of added peer flags */
+static const char* DROPPED_KEY = "dropped"; /* peer exchange key of dropped peers */
+static const char* DELIM = ":";  /* delimitor between ip and port */
+
+/**
+ * Constructor - connection to a peer from tracker,
+ * connecting starts on the executor
+ *
+ * @remote: ip:port of remote peer
+ * @core: urtorrent core component
+ */
+connection::connection(string remote, core* core) : sock_(-1),
+                                                    outgoing_(true),
+                                                    running_(false),
+                                                    addr_(remote),
+                                                    core_(core)
+{
+  char buff[remote.size()+1] = {};  //ip:port char buffer
+  char* token;                      //buffer token pointer
+
+  //fill address buff
+  memcpy(buff, remote.c_str(), remote.size());
+
+  //set peer ip
+  token = strtok(buff, DELIM);
+  if (token)
+    this->ip_ = string(token);
+
+  //set peer port
+  token = token ? strtok(nullptr, DELIM) : nullptr;
+  if (token)
+    this->port_ = string(token);
+
+  //init other members
+  this->mi_ = this->core_->mi_;
+  this->recv_ = nullptr;
+  this->send_ = nullptr;
+  this->ext_ = false;
+  this->registered_ = false;
+  this->pex_id_ = 0;
+  this->connecting_ = true;
+  this->shaken_ = false;
+  this->throttled_ = false;
+  this->backlog_ = 0;
+  this->draining_ = false;
+  this->closed_ = false;
+
+  //init timers for sending keep alive and retrying requests
+  this->timer_ = new timer(&connection::keep_alive, this);
+  this->retry_ = new timer(&connection::retry, this);
+
+  //connect as first job
+  this->post([this] {this->start();});
+}
+
+/**
+ * Constructor - connection accepted by session, the
+ * handshake is checked on the executor
+ *
+ * @sock: socket with remote peer
+ * @ip: peer's ip
+ * @handshake: handshake read by session
+ * @core: urtorrent core component
+ */
+connection::connection(int sock, string ip, string handshake,
+                       core* core) : sock_(sock),
+                                     outgoing_(false),
+                                     running_(false),
+                                     ip_(ip),
+                                     hs_(handshake),
+                                     core_(core)
+{
+  //init other members
+  this->mi_ = this->core_->mi_;
+  this->recv_ = nullptr;
+  this->send_ = nullptr;
+  this->ext_ = false;
+  this->registered_ = false;
+  this->pex_id_ = 0;
+  this->connecting_ = false;
+  this->shaken_ = true;
+  this->throttled_ = false;
+  this->backlog_ = 0;
+  this->draining_ = false;
+  this->closed_ = false;
+
+  //init timers for sending keep alive and retrying requests
+  this->timer_ = new timer(&connection::keep_alive, this);
+  this->retry_ = new timer(&connection::retry, this);
+
+  //check handshake as first job
+  this->post([this] {this->start();});
+}
+
+/**
+ * Destructor - close socket
+ */
+connection::~connection()
+{
+  if (this->sock_ >= 0)
+    ::close(this->sock_);
+}
+
+/**
+ * First job of connection. An outgoing connection starts
+ * connecting and the reactor tells once connected, an
+ * incoming one is established at once. The reactor reads
+ * messages of peer from then on.
+ */
+void connection::start()
+{
+  //set status
+  this->running_ = true;
+  this->last_in_ = steady_clock::now();
+
+  //connect peer, handshake follows once connected
+  if (this->outgoing_) {
+    if (!this->peer_connect())
+      goto _FAIL;
+    reactor::add(this);
+    return;
+  }
+
+  if (!this->establish())
+    goto _FAIL;
+  reactor::add(this);
+  return;
+
+_FAIL:
+  //never watched by reactor, ends after this job
+  this->running_ = false;
+  this->close();
+}
+
+/**
+ * Check handshake of peer, register peer and tell it
+ * pieces client has, then offer peer exchange.
+ *
+ * Return: true if connection is established
+ */
+bool connection::establish()
+{
+  //handshake with peer
+  if (!this->handshake())
+    return false;
+
+  //torrent paused while connecting
+  if (this->core_->paused_)
+    return false;
+
+  //resolve duplicate connection with peer
+  if (!this->register_peer())
+    return false;
+  this->registered_ = true;
+
+  //tell peer which pieces client has
+  if (!this->send_->send_bitfield())
+    return false;
+
+  //offer peer exchange
+  if (this->ext_ && !this->send_ext_handshake())
+    return false;
+
+  //keep alive counts from last message of peer
+  this->timer_->start(core::ALIVE_PERD_);
+  return true;
+}
+
+/**
+ * Queue a whole message to peer and write as much
+ * as the socket takes, the reactor writes the rest
+ * once the socket drains. Writes of receiver, sender
+ * and other threads are serialized, messages never
+ * interleave. A peer leaving OUT_MAX_ bytes unread
+ * is dropped.
+ *
+ * @buff: message buffer
+ * @len: message length
+ * Return: true if message is queued, otherwise false
+ */
+bool connection::send(const void* buff, size_t len)
+{
+  {
+    lock_guard<mutex> lock(this->wlock_);
+
+    if (!this->running_)
+      return false;
+
+    if (this->out_.size()+len > connection::OUT_MAX_) {
+      this->running_ = false;
+      this->out_.clear();
+      goto _WAKE;
+    }
+
+    this->out_.append((const char*)buff, len);
+    if (this->write_out())
+      return true;
+  }
+
+_WAKE:
+  //reactor lets go of connection
+  reactor::wake();
+  return false;
+}
+
+/**
+ * Write queued bytes as far as the socket takes them
+ * without waiting. A failed write stops connection.
+ * Write lock is held.
+ *
+ * Return: false if write failed, otherwise true
+ */
+bool connection::write_out()
+{
+  ssize_t wrsz;  //write size
+
+  while (!this->out_.empty()) {
+    wrsz = ::send(this->sock_, this->out_.data(), this->out_.size(),
+                  MSG_DONTWAIT|MSG_NOSIGNAL);
+    if (wrsz < 0 && errno == EINTR)
+      continue;
+    if (wrsz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return true;
+    if (wrsz <= 0) {
+      fail_handle(FAL_SYS);
+      this->running_ = false;
+      this->out_.clear();
+      return false;
+    }
+    this->out_.erase(0, wrsz);
+  }
+
+  return true;
+}
+
+/**
+ * Write queued bytes the socket takes
+ * Return: false if write failed, otherwise true
+ */
+bool connection::flush()
+{
+  lock_guard<mutex> lock(this->wlock_);
+  return this->write_out();
+}
+
+/**
+ * Read part of the message being handled, the reactor
+ * handed over the whole message and nothing waits.
+ * Jobs of connection only.
+ *
+ * @buff: buffer of at least len bytes
+ * @len: bytes to read
+ *
+ * Return: bytes read, less than len if message is shorter
+ */
+ssize_t connection::receive(void* buff, size_t len)
+{
+  len = min(len, this->mesg_.size()-this->mesg_pos_);
+  memcpy(buff, this->mesg_.data()+this->mesg_pos_, len);
+  this->mesg_pos_ += len;
+
+  return len;
+}
+
+/**
+ * Stop connection after current message, the
+ * reactor lets go of it
+ */
+void connection::stop()
+{
+  this->running_ = false;
+  reactor::wake();
+}
+
+/**
+ * Check if every queued byte reached the socket,
+ * a block queued now waits for no earlier message
+ *
+ * Return: true if nothing is queued
+ */
+bool connection::writable()
+{
+  lock_guard<mutex> lock(this->wlock_);
+  return this->out_.empty();
+}
+
+/**
+ * Interface to get socket with peer
+ */
+int connection::get_sock()
+{
+  return this->sock_;
+}
+
+/**
+ * Interface to get peer's ip
+ */
+string connection::get_ip()
+{
+  return this->ip_;
+}
+
+/**
+ * Interface to get listening address of a registered
+ * peer, empty if unknown. Connection set lock must be held.
+ */
+string connection::get_addr()
+{
+  return this->registered_ ? this->addr_ : "";
+}
+
+/**
+ * Interface to get id of remote peer, known
+ * once handshake is done
+ */
+string connection::get_id()
+{
+  return this->peer_id_;
+}
+
+/**
+ * Interface to get downloading side
+ */
+receiver* connection::get_receiver()
+{
+  return this->recv_;
+}
+
+/**
+ * Interface to get uploading side
+ */
+sender* connection::get_sender()
+{
+  return this->send_;
+}
+
+/**
+ * Start a TCP connection with peer without waiting,
+ * the reactor tells once it is connected
+ * Return: true if connecting, otherwise false
+ */
+bool connection::peer_connect()
+{
+  struct addrinfo hint;           //address hint info
+  struct addrinfo *result, *rp;   //result for getaddrinfo()
+  int rv;                         //return val from getaddrinfo
+
+  if (this->ip_.empty() || this->port_.empty()) {
+    fail_handle(FAL_ADDR);
+    return false;
+  }
+
+  memset(&hint, 0, sizeof(struct addrinfo));
+
+  //set hint info
+  hint.ai_family = AF_INET;       //set for IPv4
+  hint.ai_socktype = SOCK_STREAM; //TCP connection
+  hint.ai_flags = AI_ADDRCONFIG;  //IPv4 configuration
+  hint.ai_protocol = 0;
+
+  //retrieve peer address info to result
+  rv = getaddrinfo(this->ip_.c_str(), this->port_.c_str(),
+                   &hint, &result);
+  if (rv != 0) {
+    fail_handle(FAL_CONN, this->addr_);
+    return false;
+  }
+
+  //find address from result to start connection
+  for (rp = result; rp != nullptr; rp = rp->ai_next) {
+    this->sock_ = socket(rp->ai_family,
+                         rp->ai_socktype|SOCK_NONBLOCK,
+                         rp->ai_protocol);
+    if(this->sock_ == -1)
+      continue;
+    if(connect(this->sock_, rp->ai_addr,
+               rp->ai_addrlen) != -1 || errno == EINPROGRESS)
+      break;
+    if(::close(this->sock_) < 0) {
+      fail_handle(FAL_SYS);
+    }
+    this->sock_ = -1;
+  }
+
+  //free result objects
+  freeaddrinfo(result);
+
+  if (rp == nullptr) {
+    fail_handle(FAL_CONN, this->addr_);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Check handshake of peer. Outgoing connection sent its
+ * handshake once connected and the reactor read the
+ * return, incoming connection checks handshake read by
+ * session and returns one.
+ *
+ * Return: if handshake succeed return true, otherwise
+ *         return false
+ */
+bool connection::handshake()
+{
+  char hs_mesg[HS_LEN] = {};  //handshake message buffer
+  char rt_hs[HS_LEN] = {};    //handshake of peer
+  string version;             //peer version
+
+  //construct handshake message
+  hs_message(hs_mesg, this->mi_->get_infohash(),
+             this->mi_->get_peerid());
+
+  //session or reactor reads whole handshake
+  if (this->hs_.size() != (size_t)HS_LEN) {
+    fail_handle(FAL_HS);
+    goto _FAIL;
+  }
+  memcpy(rt_hs, this->hs_.data(), HS_LEN);
+
+  //check peer's version
+  version = string(rt_hs+VERSION_OFFSET, VERSION_LEN);
+  if (version != string(HANDSHAKE)) {
+    fail_handle(FAL_HS);
+    goto _FAIL;
+  }
+
+  //extension protocol flagged in reserved bytes
+  this->ext_ = rt_hs[VERSION_OFFSET+VERSION_LEN+EXT_RESV] & EXT_BIT;
+
+  //check info hash
+  if (string(rt_hs+HASH_OFFSET, SHA_DIGEST_LENGTH) !=
+      this->mi_->get_infohash()) {
+    fail_handle(FAL_IHASH);
+    goto _FAIL;
+  }
+
+  //retrieve peer id in last 20 bytes
+  this->peer_id_ = string(rt_hs+HASH_OFFSET+SHA_DIGEST_LENGTH,
+                          SHA_DIGEST_LENGTH);
+
+  //client connected to itself
+  if (this->peer_id_ == this->mi_->get_peerid())
+    goto _FAIL;
+
+  //send return handshake
+  if (!this->outgoing_ && !this->send(hs_mesg, HS_LEN))
+    goto _FAIL;
+
+  return true;
+
+_FAIL:  //handshake failure return
+  return false;
+}
+
+/**
+ * Create receiver and sender of peer and add them
+ * into hash maps. When the peer already has a
+ * connection, the one kept is decided by wins(),
+ * the other is shut down. Both ends decide alike.
+ *
+ * Return: true if this connection is kept, otherwise false
+ */
+bool connection::register_peer()
+{
+  connection* old = nullptr;  //connection of same peer
+  connection* keep;           //connection kept
+  connection* drop;           //connection shut down
+  recv_map::iterator it;      //receiver of peer
+
+  //acquire hash map writer locks
+  if (!acquire_writer(&this->core_->rmlock_))
+    return false;
+
+  if (!acquire_writer(&this->core_->smlock_)) {
+    release_rwlock(&this->core_->rmlock_);
+    return false;
+  }
+
+  it = this->core_->rmap_.find(this->peer_id_);
+  if (it != this->core_->rmap_.end())
+    old = it->second->get_conn();
+
+  keep = (!old || this->wins(old)) ? this : old;
+  drop = (keep == this) ? old : this;
+
+  if (keep == this) {
+    //create both sides of connection
+    this->recv_ = new receiver(this, this->peer_id_, this->core_);
+    this->send_ = new sender(this, this->peer_id_, this->core_);
+
+    //add entries into hash maps
+    this->core_->rmap_[this->peer_id_] = this->recv_;
+    this->core_->smap_[this->peer_id_] = this->send_;
+  }
+
+  if (drop) {
+    //tracker address stays with connection kept, or
+    //peer would be connected again on next announce
+    lock_guard<mutex> lock(this->core_->cnlock_);
+    if (keep->addr_.empty())
+      keep->addr_ = drop->addr_;
+    drop->addr_.clear();
+
+    //wake thread of replaced connection
+    if (drop == old)
+      shutdown(old->sock_, SHUT_RDWR);
+  }
+
+  //release hash map writer locks
+  release_rwlock(&this->core_->smlock_);
+  release_rwlock(&this->core_->rmlock_);
+
+  return keep == this;
+}
+
+/**
+ * Check if this connection is kept over another
+ * one with same peer. Connection initiated by the
+ * smaller peer id is kept, on a tie the newer one.
+ *
+ * @other: connection registered for peer
+ * Return: true if this connection is kept
+ */
+bool connection::wins(connection* other)
+{
+  return this->initiator() <= other->initiator();
+}
+
+/**
+ * Peer id initiating connection
+ */
+string connection::initiator()
+{
+  return this->outgoing_ ? this->mi_->get_peerid() : this->peer_id_;
+}
+
+/**
+ * Queue a job of connection. Jobs run one at a time
+ * on the executor in order queued, a worker is only
+ * taken while jobs are queued.
+ *
+ * @job: job to run
+ */
+void connection::post(function<void ()> job)
+{
+  {
+    lock_guard<mutex> lock(this->jlock_);
+    this->jobs_.push_back(move(job));
+    if (this->draining_)
+      return;
+    this->draining_ = true;
+  }
+
+  executor::submit(executor::NET, [this] {this->drain();});
+}
+
+/**
+ * Run queued jobs until none is left. Once the reactor
+ * let go, the connection terminates after the last job,
+ * jobs queued later by its timers never run.
+ */
+void connection::drain()
+{
+  function<void ()> job;  //job taken
+
+  while (true) {
+    {
+      lock_guard<mutex> lock(this->jlock_);
+      if (this->jobs_.empty()) {
+        if (!this->closed_) {
+          this->draining_ = false;
+          return;
+        }
+        break;
+      }
+      job = move(this->jobs_.front());
+      this->jobs_.pop_front();
+    }
+
+    job();
+    job = nullptr;
+  }
+
+  //peer maps may still point to a connection not unlisted
+  if (this->terminate())
+    delete this;
+}
+
+/**
+ * Let go of connection, it terminates after jobs
+ * queued so far. Called by reactor, or by first job
+ * before reactor watched connection.
+ */
+void connection::close()
+{
+  {
+    lock_guard<mutex> lock(this->jlock_);
+    this->closed_ = true;
+    if (this->draining_)
+      return;
+    this->draining_ = true;
+  }
+
+  executor::submit(executor::NET, [this] {this->drain();});
+}
+
+/**
+ * Write queued bytes once socket drains. An outgoing
+ * connection sends its handshake once connected.
+ * Reactor thread only.
+ */
+void connection::on_writable()
+{
+  char hs_mesg[HS_LEN] = {};  //handshake message buffer
+  int err = 0;                //connect outcome
+  socklen_t len = sizeof(err);
+
+  if (!this->connecting_) {
+    if (!this->flush())
+      this->running_ = false;
+    return;
+  }
+
+  if (getsockopt(this->sock_, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+    fail_handle(FAL_CONN, this->addr_);
+    this->running_ = false;
+    return;
+  }
+  this->connecting_ = false;
+
+  //send handshake to peer
+  hs_message(hs_mesg, this->mi_->get_infohash(),
+             this->mi_->get_peerid());
+  this->send(hs_mesg, HS_LEN);
+}
+
+/**
+ * Read bytes of peer until socket would block and hand
+ * over whole messages. Reading pauses while IN_MAX_ bytes
+ * of messages wait to be handled. Reactor thread only.
+ */
+void connection::on_readable()
+{
+  char buff[connection::READ_SIZE_];  //bytes read
+  ssize_t rdsz;                       //read size
+
+  while (this->running_ && !this->connecting_) {
+    if (this->backlog_ > connection::IN_MAX_) {
+      this->throttled_ = true;
+      return;
+    }
+
+    rdsz = recv(this->sock_, buff, sizeof(buff), MSG_DONTWAIT);
+    if (rdsz < 0 && errno == EINTR)
+      continue;
+    if (rdsz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+
+    //connection closed or failed
+    if (rdsz <= 0) {
+      this->running_ = false;
+      return;
+    }
+
+    this->last_in_ = steady_clock::now();
+    this->in_.append(buff, rdsz);
+    this->cut();
+  }
+}
+
+/**
+ * Stop a peer silent for two keep alive periods, resume
+ * reading once the backlog is handled. Reactor thread only.
+ *
+ * @now: current time
+ */
+void connection::on_timer(steady_clock::time_point now)
+{
+  if (now-this->last_in_ > seconds(2*core::ALIVE_PERD_)) {
+    this->running_ = false;
+    return;
+  }
+
+  if (this->throttled_ && this->backlog_ <= connection::IN_MAX_) {
+    this->throttled_ = false;
+    this->on_readable();
+  }
+}
+
+/**
+ * Cut whole messages from bytes read and queue them,
+ * the handshake of an outgoing peer comes first. A
+ * message of invalid size stops connection before its
+ * payload is read. Reactor thread only.
+ */
+void connection::cut()
+{
+  size_t pos = 0;      //start of message
+  size_t len;          //length of message
+  uint32_t size;       //message size
+  string mesg;         //whole message
+
+  while (this->running_) {
+    if (!this->shaken_) {
+      len = HS_LEN;
+    }
+    else {
+      if (this->in_.size()-pos < PF_LEN)
+        break;
+      memcpy(&size, this->in_.data()+pos, PF_LEN);
+      size = ntohl(size);
+
+      //payload must fit message
+      if (size && this->in_.size()-pos > PF_LEN &&
+          !this->valid_size(this->in_[pos+PF_LEN], size-ID_LEN)) {
+        fail_handle(FAL_MESG);
+        this->running_ = false;
+        break;
+      }
+      len = PF_LEN+(size_t)size;
+    }
+
+    if (this->in_.size()-pos < len)
+      break;
+    mesg = this->in_.substr(pos, len);
+    pos += len;
+
+    this->backlog_ += len;
+    if (!this->shaken_) {
+      this->shaken_ = true;
+      this->post([this, mesg] {
+        this->backlog_ -= HS_LEN;
+        this->hs_ = mesg;
+        if (this->running_ && !this->establish())
+          this->stop();
+      });
+    }
+    else {
+      this->post([this, mesg]() mutable {this->process(mesg);});
+    }
+  }
+
+  this->in_.erase(0, pos);
+}
+
+/**
+ * Handle a whole message of peer, then request a block
+ * if permitted. Messages of a stopped connection are
+ * dropped. Jobs of connection only.
+ *
+ * @mesg: whole message, length prefix included
+ */
+void connection::process(string& mesg)
+{
+  size_t len = mesg.size();  //bytes of message
+  size_t before;             //backlog before message handled
+
+  if (this->running_) {
+    //keep alive counts from last message of peer
+    this->timer_->start(core::ALIVE_PERD_);
+
+    this->mesg_.swap(mesg);
+    this->mesg_pos_ = 0;
+    if (this->mesg_handle())
+      this->request();
+    this->mesg_.clear();
+  }
+
+  //reactor resumes reading once backlog is handled
+  before = this->backlog_.fetch_sub(len);
+  if (before > connection::IN_MAX_ && before-len <= connection::IN_MAX_)
+    reactor::wake();
+}
+
+/**
+ * Request a block of interested piece from a peer not
+ * choking client, a request deferred by download limits
+ * is retried after RETRY_MS_. Jobs of connection only.
+ */
+void connection::request()
+{
+  if (!this->running_)
+    return;
+
+  //check if client interested to peer
+  if (!this->recv_->get_peer()->interested)
+    return;
+
+  //check if peer is choking client
+  if (this->recv_->get_peer()->choking)
+    return;
+
+  //client is interested in peer
+  //peer is not choking client
+  //we can download blocks of interested
+  //piece now, unless download limits defer it
+  if (!this->recv_->send_request())
+    this->retry_->start(milliseconds((int)connection::RETRY_MS_));
+}
+
+/**
+ * Retry timer handler, deferred request is retried
+ * in order with messages of peer
+ */
+void connection::retry()
+{
+  this->post([this] {this->request();});
+}
+
+/**
+ * Handle incomming message sent by peer, the whole
+ * message is handed to receiver or sender.
+ * Return: true if requesting a block is permitted,
+ *         otherwise false.
+ */
+bool connection::mesg_handle()
+{
+  uint32_t mesg_size = 0;  //message size
+  uint32_t index = 0;      //piece index of have message
+  char mesg_id = 0;        //buffer to store message id
+
+  //fetch message size
+  if (this->receive(&mesg_size, PF_LEN) != PF_LEN)
+    goto _STOP;
+
+  //convert message size to local oreder
+  mesg_size = ntohl(mesg_size);
+
+  //check if it is keep-alive message
+  if (mesg_size == KEEP_ALIVE) {
+    metrics::mesg(metrics::IN, metrics::KEEP_ALIVE);
+    return false;
+  }
+
+  //fetch message ID
+  if (this->receive(&mesg_id, ID_LEN) != ID_LEN)
+    goto _STOP;
+  metrics::mesg(metrics::IN,
+                mesg_id == EXTENDED ? metrics::EXTENDED : mesg_id);
+  mesg_size -= ID_LEN;
+
+  //payload must fit message
+  if (!this->valid_size(mesg_id, mesg_size)) {
+    fail_handle(FAL_MESG);
+    goto _STOP;
+  }
+
+  if (mesg_id == BIT_FIELD || mesg_id == UNCHOKE ||
+      mesg_id == CHOKE || mesg_id == PIECE) {
+    //downloading side
+    return this->recv_->handle(mesg_id, mesg_size);
+  }
+  else if (mesg_id == INTERESTED || mesg_id == NO_INTERESTED ||
+           mesg_id == REQUEST || mesg_id == CANCEL) {
+    //uploading side
+    this->send_->handle(mesg_id, mesg_size);
+  }
+  else if (mesg_id == HAVE) {
+    //fetch piece index
+    if (this->receive(&index, IBL_LEN) != IBL_LEN)
+      goto _STOP;
+
+    index = ntohl(index);
+    if (index >= this->core_->pnum_) {
+      fail_handle(FAL_MESG);
+      goto _STOP;
+    }
+
+    this->peer_has(index);
+  }
+  else if (mesg_id == EXTENDED) {
+    if (!this->ext_handle(mesg_size))
+      goto _STOP;
+  }
+  else if (!this->skip(mesg_size)) {
+    //unknown message discarded
+    goto _STOP;
+  }
+
+  //return and wait for message
+  return false;
+
+_STOP:
+  this->running_ = false;
+  return false;
+}
+
+/**
+ * Check payload size of message against its type,
+ * unknown messages are buffered up to IN_MAX_.
+ *
+ * @id: message id
+ * @size: payload size
+ * Return: true if size fits message, otherwise false
+ */
+bool connection::valid_size(char id, uint32_t size)
+{
+  if (id == CHOKE || id == UNCHOKE ||
+      id == INTERESTED || id == NO_INTERESTED)
+    return size == 0;
+  if (id == HAVE)
+    return size == IBL_LEN;
+  if (id == REQUEST || id == CANCEL)
+    return size == REQ_LEN-ID_LEN;
+  if (id == BIT_FIELD)
+    return size == (uint32_t)this->core_->bflen_;
+  if (id == PIECE)
+    return size >= PIC_LEN-ID_LEN &&
+           size-(PIC_LEN-ID_LEN) <= BLOCK_SIZE;
+  if (id == EXTENDED)
+    return size >= 1 && size <= (uint32_t)connection::EXT_MAX_;
+  return size <= connection::IN_MAX_;
+}
+
+/**
+ * Record a piece announced by peer in have message,
+ * count it once and look for a piece to download.
+ *
+ * @index: piece index
+ */
+void connection::peer_has(uint32_t index)
+{
+  char* bf = this->recv_->get_peer()->bitfield;  //peer bitfield
+  char bit = 1 << (BYTE_LEN-index%BYTE_LEN-1);   //bit of piece
+
+  //piece already known
+  if (bf[index/BYTE_LEN] & bit)
+    return;
+
+  //update peer's bitfield of both sides
+  bf[index/BYTE_LEN] |= bit;
+  this->send_->get_peer()->bitfield[index/BYTE_LEN] |= bit;
+
+  //count piece and find piece for idle receivers
+  this->core_->update_pcount(index);
+  if (!this->recv_->get_peer()->interested)
+    this->core_->rarest_first();
+
+  //super seeding, a piece spreading earns its uploader another
+  if (this->core_->super_)
+    this->core_->spread(this->peer_id_, index);
+}
+
+/**
+ * Send extended handshake, telling id of peer exchange
+ * and port client listens on.
+ * message format:
+ *   (len)(id=20)(extended id=0)(d1:md6:ut_pexi1ee1:pi<port>ee)
+ *
+ * Return: true if handshake is sent, otherwise false
+ */
+bool connection::send_ext_handshake()
+{
+  be_node* dict = be_create_dict();  //handshake dictionary
+  be_node* ids = be_create_dict();   //extended ids of client
+  char* buff;                        //bencoded handshake
+  long long len;                     //bencoded length
+  string mesg;                       //extended message
+
+  be_dict_add(ids, PEX_KEY, be_create_int(UT_PEX));
+  be_dict_add(dict, M_KEY, ids);
+  be_dict_add(dict, PORT_KEY, be_create_int(stoi(this->mi_->get_port())));
+
+  buff = be_encode(dict, &len);
+  be_free(dict);
+  if (!buff)
+    return false;
+
+  mesg = ext_message(EXT_HANDSHAKE, string(buff, len));
+  free(buff);
+
+  metrics::mesg(metrics::OUT, metrics::EXTENDED);
+  return this->send(mesg.data(), mesg.size());
+}
+
+/**
+ * Read an extended message and hand it to its extension,
+ * malformed or unknown ones are discarded.
+ *
+ * @size: payload size, extended id included
+ * Return: true if message is read, otherwise false
+ */
+bool connection::ext_handle(uint32_t size)
+{
+  string payload(size, 0);  //extended id and bencoded payload
+  be_node* node;            //decoded payload
+
+  if (this->receive(&payload[0], size) != (ssize_t)size)
+    return false;
+
+  node = be_decoden(payload.data()+1, size-1);
+  if (!node) {
+    fail_handle(FAL_MESG);
+    return true;
+  }
+
+  if (node->type == BE_DICT) {
+    if (payload[0] == EXT_HANDSHAKE)
+      this->ext_handshake(node);
+    else if (payload[0] == UT_PEX)
+      this->pex_handle(node);
+  }
+
+  be_free(node);
+  return true;
+}
+
+/**
+ * Read extended handshake of peer. The listening address
+ * of an incoming peer enters address set, the tracker
+ * then never makes it connect again. A peer taking peer
+ * exchange gets connected peers at once.
+ *
+ * @dict: handshake dictionary
+ */
+void connection::ext_handshake(be_node* dict)
+{
+  be_node* val;   //value of a key
+  be_node* ids;   //extended ids of peer
+  int port = 0;   //listening port of peer
+  string addr;    //listening address of peer
+
+  for (int i = 0; dict->val.d[i].val; i++) {
+    val = dict->val.d[i].val;
+
+    if (!strcmp(dict->val.d[i].key, M_KEY) && val->type == BE_DICT) {
+      ids = val;
+      for (int j = 0; ids->val.d[j].val; j++) {
+        val = ids->val.d[j].val;
+        if (!strcmp(ids->val.d[j].key, PEX_KEY) && val->type == BE_INT &&
+            val->val.i >= 0 && val->val.i <= UCHAR_MAX)
+          this->pex_id_ = (char)val->val.i;
+      }
+    }
+    else if (!strcmp(dict->val.d[i].key, PORT_KEY) && val->type == BE_INT &&
+             val->val.i > 0 && val->val.i <= USHRT_MAX) {
+      port = val->val.i;
+    }
+  }
+
+  if (!this->outgoing_ && port) {
+    addr = this->ip_+DELIM+to_string(port);
+
+    lock_guard<mutex> lock(this->core_->cnlock_);
+    if (this->addr_.empty() && addr != this->core_->local_addr_ &&
+        !this->core_->pset_.count(addr)) {
+      this->core_->pset_.insert(addr);
+      this->addr_ = addr;
+    }
+  }
+
+  if (this->pex_id_)
+    this->core_->share_peers(this);
+}
+
+/**
+ * Connect peers added in a peer exchange, dropped peers
+ * need nothing as address set only holds connected ones.
+ * Exchanges sent faster than PEX_MIN_ are ignored and at
+ * most PEX_MAX_ peers are taken from one.
+ *
+ * @dict: peer exchange dictionary
+ */
+void connection::pex_handle(be_node* dict)
+{
+  steady_clock::time_point now = steady_clock::now(); //time received
+  vector<string> peers;  //addresses added
+  be_node* val;          //value of a key
+  long long num;         //compact addresses in value
+
+  if (this->pex_in_ != steady_clock::time_point() &&
+      now-this->pex_in_ < seconds((int)connection::PEX_MIN_))
+    return;
+  this->pex_in_ = now;
+
+  for (int i = 0; dict->val.d[i].val; i++) {
+    val = dict->val.d[i].val;
+    if (strcmp(dict->val.d[i].key, ADDED_KEY) || val->type != BE_STR)
+      continue;
+
+    num = min(be_str_len(val)/ADDR_LEN, (long long)connection::PEX_MAX_);
+    for (long long k = 0; k < num; k++)
+      peers.push_back(parse_addr(val->val.s+k*ADDR_LEN));
+  }
+
+  metrics::add(metrics::PEX_PEERS, this->core_->add_peers(peers));
+}
+
+/**
+ * Build exchange of peers connected or gone since last
+ * exchange, at most PEX_MAX_ of each and at most once
+ * every PEX_PERD_. The caller sends it, the addresses
+ * count as known to peer from now on.
+ * Connection set lock must be held.
+ *
+ * @live: listening addresses of connected peers
+ * Return: extended message, empty if nothing to send
+ */
+string connection::pex_message(const addr_set& live)
+{
+  steady_clock::time_point now = steady_clock::now(); //time to send
+  string added;      //compact addresses added
+  string flags;      //flags of added addresses
+  string dropped;    //compact addresses dropped
+  string compact;    //compact address
+  int num = 0;       //addresses added or dropped
+  be_node* dict;     //peer exchange dictionary
+  char* buff;        //bencoded exchange
+  long long len;     //bencoded length
+  string mesg;       //extended message
+
+  //peer not registered or not taking exchanges
+  if (!this->registered_ || !this->pex_id_)
+    return "";
+
+  lock_guard<mutex> lock(this->pxlock_);
+
+  //first exchange is sent at once
+  if (this->pex_out_ != steady_clock::time_point() &&
+      now-this->pex_out_ < seconds((int)connection::PEX_PERD_))
+    return "";
+
+  for (auto it = live.begin();
+       it != live.end() && num < connection::PEX_MAX_; it++) {
+    if (*it == this->addr_ || this->pex_sent_.count(*it))
+      continue;
+
+    compact = compact_addr(*it);
+    if (compact.empty())
+      continue;
+
+    added += compact;
+    flags += (char)0;
+    this->pex_sent_.insert(*it);
+    num++;
+  }
+
+  num = 0;
+  for (auto it = this->pex_sent_.begin();
+       it != this->pex_sent_.end() && num < connection::PEX_MAX_; ) {
+    if (live.count(*it)) {
+      it++;
+      continue;
+    }
+
+    dropped += compact_addr(*it);
+    it = this->pex_sent_.erase(it);
+    num++;
+  }
+
+  if (added.empty() && dropped.empty())
+    return "";
+  this->pex_out_ = now;
+
+  dict = be_create_dict();
+  be_dict_add(dict, ADDED_KEY, be_create_str(added.data(), added.size()));
+  be_dict_add(dict, FLAGS_KEY, be_create_str(flags.data(), flags.size()));
+  be_dict_add(dict, DROPPED_KEY, be_create_str(dropped.data(), dropped.size()));
+
+  buff = be_encode(dict, &len);
+  be_free(dict);
+  if (!buff)
+    return "";
+
+  mesg = ext_message(this->pex_id_, string(buff, len));
+  free(buff);
+  return mesg;
+}
+
+/**
+ * Discard payload of a message client doesn't use
+ * @size: payload size
+ * Return: true if payload discarded, otherwise false
+ */
+bool connection::skip(uint32_t size)
+{
+  char buff[BLOCK_SIZE];  //discard buffer
+  uint32_t len;           //bytes to read
+
+  while (size) {
+    len = min(size, BLOCK_SIZE);
+    if (this->receive(buff, len) != (ssize_t)len)
+      return false;
+    size -= len;
+  }
+
+  return true;
+}
+
+/**
+ * Sending keep alive message to peer
+ */
+void connection::keep_alive()
+{
+  //send message
+  this->send(&KEEP_ALIVE, PF_LEN);
+  metrics::mesg(metrics::OUT, metrics::KEEP_ALIVE);
+
+  //start new countdown
+  this->timer_->start(core::ALIVE_PERD_);
+}
+
+/**
+ * Terminate connection by clearing related objects.
+ * When peer maps cannot be locked the peer stays in
+ * them, its receiver, sender and this connection are
+ * kept alive; it is still unlisted from connection set
+ * and upload queues.
+ *
+ * Return: true if connection can be deleted
+ */
+bool connection::terminate()
+{
+  bool listed = false;  //peer left in peer maps
+
+  //delete timers, their handlers are done
+  delete this->timer_;
+  delete this->retry_;
+
+  //connection closed, give it back to session
+  this->core_->session_->release_conn();
+
+  //handshake failed or connection replaced, peer never counted
+  if (!this->recv_)
+    goto _UNLIST;
+
+  //peer's pieces no longer available
+  this->core_->remove_pcount(this->recv_->get_peer()->bitfield);
+
+  //acquire hash map writer locks
+  if (!acquire_writer(&this->core_->rmlock_))
+    goto _LISTED;
+
+  if (!acquire_writer(&this->core_->smlock_)) {
+    release_rwlock(&this->core_->rmlock_);
+    goto _LISTED;
+  }
+
+  //remove entries from hash maps, unless a later
+  //connection of same peer took the entries
+  {
+    auto rit = this->core_->rmap_.find(this->peer_id_);
+    if (rit != this->core_->rmap_.end() && rit->second == this->recv_)
+      this->core_->rmap_.erase(rit);
+
+    auto sit = this->core_->smap_.find(this->peer_id_);
+    if (sit != this->core_->smap_.end() && sit->second == this->send_)
+      this->core_->smap_.erase(sit);
+  }
+
+  //release hash map writer locks
+  release_rwlock(&this->core_->smlock_);
+  release_rwlock(&this->core_->rmlock_);
+
+  {
+    //peers are no longer unchoked
+    lock_guard<mutex> lock(this->core_->cklock_);
+    this->core_->unchoked_.erase(this->recv_->get_peer());
+    this->core_->unchoked_.erase(this->send_->get_peer());
+    if (this->core_->opp_ == this->recv_->get_peer() ||
+        this->core_->opp_ == this->send_->get_peer())
+      this->core_->opp_ = nullptr;
+  }
+
+  //requested piece can be picked again
+  if (this->recv_->get_peer()->interested &&
+      !this->recv_->get_peer()->choking) {
+    lock_guard<mutex> lock(this->core_->relock_);
+    this->core_->req_set.erase(this->recv_->get_piece());
+  }
+
+  //no block is served to peer anymore
+  this->core_->drop_uploads(this->send_);
+
+  delete this->recv_;
+  delete this->send_;
+
+  //keep downloading alive
+  this->core_->rarest_first();
+  goto _UNLIST;
+
+_LISTED:
+  //no block is served to peer, its objects stay alive
+  this->core_->drop_uploads(this->send_);
+  listed = true;
+
+_UNLIST:
+  {
+    //accquire connection set lock
+    lock_guard<mutex> lock(this->core_->cnlock_);
+
+    //remove record from peer address set
+    if (!this->addr_.empty())
+      this->core_->pset_.erase(this->addr_);
+
+    //remove entry from connection set, core may
+    //be deleted once the set is empty
+    this->core_->conns_.erase(this);
+  }
+
+  return !listed;
+}
@@ -0,0 +1,557 @@
+/**
+ * Implementation of class control.
+ * See class defination: '../include/control.h'
+ *
+ */
+
+#include <control.h>
+#include <sstream>        /* std::istringstream and std::ostringstream */
+#include <cstring>        /* memcpy() */
+#include <cerrno>         /* errno */
+#include <unistd.h>       /* close(), pipe() and unlink() */
+#include <signal.h>       /* kill() */
+#include <fcntl.h>        /* fcntl() */
+#include <poll.h>         /* poll() */
+#include <sys/socket.h>   /* socket syscalls */
+#include <sys/un.h>       /* struct sockaddr_un */
+
+/************* Constants *************/
+static const string OK = "ok\n";             /* reply of command done */
+static const string ERROR = "error ";        /* reply of command failed */
+static const string TORRENTS = "torrents";   /* list command */
+static const string ADD = "add";             /* add command */
+static const string REMOVE = "remove";       /* remove command */
+static const string PAUSE = "pause";         /* pause command */
+static const string RESUME = "resume";       /* resume command */
+static const string LIMIT = "limit";         /* rate limit command */
+static const string STATS = "stats";         /* stats command */
+static const string QUIT = "quit";           /* stop command */
+static const string UP = "up";               /* upload direction */
+static const string DOWN = "down";           /* download direction */
+static const string GLOBAL = "global";       /* limit of process */
+static const string TORRENT = "torrent";     /* limit of torrent */
+static const string PEER = "peer";           /* limit of each peer */
+static const string ACTIVE = "active";       /* torrent state connecting peers */
+static const string PAUSED = "paused";       /* torrent state refusing peers */
+static const long long BYTES_PER_KB = 1024;  /* bytes in a kilobyte */
+
+/********** Internal Function **********/
+string hex_id(const string& id);
+
+/**
+ * Constructor - bind control socket and launch
+ * the control and command threads.
+ *
+ * @path: path of control socket
+ * @sess: session commanded
+ */
+control::control(string path, session* sess) : path_(path), sess_(sess),
+                                               serial_(0)
+{
+  this->setup();
+
+  this->running_ = true;
+  this->worker_ = thread(&control::run_service, this);
+  this->commander_ = thread(&control::run_commands, this);
+}
+
+/**
+ * Destructor - stop control thread, wait for a command
+ * still running, close sockets and remove socket file
+ */
+control::~control()
+{
+  char byte = 0;  //wake up byte
+
+  this->running_ = false;
+  {
+    lock_guard<mutex> lock(this->jlock_);
+    this->jcv_.notify_all();
+  }
+  if (write(this->wake_[1], &byte, 1) < 0)
+    fail_handle(FAL_SYS);
+  this->worker_.join();
+  this->commander_.join();
+
+  for (auto it = this->clients_.begin(); it != this->clients_.end(); it++)
+    close(it->first);
+  close(this->sockfd_);
+  close(this->wake_[0]);
+  close(this->wake_[1]);
+  unlink(this->path_.c_str());
+}
+
+/**
+ * Bind and listen on control socket, a socket file left by
+ * an earlier run is replaced. Sockets watched by control
+ * thread are non-blocking.
+ */
+void control::setup()
+{
+  struct sockaddr_un addr = {};  //socket address, zero initialized
+
+  if (this->path_.size() >= sizeof(addr.sun_path))
+    error_handle(ERR_CTRL);
+
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, this->path_.c_str(), this->path_.size());
+
+  this->sockfd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (this->sockfd_ < 0)
+    error_handle(ERR_SYS);
+
+  unlink(this->path_.c_str());
+  if (bind(this->sockfd_, (struct sockaddr*)&addr, sizeof(addr)) ||
+      listen(this->sockfd_, control::QUEUE_LEN_))
+    error_handle(ERR_CTRL);
+
+  //self pipe to stop control thread and to tell it a
+  //command is replied, a full pipe wakes it already
+  if (pipe(this->wake_))
+    error_handle(ERR_SYS);
+  fcntl(this->wake_[0], F_SETFL, fcntl(this->wake_[0], F_GETFL) | O_NONBLOCK);
+  fcntl(this->wake_[1], F_SETFL, fcntl(this->wake_[1], F_GETFL) | O_NONBLOCK);
+
+  fcntl(this->sockfd_, F_SETFL, fcntl(this->sockfd_, F_GETFL) | O_NONBLOCK);
+}
+
+/**
+ * Control thread job. Poll listener and clients, queue
+ * commands of readable clients, collect replies of the
+ * command thread and flush replies of writable clients.
+ * A client waiting for a reply is not read meanwhile.
+ */
+void control::run_service()
+{
+  vector<struct pollfd> fds;  //descriptors to poll
+  unordered_map<int, Client>::iterator it; //client served
+  bool keep;                  //client connection still open
+
+  while (this->running_) {
+    //listener, wake up pipe and clients
+    fds.clear();
+    fds.push_back({this->sockfd_, POLLIN, 0});
+    fds.push_back({this->wake_[0], POLLIN, 0});
+    for (it = this->clients_.begin(); it != this->clients_.end(); it++) {
+      if (it->second.busy && it->second.out.empty())
+        continue;
+      fds.push_back({it->first,
+                     (short)(it->second.out.empty() ? POLLIN : POLLOUT), 0});
+    }
+
+    if (poll(fds.data(), fds.size(), control::POLL_WAIT_) < 0)
+      continue;
+
+    if (fds[0].revents)
+      this->accept_clients();
+
+    if (fds[1].revents)
+      this->collect();
+
+    //serve clients, a client may be gone after collecting
+    for (unsigned int i = 2; i < fds.size(); i++) {
+      it = this->clients_.find(fds[i].fd);
+      if (!fds[i].revents || it == this->clients_.end())
+        continue;
+
+      keep = (fds[i].revents & POLLOUT) ?
+             this->write_client(fds[i].fd, it->second) :
+             this->read_client(fds[i].fd, it->second);
+      if (keep) continue;
+
+      close(fds[i].fd);
+      this->clients_.erase(it);
+    }
+  }
+}
+
+/**
+ * Command thread job. Run queued commands one at a time,
+ * a slow add or remove never holds up the control thread.
+ */
+void control::run_commands()
+{
+  Job job;        //command run
+  char byte = 0;  //wake up byte
+
+  while (true) {
+    {
+      unique_lock<mutex> lock(this->jlock_);
+      this->jcv_.wait(lock, [this] {
+        return !this->jobs_.empty() || !this->running_;
+      });
+      if (!this->running_)
+        return;
+      job = this->jobs_.front();
+      this->jobs_.pop_front();
+    }
+
+    job.reply = this->execute(job.line);
+
+    {
+      lock_guard<mutex> lock(this->jlock_);
+      this->done_.push_back(job);
+    }
+    if (write(this->wake_[1], &byte, 1) < 0 && errno != EAGAIN)
+      fail_handle(FAL_SYS);
+  }
+}
+
+/**
+ * Hand replies of the command thread to their clients
+ * and run their next command lines. A reply to a client
+ * gone meanwhile is dropped.
+ */
+void control::collect()
+{
+  char buff[control::BUFF_SIZE_];  //wake up bytes
+  deque<Job> done;                 //commands replied
+  unordered_map<int, Client>::iterator it; //client replied
+
+  while (read(this->wake_[0], buff, sizeof(buff)) > 0)
+    ;
+
+  {
+    lock_guard<mutex> lock(this->jlock_);
+    done.swap(this->done_);
+  }
+
+  for (unsigned int i = 0; i < done.size(); i++) {
+    it = this->clients_.find(done[i].fd);
+    if (it == this->clients_.end() || it->second.serial != done[i].serial)
+      continue;
+
+    it->second.out += done[i].reply;
+    it->second.busy = false;
+    this->run_lines(done[i].fd, it->second);
+    if (this->write_client(done[i].fd, it->second))
+      continue;
+
+    close(done[i].fd);
+    this->clients_.erase(it);
+  }
+}
+
+/**
+ * Accept every pending client
+ */
+void control::accept_clients()
+{
+  int fd;  //client socket
+
+  while ((fd = accept(this->sockfd_, nullptr, nullptr)) >= 0) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    this->clients_[fd] = {"", "", false, false, this->serial_++};
+  }
+}
+
+/**
+ * Read available bytes of a client and run its complete
+ * command lines. A client closing its side still gets
+ * replies of commands sent before.
+ *
+ * @fd: client socket
+ * @client: client state
+ *
+ * Return: true if connection is kept open
+ */
+bool control::read_client(int fd, Client& client)
+{
+  char buff[control::BUFF_SIZE_];  //receive buffer
+  ssize_t rdsz;                    //bytes read
+
+  while ((rdsz = recv(fd, buff, sizeof(buff), 0)) > 0)
+    client.in.append(buff, rdsz);
+
+  //peer closed or connection failed
+  if (!rdsz || (rdsz < 0 && errno != EAGAIN && errno != EINTR))
+    client.closing = true;
+
+  this->run_lines(fd, client);
+
+  if (!client.busy && client.in.size() > (size_t)control::MAX_LINE_) {
+    client.out += ERROR+"line too long\n";
+    client.in.clear();
+    client.closing = true;
+  }
+
+  if (!client.out.empty())
+    return this->write_client(fd, client);
+  return !client.closing || client.busy;
+}
+
+/**
+ * Run complete command lines of a client until one is
+ * queued for the command thread. Stats and quit are
+ * answered at once, a command may stop the daemon.
+ *
+ * @fd: client socket
+ * @client: client state
+ */
+void control::run_lines(int fd, Client& client)
+{
+  size_t end;  //end of a command line
+  string line; //command line
+
+  while (!client.busy && (end = client.in.find('\n')) != string::npos) {
+    string command;  //command name
+
+    line = client.in.substr(0, end);
+    client.in.erase(0, end+1);
+
+    istringstream is(line);
+    is >> command;
+    if (command == STATS || command == QUIT) {
+      client.out += this->execute(line);
+      continue;
+    }
+
+    client.busy = true;
+    lock_guard<mutex> lock(this->jlock_);
+    this->jobs_.push_back({fd, client.serial, line, ""});
+    this->jcv_.notify_one();
+  }
+}
+
+/**
+ * Send queued reply bytes, as many as the socket takes
+ *
+ * @fd: client socket
+ * @client: client state
+ *
+ * Return: true if connection is kept open
+ */
+bool control::write_client(int fd, Client& client)
+{
+  ssize_t wrsz;  //bytes sent
+
+  while (!client.out.empty()) {
+    wrsz = send(fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+    if (wrsz < 0 && errno == EINTR)
+      continue;
+    if (wrsz < 0 && errno == EAGAIN)
+      return true;
+    if (wrsz <= 0)
+      return false;
+    client.out.erase(0, wrsz);
+  }
+
+  return !client.closing || client.busy;
+}
+
+/**
+ * Run a command line, on control thread for stats and
+ * quit, on command thread otherwise
+ *
+ * @line: command and its arguments
+ * Return: reply lines ending with 'ok' or 'error <reason>'
+ */
+string control::execute(const string& line)
+{
+  istringstream is(line);  //command arguments
+  ostringstream os;        //reply lines
+  string command;          //command name
+  string reason;           //failure reason
+  bool done = false;       //command succeeded
+
+  is >> command;
+
+  if (command == TORRENTS) {
+    this->do_torrents(os);
+    done = true;
+  }
+  else if (command == ADD) {
+    done = this->do_add(is, os, reason);
+  }
+  else if (command == REMOVE) {
+    done = this->do_remove(is, reason);
+  }
+  else if (command == PAUSE || command == RESUME) {
+    done = this->do_pause(is, command == PAUSE, reason);
+  }
+  else if (command == LIMIT) {
+    done = this->do_limit(is, reason);
+  }
+  else if (command == STATS) {
+    os << this->sess_->get_snapshot();
+    done = true;
+  }
+  else if (command == QUIT) {
+    //main thread waits for the signal to clean up
+    kill(getpid(), SIGTERM);
+    done = true;
+  }
+  else if (command.empty()) {
+    reason = "empty command";
+  }
+  else {
+    reason = "unknown command "+command;
+  }
+
+  if (done)
+    os << OK;
+  else
+    os << ERROR << reason << "\n";
+  return os.str();
+}
+
+/**
+ * List hosted torrents, one line each:
+ *   <index> <info hash> <active|paused> <bytes left> <file>
+ *
+ * @os: output stream
+ */
+void control::do_torrents(ostream& os)
+{
+  core* c;  //core of torrent
+
+  for (int i = 0; i < this->sess_->size(); i++) {
+    c = this->sess_->get_core(i);
+    os << i << " " << hex_id(this->sess_->get_meta(i)->get_infohash())
+       << " " << (c->paused() ? PAUSED : ACTIVE)
+       << " " << this->sess_->get_agent(i)->get_left()
+       << " " << this->sess_->get_meta(i)->get_filename() << "\n";
+  }
+}
+
+/**
+ * Host one more torrent and reply its index.
+ * usage: add <torrent>
+ *
+ * @is: command arguments
+ * @os: output stream
+ * @reason: failure reason
+ * Return: true if torrent is hosted
+ */
+bool control::do_add(istream& is, ostream& os, string& reason)
+{
+  string file;  //torrent file
+  int index;    //index of torrent
+
+  if (!(is >> file)) {
+    reason = "usage: add <torrent>";
+    return false;
+  }
+
+  //malformed metainfo or silent trackers are reported
+  index = this->sess_->add(file, reason);
+  if (index < 0)
+    return false;
+
+  os << index << "\n";
+  return true;
+}
+
+/**
+ * Stop and remove a torrent, later torrents move
+ * down one index.
+ * usage: remove <index>
+ *
+ * @is: command arguments
+ * @reason: failure reason
+ * Return: true if torrent is removed
+ */
+bool control::do_remove(istream& is, string& reason)
+{
+  int index;  //torrent index
+
+  if (!this->read_index(is, index, reason))
+    return false;
+
+  this->sess_->remove(index);
+  return true;
+}
+
+/**
+ * Pause or resume a torrent.
+ * usage: pause <index>
+ *        resume <index>
+ *
+ * @is: command arguments
+ * @pause: pause if true, otherwise resume
+ * @reason: failure reason
+ * Return: true if done
+ */
+bool control::do_pause(istream& is, bool pause, string& reason)
+{
+  int index;  //torrent index
+
+  if (!this->read_index(is, index, reason))
+    return false;
+
+  if (pause)
+    this->sess_->get_core(index)->pause();
+  else
+    this->sess_->get_core(index)->resume();
+
+  //stats asked after reply show new state
+  this->sess_->refresh(true);
+  return true;
+}
+
+/**
+ * Set a rate limit.
+ * usage: limit <up|down> global <KB/s>
+ *        limit <up|down> <torrent|peer> <KB/s> <index>
+ *
+ * @is: command arguments
+ * @reason: failure reason
+ * Return: true if limit is set
+ */
+bool control::do_limit(istream& is, string& reason)
+{
+  string dir;      //direction
+  string scope;    //limit level
+  long long rate;  //bytes per second, 0 for unlimited
+  int index;       //torrent index
+  bool up;         //upload limit
+  core* c;         //core of torrent
+
+  is >> dir >> scope >> rate;
+  up = (dir == UP);
+
+  if (!is || rate < 0 || (!up && dir != DOWN) ||
+      (scope != GLOBAL && scope != TORRENT && scope != PEER)) {
+    reason = "usage: limit <up|down> <global|torrent|peer> <KB/s> [index]";
+    return false;
+  }
+  rate *= BYTES_PER_KB;
+
+  if (scope == GLOBAL) {
+    (up ? this->sess_->get_up_limit() :
+          this->sess_->get_down_limit())->set_rate(rate);
+    this->sess_->refresh(true);
+    return true;
+  }
+
+  if (!this->read_index(is, index, reason))
+    return false;
+
+  c = this->sess_->get_core(index);
+  if (scope == TORRENT)
+    c->set_limit(up ? core::TORRENT_UP : core::TORRENT_DOWN, rate);
+  else
+    c->set_limit(up ? core::PEER_UP : core::PEER_DOWN, rate);
+
+  //stats asked after reply show new limits
+  this->sess_->refresh(true);
+  return true;
+}
+
+/**
+ * Read a torrent index argument, indexes change only
+ * by commands of the command thread
+ *
+ * @is: command arguments
+ * @index: torrent index
+ * @reason: failure reason
+ * Return: true if index names a hosted torrent
+ */
+bool control::read_index(istream& is, int& index, string& reason)
+{
+  if (!(is >> index) || index < 0 || index >= this->sess_->size()) {
+    reason = "no such torrent, type torrents to list";
+    return false;
+  }
+  return true;
+}
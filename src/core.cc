@@ -5,19 +5,24 @@
  */
 
 #include <core.h>
+#include <session.h> /* class session */
+#include <connection.h> /* class connection */
 #include <cmath>     /* ceil() */
 #include <fstream>   /* std::ofstream */
-#include <climits>   /* INT_MAX */
+#include <climits>   /* INT_MAX, IOV_MAX */
 #include <ctime>     /* srand() and rand() */
 #include <algorithm> /* sort() */
+#include <sys/socket.h> /* shutdown() */
+#include <sys/mman.h>   /* mmap() */
+#include <sys/uio.h>    /* preadv() */
+#include <unistd.h>     /* pread() */
+#include <executor.h>   /* work-stealing executor */
 
-/****** Global Variables ******/
-extern string port;      /* client port, assigned by user */
-
-
+/********** Internal Function **********/
+static void merge_extents(vector<pair<uint64_t, uint64_t>>& ext);
 
 /**
- * Constructor - set components: server, tracker_agent 
+ * Constructor - set components: session, tracker_agent 
  * and metainfo.
  *
  * Acknowledge current peers in torrent.
@@ -27,31 +32,32 @@ extern string port;      /* client port, assigned by user */
  *
  * Allocate disk space for temporary file if role is leecher.
  *
- * Launch a thread dedicated to dispatch peer's request.
- *
- * For each peer create a receiver which initiate thread for
- * dedicated peer.
+ * For each peer create a connection, the reactor reads its
+ * messages and the executor handles them.
  *
- * Register and start a timer which timeout in 10s.
- * The timer will actually timeout in every 10s due
- * to recursive calling by core::timeout.
+ * Incoming peers are handed over by the session, which
+ * also calls core::timeout every 10s.
  *
- * @serv: server object which establish TCP server
+ * @sess: session hosting torrent
  * @mi: metainfo handler
  * @agent: remote tracker agent
  */
-core::core(server* serv, metainfo* mi, 
-           tracker_agent* agent) : server_(serv),
+core::core(session* sess, metainfo* mi, 
+           tracker_agent* agent) : session_(sess),
                                    mi_(mi),
-                                   agent_(agent)
+                                   agent_(agent),
+                                   up_limit_(&sess->up_limit_),
+                                   down_limit_(&sess->down_limit_),
+                                   peer_up_rate_(0),
+                                   peer_down_rate_(0)
 {
   vector<string> peers;  //vector of peers in torrent
 
   //retrieve current peers self-included
   peers = this->agent_->get_peers();
 
-  //find self address
-  this->local_addr_ = this->agent_->get_ip()+":"+port;
+  //find self address as announced to tracker
+  this->local_addr_ = this->agent_->get_ip()+":"+this->mi_->get_port();
 
   //add peers into set
   for (unsigned int i = 0; i < peers.size(); i++) {
@@ -81,6 +87,9 @@ core::core(server* serv, metainfo* mi,
 
   //init accumulative time
   this->actime_ = 0;
+  this->named_ = false;
+  this->paused_ = false;
+  this->super_ = false;
 
   //empty optimistic peer
   this->opp_ = nullptr;
@@ -88,6 +97,16 @@ core::core(server* serv, metainfo* mi,
   //init bitfield reader writer lock
   this->rwlock_init();
 
+  //pieces sent are kept in memory if session has a read cache
+  this->cache_ = this->session_->cache_;
+  this->owner_ = this->session_->owners_++;
+
+  //serve block requests of peers in rounds
+  this->uploading_ = true;
+  this->round_ = false;
+  this->queued_ = 0;
+  this->up_timer_ = new timer(&core::kick_upload, this);
+
   //determine client role via inspecting local file size
   if (this->agent_->get_left()) {
     this->role_ = P_LEECHER;
@@ -104,15 +123,11 @@ core::core(server* serv, metainfo* mi,
 
     //map file into memory
     this->map_file(this->mi_->get_tmpfile());
-
-    //launch peer updater
-    thread updater(&core::peer_updater, this);
-    updater.detach();
-
   }
   else {
     this->role_ = P_SEEDER;
     this->finish_ = true;
+    this->named_ = true;
 
     //fill bitfield
     memset(this->bitfield_, ~0, this->bflen_);
@@ -121,25 +136,23 @@ core::core(server* serv, metainfo* mi,
     this->bitfield_[this->bflen_-1] &= 
       ((~0) << this->spare_offset_);
 
-    //won't use piece count
-    this->pcount_ = nullptr;
+    //super seeding counts pieces of peers, otherwise no piece count
+    this->super_ = this->session_->super_seed_;
+    this->pcount_ = this->super_ ? new int[this->pnum_]() : nullptr;
+    if (this->super_)
+      this->shown_.assign(this->pnum_, 0);
     
     //map file into memory
     this->map_file(this->mi_->get_filename());
   }
 
-  //launch a dispatcher thread
-  thread dispatcher(&core::dispatch, this);
-  dispatcher.detach();
-
-  //fire receiver threads to download from peers
+  //connect peers to download from
   this->conn_peers();
 
-  //register a timer with core::timeout as handler
-  this->timer_ = new timer(&core::timeout, this);
-
-  //startup timer that timeout every 10s.
-  this->timer_->start(core::TO_UNIT_);
+  //receive peer list updates from tracker
+  if (this->role_ == P_LEECHER)
+    this->agent_->set_callback(bind(&core::peer_updater, this,
+                                    placeholders::_1));
 }
 
 /**
@@ -150,24 +163,32 @@ core::~core()
   //set downloading finish
   this->finish_ = true;
 
-  //infor updater thread to terminate
-  this->agent_->do_notify();
+  //stop receiving peer list updates
+  this->agent_->set_callback(nullptr);
+
+  //stop upload rounds, wait for the one running
+  {
+    lock_guard<mutex> lock(this->uplock_);
+    this->uploading_ = false;
+  }
+  delete this->up_timer_;
+  {
+    unique_lock<mutex> lk(this->uplock_);
+    while (this->round_)
+      this->upcv_.wait(lk);
+  }
+  if (this->cache_)
+    this->cache_->drop(this->owner_);
 
   //clean memory allocated in this object
   delete[] this->bitfield_;
-  delete this->timer_;
 
   if (this->pcount_)
     delete[] this->pcount_;
 
-  //deallocate receivers
-  for (auto it = this->receivers_.begin();
-       it != this->receivers_.end(); it++)
-    delete *it;
-
-  //deallocate senders
-  for (auto it = this->senders_.begin();
-       it != this->senders_.end(); it++)
+  //deallocate connections
+  for (auto it = this->conns_.begin();
+       it != this->conns_.end(); it++)
     delete *it;
 
   //destory reader writer locks
@@ -198,7 +219,7 @@ string core::get_bf()
     goto _EXIT;
 
   //wrap bitfield to string
-  retval = string(this->bitfield_, this->pnum_);
+  retval = string(this->bitfield_, this->bflen_);
 
   //release bitfield reader lock
   if (!release_rwlock(&this->bflock_))
@@ -236,9 +257,13 @@ bool core::full_downloaded()
  * Change temporary file name to target file name
  * when all the pieces of target file has been downloaded.
  * Also informs tracker of client's completation.
+ * Only the first caller renames, later ones return.
  */
 void core::name_target()
 {
+  if (this->named_.exchange(true))
+    return;
+
   if (rename(this->mi_->get_tmpfile().c_str(), 
              this->mi_->get_filename().c_str()))
     error_handle(ERR_SYS);
@@ -247,43 +272,778 @@ void core::name_target()
 }
 
 /**
- * A worker thread which waiting for peer list's
- * update. Once the client get a new peer list
- * from tracker, the thread will also updating
- * peer address set and launch new receiver when
- * it is appropriate.
+ * Set a rate limit of torrent or of its peers,
+ * peer limits apply to connected and later peers.
+ *
+ * @limit: limit to set
+ * @rate: bytes per second, 0 for unlimited
  */
-void core::peer_updater()
+void core::set_limit(Limit limit, long long rate)
 {
-  vector<string> peers;  //vector of peers in torrent
+  if (limit == TORRENT_UP) {
+    this->up_limit_.set_rate(rate);
+  }
+  else if (limit == TORRENT_DOWN) {
+    this->down_limit_.set_rate(rate);
+  }
+  else if (limit == PEER_UP) {
+    this->peer_up_rate_ = rate;
 
-  while (!this->finish_) {
-    //block waiting for peer's update
-    this->agent_->waiting_peer_update();
-  
-    //do nothing when downloading finished
-    if (this->finish_) return;
+    acquire_reader(&this->smlock_);
+    for (auto it = this->smap_.begin(); 
+         it != this->smap_.end(); it++)
+      it->second->get_limit()->set_rate(rate);
+    release_rwlock(&this->smlock_);
+  }
+  else if (limit == PEER_DOWN) {
+    this->peer_down_rate_ = rate;
+
+    acquire_reader(&this->rmlock_);
+    for (auto it = this->rmap_.begin(); 
+         it != this->rmap_.end(); it++)
+      it->second->get_limit()->set_rate(rate);
+    release_rwlock(&this->rmlock_);
+  }
+}
+
+/**
+ * Interface to get a rate limit
+ *
+ * @limit: limit to get
+ * Return: bytes per second, 0 for unlimited
+ */
+long long core::get_limit(Limit limit)
+{
+  if (limit == TORRENT_UP)
+    return this->up_limit_.get_rate();
+  if (limit == TORRENT_DOWN)
+    return this->down_limit_.get_rate();
+  if (limit == PEER_UP)
+    return this->peer_up_rate_;
+  return this->peer_down_rate_;
+}
+
+/**
+ * Serve a peer connected to the session, its handshake
+ * was read by the session to find this torrent.
+ *
+ * @sock: socket with remote peer
+ * @ip: peer's ip
+ * @handshake: handshake sent by peer
+ */
+void core::accept_peer(int sock, string ip, string handshake)
+{
+  //set is locked before the connection may terminate
+  //and erase itself
+  lock_guard<mutex> lock(this->cnlock_);
+
+  //paused torrent gives connection back to budget
+  if (this->paused_) {
+    close(sock);
+    this->session_->release_conn();
+    return;
+  }
+
+  this->conns_.insert(new connection(sock, ip, handshake, this));
+}
+
+/**
+ * Pause torrent, connections with peers are shut down and
+ * terminate on the executor, peers connecting later
+ * are refused until resumed.
+ */
+void core::pause()
+{
+  int sock;  //socket with peer
+
+  lock_guard<mutex> lock(this->cnlock_);
+  this->paused_ = true;
+
+  //reactor sees shut down sockets closed, connections
+  //still connecting see the flag after handshake
+  for (auto it = this->conns_.begin(); it != this->conns_.end(); it++) {
+    sock = (*it)->get_sock();
+    if (sock >= 0)
+      shutdown(sock, SHUT_RDWR);
+  }
+}
+
+/**
+ * Resume a paused torrent, a leecher reconnects peers
+ * of last tracker reply and asks tracker for more.
+ */
+void core::resume()
+{
+  {
+    lock_guard<mutex> lock(this->cnlock_);
+    if (!this->paused_)
+      return;
+    this->paused_ = false;
+  }
+
+  if (this->role_ != P_LEECHER)
+    return;
+
+  this->add_peers(this->agent_->get_peers());
+  this->agent_->reannounce();
+}
+
+/**
+ * Interface to check whether torrent is paused
+ */
+bool core::paused()
+{
+  return this->paused_;
+}
+
+/**
+ * Tracker reply consumer, invoked on the tracker agent's
+ * I/O thread whenever a new peer list arrives. Updates
+ * peer address set and connects new peer when it is
+ * appropriate.
+ *
+ * @mesg: tracker reply
+ */
+void core::peer_updater(const tracker_agent::Message& mesg)
+{
+  this->add_peers(mesg.peers);
+}
+
+/**
+ * Connect peers learned from tracker or by peer exchange,
+ * client itself and peers in address set are skipped.
+ *
+ * @peers: addresses as ip:port
+ * Return: number of connections launched
+ */
+int core::add_peers(const vector<string>& peers)
+{
+  int added = 0;  //connections launched
+
+  //do nothing when downloading finished or paused
+  if (this->finish_ || this->paused_) return 0;
+
+  //acquire locks to update peer
+  lock_guard<mutex> lock(this->cnlock_);
+
+  for (unsigned int i = 0; i < peers.size(); i++) {
+    //skip local address
+    if (this->local_addr_ == peers[i]) continue;
+
+    //skip peer already in set
+    if (this->pset_.count(peers[i])) continue;
+
+    //connection budget used up, later replies retry
+    if (!this->connect_peer(peers[i])) break;
+    added++;
+  }
+
+  return added;
+}
+
+/**
+ * Connect a peer found on local network, it is preferred
+ * over other peers when picking who to download from.
+ *
+ * @addr: address as ip:port
+ */
+void core::add_lan_peer(string addr)
+{
+  vector<string> peers(1, addr);  //peer to connect
 
-    //perform updating
-    peers = this->agent_->get_peers();
+  {
+    lock_guard<mutex> lock(this->lnlock_);
+    this->lan_.insert(addr.substr(0, addr.rfind(':')));
+  }
 
-    //acquire locks to update peer
-    lock_guard<mutex> lock(this->rslock_);
+  metrics::add(metrics::LSD_PEERS, this->add_peers(peers));
+}
 
-    for (unsigned int i = 0; i < peers.size(); i++) {
-      //skip local address
-      if (this->local_addr_ == peers[i]) continue;
+/**
+ * Check if a peer is on local network
+ * @ip: peer's ip
+ */
+bool core::on_lan(const string& ip)
+{
+  lock_guard<mutex> lock(this->lnlock_);
+  return this->lan_.count(ip);
+}
 
-      //skip peer already in set
-      if (this->pset_.count(peers[i])) continue;
+/**
+ * Send addresses of connected peers by peer exchange,
+ * each connection gets what changed since its last
+ * exchange and paces itself. Exchanges are built under
+ * the connection set lock and sent after it is released,
+ * a connection is still alive while its sender is mapped.
+ *
+ * @to: connection to send, every connection if nullptr
+ */
+void core::share_peers(connection* to)
+{
+  addr_set live;  //addresses of connected peers
+  string addr;    //address of a peer
+  string mesg;    //exchange of a connection
+  vector<pair<connection*, string>> out; //exchanges to send
+  send_map::iterator sit;                //sender of peer
+
+  {
+    lock_guard<mutex> lock(this->cnlock_);
+
+    for (auto it = this->conns_.begin(); it != this->conns_.end(); it++) {
+      addr = (*it)->get_addr();
+      if (!addr.empty())
+        live.insert(addr);
+    }
 
-      //store peer address into set
-      this->pset_.insert(peers[i]);
+    for (auto it = this->conns_.begin(); it != this->conns_.end(); it++) {
+      if (to && *it != to)
+        continue;
+      mesg = (*it)->pex_message(live);
+      if (!mesg.empty())
+        out.push_back(make_pair(*it, mesg));
+    }
+  }
+
+  if (out.empty() || !acquire_reader(&this->smlock_))
+    return;
+
+  for (unsigned int i = 0; i < out.size(); i++) {
+    sit = this->smap_.find(out[i].first->get_id());
+    if (sit == this->smap_.end() || sit->second->get_conn() != out[i].first)
+      continue;
+
+    out[i].first->send(out[i].second.data(), out[i].second.size());
+    metrics::mesg(metrics::OUT, metrics::EXTENDED);
+  }
 
-      //launch a receiver
-      this->receivers_.insert(new receiver(peers[i], this));
+  release_rwlock(&this->smlock_);
+}
+
+/**
+ * Queue an upload round on the executor unless one is
+ * queued or running. Also the handler of the timer
+ * resuming peers skipped by the last round.
+ */
+void core::kick_upload()
+{
+  {
+    lock_guard<mutex> lock(this->uplock_);
+
+    if (!this->uploading_ || this->round_ || this->upq_.empty())
+      return;
+    this->round_ = true;
+  }
+
+  executor::submit(executor::DISK, [this] { this->upload_round(); });
+}
+
+/**
+ * Upload round, deficit round robin over peers with queued
+ * requests. Each waiting peer earns QUANTUM_ bytes and the
+ * head requests they cover join the round, the rest waits
+ * for next rounds. A peer choked since its requests loses
+ * them, a peer that cannot take a block now keeps its place.
+ *
+ * Blocks of a round are sent in file order, file ranges of
+ * the round and of requests still queued are read ahead.
+ * A block the limits refuse goes back to the head of its
+ * queue. The next round is queued at once after progress,
+ * after UP_WAIT_ ms when every peer was skipped.
+ */
+void core::upload_round()
+{
+  unique_lock<mutex> lk(this->uplock_);
+  vector<Upload> batch;     //blocks sent in round
+  vector<Upload> refused;   //blocks refused by limits
+  vector<sender*> choked;   //peers choked since requests
+  vector<Extent> ahead;     //file ranges of queued requests
+  size_t turns;             //peers waiting at round start
+  sender* s;                //peer in turn
+  bool next;                //next round follows at once
+
+  //torrent being removed
+  if (!this->uploading_) {
+    this->round_ = false;
+    this->upcv_.notify_all();
+    return;
+  }
+
+  //one turn for each waiting peer
+  turns = this->upq_.size();
+  for (size_t i = 0; i < turns; i++) {
+    s = this->upq_.front();
+    this->upq_.pop_front();
+
+    if (s->peer_->choking) {
+      metrics::add(metrics::UPLOAD_DROPS, s->requests_.size());
+      this->queued_ -= s->requests_.size();
+      s->requests_.clear();
+      choked.push_back(s);
+    }
+    else if (!s->ready()) {
+      this->upq_.push_back(s);
+      continue;
+    }
+    else {
+      s->deficit_ += core::QUANTUM_;
+      while (!s->requests_.empty() &&
+             s->requests_.front().size <= s->deficit_) {
+        s->deficit_ -= s->requests_.front().size;
+        batch.push_back(make_pair(s, s->requests_.front()));
+        s->requests_.pop_front();
+        this->queued_--;
+      }
+    }
+    this->serving_.insert(s);
+
+    //peer keeps its place while requests remain
+    if (s->requests_.empty()) {
+      s->deficit_ = 0;
+      s->queued_ = false;
+    }
+    else {
+      this->upq_.push_back(s);
     }
   }
+
+  if (!batch.empty() || !choked.empty()) {
+    //requests of next rounds
+    for (auto it = this->upq_.begin(); it != this->upq_.end(); it++)
+      for (auto rit = (*it)->requests_.begin();
+           rit != (*it)->requests_.end(); rit++)
+        ahead.push_back(this->extent(*rit));
+
+    //send without lock, peers keep queueing requests
+    lk.unlock();
+
+    for (unsigned int i = 0; i < choked.size(); i++)
+      choked[i]->send_choke();
+
+    this->read_ahead(batch, ahead);
+    for (unsigned int i = 0; i < batch.size(); i++)
+      if (!batch[i].first->upload(batch[i].second))
+        refused.push_back(batch[i]);
+
+    lk.lock();
+  }
+
+  //refused blocks are sent first when peer is resumed
+  for (auto it = refused.rbegin(); it != refused.rend(); it++) {
+    s = it->first;
+    s->requests_.push_front(it->second);
+    s->deficit_ += it->second.size;
+    this->queued_++;
+    if (!s->queued_) {
+      s->queued_ = true;
+      this->upq_.push_back(s);
+    }
+  }
+  this->serving_.clear();
+
+  next = this->uploading_ && !this->upq_.empty() &&
+         (refused.size() < batch.size() || !choked.empty());
+  if (!next)
+    this->round_ = false;
+  if (this->uploading_ && !this->upq_.empty() && !next)
+    this->up_timer_->start(milliseconds((int)core::UP_WAIT_));
+  this->upcv_.notify_all();
+  lk.unlock();
+
+  if (next)
+    executor::submit(executor::DISK, [this] { this->upload_round(); });
+}
+
+/**
+ * File range of a requested block
+ * @req: block requested
+ * Return: offset and end of block in file
+ */
+core::Extent core::extent(const sender::Request& req)
+{
+  uint64_t offset = (uint64_t)req.piece*this->plen_+req.begin;  //block offset
+
+  return make_pair(offset, offset+req.size);
+}
+
+/**
+ * Order blocks of a round by file offset and read ahead
+ * their ranges and ranges of requests still queued into
+ * the read cache. Adjacent blocks are merged, each run of
+ * adjacent pieces not cached yet is read from storage by
+ * one read instead of one read per piece on first block.
+ * A round reads ahead up to 1/AHEAD_SHARE_ of the cache,
+ * nothing is read ahead when the cache is off.
+ *
+ * @batch: blocks of round, sorted on return
+ * @ahead: ranges of queued requests
+ */
+void core::read_ahead(vector<Upload>& batch, vector<Extent>& ahead)
+{
+  long long budget;   //bytes left to read ahead
+  uint32_t first;     //first piece of a run
+  uint32_t last;      //piece after a run
+  uint32_t end;       //piece after a range
+
+  sort(batch.begin(), batch.end(), [this](const Upload& a, const Upload& b) {
+    return this->extent(a.second) < this->extent(b.second);
+  });
+
+  if (!this->cache_)
+    return;
+
+  for (unsigned int i = 0; i < batch.size(); i++)
+    ahead.push_back(this->extent(batch[i].second));
+  merge_extents(ahead);
+
+  //ranges of round come first in file order, queued ranges follow
+  budget = this->session_->cache_size_/core::AHEAD_SHARE_;
+  for (unsigned int i = 0; i < ahead.size() && budget > 0; i++) {
+    first = ahead[i].first/this->plen_;
+    end = (ahead[i].second-1)/this->plen_+1;
+
+    while (first < end && budget > 0) {
+      if (!this->cacheable(first) || this->cache_->has(this->owner_, first)) {
+        first++;
+        continue;
+      }
+
+      for (last = first+1; last < end && last-first < IOV_MAX &&
+           this->cacheable(last) && !this->cache_->has(this->owner_, last) &&
+           (long long)(last-first+1)*this->plen_ <= budget; last++)
+        ;
+
+      this->read_run(first, last);
+      budget -= (long long)(last-first)*this->plen_;
+      first = last;
+    }
+  }
+}
+
+/**
+ * Read a run of adjacent pieces by one read and keep
+ * them in read cache
+ *
+ * @first: first piece of run
+ * @last: piece after run
+ */
+void core::read_run(uint32_t first, uint32_t last)
+{
+  vector<struct iovec> iov;  //one buffer per piece
+  vector<string*> data;      //pieces read
+  size_t total = 0;          //bytes of run
+  uint32_t len;              //length of piece
+  ssize_t rdsz;              //bytes read
+
+  for (uint32_t i = first; i < last; i++) {
+    len = (i == this->pnum_-1) ? this->lplen_ : this->plen_;
+    data.push_back(new string(len, 0));
+    iov.push_back({&(*data.back())[0], len});
+    total += len;
+  }
+
+  rdsz = preadv(this->fd_, iov.data(), iov.size(), (off_t)first*this->plen_);
+  if (rdsz != (ssize_t)total) {
+    fail_handle(FAL_SYS);
+    for (unsigned int i = 0; i < data.size(); i++)
+      delete data[i];
+    return;
+  }
+
+  for (unsigned int i = 0; i < data.size(); i++)
+    this->cache_->put(this->owner_, first+i, piece_cache::Piece(data[i]));
+  metrics::add(metrics::READ_RANGES, 1);
+}
+
+/**
+ * Check if a piece could be served from read cache,
+ * i.e. it is verified and fits a shard of the cache
+ *
+ * @index: piece index
+ */
+bool core::cacheable(uint32_t index)
+{
+  uint32_t len;  //length of piece
+  bool held;     //piece verified
+
+  len = (index == this->pnum_-1) ? this->lplen_ : this->plen_;
+  if (!this->cache_->fits(len))
+    return false;
+
+  if (!acquire_reader(&this->bflock_))
+    return false;
+  held = this->bitfield_[index/BYTE_LEN] & (1 << (BYTE_LEN-index%BYTE_LEN-1));
+  release_rwlock(&this->bflock_);
+
+  return held;
+}
+
+/**
+ * Find a verified piece in read cache, on miss the whole
+ * piece is read from storage by one read and cached.
+ * Pieces not verified yet or too big for a shard are
+ * never cached and are read from the mapped file.
+ *
+ * @index: piece index
+ * Return: piece data, nullptr if cache is off, piece is
+ *         not cacheable or read failed
+ */
+piece_cache::Piece core::read_piece(uint32_t index)
+{
+  piece_cache::Piece piece;  //cached piece
+  string* data;              //piece read from storage
+  uint32_t len;              //length of piece
+  ssize_t rdsz;              //bytes read
+
+  //reading a piece the cache drops multiplies reads
+  if (!this->cache_ || !this->cacheable(index))
+    return nullptr;
+
+  //misses are counted for cacheable pieces only
+  piece = this->cache_->get(this->owner_, index);
+  if (piece)
+    return piece;
+
+  len = (index == this->pnum_-1) ? this->lplen_ : this->plen_;
+  data = new string(len, 0);
+  rdsz = pread(this->fd_, &(*data)[0], len, (off_t)index*this->plen_);
+  if (rdsz != (ssize_t)len) {
+    fail_handle(FAL_SYS);
+    delete data;
+    return nullptr;
+  }
+
+  piece = piece_cache::Piece(data);
+  this->cache_->put(this->owner_, index, piece);
+  return piece;
+}
+
+/**
+ * Queue a block request of an unchoked peer
+ *
+ * @s: sender of peer
+ * @req: block requested
+ * Return: true if queued, false if queue of peer is full
+ */
+bool core::queue_upload(sender* s, const sender::Request& req)
+{
+  {
+    lock_guard<mutex> lock(this->uplock_);
+
+    if (s->requests_.size() >= core::QUEUE_MAX_)
+      return false;
+
+    s->requests_.push_back(req);
+    this->queued_++;
+
+    if (!s->queued_) {
+      s->queued_ = true;
+      this->upq_.push_back(s);
+    }
+  }
+
+  this->kick_upload();
+  return true;
+}
+
+/**
+ * Remove a queued block request cancelled by peer,
+ * a block being sent is not recalled
+ *
+ * @s: sender of peer
+ * @req: block cancelled
+ */
+void core::cancel_upload(sender* s, const sender::Request& req)
+{
+  lock_guard<mutex> lock(this->uplock_);
+
+  for (auto it = s->requests_.begin(); it != s->requests_.end(); it++) {
+    if (it->piece == req.piece && it->begin == req.begin &&
+        it->size == req.size) {
+      s->requests_.erase(it);
+      this->queued_--;
+      metrics::add(metrics::UPLOAD_DROPS, 1);
+      return;
+    }
+  }
+}
+
+/**
+ * Forget requests of a leaving peer once the upload
+ * round sending to it is done
+ *
+ * @s: sender of peer
+ */
+void core::drop_uploads(sender* s)
+{
+  unique_lock<mutex> lk(this->uplock_);
+
+  while (this->serving_.count(s))
+    this->upcv_.wait(lk);
+
+  this->queued_ -= s->requests_.size();
+  s->requests_.clear();
+  if (s->queued_) {
+    this->upq_.erase(find(this->upq_.begin(), this->upq_.end(), s));
+    s->queued_ = false;
+  }
+}
+
+/**
+ * Super seeding, a new peer is told one piece instead
+ * of the whole bitfield.
+ *
+ * @id: peer id
+ */
+void core::reveal(const string& id)
+{
+  if (!acquire_reader(&this->rmlock_))
+    return;
+  if (!acquire_reader(&this->smlock_)) {
+    release_rwlock(&this->rmlock_);
+    return;
+  }
+
+  {
+    lock_guard<mutex> lock(this->sslock_);
+    this->reveal_to(id);
+  }
+
+  release_rwlock(&this->smlock_);
+  release_rwlock(&this->rmlock_);
+}
+
+/**
+ * Super seeding, a peer announced a piece. Peers told
+ * that piece uploaded it to the announcing peer, they
+ * are told one more piece. The announcing peer itself
+ * is told more once no other peer lacks its piece.
+ *
+ * @id: id of peer announcing piece
+ * @index: piece index
+ */
+void core::spread(const string& id, uint32_t index)
+{
+  vector<string> ids;  //peers to tell more
+  int holders;         //peers holding piece
+
+  if (!acquire_reader(&this->rmlock_))
+    return;
+  if (!acquire_reader(&this->smlock_)) {
+    release_rwlock(&this->rmlock_);
+    return;
+  }
+
+  {
+    lock_guard<mutex> lock(this->sslock_);
+
+    acquire_reader(&this->pclock_);
+    holders = this->pcount_[index];
+    release_rwlock(&this->pclock_);
+
+    for (auto it = this->reveals_.begin(); it != this->reveals_.end(); it++) {
+      if (it->second.piece != index) continue;
+      if (it->first != id || holders >= (int)this->rmap_.size())
+        ids.push_back(it->first);
+    }
+
+    for (unsigned int i = 0; i < ids.size(); i++)
+      this->reveal_to(ids[i]);
+  }
+
+  release_rwlock(&this->smlock_);
+  release_rwlock(&this->rmlock_);
+}
+
+/**
+ * Super seeding, peers holding their revealed piece for
+ * REVEAL_WAIT_ without it spreading are told one more,
+ * e.g. when no peer downloads from them. Peers gone are
+ * forgotten.
+ */
+void core::reveal_stalled()
+{
+  steady_clock::time_point now = steady_clock::now();  //current time
+  vector<string> ids;  //peers to tell more
+  recv_map::iterator rit;  //receiver of peer
+  char* bf;            //peer bitfield
+  uint32_t p;          //revealed piece
+
+  if (!acquire_reader(&this->rmlock_))
+    return;
+  if (!acquire_reader(&this->smlock_)) {
+    release_rwlock(&this->rmlock_);
+    return;
+  }
+
+  {
+    lock_guard<mutex> lock(this->sslock_);
+
+    for (auto it = this->reveals_.begin(); it != this->reveals_.end();) {
+      rit = this->rmap_.find(it->first);
+      if (rit == this->rmap_.end()) {
+        it = this->reveals_.erase(it);
+        continue;
+      }
+
+      bf = rit->second->get_peer()->bitfield;
+      p = it->second.piece;
+      if ((bf[p/BYTE_LEN] & (1 << (BYTE_LEN-p%BYTE_LEN-1))) &&
+          it->second.at+seconds((int)core::REVEAL_WAIT_) <= now)
+        ids.push_back(it->first);
+      it++;
+    }
+
+    for (unsigned int i = 0; i < ids.size(); i++)
+      this->reveal_to(ids[i]);
+  }
+
+  release_rwlock(&this->smlock_);
+  release_rwlock(&this->rmlock_);
+}
+
+/**
+ * Super seeding, tell peer the piece it lacks which
+ * fewest peers hold, pieces revealed fewer times first.
+ * Peer map readers and revealed pieces lock are held.
+ *
+ * @id: peer id
+ */
+void core::reveal_to(const string& id)
+{
+  recv_map::iterator rit = this->rmap_.find(id);  //receiver of peer
+  send_map::iterator sit = this->smap_.find(id);  //sender of peer
+  char* bf;                   //peer bitfield
+  uint32_t pick = this->pnum_; //piece to reveal
+  int holders = INT_MAX;      //peers holding picked piece
+
+  if (rit == this->rmap_.end() || sit == this->smap_.end()) {
+    this->reveals_.erase(id);
+    return;
+  }
+  bf = rit->second->get_peer()->bitfield;
+
+  acquire_reader(&this->pclock_);
+  for (uint32_t i = 0; i < this->pnum_; i++) {
+    if (bf[i/BYTE_LEN] & (1 << (BYTE_LEN-i%BYTE_LEN-1))) continue;
+    if (pick == this->pnum_ || this->pcount_[i] < holders ||
+        (this->pcount_[i] == holders &&
+         this->shown_[i] < this->shown_[pick])) {
+      pick = i;
+      holders = this->pcount_[i];
+    }
+  }
+  release_rwlock(&this->pclock_);
+
+  //peer holds every piece
+  if (pick == this->pnum_) {
+    this->reveals_.erase(id);
+    return;
+  }
+
+  this->shown_[pick]++;
+  this->reveals_[id] = {pick, steady_clock::now()};
+  sit->second->do_send_have(pick);
+  metrics::add(metrics::REVEALS, 1);
 }
 
 /**
@@ -320,32 +1080,40 @@ void core::conn_peers()
   //seeder doesn't need to receive any piece
   if (this->role_ != P_LEECHER) return;
 
+  vector<string> peers;  //addresses of peers
+
+  //peers out of budget are forgotten, tracker replies retry
+  peers.assign(this->pset_.begin(), this->pset_.end());
+  this->pset_.clear();
+
+  lock_guard<mutex> lock(this->cnlock_);
+
   //for each peer launch a communicating thread
-  for (auto it = this->pset_.begin(); 
-       it != this->pset_.end(); it++) {
-    //setup a receiver
-    this->receivers_.insert(new receiver(*it, this));
+  for (unsigned int i = 0; i < peers.size(); i++) {
+    //setup a connection
+    if (!this->connect_peer(peers[i])) break;
   }
 }
 
 /**
- * Incoming peer's request dispatcher, this is
- * performed by a dedicated thread.
- * Once a request has come, a handle thread will be
- * launched to serve the request.
+ * Connect a peer when the session connection
+ * budget allows and torrent is not paused.
+ * Connection set lock must be held.
+ *
+ * @addr: ip:port of peer
+ * Return: true if connection launched, otherwise false
  */
-void core::dispatch()
+bool core::connect_peer(string addr)
 {
-  int sock;    //socket with remote peer
-  string ip;   //client ip;
+  if (this->paused_ || !this->session_->acquire_conn())
+    return false;
 
-  //continuously accept request
-  while (true) {
-    sock = this->server_->accept_peer(ip);
+  //store peer address into set
+  this->pset_.insert(addr);
 
-    //setup a sender thread
-    this->senders_.insert(new sender(sock, ip, this));
-  }
+  //launch a connection
+  this->conns_.insert(new connection(addr, this));
+  return true;
 }
 
 /**
@@ -356,6 +1124,10 @@ void core::dispatch()
  */
 bool core::update_pcount(char* pbf)
 {
+  //seeder doesn't count pieces
+  if (!this->pcount_)
+    return true;
+
   //acquire bitfield reader lock
   if (!acquire_reader(&this->bflock_))
     goto _ERROR;
@@ -364,15 +1136,8 @@ bool core::update_pcount(char* pbf)
   if (!acquire_writer(&this->pclock_))
     goto _ERROR;
 
-  //iterate though bitfield
-  for (uint32_t i = 0; i < this->pnum_; i++) {
-    //count of pieces already at local are set to INT_MAX, ignore them
-    if (this->pcount_[i] == INT_MAX) continue;
-
-    //increase piece count if piece bit is set
-    if (*(pbf+i/BYTE_LEN) & (1<<(BYTE_LEN-i%BYTE_LEN-1)))
-      this->pcount_[i]++;
-  }
+  //count pieces held by peer
+  count_pieces(this->pcount_, pbf, this->pnum_);
 
   //release piece count writer lock
   if (!release_rwlock(&this->pclock_))
@@ -387,6 +1152,58 @@ _ERROR:
   return false;
 }
 
+/**
+ * Count a piece announced by peer in have message.
+ * Thread safe.
+ * @index: piece index
+ * Return: true if update succeed, otherwise return false.
+ */
+bool core::update_pcount(uint32_t index)
+{
+  //seeder doesn't count pieces
+  if (!this->pcount_)
+    return true;
+
+  //acquire piece count writer lock
+  if (!acquire_writer(&this->pclock_))
+    return false;
+
+  //downloaded pieces stay at INT_MAX
+  if (this->pcount_[index] != INT_MAX)
+    this->pcount_[index]++;
+
+  //release piece count writer lock
+  return release_rwlock(&this->pclock_);
+}
+
+/**
+ * Discount pieces held by a peer leaving swarm.
+ * Thread safe.
+ * @pbf: bitfield of peer
+ * Return: true if update succeed, otherwise return false.
+ */
+bool core::remove_pcount(char* pbf)
+{
+  //seeder doesn't count pieces
+  if (!this->pcount_)
+    return true;
+
+  //acquire piece count writer lock
+  if (!acquire_writer(&this->pclock_))
+    return false;
+
+  //downloaded pieces stay at INT_MAX
+  for (uint32_t i = 0; i < this->pnum_; i++) {
+    if (!(pbf[i/BYTE_LEN] & (1 << (BYTE_LEN-i%BYTE_LEN-1))))
+      continue;
+    if (this->pcount_[i] != INT_MAX && this->pcount_[i] > 0)
+      this->pcount_[i]--;
+  }
+
+  //release piece count writer lock
+  return release_rwlock(&this->pclock_);
+}
+
 /**
  * Interface to update local bitfield
  * and set the rarity of setted piece index
@@ -438,22 +1255,20 @@ void core::rarest_first()
   //do nothing when all pieces are downloaded
   if (this->finish_) return;
 
-  int rn = INT_MAX;      //rarest piece number
+  int rn;                //rarest piece number
   uint32_t pseq;         //sequence of choosed piece
   vector<uint32_t> seqs; //sequences of the rarest pieces
   char* bf;              //pointer to peer btfield
   receiver* recv;        //pointer to receiver in hash map
+  receiver* pick = nullptr; //receiver picked, local network first
   peer* pr;              //peer of receiver
 
   //acquire piece count reader lock
   if (!acquire_reader(&this->pclock_))
     return;
 
-  //find the number of the rarest piece
-  for (uint32_t i = 0; i < this->pnum_; i++) {
-    if (this->pcount_[i] && this->pcount_[i] < rn)
-      rn = this->pcount_[i];
-  }
+  //find the sequences of pieces which are the rarest
+  rn = rarest_pieces(this->pcount_, this->pnum_, seqs);
 
   //all pieces are downloaded, exit
   if (rn == INT_MAX) {
@@ -462,10 +1277,10 @@ void core::rarest_first()
     return;
   }
 
-  //find the sequences of pieces which are the rarest
-  for (uint32_t i = 0; i < this->pnum_; i++) {
-    if (this->pcount_[i] == rn)
-      seqs.push_back(i);
+  //no peer holds a missing piece yet
+  if (seqs.empty()) {
+    release_rwlock(&this->pclock_);
+    return;
   }
 
   //release piece count reader lock
@@ -494,17 +1309,28 @@ void core::rarest_first()
     bf = pr->bitfield;
 
     //test bit of the rarest piece
-    if (*(bf+pseq/BYTE_LEN) & (1<<(BYTE_LEN-pseq%BYTE_LEN-1))) {
-      //inform receiver piece to interest
-      recv->set_piece(pseq);
-      pr->interested = true;
-
-      //send interested request to peer
-      recv->send_interested();
+    if (!(*(bf+pseq/BYTE_LEN) & (1<<(BYTE_LEN-pseq%BYTE_LEN-1))))
+      continue;
+
+    //peers on local network are cheaper to download from
+    if (!pick)
+      pick = recv;
+    if (this->on_lan(recv->get_conn()->get_ip())) {
+      pick = recv;
       break;
     }
   }
 
+  if (pick) {
+    //inform receiver piece to interest
+    pick->set_piece(pseq);
+    trace::record(trace::PICKED, pseq);
+    pick->get_peer()->interested = true;
+
+    //send interested request to peer
+    pick->send_interested();
+  }
+
   //release receiver hash map reader lock
   if (!release_rwlock(&this->rmlock_))
     return;
@@ -558,8 +1384,8 @@ void core::re_unchoke()
     [](peer* p1, peer* p2) 
     {return p1->rate > p2->rate;});
 
-  //find top 3 peers
-  for (int i = 0; i < core::RE_UNCHK_; i++)
+  //find top 3 peers, fewer may be interested
+  for (int i = 0; i < core::RE_UNCHK_ && i < (int)drates.size(); i++)
     top_three.insert(drates[i]);
 
   //acquire lock to access unchoked peer set
@@ -568,13 +1394,17 @@ void core::re_unchoke()
   //choke peers unchoked but neither in top 3
   //nor optimistic unchoked
   for (auto it = this->unchoked_.begin(); 
-       it != this->unchoked_.end(); it++) {
+       it != this->unchoked_.end(); ) {
     if (!top_three.count(*it) && this->opp_ != *it) {
        //choke peer
       (*it)->choking = true;
+      metrics::add(metrics::CHOKES, 1);
 
       //kick peer out of unchoked set
-      this->unchoked_.erase(*it);
+      it = this->unchoked_.erase(it);
+    }
+    else {
+      it++;
     }
   }
 
@@ -591,6 +1421,7 @@ void core::re_unchoke()
 
     //set peer status
     (*it)->choking = false;
+    metrics::add(metrics::UNCHOKES, 1);
 
     //add peer into unchoke array
     this->unchoked_.insert(*it);
@@ -618,8 +1449,10 @@ void core::op_unchoke()
   int index;          //random index of candidate senders
 
   //choke previously optimistic unchoked peer
-  if (this->opp_)
+  if (this->opp_) {
     this->opp_->choking = true;
+    metrics::add(metrics::CHOKES, 1);
+  }
 
   //acquire sender hash map reader lock
   if (!acquire_reader(&this->smlock_))
@@ -638,10 +1471,17 @@ void core::op_unchoke()
     pv.push_back(it->second);
   }
 
+  //no peer waiting for unchoke
+  if (pv.empty()) {
+    release_rwlock(&this->smlock_);
+    return;
+  }
+
   //randomly pick one peer
   srand(time(nullptr));
   index = rand()%pv.size();
   pv[index]->get_peer()->choking = false;
+  metrics::add(metrics::UNCHOKES, 1);
 
   //unchoke peer
   pv[index]->send_unchoke();
@@ -655,6 +1495,7 @@ void core::op_unchoke()
 /**
  * Timeout event handler, accumulate passed time and
  * decide which event should occur next.
+ * Called by the session timer.
  */
 void core::timeout()
 {
@@ -664,6 +1505,16 @@ void core::timeout()
   //perform regular unchoke
   this->re_unchoke();
 
+  //look for more peers when the swarm is larger than known
+  this->check_swarm();
+
+  //tell peers about each other
+  this->share_peers();
+
+  //keep super seeding going with peers nobody downloads from
+  if (this->super_)
+    this->reveal_stalled();
+
   //check if time to do optimistic choke
   if (!this->actime_%core::OU_PERD_) {
     this->op_unchoke();
@@ -671,9 +1522,33 @@ void core::timeout()
     //restart accumulating time
     this->actime_ = 0;
   }
+}
+
+/**
+ * Compare swarm size from cached scrape with peers known to
+ * a leecher, announce early if the swarm holds more peers.
+ * When fresh statistics show no peer is missing the next
+ * periodical announce is deferred. Statistics are refreshed
+ * by scrapes of the session.
+ */
+void core::check_swarm()
+{
+  tracker_agent::Stats stats;  //swarm statistics
+  size_t known;                //peers known to client
+
+  if (this->role_ != P_LEECHER || this->finish_ || this->paused_) return;
+  if (!this->agent_->get_stats(this->mi_->get_infohash(), stats)) return;
+
+  {
+    lock_guard<mutex> lock(this->cnlock_);
+    known = this->pset_.size();
+  }
 
-  //restart timer
-  this->timer_->start(core::TO_UNIT_);
+  //swarm counts include client itself
+  if ((size_t)(stats.seeders+stats.leechers) > known+1)
+    this->agent_->reannounce();
+  else if (tracker_agent::fresh(stats))
+    this->agent_->defer();
 }
 
 /**
@@ -761,3 +1636,21 @@ void core::unmap_file()
   if (close(this->fd_))
     error_handle(ERR_SYS);
 }
+
+/**
+ * Sort file ranges and merge overlapping or adjacent ones
+ * @ext: ranges as offset and end, merged on return
+ */
+static void merge_extents(vector<pair<uint64_t, uint64_t>>& ext)
+{
+  size_t n = 0;  //ranges kept
+
+  sort(ext.begin(), ext.end());
+  for (size_t i = 0; i < ext.size(); i++) {
+    if (n && ext[i].first <= ext[n-1].second)
+      ext[n-1].second = max(ext[n-1].second, ext[i].second);
+    else
+      ext[n++] = ext[i];
+  }
+  ext.resize(n);
+}
@@ -0,0 +1,290 @@
+/**
+ * Implementation of metainfo creator.
+ * See class defination: '../include/creator.h'
+ *
+ */
+
+#include <creator.h>
+#include <executor.h> /* work-stealing executor */
+#include <vector>     /* std::vector */
+#include <chrono>     /* std::chrono::steady_clock */
+#include <fstream>    /* std::ofstream */
+#include <ctime>      /* time() */
+#include <sys/stat.h> /* stat() and struct stat */
+#include <fcntl.h>    /* open() and posix_fadvise() */
+#include <unistd.h>   /* pread() and close() */
+
+using namespace std::chrono;
+
+/************* Constants *************/
+static const char* ANNOUNCE = "announce";         /* metainfo announce field key */
+static const char* CREATED_BY = "created by";     /* metainfo creator field key */
+static const char* CREATE_DATE = "creation date"; /* metainfo creation date field key */
+static const char* INFO = "info";                 /* metainfo info field key */
+static const char* LENGTH = "length";             /* metainfo length field key */
+static const char* NAME = "name";                 /* metainfo name field key */
+static const char* PLEN = "piece length";         /* metainfo piece length field key */
+static const char* PIECE = "pieces";              /* metainfo pieces field key */
+static const char* CREATOR = "URTorrent";         /* value of created by field */
+
+/**
+ * Constructor - inspect payload and decide piece layout.
+ *
+ * @file: payload file to share
+ * @announce: tracker URL
+ * @piece_len: piece length in bytes, 0 picks one automatically
+ */
+creator::creator(string file, string announce,
+                 long long piece_len) : file_(file),
+                                        announce_(announce),
+                                        piece_length_(piece_len)
+{
+  struct stat buff = {};  //zero initialized file info buffer
+  size_t slash;           //position of last path separator
+
+  //check payload
+  if (stat(this->file_.c_str(), &buff) != 0)
+    error_handle(ERR_SYS);
+  if (!S_ISREG(buff.st_mode) || !buff.st_size)
+    error_handle(ERR_PAYLOAD);
+  this->file_size_ = buff.st_size;
+
+  //store base name only, peers open the file in their working directory
+  slash = this->file_.find_last_of('/');
+  this->name_ = (slash == string::npos) ?
+                this->file_ : this->file_.substr(slash+1);
+
+  //piece length has to be whole blocks
+  if (!this->piece_length_)
+    this->choose_piece_length();
+  else if (this->piece_length_ < creator::MIN_PLEN_ ||
+           this->piece_length_ % creator::MIN_PLEN_)
+    error_handle(ERR_USAGE);
+
+  //compute piece layout
+  this->pnum_ = (this->file_size_+this->piece_length_-1)/
+                this->piece_length_;
+  this->run_ = creator::RUN_BYTES_/this->piece_length_;
+  if (!this->run_)
+    this->run_ = 1;
+
+  //one hashing job per executor worker
+  this->nthread_ = executor::get_workers();
+
+  this->hashes_ = new unsigned char[this->pnum_*SHA_DIGEST_LENGTH]();
+  this->next_ = 0;
+  this->failed_ = false;
+  this->seconds_ = 0;
+}
+
+/**
+ * Destructor - clean up piece hashes
+ */
+creator::~creator()
+{
+  delete[] this->hashes_;
+}
+
+/**
+ * Hash all pieces with jobs on executor, then
+ * write the metainfo file.
+ *
+ * @torrent: path of metainfo file to write
+ */
+void creator::make(string torrent)
+{
+  time_point<steady_clock> epoch;  //hashing start time
+  mutex lock;                      //lock to wait jobs
+  condition_variable done;         //a job finished
+  unsigned int finished = 0;       //jobs finished
+
+  epoch = steady_clock::now();
+
+  //queue hashing jobs
+  for (unsigned int i = 0; i < this->nthread_; i++) {
+    executor::submit(executor::HASH, [&] {
+      this->hash_worker();
+      lock_guard<mutex> lk(lock);
+      finished++;
+      done.notify_one();
+    });
+  }
+
+  //wait for all pieces to be hashed
+  {
+    unique_lock<mutex> lk(lock);
+    done.wait(lk, [&] {return finished == this->nthread_;});
+  }
+
+  this->seconds_ = duration_cast<duration<double>>(
+                   steady_clock::now()-epoch).count();
+
+  if (this->failed_)
+    error_handle(ERR_SYS);
+
+  this->write_meta(torrent);
+}
+
+/**
+ * Interface for retrieving payload size
+ */
+long long creator::get_size()
+{
+  return this->file_size_;
+}
+
+/**
+ * Interface for retrieving piece length
+ */
+long long creator::get_piece_size()
+{
+  return this->piece_length_;
+}
+
+/**
+ * Interface for retrieving number of pieces
+ */
+size_t creator::get_piece_num()
+{
+  return this->pnum_;
+}
+
+/**
+ * Interface for retrieving number of hashing workers
+ */
+unsigned int creator::get_threads()
+{
+  return this->nthread_;
+}
+
+/**
+ * Interface for retrieving seconds spent on hashing
+ */
+double creator::get_seconds()
+{
+  return this->seconds_;
+}
+
+/**
+ * Pick the smallest power of two piece length which
+ * keeps the piece count around TARGET_PIECES_, bounded
+ * by one block and MAX_PLEN_.
+ */
+void creator::choose_piece_length()
+{
+  this->piece_length_ = creator::MIN_PLEN_;
+
+  while (this->piece_length_ < creator::MAX_PLEN_ &&
+         this->file_size_/this->piece_length_ > creator::TARGET_PIECES_)
+    this->piece_length_ <<= 1;
+}
+
+/**
+ * Hashing job, claim runs of consecutive pieces
+ * until none left. Each run is announced to the kernel
+ * with POSIX_FADV_WILLNEED before reading so the disk
+ * streams ahead while earlier pieces are hashed.
+ */
+void creator::hash_worker()
+{
+  int fd;                 //private payload descriptor
+  size_t first, last;     //claimed run [first, last)
+  long long offset;       //file offset of piece
+  long long length;       //length of piece
+  long long done;         //bytes read of piece
+  ssize_t rdsz;           //data read size
+  unsigned char* buff;    //piece buffer
+
+  fd = open(this->file_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    this->failed_ = true;
+    return;
+  }
+
+  //whole file is read front to back within each run
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  buff = new unsigned char[this->piece_length_];
+
+  while (!this->failed_) {
+    //claim next run
+    first = this->next_.fetch_add(this->run_);
+    if (first >= this->pnum_) break;
+    last = min(first+this->run_, this->pnum_);
+
+    //read ahead the whole run
+    offset = (long long)first*this->piece_length_;
+    posix_fadvise(fd, offset,
+                  min((long long)(last-first)*this->piece_length_,
+                      this->file_size_-offset),
+                  POSIX_FADV_WILLNEED);
+
+    for (size_t i = first; i < last; i++) {
+      offset = (long long)i*this->piece_length_;
+      length = min(this->piece_length_, this->file_size_-offset);
+
+      //read whole piece, pread may return short
+      for (done = 0; done < length; done += rdsz) {
+        rdsz = pread(fd, buff+done, length-done, offset+done);
+        if (rdsz <= 0) {
+          this->failed_ = true;
+          goto _EXIT;
+        }
+      }
+
+      SHA1(buff, length, this->hashes_+i*SHA_DIGEST_LENGTH);
+    }
+  }
+
+_EXIT:
+  delete[] buff;
+  close(fd);
+}
+
+/**
+ * Build metainfo dictionary, bencode it and
+ * write it to disk. The layout is the single
+ * file mode read by metainfo::Parser.
+ *
+ * @torrent: path of metainfo file to write
+ */
+void creator::write_meta(string torrent)
+{
+  be_node* meta;      //metainfo dictionary
+  be_node* info;      //info dictionary
+  char* encoded;      //bencoded metainfo
+  long long len = 0;  //length of bencoded metainfo
+
+  //info dictionary
+  info = be_create_dict();
+  be_dict_add(info, LENGTH, be_create_int(this->file_size_));
+  be_dict_add(info, NAME, be_create_str(this->name_.c_str(),
+                                        this->name_.size()));
+  be_dict_add(info, PLEN, be_create_int(this->piece_length_));
+  be_dict_add(info, PIECE,
+              be_create_str((char*)this->hashes_,
+                            this->pnum_*SHA_DIGEST_LENGTH));
+
+  //top level dictionary
+  meta = be_create_dict();
+  be_dict_add(meta, ANNOUNCE, be_create_str(this->announce_.c_str(),
+                                            this->announce_.size()));
+  be_dict_add(meta, CREATED_BY, be_create_str(CREATOR, strlen(CREATOR)));
+  be_dict_add(meta, CREATE_DATE, be_create_int(time(nullptr)));
+  be_dict_add(meta, INFO, info);
+
+  encoded = be_encode(meta, &len);
+  be_free(meta);
+  if (!encoded)
+    error_handle(ERR_WRITE);
+
+  //write metainfo file
+  ofstream meta_file(torrent, (ofstream::out|ofstream::binary));
+  meta_file.write(encoded, len);
+  meta_file.close();
+  free(encoded);
+
+  //error check
+  if (!meta_file.good())
+    error_handle(ERR_WRITE);
+}
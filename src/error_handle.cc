@@ -25,7 +25,18 @@ void error_handle(Error error)
 
   switch (error) {
     case ERR_USAGE:
-      cerr << "Usage: urtorrent <port number> <torrent>\n";
+      cerr << "Usage: urtorrent [-t <tracker port>] [-a <advertised port>] "
+           << "[-m <metrics file>]\n"
+           << "                 [-T <trace file>] [-U <KB/s>] [-D <KB/s>] "
+           << "[-C <connections>]\n"
+           << "                 [-w <workers>] [-L <group ip>:<port>] [-S] "
+           << "[-R <MB>]\n"
+           << "                 <port number> <torrent> [<torrent> ...]\n"
+           << "       urtorrent -d <control socket> [options] "
+           << "<port number> [<torrent> ...]\n"
+           << "       urtorrent create <file> <announce URL> <torrent> "
+           << "[piece length]\n"
+           << "       urtorrent tracker <port number> [interval]\n";
       break;
 
     case ERR_BIND:
@@ -61,6 +72,22 @@ void error_handle(Error error)
       cerr << "I/O error: cannot allocate temporary file on disk\n";
       break;
 
+    case ERR_PAYLOAD:
+      cerr << "payload error: file to share must be a non-empty regular file\n";
+      break;
+
+    case ERR_WRITE:
+      cerr << "I/O error: cannot write metainfo file\n";
+      break;
+
+    case ERR_CTRL:
+      cerr << "cannot listen on control socket\n";
+      break;
+
+    case ERR_LSD:
+      cerr << "cannot join discovery group, expected <multicast ip>:<port>\n";
+      break;
+
     default:
       //ERR_TRACK display error message in place
       break;
@@ -68,6 +95,25 @@ void error_handle(Error error)
   exit(EXIT_FAILURE);
 }
 
+/**
+ * Overload of error_handle naming what failed, used
+ * when it is not the client port
+ *
+ * @error: error enumeration define in "../include/error_handle.h".
+ * @info: additional info provided by caller, e.g. port bound
+ */
+void error_handle(Error error, string info)
+{
+  switch (error) {
+    case ERR_BIND:
+      cerr << "cannot bind port: " << info << endl;
+      exit(EXIT_FAILURE);
+
+    default:
+      error_handle(error);
+  }
+}
+
 /**
  * Display message for failure, the program will not
  * be terminated by this call.
@@ -102,6 +148,10 @@ void fail_handle(Fail fail)
       cerr << "bitfield invalid\n";
       break;
 
+    case FAL_MESG:
+      cerr << "message invalid\n";
+      break;
+
     default:
       break;
   }
@@ -141,5 +191,18 @@ void help()
   cout << "\tshow : This will display the list of our current" 
        << "peers and some stats about them\n";
   cout << "\tstatus : This will print out the status of our download\n";
+  cout << "\tscrape : This will display swarm statistics "
+       << "reported by the tracker\n";
+  cout << "\tmetrics : This will print counters and latency "
+       << "histograms in Prometheus format\n";
+  cout << "\ttrace : This will start tracing piece lifecycles, "
+       << "or write the trace as Chrome trace JSON\n";
+  cout << "\tlimit <up|down> <global|torrent|peer> <KB/s> : This will "
+       << "set a rate limit, 0 for unlimited\n";
+  cout << "\ttorrents : This will list hosted torrents, commands "
+       << "apply to the one marked\n";
+  cout << "\ttorrent <index> : This will select the torrent "
+       << "commands apply to\n";
+  cout << "\tadd <torrent> : This will host one more torrent\n";
   cout << flush;
 }
@@ -0,0 +1,226 @@
+/**
+ * Implementation of work-stealing executor.
+ * See class defination: '../include/executor.h'
+ *
+ * The pool is allocated once and never freed, jobs of detached
+ * threads still queued at exit run on valid memory.
+ *
+ */
+
+#include <executor.h>
+
+/***************** Constants *****************/
+const long long executor::LIMITS_[CLASS_NUM] = {
+  65536,   /* NET: timer handlers and messages of every connection */
+  1024,    /* HASH: pieces waiting for SHA-1 */
+  256      /* DISK: file writes */
+};
+
+/**
+ * Constructor - launch workers
+ * @size: number of workers
+ */
+executor::Pool::Pool(unsigned int size) : queued(0), next(0)
+{
+  for (int c = 0; c < CLASS_NUM; c++)
+    this->pending[c] = 0;
+
+  for (unsigned int i = 0; i < size; i++)
+    this->workers.push_back(new Worker());
+
+  for (unsigned int i = 0; i < size; i++) {
+    thread t_work(&executor::work, this, (int)i);
+    t_work.detach();
+  }
+}
+
+/**
+ * Size pool, takes effect only before the
+ * first job is queued.
+ *
+ * @workers: number of workers, 0 for one per core
+ */
+void executor::init(unsigned int workers)
+{
+  pool(workers);
+}
+
+/**
+ * Queue a job. A submitter outside the pool waits while
+ * the class has too many jobs pending, a worker queues
+ * into its own deque and never waits.
+ *
+ * @c: job class
+ * @job: job to run
+ */
+void executor::submit(Class c, function<void ()> job)
+{
+  Pool* p = pool();     //process wide pool
+  int id = self();      //worker id of caller
+  Worker* w;            //worker to queue job
+
+  //back-pressure on producers outside pool
+  if (id < 0 && p->pending[c] >= LIMITS_[c]) {
+    unique_lock<mutex> lk(p->lock);
+    p->room.wait(lk, [p, c] {return p->pending[c] < LIMITS_[c];});
+  }
+  p->pending[c]++;
+
+  //workers keep their jobs, others spread round robin
+  if (id < 0)
+    id = p->next++ % p->workers.size();
+  w = p->workers[id];
+
+  {
+    lock_guard<mutex> lock(w->lock);
+    w->jobs[c].push_back(move(job));
+  }
+
+  //wake a sleeping worker
+  {
+    lock_guard<mutex> lock(p->lock);
+    p->queued++;
+  }
+  p->work.notify_one();
+}
+
+/**
+ * Run a job on pool and wait for it, a worker runs
+ * the job itself instead of waiting on its own pool.
+ *
+ * @c: job class
+ * @job: job to run
+ */
+void executor::run(Class c, function<void ()> job)
+{
+  mutex lock;               //lock to wait job
+  condition_variable done;  //job finished
+  bool finished = false;    //job status
+
+  if (self() >= 0) {
+    job();
+    return;
+  }
+
+  submit(c, [&] {
+    job();
+    lock_guard<mutex> lk(lock);
+    finished = true;
+    done.notify_one();
+  });
+
+  unique_lock<mutex> lk(lock);
+  done.wait(lk, [&] {return finished;});
+}
+
+/**
+ * Interface to get number of workers
+ */
+unsigned int executor::get_workers()
+{
+  return pool()->workers.size();
+}
+
+/**
+ * Interface to get jobs of a class queued or running
+ * @c: job class
+ */
+long long executor::get_pending(Class c)
+{
+  return pool()->pending[c];
+}
+
+/**
+ * Process wide pool, created on first use
+ * @size: number of workers, 0 for one per core
+ */
+executor::Pool* executor::pool(unsigned int size)
+{
+  static Pool* p = new Pool(size ? size :          //never freed
+                            max(thread::hardware_concurrency(), 1u));
+
+  return p;
+}
+
+/**
+ * Worker id of calling thread
+ */
+int& executor::self()
+{
+  static thread_local int id = -1;  //-1 outside pool
+
+  return id;
+}
+
+/**
+ * Worker thread job, run jobs until process exits
+ * and sleep while none is queued.
+ *
+ * @p: pool of worker
+ * @id: worker id
+ */
+void executor::work(Pool* p, int id)
+{
+  function<void ()> job;  //job taken
+  Class c;                //class of job
+
+  self() = id;
+
+  while (true) {
+    if (!take(p, id, job, c)) {
+      unique_lock<mutex> lk(p->lock);
+      p->work.wait(lk, [p] {return p->queued > 0;});
+      continue;
+    }
+
+    job();
+    job = nullptr;
+
+    //wake producers waiting for room
+    if (p->pending[c]-- == LIMITS_[c]) {
+      lock_guard<mutex> lock(p->lock);
+      p->room.notify_all();
+    }
+  }
+}
+
+/**
+ * Take a job by priority of class. Own deque is taken from
+ * its back, newest first, other deques are stolen from their
+ * front, oldest first.
+ *
+ * @p: pool of worker
+ * @id: worker id
+ * @job: job taken
+ * @c: class of job taken
+ * Return: true if a job is taken, otherwise false
+ */
+bool executor::take(Pool* p, int id, function<void ()>& job, Class& c)
+{
+  int size = p->workers.size();  //number of workers
+  Worker* w;                     //worker taken from
+
+  for (int k = 0; k < CLASS_NUM; k++) {
+    for (int i = 0; i < size; i++) {
+      w = p->workers[(id+i)%size];
+      lock_guard<mutex> lock(w->lock);
+      if (w->jobs[k].empty())
+        continue;
+
+      if (!i) {
+        job = move(w->jobs[k].back());
+        w->jobs[k].pop_back();
+      }
+      else {
+        job = move(w->jobs[k].front());
+        w->jobs[k].pop_front();
+      }
+
+      c = (Class)k;
+      p->queued--;
+      return true;
+    }
+  }
+
+  return false;
+}
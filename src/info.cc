@@ -1,5 +1,5 @@
 /**
- * Implementation of show and status command.
+ * Implementation of show, status and metrics command.
  *
  *
  */
@@ -17,10 +17,14 @@ static const int UPL_ALIGN = 9;   /* display alignment for upload */
 static const int LEFT_ALIGN = 5;  /* display alignment for left */
 static const char BON = '1';      /* display for bit is set */
 static const char BOFF = '0';     /* display for bit is unset */
+static const char* const HEX = "0123456789abcdef"; /* hex digits of peer id */
 
 /***** Internal Used Functions *****/
 void display_id_ip(int id, string ip);
 void display_status(peer* p);
+string hex_id(const string& id);
+void peer_metric(ostream& os, const char* name, const string& torrent,
+                 peer* p, string ip);
 
 /**
  * Implementation of command show
@@ -50,6 +54,7 @@ void core::do_show()
 void core::do_status()
 {
   int uline = this->pnum_+STATUS_WD;  //table width
+  tracker_agent::Stats stats;         //swarm statistics
 
   //display bar
   cout << "\t\t"
@@ -73,7 +78,119 @@ void core::do_status()
        << left << this->agent_->get_left()
        << "| ";
   show_bf(this->bitfield_);
-  cout << endl << flush;
+  cout << endl;
+
+  //display cached swarm statistics
+  if (this->agent_->get_stats(this->mi_->get_infohash(), stats))
+    cout << "\t\tswarm: " << stats.seeders << " seeders, "
+         << stats.leechers << " leechers, "
+         << stats.completed << " completed" << endl;
+  cout << flush;
+}
+
+/**
+ * Gauges of torrents in Prometheus text format, every
+ * sample is labelled with the info hash of its torrent.
+ * Global metrics are written by the registry.
+ *
+ * @os: output stream
+ * @cores: torrents to write
+ */
+void core::write_gauges(ostream& os, const vector<core*>& cores)
+{
+  vector<string> labels;  //torrent label of each core
+  core* c;                //torrent written
+  int pieces;             //pieces held by client
+  size_t down, up;        //peers by direction
+
+  for (unsigned int i = 0; i < cores.size(); i++)
+    labels.push_back("torrent=\""+hex_id(cores[i]->mi_->get_infohash())+"\"");
+
+  //pieces held, spare bits are never set
+  os << "# HELP urtorrent_pieces Pieces held by client.\n"
+     << "# TYPE urtorrent_pieces gauge\n";
+  for (unsigned int i = 0; i < cores.size(); i++) {
+    c = cores[i];
+    pieces = 0;
+    if (acquire_reader(&c->bflock_)) {
+      for (int j = 0; j < c->bflen_; j++)
+        pieces += __builtin_popcount((unsigned char)c->bitfield_[j]);
+      release_rwlock(&c->bflock_);
+    }
+    os << "urtorrent_pieces{" << labels[i] << "} " << pieces << "\n";
+  }
+
+  os << "# HELP urtorrent_left_bytes Bytes left to download.\n"
+     << "# TYPE urtorrent_left_bytes gauge\n";
+  for (unsigned int i = 0; i < cores.size(); i++)
+    os << "urtorrent_left_bytes{" << labels[i] << "} "
+       << cores[i]->agent_->get_left() << "\n";
+
+  os << "# HELP urtorrent_paused Torrent paused, peers refused.\n"
+     << "# TYPE urtorrent_paused gauge\n";
+  for (unsigned int i = 0; i < cores.size(); i++)
+    os << "urtorrent_paused{" << labels[i] << "} "
+       << (cores[i]->paused_ ? 1 : 0) << "\n";
+
+  os << "# HELP urtorrent_upload_queued_requests Block requests waiting for upload.\n"
+     << "# TYPE urtorrent_upload_queued_requests gauge\n";
+  for (unsigned int i = 0; i < cores.size(); i++)
+    os << "urtorrent_upload_queued_requests{" << labels[i] << "} "
+       << cores[i]->queued_ << "\n";
+
+  os << "# HELP urtorrent_piece_cache_bytes Bytes of pieces in read cache.\n"
+     << "# TYPE urtorrent_piece_cache_bytes gauge\n";
+  for (unsigned int i = 0; i < cores.size(); i++)
+    os << "urtorrent_piece_cache_bytes{" << labels[i] << "} "
+       << (cores[i]->cache_ ?
+           cores[i]->cache_->get_bytes(cores[i]->owner_) : 0) << "\n";
+
+  os << "# HELP urtorrent_peers Connected peers by direction.\n"
+     << "# TYPE urtorrent_peers gauge\n";
+  for (unsigned int i = 0; i < cores.size(); i++) {
+    c = cores[i];
+    down = up = 0;
+    if (acquire_reader(&c->rmlock_)) {
+      down = c->rmap_.size();
+      release_rwlock(&c->rmlock_);
+    }
+    if (acquire_reader(&c->smlock_)) {
+      up = c->smap_.size();
+      release_rwlock(&c->smlock_);
+    }
+    os << "urtorrent_peers{" << labels[i] << ",direction=\"down\"} "
+       << down << "\n"
+       << "urtorrent_peers{" << labels[i] << ",direction=\"up\"} "
+       << up << "\n";
+  }
+
+  //bytes exchanged with each peer
+  os << "# HELP urtorrent_peer_downloaded_bytes Payload bytes downloaded "
+     << "from a peer.\n"
+     << "# TYPE urtorrent_peer_downloaded_bytes gauge\n";
+  for (unsigned int i = 0; i < cores.size(); i++) {
+    c = cores[i];
+    if (!acquire_reader(&c->rmlock_))
+      continue;
+    for (auto it = c->rmap_.begin(); it != c->rmap_.end(); it++)
+      peer_metric(os, "urtorrent_peer_downloaded_bytes", labels[i],
+                  it->second->get_peer(), it->second->get_ip());
+    release_rwlock(&c->rmlock_);
+  }
+
+  os << "# HELP urtorrent_peer_uploaded_bytes Payload bytes uploaded "
+     << "to a peer.\n"
+     << "# TYPE urtorrent_peer_uploaded_bytes gauge\n";
+  for (unsigned int i = 0; i < cores.size(); i++) {
+    c = cores[i];
+    if (!acquire_reader(&c->smlock_))
+      continue;
+    for (auto it = c->smap_.begin(); it != c->smap_.end(); it++)
+      peer_metric(os, "urtorrent_peer_uploaded_bytes", labels[i],
+                  it->second->get_peer(), it->second->get_ip());
+    release_rwlock(&c->smlock_);
+  }
+  os << flush;
 }
 
 /**
@@ -219,3 +336,34 @@ void display_status(peer* p)
   else
     cout << BOFF;
 }
+
+/**
+ * Encode peer id in hex, ids may hold any byte
+ * @id: peer id
+ */
+string hex_id(const string& id)
+{
+  string hex;  //encoded id
+
+  for (unsigned int i = 0; i < id.size(); i++) {
+    hex += HEX[(unsigned char)id[i] >> 4];
+    hex += HEX[(unsigned char)id[i] & 0xf];
+  }
+  return hex;
+}
+
+/**
+ * Write one sample of a per-peer metric
+ * @os: output stream
+ * @name: metric name
+ * @torrent: torrent label
+ * @p: peer
+ * @ip: ip of peer
+ */
+void peer_metric(ostream& os, const char* name, const string& torrent,
+                 peer* p, string ip)
+{
+  os << name << "{" << torrent << ",peer=\"" << hex_id(p->id)
+     << "\",ip=\"" << ip << "\"} " << p->bytes.load(memory_order_relaxed)
+     << "\n";
+}
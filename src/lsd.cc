@@ -0,0 +1,329 @@
+/**
+ * Implementation of class lsd.
+ * See class defination: '../include/lsd.h'
+ *
+ * Announce format:
+ *   BT-SEARCH * HTTP/1.1\r\n
+ *   Host: <group ip>:<group port>\r\n
+ *   Port: <port>\r\n
+ *   Infohash: <40 hex digits>\r\n    (one line per torrent)
+ *   cookie: <cookie>\r\n
+ *   \r\n
+ *   \r\n
+ *
+ */
+
+#include <lsd.h>
+#include <sstream>        /* std::istringstream */
+#include <random>         /* std::random_device */
+#include <cstdlib>        /* atoi() */
+#include <cstdint>        /* UINT16_MAX */
+#include <cctype>         /* isxdigit() and tolower() */
+#include <strings.h>      /* strncasecmp() */
+#include <unistd.h>       /* close(), pipe(), read() and write() */
+#include <fcntl.h>        /* fcntl() */
+#include <poll.h>         /* poll() */
+#include <arpa/inet.h>    /* inet_pton(), inet_ntop() and htons() */
+#include <sys/socket.h>   /* socket syscalls */
+
+/************* Constants *************/
+static const string SEARCH = "BT-SEARCH * HTTP/1.1";  /* request line */
+static const string HOST = "Host: ";                  /* group header */
+static const string PORT = "Port: ";                  /* announced port header */
+static const string INFOHASH = "Infohash: ";          /* info hash header */
+static const string COOKIE = "cookie: ";              /* cookie header */
+static const string CRLF = "\r\n";                    /* end of line */
+static const char* const HEX = "0123456789abcdef";    /* hex digits */
+static const int HASH_LEN = 20;                       /* length of info hash */
+
+/********** Internal Function **********/
+static string hex_string(const string& bytes);
+static string hex_bytes(const string& hex);
+static bool has_prefix(const string& line, const string& prefix);
+
+/**
+ * Constructor - join multicast group and launch
+ * the discovery thread.
+ *
+ * @group: multicast group as ip:port
+ * @port: port peers reach client on
+ * @hashes: source of info hashes to announce
+ * @found: consumer of peers found
+ */
+lsd::lsd(string group, string port, Hashes hashes,
+         Found found) : group_(group), port_(port),
+                        hashes_(hashes), found_(found)
+{
+  random_device rd;  //seed of cookie
+
+  this->cookie_ = to_string(rd());
+
+  this->setup();
+
+  this->running_ = true;
+  this->worker_ = thread(&lsd::run_service, this);
+}
+
+/**
+ * Destructor - stop discovery thread and close sockets
+ */
+lsd::~lsd()
+{
+  char byte = 0;  //wake up byte
+
+  this->running_ = false;
+  if (write(this->wake_[1], &byte, 1) < 0)
+    fail_handle(FAL_SYS);
+  this->worker_.join();
+
+  close(this->sockfd_);
+  close(this->wake_[0]);
+  close(this->wake_[1]);
+}
+
+/**
+ * Bind group port shared with other clients of host,
+ * join group and keep announces on local network.
+ */
+void lsd::setup()
+{
+  struct sockaddr_in local = {};  //address bound, zero initialized
+  struct ip_mreq mreq = {};       //group membership
+  size_t colon;                   //delimiter of group port
+  int yes = 1;                    //option val for setsockopt()
+  unsigned char ttl = 1;          //announces stay on local network
+  unsigned char loop = 1;         //clients of host hear each other
+
+  colon = this->group_.rfind(':');
+  if (colon == string::npos)
+    error_handle(ERR_LSD);
+
+  this->addr_.sin_family = AF_INET;
+  this->addr_.sin_port = htons(atoi(this->group_.c_str()+colon+1));
+  if (!this->addr_.sin_port ||
+      inet_pton(AF_INET, this->group_.substr(0, colon).c_str(),
+                &this->addr_.sin_addr) != 1 ||
+      !IN_MULTICAST(ntohl(this->addr_.sin_addr.s_addr)))
+    error_handle(ERR_LSD);
+
+  this->sockfd_ = socket(AF_INET, SOCK_DGRAM, 0);
+  if (this->sockfd_ < 0)
+    error_handle(ERR_SYS);
+
+  if (setsockopt(this->sockfd_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) ||
+      setsockopt(this->sockfd_, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)))
+    error_handle(ERR_SYS);
+
+  local.sin_family = AF_INET;
+  local.sin_port = this->addr_.sin_port;
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(this->sockfd_, (struct sockaddr*)&local, sizeof(local)))
+    error_handle(ERR_LSD);
+
+  mreq.imr_multiaddr = this->addr_.sin_addr;
+  mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+  if (setsockopt(this->sockfd_, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                 &mreq, sizeof(mreq)) ||
+      setsockopt(this->sockfd_, IPPROTO_IP, IP_MULTICAST_TTL,
+                 &ttl, sizeof(ttl)) ||
+      setsockopt(this->sockfd_, IPPROTO_IP, IP_MULTICAST_LOOP,
+                 &loop, sizeof(loop)))
+    error_handle(ERR_LSD);
+
+  //self pipe to stop discovery thread
+  if (pipe(this->wake_))
+    error_handle(ERR_SYS);
+
+  fcntl(this->sockfd_, F_SETFL, fcntl(this->sockfd_, F_GETFL) | O_NONBLOCK);
+}
+
+/**
+ * Discovery thread job. Announce torrents due and
+ * read announces of other clients.
+ */
+void lsd::run_service()
+{
+  struct pollfd fds[2];  //socket and wake up pipe
+
+  while (this->running_) {
+    this->announce();
+
+    fds[0] = {this->sockfd_, POLLIN, 0};
+    fds[1] = {this->wake_[0], POLLIN, 0};
+    if (poll(fds, 2, lsd::POLL_WAIT_) < 0)
+      continue;
+
+    if (fds[0].revents)
+      this->receive();
+  }
+}
+
+/**
+ * Announce torrents added since last call or not announced
+ * for ANNOUNCE_PERD_, up to HASHES_MAX_ info hashes in one
+ * datagram. Removed torrents are forgotten.
+ */
+void lsd::announce()
+{
+  steady_clock::time_point now = steady_clock::now(); //current time
+  unordered_map<string, steady_clock::time_point> next; //next announces
+  vector<string> hashes = this->hashes_();  //hosted torrents
+  vector<string> due;                       //torrents to announce
+  string mesg;                              //announce datagram
+
+  for (unsigned int i = 0; i < hashes.size(); i++) {
+    auto it = this->next_.find(hashes[i]);
+    if (it != this->next_.end() && it->second > now) {
+      next[hashes[i]] = it->second;
+      continue;
+    }
+    due.push_back(hashes[i]);
+    next[hashes[i]] = now+seconds((int)lsd::ANNOUNCE_PERD_);
+  }
+  this->next_.swap(next);
+
+  for (unsigned int i = 0; i < due.size(); i += lsd::HASHES_MAX_) {
+    mesg = SEARCH+CRLF+HOST+this->group_+CRLF+PORT+this->port_+CRLF;
+    for (unsigned int j = i; j < due.size() && j < i+lsd::HASHES_MAX_; j++)
+      mesg += INFOHASH+hex_string(due[j])+CRLF;
+    mesg += COOKIE+this->cookie_+CRLF+CRLF+CRLF;
+
+    if (sendto(this->sockfd_, mesg.data(), mesg.size(), 0,
+               (struct sockaddr*)&this->addr_, sizeof(this->addr_)) < 0)
+      fail_handle(FAL_SYS);
+  }
+}
+
+/**
+ * Read every pending announce
+ */
+void lsd::receive()
+{
+  char buff[lsd::DGRAM_SIZE_];   //datagram buffer
+  struct sockaddr_in from = {};  //sender address
+  socklen_t len;                 //address length
+  ssize_t rdsz;                  //datagram size
+
+  while (true) {
+    len = sizeof(from);
+    rdsz = recvfrom(this->sockfd_, buff, sizeof(buff), 0,
+                    (struct sockaddr*)&from, &len);
+    if (rdsz < 0)
+      break;
+    this->parse(string(buff, rdsz), from);
+  }
+}
+
+/**
+ * Parse an announce, peers of other clients are handed
+ * to consumer as info hash and ip:port.
+ *
+ * @mesg: announce datagram
+ * @from: sender address
+ */
+void lsd::parse(const string& mesg, const struct sockaddr_in& from)
+{
+  istringstream is(mesg);   //lines of announce
+  string line;              //line read
+  vector<string> hashes;    //info hashes announced
+  string hash;              //info hash decoded
+  string cookie;            //cookie of sender
+  int port = 0;             //port announced
+  char ip[INET_ADDRSTRLEN]; //sender ip
+
+  if (!getline(is, line) || line.compare(0, SEARCH.size(), SEARCH))
+    return;
+
+  while (getline(is, line)) {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+
+    if (has_prefix(line, COOKIE)) {
+      //own announce looped back
+      cookie = line.substr(COOKIE.size());
+      if (cookie == this->cookie_)
+        return;
+    }
+    else if (has_prefix(line, PORT)) {
+      port = atoi(line.c_str()+PORT.size());
+    }
+    else if (has_prefix(line, INFOHASH)) {
+      hash = hex_bytes(line.substr(INFOHASH.size()));
+      if (hash.size() == (size_t)HASH_LEN)
+        hashes.push_back(hash);
+    }
+  }
+
+  if (port <= 0 || port > UINT16_MAX)
+    return;
+
+  inet_ntop(AF_INET, &from.sin_addr, ip, INET_ADDRSTRLEN);
+  for (unsigned int i = 0; i < hashes.size(); i++)
+    this->found_(hashes[i], string(ip)+":"+to_string(port));
+
+  //client heard before knows torrents already
+  if (this->cookies_.count(cookie))
+    return;
+  if (this->cookies_.size() >= (size_t)lsd::COOKIES_MAX_)
+    this->cookies_.clear();
+  this->cookies_.insert(cookie);
+
+  //answer new client on next announce, it answers back
+  //once and then knows this client too
+  for (unsigned int i = 0; i < hashes.size(); i++) {
+    auto it = this->next_.find(hashes[i]);
+    if (it != this->next_.end())
+      it->second = steady_clock::now();
+  }
+}
+
+/**
+ * Encode bytes in hex
+ * @bytes: bytes to encode
+ */
+static string hex_string(const string& bytes)
+{
+  string hex;  //encoded bytes
+
+  for (unsigned int i = 0; i < bytes.size(); i++) {
+    hex += HEX[(unsigned char)bytes[i] >> 4];
+    hex += HEX[(unsigned char)bytes[i] & 0xf];
+  }
+  return hex;
+}
+
+/**
+ * Decode hex digits of either case
+ * @hex: hex digits
+ * Return: bytes decoded, empty if not hex
+ */
+static string hex_bytes(const string& hex)
+{
+  string bytes;   //decoded bytes
+  int hi, lo;     //nibbles of a byte
+
+  if (hex.size()%2)
+    return "";
+
+  for (unsigned int i = 0; i < hex.size(); i += 2) {
+    hi = isxdigit(hex[i]) ? (isdigit(hex[i]) ? hex[i]-'0' :
+                                               tolower(hex[i])-'a'+10) : -1;
+    lo = isxdigit(hex[i+1]) ? (isdigit(hex[i+1]) ? hex[i+1]-'0' :
+                                                   tolower(hex[i+1])-'a'+10) : -1;
+    if (hi < 0 || lo < 0)
+      return "";
+    bytes += (char)(hi << 4 | lo);
+  }
+  return bytes;
+}
+
+/**
+ * Check a header name, case insensitive
+ * @line: header line
+ * @prefix: header name with its colon and space
+ */
+static bool has_prefix(const string& line, const string& prefix)
+{
+  return line.size() >= prefix.size() &&
+         !strncasecmp(line.c_str(), prefix.c_str(), prefix.size());
+}
@@ -10,25 +10,28 @@
 
 #include <metainfo.h>  /* metainfo class */
 #include <ctime>       /* srand(), rand() and time() */
+#include <cerrno>      /* errno */
 
 /************* Constants *************/
-static const char* ANNOUNCE = "announce";  /* metainfo announce field key */
-static const char* LENGTH = "length";      /* metainfo length field key */
-static const char* NAME = "name";          /* metainfo name field key */
-static const char* PLEN = "piece length";  /* metainfo piece length field key */
-static const char* PIECE = "pieces";       /* metainfo pieces field key */
-static const char* INFO = "4:infod6:";     /* anchor for info directory */
-static const int EXTRA_LEN = 6;            /* bytes before info dictionary */
-static const int TAIL_LEN = 1;             /* length of trailing ee */
-static const int MAX_ASCII = 256;          /* upper bound of ascii (exclusive) */
-static const int BYTE_DIGIT = 2;           /* digits of hexdecimal per byte */
-static const int MIN_ALIGNMENT = 5;        /* display alignment shift */
+static const char* ANNOUNCE = "announce";      /* metainfo announce field key */
+static const char* ANN_LIST = "announce-list"; /* metainfo announce list field key */
+static const char* LENGTH = "length";          /* metainfo length field key */
+static const char* NAME = "name";              /* metainfo name field key */
+static const char* PLEN = "piece length";      /* metainfo piece length field key */
+static const char* PIECE = "pieces";           /* metainfo pieces field key */
+static const char* INFO = "info";              /* metainfo info field key */
+static const int MAX_ASCII = 256;              /* upper bound of ascii (exclusive) */
+static const int BYTE_DIGIT = 2;               /* digits of hexdecimal per byte */
+static const int MIN_ALIGNMENT = 5;            /* display alignment shift */
 
 /********** Internal Function **********/
+static void print_binary(const unsigned char* bytes, size_t len);
 static void print_binary(string str);
 
 /**
  * Constructor - Read metainfo file and parse metainfo.
+ * A failure is kept in error_ instead of stopping the
+ * process, a daemon adding a bad file keeps running.
  *
  * @file: metainfo file
  * @port: port this peer listen on
@@ -37,6 +40,11 @@ metainfo::metainfo(string file, string port)
 {
   this->metafile_ = file;
   this->port_ = port;
+  this->piece_hash_ = nullptr;
+  this->piece_num_ = 0;
+  this->piece_length_ = 0;
+  this->file_size_ = 0;
+  this->last_size_ = 0;
 
   //retrieve local info
   this->generate_peerid();
@@ -45,6 +53,14 @@ metainfo::metainfo(string file, string port)
   this->Parser();
 }
 
+/**
+ * Destructor - clean up piece hash table
+ */
+metainfo::~metainfo()
+{
+  delete[] this->piece_hash_;
+}
+
 /**
  * Print out metainfo message.
  *
@@ -55,7 +71,7 @@ metainfo::metainfo(string file, string port)
 void metainfo::show_meta(string ip)
 {
   int plen =
-  (to_string(this->piece_hash_.size()).size());   //maximum piece sequence display size
+  (to_string(this->piece_num_).size());   //maximum piece sequence display size
   
   int aligment =
   (plen > MIN_ALIGNMENT) ? plen : MIN_ALIGNMENT;  //display alignment
@@ -80,7 +96,7 @@ void metainfo::show_meta(string ip)
   
   cout << "\tfile size\t: " <<
        this->file_size_ << " (" <<
-       this->file_size_/this->piece_length_ <<
+       this->piece_num_-1 <<
        " * [piece length] + " <<
        this->last_size_ <<
        ")" << endl;
@@ -88,14 +104,38 @@ void metainfo::show_meta(string ip)
   cout << "\tannounce URL\t: " <<
        this->announce_ << endl;
 
+  //announce-list tiers
+  for (unsigned int i = 0; i < this->announce_list_.size(); i++) {
+    cout << "\ttier " << i << "\t\t: ";
+    for (unsigned int j = 0; j < this->announce_list_[i].size(); j++)
+      cout << this->announce_list_[i][j] << " ";
+    cout << endl;
+  }
+
   cout << "\tpieces' hashes : " << endl;
-  for (unsigned int i = 0; i < this->piece_hash_.size(); i++) {
+  for (unsigned int i = 0; i < this->piece_num_; i++) {
     cout << "\t" << setfill(' ') << setw(aligment) << i << ":  ";
-    print_binary(this->piece_hash_[i]);
+    print_binary(this->get_piecehash(i), SHA_DIGEST_LENGTH);
   }
   cout << flush;
 }
 
+/**
+ * Interface to check metainfo file was parsed
+ */
+bool metainfo::valid()
+{
+  return this->error_.empty();
+}
+
+/**
+ * Interface to get reason parsing failed
+ */
+string metainfo::get_error()
+{
+  return this->error_;
+}
+
 /**
  *  Interface for retrieve tracker URL
  */
@@ -104,6 +144,18 @@ string metainfo::get_announce()
   return this->announce_;
 }
 
+/**
+ * Interface for retrieve tiers of tracker URLs (BEP 12).
+ * A metainfo without announce-list yields a single tier
+ * holding the announce URL.
+ */
+vector<vector<string>> metainfo::get_announce_list()
+{
+  if (this->announce_list_.empty())
+    return vector<vector<string>>(1, vector<string>(1, this->announce_));
+  return this->announce_list_;
+}
+
 /**
  * Interface for retrieving target filename
  */
@@ -136,13 +188,33 @@ string metainfo::get_infohash()
   return this->info_hash_;
 }
 
+/**
+ * Interface for retrieving raw bencoded info dictionary
+ */
+string metainfo::get_info()
+{
+  return this->info_raw_;
+}
+
 /**
  * Interface to get hash of specific piece
  * @index: piece index
+ * Return: pointer to 20 bytes hash inside the hash table
+ */
+const unsigned char* metainfo::get_piecehash(int index)
+{
+  return this->piece_hash_+(size_t)index*SHA_DIGEST_LENGTH;
+}
+
+/**
+ * Compare a digest with the hash of a piece
+ * @index: piece index
+ * @hash: 20 bytes SHA1 digest
+ * Return: true if digest matches
  */
-string metainfo::get_piecehash(int index)
+bool metainfo::match_piecehash(int index, const unsigned char* hash)
 {
-  return this->piece_hash_[index];
+  return !memcmp(this->get_piecehash(index), hash, SHA_DIGEST_LENGTH);
 }
 
 /**
@@ -182,7 +254,7 @@ long long metainfo::get_last_psize()
  */
 size_t metainfo::get_piece_num()
 {
-  return this->piece_hash_.size();
+  return this->piece_num_;
 }
 
 /**
@@ -194,8 +266,9 @@ void metainfo::generate_peerid()
   string uid;   //peer id to be generated
   int bcount;   //random bytes count
 
-  //generate random seed
-  srand(time(NULL));
+  //generate random seed, clients started in the same
+  //second must not share an id
+  srand(time(NULL) ^ getpid());
 
   //append client version at the beginning
   uid = string(metainfo::VERSION_);
@@ -214,20 +287,28 @@ void metainfo::generate_peerid()
  * the assumed largest metainfo is no bigger than
  * 8KB. 
  * Decoding is done by invoking C bendecoder.
+ *
+ * Return: true if metainfo is parsed, otherwise
+ *         error_ holds the reason
  */
-void metainfo::Parser()
+bool metainfo::Parser()
 {
   int fd;                //metainfo file descriptor
   size_t size;           //metainfo file size
   char* map_region;      //memory mapped region
   be_node* node;         //bedecoder node
+  bool parsed;           //metainfo well formatted
   struct stat buff = {}; //zero initialized file info buffer
 
-  this->get_tmpfile();
-
   //check file size
-  if (stat(this->metafile_.c_str(), &buff) != 0)
-    error_handle(ERR_SYS);
+  if (stat(this->metafile_.c_str(), &buff) != 0) {
+    this->error_ = "cannot read "+this->metafile_+": "+strerror(errno);
+    return false;
+  }
+  if (!S_ISREG(buff.st_mode) || !buff.st_size) {
+    this->error_ = this->metafile_+" is not a metainfo file";
+    return false;
+  }
   //if (buff.st_size > metainfo::MAX_SIZE_)
   //  error_handle(ERR_SIZE);
   size = (size_t)buff.st_size;
@@ -235,45 +316,82 @@ void metainfo::Parser()
   //open metainfo file
   fd = open(this->metafile_.c_str(), O_RDONLY);
   if (fd < 0) {
-    error_handle(ERR_SYS);
+    this->error_ = "cannot read "+this->metafile_+": "+strerror(errno);
+    return false;
   }
 
-  //map metainfo file into memory with read only permission
+  //map metainfo file into memory with read only permission,
+  //the mapping outlives the descriptor
   map_region = (char*)mmap(nullptr, size, PROT_READ, 
                            MAP_PRIVATE, fd, 0);
+  if (map_region == MAP_FAILED)
+    this->error_ = "cannot read "+this->metafile_+": "+strerror(errno);
 
-  if (map_region < (char*) 0) {
-    error_handle(ERR_SYS);
-  }
+  //close metainfo file
+  if (close(fd) < 0)
+    fail_handle(FAL_SYS);
+
+  if (map_region == MAP_FAILED)
+    return false;
 
   //generate metainfo be_node
   node = be_decoden(map_region, (long long)size);
-  if (!node || node->type != BE_DICT) {
-    error_handle(ERR_PARSE);
-  }
-
-  //parse metainfo from be_node
-  this->_dump_be_node(node, nullptr);
-
-  //hash info dictionary
-  this->_hash_info(map_region, size);
 
-  //compute the size of the last piece
-  this->last_size_ = 
-  this->file_size_%this->piece_length_;
+  //parse metainfo from be_node, info dictionary is hashed on the way
+  parsed = node && node->type == BE_DICT &&
+           this->_dump_be_node(node, nullptr);
 
   //clean be_node memory
-  be_free(node);
+  if (node)
+    be_free(node);
 
   //unmap file
-  if (munmap(map_region, size) < 0) {
-    error_handle(ERR_SYS);
-  }
+  if (munmap(map_region, size) < 0)
+    fail_handle(FAL_SYS);
 
-  //close metainfo file
-  if (close(fd) < 0) {
-    error_handle(ERR_SYS);
+  if (!parsed) {
+    this->error_ = "parse error: metainfo file are not well formatted";
+    return false;
   }
+
+  if (!this->validate())
+    return false;
+
+  //compute the size of the last piece,
+  //a file of whole pieces ends with a full piece
+  this->last_size_ = 
+  this->file_size_%this->piece_length_;
+  if (!this->last_size_)
+    this->last_size_ = this->piece_length_;
+  return true;
+}
+
+/**
+ * Check fields every torrent needs, piece hashes
+ * must cover the file exactly.
+ *
+ * Return: true if metainfo is usable, otherwise
+ *         error_ holds the reason
+ */
+bool metainfo::validate()
+{
+  if (this->info_raw_.empty())
+    this->error_ = "no info dictionary";
+  else if (this->filename_.empty())
+    this->error_ = "no file name";
+  else if (this->piece_length_ <= 0)
+    this->error_ = "invalid piece length";
+  else if (this->file_size_ <= 0)
+    this->error_ = "invalid file length";
+  else if (this->piece_num_ !=
+           (size_t)((this->file_size_-1)/this->piece_length_+1))
+    this->error_ = "piece hashes do not cover file length";
+  else if (this->announce_.empty() && this->announce_list_.empty())
+    this->error_ = "no announce URL";
+
+  if (!this->error_.empty())
+    this->error_ = "parse error: "+this->error_;
+  return this->error_.empty();
 }
 
 /**
@@ -281,27 +399,30 @@ void metainfo::Parser()
  *
  * @node: be_node to parse.
  * @key: field of metainfo, could be nullptr if not applicable.
+ * Return: false if a field is malformed
  */
-void metainfo::_dump_be_node(be_node* node, char* key)
+bool metainfo::_dump_be_node(be_node* node, char* key)
 {
-  string strval;  //bencode string value
+  size_t len;     //bencode string length
 
   switch (node->type) {
     case BE_STR:
       //extract announce, filename, piece hash
-      strval = string(node->val.s, (size_t)be_str_len(node));
+      len = (size_t)be_str_len(node);
       if(!strcmp(key, ANNOUNCE)) {
-        this->announce_ = strval;
+        this->announce_ = string(node->val.s, len);
       }
       else if (!strcmp(key, NAME)) {
-        this->filename_ = strval;
+        this->filename_ = string(node->val.s, len);
       }
       else if (!strcmp(key, PIECE)) {
-        while (strval.size()/SHA_DIGEST_LENGTH) {
-          this->piece_hash_.push_back(
-                 strval.substr(0, SHA_DIGEST_LENGTH));
-          strval = strval.substr(SHA_DIGEST_LENGTH);
-        }
+        //copy hashes into one table, trailing partial hash is dropped
+        delete[] this->piece_hash_;
+        this->piece_num_ = len/SHA_DIGEST_LENGTH;
+        this->piece_hash_ =
+          new unsigned char[this->piece_num_*SHA_DIGEST_LENGTH];
+        memcpy(this->piece_hash_, node->val.s,
+               this->piece_num_*SHA_DIGEST_LENGTH);
       }
       break;
 
@@ -316,43 +437,92 @@ void metainfo::_dump_be_node(be_node* node, char* key)
       break;
 
     case BE_LIST:
-      //shouldn't contain any list
-      error_handle(ERR_PARSE);
+      //only announce-list is understood, other lists are ignored
+      if (key && !strcmp(key, ANN_LIST))
+        return this->_dump_announce_list(node);
+      break;
 
     case BE_DICT:
+      //hash info dictionary over its exact source bytes
+      if (key && !strcmp(key, INFO))
+        this->_hash_info(node);
+
       //iterate through bencode dictionary
       for (int i = 0; node->val.d[i].val; ++i)
-        _dump_be_node(node->val.d[i].val, node->val.d[i].key);
+        if (!_dump_be_node(node->val.d[i].val, node->val.d[i].key))
+          return false;
       break;
   }
+  return true;
+}
+
+/**
+ * Extract tiers of announce-list, a list of lists of URLs.
+ * Empty tiers are dropped.
+ *
+ * @node: announce-list be_node
+ * Return: false if a tier is not a list of URLs
+ */
+bool metainfo::_dump_announce_list(be_node* node)
+{
+  be_node* tier;        //list of URLs in one tier
+  vector<string> urls;  //URLs of tier
+
+  for (int i = 0; node->val.l[i]; ++i) {
+    tier = node->val.l[i];
+    if (tier->type != BE_LIST)
+      return false;
+
+    urls.clear();
+    for (int j = 0; tier->val.l[j]; ++j) {
+      if (tier->val.l[j]->type != BE_STR)
+        return false;
+      urls.push_back(string(tier->val.l[j]->val.s,
+                            (size_t)be_str_len(tier->val.l[j])));
+    }
+
+    if (!urls.empty())
+      this->announce_list_.push_back(urls);
+  }
+  return true;
 }
 
 /**
- * Using SHA1 hash info dictionary.
+ * Using SHA1 hash info dictionary. The raw bytes of the
+ * dictionary are kept for later reuse, e.g. metadata
+ * exchange, without re-encoding.
  *
- * @meta_str: metainfo string.
- * @meta_len: length of metainfo string.
+ * @info: decoded info dictionary, carrying its source span.
  */
-void metainfo::_hash_info(char* meta_str, size_t meta_len)
+void metainfo::_hash_info(be_node* info)
 {
-  char* info_str;                            //info field string
   unsigned char hash_res[SHA_DIGEST_LENGTH]; //array of hash result
-  size_t info_len = 0;                       //info dictionary length
-  
-  //find position of info key
-  info_str = strstr(meta_str, INFO);
-  info_str += EXTRA_LEN;
 
-  //compute length of info dictionary
-  //subtract preceding bytes and trailing 'e'
-  info_len = ((meta_len-(info_str-meta_str))-TAIL_LEN)/sizeof(char);
+  //keep a copy of the raw info dictionary
+  this->info_raw_ = string(info->src, (size_t)info->src_len);
 
   //perform SHA1 hash on info dictionary
-  SHA1((unsigned char*)info_str, info_len, hash_res);
+  SHA1((const unsigned char*)info->src, (size_t)info->src_len, hash_res);
   this->info_hash_ = string(reinterpret_cast<char*>(hash_res),
                             SHA_DIGEST_LENGTH);
 }
 
+/**
+ * Print out bytes as 2 digits hexdecimal value per byte.
+ *
+ * @bytes: bytes to print out.
+ * @len: number of bytes.
+ */
+static void print_binary(const unsigned char* bytes, size_t len)
+{
+  //print 2 digits hexdecimal value for each byte
+  for(size_t i = 0; i < len; i++) {
+    cout << setfill('0') << setw(BYTE_DIGIT) <<
+         hex << ((unsigned int)(bytes[i]));
+  }
+  cout << dec << endl;
+}
+
 /**
  * Print out string as 2 digits hexdecimal value per byte.
  *
@@ -361,13 +531,6 @@ void metainfo::_hash_info(char* meta_str, size_t meta_len)
 static void print_binary(string str)
 {
   //string to unsigned char* conversion
-  const unsigned char* cstr =
-         reinterpret_cast<const unsigned char*>(str.c_str());
-
-  //print 2 digits hexdecimal value for each 20 byte hash byte
-  for(unsigned int i = 0; i < str.size(); i++) {
-    cout << setfill('0') << setw(BYTE_DIGIT) <<
-         hex << ((unsigned int)(cstr[i]));
-  }
-  cout << dec << endl;
+  print_binary(reinterpret_cast<const unsigned char*>(str.c_str()),
+               str.size());
 }
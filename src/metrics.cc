@@ -0,0 +1,284 @@
+/**
+ * Implementation of metrics registry.
+ *
+ * The registry is allocated once and never freed, so detached
+ * threads still running at exit record into valid memory.
+ *
+ */
+
+#include <metrics.h>
+#include <algorithm>   /* std::find() and std::min() */
+
+/***************** Constants *****************/
+static const double SEC_PER_NS = 1e-9;  /* seconds in a nanosecond */
+static const double SEC_PER_US = 1e-6;  /* seconds in a microsecond */
+
+//Metric names and help, same order as enums
+static const char* const COUNTER_NAME[] = {
+  "urtorrent_downloaded_bytes_total",
+  "urtorrent_uploaded_bytes_total",
+  "urtorrent_pieces_completed_total",
+  "urtorrent_hash_failures_total",
+  "urtorrent_chokes_total",
+  "urtorrent_unchokes_total",
+  "urtorrent_pex_peers_total",
+  "urtorrent_lsd_peers_total",
+  "urtorrent_super_seed_reveals_total",
+  "urtorrent_upload_requests_dropped_total",
+  "urtorrent_readahead_ranges_total",
+  "urtorrent_piece_cache_hits_total",
+  "urtorrent_piece_cache_misses_total"
+};
+static const char* const COUNTER_HELP[] = {
+  "Payload bytes downloaded from peers.",
+  "Payload bytes uploaded to peers.",
+  "Pieces downloaded and verified.",
+  "Pieces failed SHA-1 verification.",
+  "Peers choked by this client.",
+  "Peers unchoked by this client.",
+  "Peers connected after learning them from peer exchange.",
+  "Peers connected after finding them on local network.",
+  "Pieces revealed to peers one by one while super seeding.",
+  "Block requests dropped: peer choked, queue full or request cancelled.",
+  "Runs of adjacent pieces read ahead into the read cache by one read each.",
+  "Blocks uploaded from a piece in read cache.",
+  "Blocks whose piece was not in read cache."
+};
+static const char* const HISTOGRAM_NAME[] = {
+  "urtorrent_request_rtt_seconds",
+  "urtorrent_hash_seconds",
+  "urtorrent_block_write_seconds",
+  "urtorrent_piece_seconds"
+};
+static const char* const HISTOGRAM_HELP[] = {
+  "Time from block request to piece message.",
+  "Time to SHA-1 a downloaded piece.",
+  "Time to read a block into the mapped file.",
+  "Time from first request to verified piece."
+};
+static const char* const MESG_NAME[] = {
+  "choke", "unchoke", "interested", "not_interested", "have",
+  "bitfield", "request", "piece", "cancel", "keep_alive", "extended"
+};
+static const char* const DIRECTION_NAME[] = {"in", "out"};
+
+/**
+ * Constructor - zero every value
+ */
+metrics::Shard::Shard()
+{
+  for (int i = 0; i < COUNTER_NUM; i++)
+    this->counters[i] = 0;
+  for (int d = 0; d < DIRECTION_NUM; d++)
+    for (int i = 0; i < MESG_NUM; i++)
+      this->mesgs[d][i] = 0;
+  for (int h = 0; h < HISTOGRAM_NUM; h++) {
+    for (int i = 0; i < BUCKETS; i++)
+      this->buckets[h][i] = 0;
+    this->sums[h] = 0;
+  }
+}
+
+/**
+ * Constructor - register a shard for calling thread
+ */
+metrics::Local::Local()
+{
+  Registry* reg = registry();  //process wide registry
+
+  this->shard = new Shard();
+  lock_guard<mutex> lock(reg->lock);
+  reg->shards.push_back(this->shard);
+}
+
+/**
+ * Destructor - fold shard of exiting thread
+ * into retired shard
+ */
+metrics::Local::~Local()
+{
+  Registry* reg = registry();  //process wide registry
+
+  lock_guard<mutex> lock(reg->lock);
+  reg->shards.erase(find(reg->shards.begin(), reg->shards.end(),
+                         this->shard));
+  fold(reg->retired, *this->shard);
+  delete this->shard;
+}
+
+/**
+ * Increase a counter
+ *
+ * @c: counter
+ * @v: value to add
+ */
+void metrics::add(Counter c, long long v)
+{
+  bump(local()->counters[c], v);
+}
+
+/**
+ * Count a peer wire message
+ *
+ * @d: direction of message
+ * @id: message id, KEEP_ALIVE for keep alive,
+ *      EXTENDED for extended messages
+ */
+void metrics::mesg(Direction d, int id)
+{
+  //ignore unknown ids sent by peers
+  if (id < 0 || id >= MESG_NUM)
+    return;
+  bump(local()->mesgs[d][id], 1);
+}
+
+/**
+ * Record a duration into histogram
+ *
+ * @h: histogram
+ * @d: duration
+ */
+void metrics::observe(Histogram h, steady_clock::duration d)
+{
+  Shard* shard = local();  //shard of thread
+  long long ns;            //duration in ns
+  long long us;            //duration in us
+  int i = 0;               //bucket index
+
+  ns = duration_cast<nanoseconds>(d).count();
+  if (ns < 0)
+    ns = 0;
+
+  //bucket i holds durations below 2^i us
+  us = ns/1000;
+  if (us)
+    i = min(64-__builtin_clzll(us), BUCKETS-1);
+
+  bump(shard->buckets[h][i], 1);
+  bump(shard->sums[h], ns);
+}
+
+/**
+ * Write global metrics in Prometheus text format
+ *
+ * @os: output stream
+ */
+void metrics::write_text(ostream& os)
+{
+  Shard sum;          //sum of shards
+  long long count;    //cumulative bucket count
+
+  collect(sum);
+
+  for (int i = 0; i < COUNTER_NUM; i++) {
+    os << "# HELP " << COUNTER_NAME[i] << " " << COUNTER_HELP[i] << "\n"
+       << "# TYPE " << COUNTER_NAME[i] << " counter\n"
+       << COUNTER_NAME[i] << " " << sum.counters[i] << "\n";
+  }
+
+  os << "# HELP urtorrent_messages_total Peer wire messages by type.\n"
+     << "# TYPE urtorrent_messages_total counter\n";
+  for (int d = 0; d < DIRECTION_NUM; d++)
+    for (int i = 0; i < MESG_NUM; i++)
+      os << "urtorrent_messages_total{direction=\"" << DIRECTION_NAME[d]
+         << "\",type=\"" << MESG_NAME[i] << "\"} "
+         << sum.mesgs[d][i] << "\n";
+
+  for (int h = 0; h < HISTOGRAM_NUM; h++) {
+    os << "# HELP " << HISTOGRAM_NAME[h] << " " << HISTOGRAM_HELP[h] << "\n"
+       << "# TYPE " << HISTOGRAM_NAME[h] << " histogram\n";
+
+    count = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+      count += sum.buckets[h][i];
+      os << HISTOGRAM_NAME[h] << "_bucket{le=\"";
+      if (i == BUCKETS-1)
+        os << "+Inf";
+      else
+        os << (double)(1LL<<i)*SEC_PER_US;
+      os << "\"} " << count << "\n";
+    }
+    os << HISTOGRAM_NAME[h] << "_sum " << sum.sums[h]*SEC_PER_NS << "\n"
+       << HISTOGRAM_NAME[h] << "_count " << count << "\n";
+  }
+}
+
+/**
+ * Total value of a counter over every thread
+ *
+ * @c: counter
+ */
+long long metrics::total(Counter c)
+{
+  Shard sum;  //sum of shards
+
+  collect(sum);
+  return sum.counters[c];
+}
+
+/**
+ * Shard of calling thread, registered on first use
+ */
+metrics::Shard* metrics::local()
+{
+  static thread_local Local local;  //shard owner of thread
+
+  return local.shard;
+}
+
+/**
+ * Process wide registry
+ */
+metrics::Registry* metrics::registry()
+{
+  static Registry* reg = new Registry();  //never freed
+
+  return reg;
+}
+
+/**
+ * Increase a value written by one thread only,
+ * a plain load and store avoids a locked instruction.
+ *
+ * @v: value
+ * @n: increment
+ */
+void metrics::bump(atomic<long long>& v, long long n)
+{
+  v.store(v.load(memory_order_relaxed)+n, memory_order_relaxed);
+}
+
+/**
+ * Sum every live and retired shard
+ *
+ * @sum: zeroed shard to fill
+ */
+void metrics::collect(Shard& sum)
+{
+  Registry* reg = registry();  //process wide registry
+
+  lock_guard<mutex> lock(reg->lock);
+  fold(sum, reg->retired);
+  for (unsigned int i = 0; i < reg->shards.size(); i++)
+    fold(sum, *reg->shards[i]);
+}
+
+/**
+ * Add values of a shard into another
+ *
+ * @to: shard to add into
+ * @from: shard to add
+ */
+void metrics::fold(Shard& to, const Shard& from)
+{
+  for (int i = 0; i < COUNTER_NUM; i++)
+    to.counters[i] += from.counters[i].load(memory_order_relaxed);
+  for (int d = 0; d < DIRECTION_NUM; d++)
+    for (int i = 0; i < MESG_NUM; i++)
+      to.mesgs[d][i] += from.mesgs[d][i].load(memory_order_relaxed);
+  for (int h = 0; h < HISTOGRAM_NUM; h++) {
+    for (int i = 0; i < BUCKETS; i++)
+      to.buckets[h][i] += from.buckets[h][i].load(memory_order_relaxed);
+    to.sums[h] += from.sums[h].load(memory_order_relaxed);
+  }
+}
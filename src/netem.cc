@@ -0,0 +1,512 @@
+/**
+ * Implementation of class netem.
+ * See class defination: '../include/netem.h'
+ *
+ */
+
+#include <netem.h>
+#include <cmath>          /* pow() and ceil() */
+#include <cerrno>         /* errno */
+#include <sstream>        /* std::istringstream */
+#include <random>         /* std::random_device */
+#include <unistd.h>       /* close(), pipe(), read() and write() */
+#include <fcntl.h>        /* fcntl() */
+#include <poll.h>         /* poll() */
+#include <netinet/tcp.h>  /* TCP_NODELAY */
+#include <arpa/inet.h>    /* htonl() and htons() */
+#include <sys/socket.h>   /* socket syscalls */
+
+/************* Constants *************/
+static const string LATENCY = "latency";  /* one way delay key, ms */
+static const string RATE = "rate";        /* bandwidth key, KB/s */
+static const string BURST = "burst";      /* bucket size key, KB */
+static const string LOSS = "loss";        /* segment loss key, percent */
+static const int KB = 1024;               /* bytes in a kilobyte */
+
+/********** Internal Function **********/
+static void set_nonblock(int fd);
+
+/**
+ * Constructor - bind a listener per link and launch
+ * the service thread.
+ *
+ * @links: links to emulate
+ */
+netem::netem(const vector<Link>& links) : links_(links)
+{
+  random_device rd;  //seed of loss generator
+
+  this->seed_ = ((unsigned long long)rd() << 32) | rd() | 1;
+  this->bytes_ = 0;
+  this->losses_ = 0;
+
+  this->setup();
+
+  this->running_ = true;
+  this->worker_ = thread(&netem::run_service, this);
+}
+
+/**
+ * Destructor - stop service thread and close sockets
+ */
+netem::~netem()
+{
+  char byte = 0;  //wake up byte
+
+  this->running_ = false;
+  if (write(this->wake_[1], &byte, 1) < 0)
+    fail_handle(FAL_SYS);
+  this->worker_.join();
+
+  for (unsigned int i = 0; i < this->conns_.size(); i++)
+    this->drop(this->conns_[i]);
+  for (unsigned int i = 0; i < this->runtime_.size(); i++)
+    close(this->runtime_[i].fd);
+  close(this->wake_[0]);
+  close(this->wake_[1]);
+}
+
+/**
+ * Interface for retrieving bytes forwarded by all links
+ */
+long long netem::get_bytes()
+{
+  return this->bytes_;
+}
+
+/**
+ * Interface for retrieving number of segments lost
+ */
+long long netem::get_losses()
+{
+  return this->losses_;
+}
+
+/**
+ * Parse space separated settings, e.g.
+ * 'latency=50 rate=1024 loss=0.5', into shape.
+ * Keys absent from spec leave shape untouched.
+ *
+ * @spec: settings, latency in ms, rate and burst
+ *        in KB/s and KB, loss in percent
+ * @shape: shape to update
+ *
+ * Return: false on unknown key or invalid value
+ */
+bool netem::parse_shape(const string& spec, Shape& shape)
+{
+  istringstream in(spec);  //settings stream
+  string token;            //key=value token
+  string key;              //setting key
+  double val;              //setting value
+  size_t pos;              //position of '='
+
+  while (in >> token) {
+    pos = token.find('=');
+    if (pos == string::npos)
+      return false;
+
+    key = token.substr(0, pos);
+    try {
+      val = stod(token.substr(pos+1));
+    } catch (...) {
+      return false;
+    }
+    if (val < 0)
+      return false;
+
+    if (key == LATENCY)
+      shape.latency = (int)val;
+    else if (key == RATE)
+      shape.rate = (long long)(val*KB);
+    else if (key == BURST)
+      shape.burst = (long long)(val*KB);
+    else if (key == LOSS && val < 100)
+      shape.loss = val/100;
+    else
+      return false;
+  }
+
+  return true;
+}
+
+/**
+ * Bind listeners of links, every socket watched by
+ * service thread is non-blocking.
+ */
+void netem::setup()
+{
+  struct sockaddr_in addr = {};  //listening address
+  steady_clock::time_point now = steady_clock::now();
+  int yes = 1;                   //option val for setsockopt()
+
+  for (unsigned int i = 0; i < this->links_.size(); i++) {
+    Runtime rt;  //listener and buckets of link
+
+    rt.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (rt.fd < 0)
+      error_handle(ERR_SYS);
+    if (setsockopt(rt.fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)))
+      error_handle(ERR_SYS);
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(stoi(this->links_[i].port));
+    if (bind(rt.fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+        listen(rt.fd, netem::QUEUE_LEN_))
+      error_handle(ERR_BIND);
+    set_nonblock(rt.fd);
+
+    rt.down.tokens = rt.up.tokens = netem::bucket_size(this->links_[i].shape);
+    rt.down.refill = rt.up.refill = now;
+    this->runtime_.push_back(rt);
+  }
+
+  //self pipe to stop service thread
+  if (pipe(this->wake_))
+    error_handle(ERR_SYS);
+}
+
+/**
+ * Service thread job. Poll sockets a pipe may read from
+ * or is blocked on, and wake up in time for the earliest
+ * chunk release or bucket refill.
+ */
+void netem::run_service()
+{
+  vector<struct pollfd> fds;    //descriptors to poll
+  steady_clock::time_point now; //current time
+  steady_clock::time_point due; //earliest event
+  size_t base;                  //index of first connection socket
+  size_t nconn;                 //connections polled
+  long long wait;               //poll timeout in ms
+
+  while (this->running_) {
+    now = steady_clock::now();
+    due = now+milliseconds((int)netem::POLL_WAIT_);
+
+    for (unsigned int i = 0; i < this->runtime_.size(); i++) {
+      this->refill(this->runtime_[i].down, this->links_[i].shape, now);
+      this->refill(this->runtime_[i].up, this->links_[i].shape, now);
+    }
+
+    //wake up pipe, listeners and connections
+    fds.clear();
+    fds.push_back({this->wake_[0], POLLIN, 0});
+    for (unsigned int i = 0; i < this->runtime_.size(); i++)
+      fds.push_back({this->runtime_[i].fd, POLLIN, 0});
+
+    base = fds.size();
+    nconn = this->conns_.size();
+    for (unsigned int i = 0; i < nconn; i++) {
+      Conn* conn = this->conns_[i];
+      const Shape& shape = this->links_[conn->link].shape;
+      short ev_down;  //events of remote socket
+      short ev_up;    //events of target socket
+
+      ev_down = (this->can_read(conn->down, shape) ? POLLIN : 0) |
+                (conn->up.blocked ? POLLOUT : 0);
+      ev_up = (this->can_read(conn->up, shape) ? POLLIN : 0) |
+              (conn->down.blocked ? POLLOUT : 0);
+
+      //idle sockets are skipped, a hang up is seen on next read
+      fds.push_back({ev_down ? conn->down.from : -1, ev_down, 0});
+      fds.push_back({ev_up ? conn->up.from : -1, ev_up, 0});
+
+      due = min(due, this->next_event(conn->down, shape));
+      due = min(due, this->next_event(conn->up, shape));
+    }
+
+    wait = duration_cast<milliseconds>(due-now).count()+1;
+    if (poll(fds.data(), fds.size(), (int)max(0LL, wait)) < 0)
+      continue;
+
+    now = steady_clock::now();
+    for (unsigned int i = 0; i < this->runtime_.size(); i++) {
+      this->refill(this->runtime_[i].down, this->links_[i].shape, now);
+      this->refill(this->runtime_[i].up, this->links_[i].shape, now);
+    }
+
+    //move bytes of polled connections
+    for (unsigned int i = 0; i < nconn; i++) {
+      Conn* conn = this->conns_[i];
+      const Shape& shape = this->links_[conn->link].shape;
+      bool ok = true;  //connection healthy
+
+      if (fds[base+2*i].revents && this->can_read(conn->down, shape))
+        ok = this->fill(conn->down, shape, now);
+      if (ok && fds[base+2*i+1].revents && this->can_read(conn->up, shape))
+        ok = this->fill(conn->up, shape, now);
+      ok = ok && this->flush(conn->down, now) && this->flush(conn->up, now);
+
+      if (!ok || (conn->down.shut && conn->up.shut)) {
+        this->drop(conn);
+        this->conns_[i] = nullptr;
+      }
+    }
+
+    for (unsigned int i = 0; i < this->conns_.size(); )
+      if (!this->conns_[i])
+        this->conns_.erase(this->conns_.begin()+i);
+      else
+        i++;
+
+    //new connections
+    for (unsigned int i = 0; i < this->runtime_.size(); i++)
+      if (fds[1+i].revents & POLLIN)
+        this->accept_conn(i);
+  }
+}
+
+/**
+ * Accept pending connections of a link and connect
+ * each of them to the peer behind the link.
+ *
+ * @link: index of link
+ */
+void netem::accept_conn(int link)
+{
+  struct sockaddr_in addr = {};  //address of peer behind link
+  int remote;                    //accepted socket
+  int target;                    //socket to peer
+  int yes = 1;                   //option val for setsockopt()
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(stoi(this->links_[link].target));
+
+  while ((remote = accept(this->runtime_[link].fd, nullptr, nullptr)) >= 0) {
+    Conn* conn;  //new connection
+
+    //connect on loopback completes at once
+    target = socket(AF_INET, SOCK_STREAM, 0);
+    if (target < 0 ||
+        connect(target, (struct sockaddr*)&addr, sizeof(addr))) {
+      fail_handle(FAL_CONN, "127.0.0.1:"+this->links_[link].target);
+      if (target >= 0) close(target);
+      close(remote);
+      continue;
+    }
+
+    //chunks leave as released, not merged by Nagle
+    setsockopt(remote, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    setsockopt(target, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    set_nonblock(remote);
+    set_nonblock(target);
+
+    conn = new Conn();
+    conn->link = link;
+    conn->down.from = remote;
+    conn->down.to = target;
+    conn->down.bucket = &this->runtime_[link].down;
+    conn->up.from = target;
+    conn->up.to = remote;
+    conn->up.bucket = &this->runtime_[link].up;
+    this->conns_.push_back(conn);
+  }
+}
+
+/**
+ * Read bytes the bucket allows and queue them as a chunk.
+ * The chunk is released after link latency, plus a
+ * retransmission timeout if any of its segments is lost.
+ * Release times never decrease, so a loss stalls every
+ * later chunk of the direction.
+ *
+ * @pipe: direction to read
+ * @shape: link conditions
+ * @now: current time
+ *
+ * Return: false on socket error
+ */
+bool netem::fill(Pipe& pipe, const Shape& shape, steady_clock::time_point now)
+{
+  char buff[netem::BUFF_SIZE_];  //read buffer
+  size_t want = netem::BUFF_SIZE_; //bytes to read
+  ssize_t len;                   //bytes read
+  Chunk chunk;                   //queued chunk
+  double segs;                   //segments in chunk
+
+  if (shape.rate)
+    want = min(want, (size_t)pipe.bucket->tokens);
+
+  len = read(pipe.from, buff, want);
+  if (len < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+  if (len == 0) {
+    pipe.eof = true;
+    return true;
+  }
+
+  if (shape.rate)
+    pipe.bucket->tokens -= len;
+
+  chunk.release = now+milliseconds(shape.latency);
+  if (shape.loss > 0) {
+    segs = ceil((double)len/netem::MSS_);
+    if (this->uniform() < 1-pow(1-shape.loss, segs)) {
+      chunk.release += milliseconds(netem::MIN_RTO_+2*shape.latency);
+      this->losses_++;
+    }
+  }
+  chunk.release = max(chunk.release, pipe.last);
+  chunk.data.assign(buff, len);
+
+  pipe.last = chunk.release;
+  pipe.queued += len;
+  pipe.queue.push_back(move(chunk));
+  return true;
+}
+
+/**
+ * Write released chunks to target of pipe, pass on end of
+ * file once the queue is drained.
+ *
+ * @pipe: direction to write
+ * @now: current time
+ *
+ * Return: false on socket error
+ */
+bool netem::flush(Pipe& pipe, steady_clock::time_point now)
+{
+  ssize_t len;  //bytes written
+
+  pipe.blocked = false;
+  while (!pipe.queue.empty() && pipe.queue.front().release <= now) {
+    Chunk& head = pipe.queue.front();
+
+    len = send(pipe.to, head.data.data()+pipe.offset,
+               head.data.size()-pipe.offset, MSG_NOSIGNAL);
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        pipe.blocked = true;
+        break;
+      }
+      return false;
+    }
+
+    this->bytes_ += len;
+    pipe.offset += len;
+    if (pipe.offset == head.data.size()) {
+      pipe.queued -= head.data.size();
+      pipe.offset = 0;
+      pipe.queue.pop_front();
+    }
+  }
+
+  if (pipe.eof && pipe.queue.empty() && !pipe.shut) {
+    shutdown(pipe.to, SHUT_WR);
+    pipe.shut = true;
+  }
+  return true;
+}
+
+/**
+ * Figure out when pipe needs service without socket
+ * readiness: its head chunk is due or its bucket holds
+ * enough tokens again.
+ *
+ * @pipe: direction
+ * @shape: link conditions
+ *
+ * Return: time of next event, time_point::max() if none
+ */
+steady_clock::time_point netem::next_event(Pipe& pipe, const Shape& shape)
+{
+  steady_clock::time_point due = steady_clock::time_point::max();
+  double need;  //tokens missing
+
+  if (!pipe.queue.empty() && !pipe.blocked)
+    due = pipe.queue.front().release;
+
+  if (shape.rate && !pipe.eof && pipe.queued < (size_t)netem::QUEUE_CAP_) {
+    need = min((double)netem::MSS_, netem::bucket_size(shape))-pipe.bucket->tokens;
+    if (need > 0)
+      due = min(due, pipe.bucket->refill+
+                     microseconds((long long)(need*1e6/shape.rate)));
+  }
+
+  return due;
+}
+
+/**
+ * Check if pipe may read: source open, queue below
+ * its cap and at least a segment worth of tokens.
+ *
+ * @pipe: direction
+ * @shape: link conditions
+ */
+bool netem::can_read(Pipe& pipe, const Shape& shape)
+{
+  if (pipe.eof || pipe.queued >= (size_t)netem::QUEUE_CAP_)
+    return false;
+  if (!shape.rate)
+    return true;
+  return pipe.bucket->tokens >= min((double)netem::MSS_, netem::bucket_size(shape));
+}
+
+/**
+ * Add tokens earned since last refill, up to bucket size
+ *
+ * @bucket: bucket to refill
+ * @shape: link conditions
+ * @now: current time
+ */
+void netem::refill(Bucket& bucket, const Shape& shape,
+                   steady_clock::time_point now)
+{
+  double elapsed;  //seconds since last refill
+
+  if (!shape.rate)
+    return;
+
+  elapsed = duration_cast<duration<double>>(now-bucket.refill).count();
+  bucket.tokens = min(netem::bucket_size(shape), bucket.tokens+elapsed*shape.rate);
+  bucket.refill = now;
+}
+
+/**
+ * Bucket size of a link, BURST_MS_ worth of rate
+ * but at least a segment unless given.
+ *
+ * @shape: link conditions
+ */
+double netem::bucket_size(const Shape& shape)
+{
+  if (shape.burst)
+    return shape.burst;
+  return max((double)netem::MSS_, shape.rate*netem::BURST_MS_/1000.0);
+}
+
+/**
+ * Draw a uniform number in [0, 1) by xorshift64
+ */
+double netem::uniform()
+{
+  this->seed_ ^= this->seed_ << 13;
+  this->seed_ ^= this->seed_ >> 7;
+  this->seed_ ^= this->seed_ << 17;
+  return (this->seed_ >> 11)*(1.0/9007199254740992.0);
+}
+
+/**
+ * Close both sockets of a connection and release it
+ *
+ * @conn: connection to close
+ */
+void netem::drop(Conn* conn)
+{
+  close(conn->down.from);
+  close(conn->up.from);
+  delete conn;
+}
+
+/**
+ * Make a socket non-blocking
+ *
+ * @fd: socket
+ */
+static void set_nonblock(int fd)
+{
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
@@ -0,0 +1,254 @@
+/**
+ * Implementation of piece read cache.
+ * See class defination: '../include/piece_cache.h'
+ *
+ */
+
+#include <piece_cache.h>
+#include <algorithm>     /* std::max() */
+#include <vector>        /* std::vector */
+#include <metrics.h>     /* metrics registry */
+
+/**
+ * Constructor - split capacity over shards
+ * @capacity: bytes of pieces held
+ */
+piece_cache::piece_cache(long long capacity) : capacity_(capacity/SHARDS_)
+{
+}
+
+/**
+ * Look up a piece. A piece read again is moved to
+ * front of HOT, IN keeps its arrival order.
+ *
+ * @owner: torrent of piece
+ * @index: piece index
+ * Return: piece data, nullptr on miss
+ */
+piece_cache::Piece piece_cache::get(uint32_t owner, uint32_t index)
+{
+  Key key = piece_cache::key_of(owner, index);  //key of piece
+  Shard& s = this->shard_of(key);               //shard of piece
+
+  lock_guard<mutex> lock(s.lock);
+
+  auto it = s.entries.find(key);
+  if (it == s.entries.end() || it->second.queue == OUT) {
+    metrics::add(metrics::CACHE_MISSES, 1);
+    return nullptr;
+  }
+
+  if (it->second.queue == HOT)
+    s.hot.splice(s.hot.begin(), s.hot, it->second.pos);
+
+  metrics::add(metrics::CACHE_HITS, 1);
+  return it->second.data;
+}
+
+/**
+ * Keep a piece read from storage after a miss. A piece
+ * remembered by OUT was read again soon after eviction
+ * and enters HOT, any other piece enters IN.
+ *
+ * @owner: torrent of piece
+ * @index: piece index
+ * @data: piece data
+ */
+void piece_cache::put(uint32_t owner, uint32_t index, Piece data)
+{
+  Key key = piece_cache::key_of(owner, index);  //key of piece
+  Shard& s = this->shard_of(key);               //shard of piece
+  Queue q = IN;                                 //queue piece enters
+
+  //piece never fits shard
+  if (!this->fits(data->size()))
+    return;
+
+  lock_guard<mutex> lock(s.lock);
+
+  auto it = s.entries.find(key);
+  if (it != s.entries.end()) {
+    //filled by another reader meanwhile
+    if (it->second.queue != OUT)
+      return;
+    this->unlink(s, key);
+    q = HOT;
+  }
+
+  list<Key>& l = this->queue_of(s, q);
+  l.push_front(key);
+  s.entries[key] = {q, data, l.begin()};
+  (q == IN ? s.in_bytes : s.hot_bytes) += data->size();
+
+  this->evict(s);
+}
+
+/**
+ * Check if a piece is held without touching its
+ * queue or counting a hit or miss
+ *
+ * @owner: torrent of piece
+ * @index: piece index
+ */
+bool piece_cache::has(uint32_t owner, uint32_t index)
+{
+  Key key = piece_cache::key_of(owner, index);  //key of piece
+  Shard& s = this->shard_of(key);               //shard of piece
+
+  lock_guard<mutex> lock(s.lock);
+
+  auto it = s.entries.find(key);
+  return it != s.entries.end() && it->second.queue != OUT;
+}
+
+/**
+ * Forget every piece of a torrent removed from session,
+ * its memory goes back to other torrents at once
+ *
+ * @owner: torrent of pieces
+ */
+void piece_cache::drop(uint32_t owner)
+{
+  vector<Key> keys;  //keys of torrent in a shard
+
+  for (int i = 0; i < SHARDS_; i++) {
+    Shard& s = this->shards_[i];
+    lock_guard<mutex> lock(s.lock);
+
+    keys.clear();
+    for (auto it = s.entries.begin(); it != s.entries.end(); it++)
+      if (it->first >> 32 == owner)
+        keys.push_back(it->first);
+    for (unsigned int j = 0; j < keys.size(); j++)
+      this->unlink(s, keys[j]);
+  }
+}
+
+/**
+ * Check if a piece fits the share of a shard, a
+ * bigger piece is never held and never worth reading
+ * for the cache.
+ *
+ * @size: bytes of piece
+ */
+bool piece_cache::fits(long long size)
+{
+  return size <= this->capacity_;
+}
+
+/**
+ * Interface to get bytes of pieces held for a torrent
+ *
+ * @owner: torrent of pieces
+ */
+long long piece_cache::get_bytes(uint32_t owner)
+{
+  long long bytes = 0;  //bytes of torrent in every shard
+
+  for (int i = 0; i < SHARDS_; i++) {
+    Shard& s = this->shards_[i];
+    lock_guard<mutex> lock(s.lock);
+
+    for (auto it = s.entries.begin(); it != s.entries.end(); it++)
+      if (it->first >> 32 == owner && it->second.queue != OUT)
+        bytes += it->second.data->size();
+  }
+  return bytes;
+}
+
+/**
+ * Compose key of a piece
+ *
+ * @owner: torrent of piece
+ * @index: piece index
+ */
+piece_cache::Key piece_cache::key_of(uint32_t owner, uint32_t index)
+{
+  return (Key)owner << 32 | index;
+}
+
+/**
+ * Get shard of a key, pieces of a torrent and same
+ * pieces of torrents are spread over shards
+ *
+ * @key: key of piece
+ */
+piece_cache::Shard& piece_cache::shard_of(Key key)
+{
+  return this->shards_[((key >> 32)+key)%SHARDS_];
+}
+
+/**
+ * Get list of a queue
+ *
+ * @s: shard
+ * @q: queue
+ */
+list<piece_cache::Key>& piece_cache::queue_of(Shard& s, Queue q)
+{
+  if (q == IN)
+    return s.in;
+  if (q == HOT)
+    return s.hot;
+  return s.out;
+}
+
+/**
+ * Evict pieces until shard fits its capacity. IN gives
+ * back its oldest piece while over its share, the key is
+ * kept in OUT; otherwise least recently used piece of HOT
+ * is dropped. Shard lock is held.
+ *
+ * @s: shard
+ */
+void piece_cache::evict(Shard& s)
+{
+  Key key;              //piece evicted
+  long long size;       //bytes of piece evicted
+  size_t out_max;       //pieces OUT remembers
+
+  while (s.in_bytes+s.hot_bytes > this->capacity_) {
+    if (s.in_bytes > this->capacity_/IN_SHARE_ || s.hot.empty()) {
+      key = s.in.back();
+      Entry& e = s.entries[key];
+      size = e.data->size();
+
+      s.in.pop_back();
+      s.in_bytes -= size;
+      s.out.push_front(key);
+      e = {OUT, nullptr, s.out.begin()};
+
+      //forget oldest keys, OUT is sized in pieces
+      out_max = max(1LL, this->capacity_/size/OUT_SHARE_);
+      while (s.out.size() > out_max) {
+        s.entries.erase(s.out.back());
+        s.out.pop_back();
+      }
+    }
+    else {
+      key = s.hot.back();
+      s.hot_bytes -= s.entries[key].data->size();
+      s.hot.pop_back();
+      s.entries.erase(key);
+    }
+  }
+}
+
+/**
+ * Drop an entry from its queue and the shard.
+ * Shard lock is held.
+ *
+ * @s: shard
+ * @key: key of piece
+ */
+void piece_cache::unlink(Shard& s, Key key)
+{
+  Entry& e = s.entries[key];  //entry dropped
+
+  this->queue_of(s, e.queue).erase(e.pos);
+  if (e.queue == IN)
+    s.in_bytes -= e.data->size();
+  else if (e.queue == HOT)
+    s.hot_bytes -= e.data->size();
+  s.entries.erase(key);
+}
@@ -0,0 +1,176 @@
+/**
+ * Implementation of hierarchical token bucket rate limiter.
+ * See class defination: '../include/rate_limit.h'
+ *
+ */
+
+#include <rate_limit.h>
+#include <algorithm>   /* std::min() and std::max() */
+
+/***************** Constants *****************/
+static const double MS_PER_SEC = 1000;     /* milliseconds in a second */
+static const double US_PER_SEC = 1000000;  /* microseconds in a second */
+
+/**
+ * Constructor - empty bucket
+ *
+ * @parent: enclosing limit, nullptr for a top level limit
+ * @rate: bytes per second, 0 for unlimited
+ */
+rate_limit::rate_limit(rate_limit* parent, long long rate) : parent_(parent)
+{
+  this->rate_ = max(rate, 0LL);
+  this->bytes_ = 0;
+  this->tokens_ = 0;
+  this->refill_ = steady_clock::now();
+  this->next_ = 0;
+  this->serving_ = 0;
+}
+
+/**
+ * Set rate, waiters pick up the new rate at once
+ *
+ * @rate: bytes per second, 0 for unlimited
+ */
+void rate_limit::set_rate(long long rate)
+{
+  lock_guard<mutex> lock(this->lock_);
+
+  //tokens earned at the old rate are kept
+  this->refill(steady_clock::now());
+  this->rate_ = max(rate, 0LL);
+  this->cv_.notify_all();
+}
+
+/**
+ * Interface to get rate
+ */
+long long rate_limit::get_rate()
+{
+  lock_guard<mutex> lock(this->lock_);
+  return this->rate_;
+}
+
+/**
+ * Interface to get bytes passed
+ */
+long long rate_limit::get_bytes()
+{
+  lock_guard<mutex> lock(this->lock_);
+  return this->bytes_;
+}
+
+/**
+ * Wait for turn and tokens, then pass bytes on to parent.
+ * Waiting for the parent happens after this limit is released,
+ * so children of a parent queue there in arrival order.
+ *
+ * @bytes: bytes to send or receive
+ */
+void rate_limit::consume(long long bytes)
+{
+  {
+    unique_lock<mutex> lk(this->lock_);
+    unsigned long long ticket = this->next_++;  //turn of caller
+    steady_clock::time_point now;               //current time
+
+    //serve callers in arrival order
+    while (this->serving_ != ticket)
+      this->cv_.wait(lk);
+
+    //wait until bucket is out of debt
+    while (this->rate_) {
+      now = steady_clock::now();
+      this->refill(now);
+      if (this->tokens_ > 0)
+        break;
+
+      this->cv_.wait_until(lk, now+microseconds(
+        (long long)(-this->tokens_*US_PER_SEC/this->rate_)+1));
+    }
+
+    if (this->rate_)
+      this->tokens_ -= bytes;
+    this->bytes_ += bytes;
+
+    //next caller's turn
+    this->serving_++;
+    this->cv_.notify_all();
+  }
+
+  if (this->parent_)
+    this->parent_->consume(bytes);
+}
+
+/**
+ * Check if a caller would pass this limit without
+ * waiting, i.e. no caller is waiting and bucket is
+ * out of debt. Parents are not checked.
+ *
+ * Return: true if consume() passes this limit at once
+ */
+bool rate_limit::ready()
+{
+  lock_guard<mutex> lock(this->lock_);
+
+  if (this->serving_ != this->next_)
+    return false;
+  if (!this->rate_)
+    return true;
+
+  this->refill(steady_clock::now());
+  return this->tokens_ > 0;
+}
+
+/**
+ * Pass bytes through this limit and its parents when
+ * none would wait, otherwise nothing is taken. A level
+ * turning busy between check and take goes into debt
+ * by this request.
+ *
+ * @bytes: bytes to send or receive
+ * Return: true if bytes passed, false if caller retries later
+ */
+bool rate_limit::try_consume(long long bytes)
+{
+  for (rate_limit* l = this; l; l = l->parent_)
+    if (!l->ready())
+      return false;
+
+  for (rate_limit* l = this; l; l = l->parent_)
+    l->take(bytes);
+  return true;
+}
+
+/**
+ * Take bytes from bucket without waiting for turn
+ * @bytes: bytes to send or receive
+ */
+void rate_limit::take(long long bytes)
+{
+  lock_guard<mutex> lock(this->lock_);
+
+  if (this->rate_) {
+    this->refill(steady_clock::now());
+    this->tokens_ -= bytes;
+  }
+  this->bytes_ += bytes;
+}
+
+/**
+ * Add tokens earned since last refill, up to
+ * BURST_MS_ worth of rate. Lock must be held.
+ *
+ * @now: current time
+ */
+void rate_limit::refill(steady_clock::time_point now)
+{
+  double burst;   //bucket size in bytes
+  double earned;  //tokens earned since last refill
+
+  earned = duration_cast<duration<double>>(now-this->refill_).count()*
+           this->rate_;
+  burst = this->rate_*BURST_MS_/MS_PER_SEC;
+  this->tokens_ = min(this->tokens_+earned, burst);
+  this->refill_ = now;
+}
@@ -0,0 +1,173 @@
+/**
+ * Implementation of reactor.
+ * See class defination: '../include/reactor.h'
+ *
+ * Sockets are watched edge triggered, a connection reads and
+ * writes until the socket would block. A connection is only
+ * let go after the events taken with it are handled, it is
+ * deleted on the executor once let go.
+ *
+ */
+
+#include <reactor.h>
+#include <sys/epoll.h>      /* epoll_create1(), epoll_ctl() and epoll_wait() */
+#include <sys/eventfd.h>    /* eventfd() */
+#include <unistd.h>         /* read() and write() */
+#include <chrono>           /* std::chrono::steady_clock */
+#include <unordered_set>    /* std::unordered_set */
+#include <error_handle.h>   /* error_handle() and fail_handle() */
+#include <connection.h>     /* class connection */
+
+/**
+ * Constructor - create epoll set and launch reactor thread
+ */
+reactor::Service::Service()
+{
+  struct epoll_event ev = {};  //wake up event
+
+  this->epfd = epoll_create1(0);
+  this->wake = eventfd(0, EFD_NONBLOCK);
+  if (this->epfd < 0 || this->wake < 0)
+    error_handle(ERR_SYS);
+
+  //wake up eventfd is told by a null pointer
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  if (epoll_ctl(this->epfd, EPOLL_CTL_ADD, this->wake, &ev))
+    error_handle(ERR_SYS);
+
+  thread t_poll(&reactor::poll, this);
+  t_poll.detach();
+}
+
+/**
+ * Watch socket of a connection, its messages are
+ * handed to it from now on
+ *
+ * @conn: connection with socket set up
+ */
+void reactor::add(connection* conn)
+{
+  Service* svc = service();  //process wide reactor
+
+  {
+    lock_guard<mutex> lock(svc->lock);
+    svc->adding.push_back(conn);
+  }
+  reactor::wake();
+}
+
+/**
+ * Wake reactor to watch connections added and
+ * sweep connections stopped
+ */
+void reactor::wake()
+{
+  uint64_t one = 1;  //eventfd increment
+
+  if (write(service()->wake, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    fail_handle(FAL_SYS);
+}
+
+/**
+ * Process wide reactor, created on first use
+ */
+reactor::Service* reactor::service()
+{
+  static Service* svc = new Service();  //never freed
+
+  return svc;
+}
+
+/**
+ * Reactor thread job. Wait for sockets, hand events to
+ * connections and let go of connections stopped. Every
+ * connection is swept when woken or once every SWEEP_MS_.
+ *
+ * @svc: reactor of process
+ */
+void reactor::poll(Service* svc)
+{
+  struct epoll_event events[MAX_EVENTS_];  //events taken
+  struct epoll_event ev;                   //event of connection added
+  unordered_set<connection*> conns;        //connections watched
+  vector<connection*> added;               //connections to watch
+  vector<connection*> touched;             //connections to check
+  steady_clock::time_point swept;          //time of last sweep
+  steady_clock::time_point now;            //current time
+  connection* conn;                        //connection of event
+  uint64_t count;                          //wake ups
+  bool woken;                              //woken by eventfd
+  int ready;                               //events taken
+
+  swept = steady_clock::now();
+
+  while (true) {
+    ready = epoll_wait(svc->epfd, events, MAX_EVENTS_, SWEEP_MS_);
+    if (ready < 0) {
+      if (errno != EINTR)
+        fail_handle(FAL_SYS);
+      ready = 0;
+    }
+
+    //watch connections added meanwhile
+    {
+      lock_guard<mutex> lock(svc->lock);
+      added.swap(svc->adding);
+    }
+    for (unsigned int i = 0; i < added.size(); i++) {
+      conn = added[i];
+      ev = {};
+      ev.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+      ev.data.ptr = conn;
+      if (epoll_ctl(svc->epfd, EPOLL_CTL_ADD, conn->sock_, &ev)) {
+        fail_handle(FAL_SYS);
+        conn->running_ = false;
+      }
+      conns.insert(conn);
+      touched.push_back(conn);
+    }
+    added.clear();
+
+    //hand events to connections
+    woken = false;
+    for (int i = 0; i < ready; i++) {
+      if (!events[i].data.ptr) {
+        if (read(svc->wake, &count, sizeof(count)) < 0 && errno != EAGAIN)
+          fail_handle(FAL_SYS);
+        woken = true;
+        continue;
+      }
+
+      conn = (connection*)events[i].data.ptr;
+      if (events[i].events & (EPOLLOUT|EPOLLERR|EPOLLHUP))
+        conn->on_writable();
+      if (events[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLERR|EPOLLHUP))
+        conn->on_readable();
+      touched.push_back(conn);
+    }
+
+    //sweep silent, throttled and stopped connections
+    now = steady_clock::now();
+    if (woken || now-swept >= milliseconds((int)reactor::SWEEP_MS_)) {
+      swept = now;
+      for (auto it = conns.begin(); it != conns.end(); it++) {
+        (*it)->on_timer(now);
+        touched.push_back(*it);
+      }
+    }
+
+    //let go of stopped connections, they end on executor
+    for (unsigned int i = 0; i < touched.size(); i++) {
+      conn = touched[i];
+      if (conn->running_ || !conns.count(conn))
+        continue;
+
+      if (epoll_ctl(svc->epfd, EPOLL_CTL_DEL, conn->sock_, nullptr))
+        fail_handle(FAL_SYS);
+      conns.erase(conn);
+      conn->close();
+    }
+    touched.clear();
+  }
+}
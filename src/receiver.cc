@@ -5,56 +5,32 @@
  */
 
 #include <receiver.h>
-#include <sys/socket.h> /* socket syscalls*/
-#include <netdb.h>      /* getaddrinfo() and struct addrinfo */
 #include <core.h>       /* class core */
-
-/*** Constants ***/
-static const char* DELIM = ":";                   /* delimitor between ip and port */
+#include <connection.h> /* class connection */
+#include <executor.h>   /* work-stealing executor */
 
 /**
- * Constructor - initiate members and launch a
- * thread to communicate with peer
+ * Constructor - initiate members, peer is
+ * identified by its handshake
  *
- * @remote: ip:port of remote peer
+ * @conn: connection with peer
+ * @id: peer id
  * @core: urtorrent core component
  */
-receiver::receiver(string remote, core* core) : core_(core)
+receiver::receiver(connection* conn, string id,
+                   core* core) : conn_(conn),
+                                 core_(core),
+                                 limit_(&core->down_limit_,
+                                        core->peer_down_rate_)
 {
-  char buff[remote.size()+1] = {};  //ip:port char buffer
-  char* token;                      //buffer token pointer
-
-  //fill address buff
-  memcpy(buff, remote.c_str(), remote.size());
-
-  //set peer ip
-  token = strtok(buff, DELIM);
-  if (!token)
-    fail_handle(FAL_ADDR);
-  this->ip_ = string(token);
-
-  //set peer port
-  token = strtok(nullptr, DELIM);
-  if (!token)
-    fail_handle(FAL_ADDR);
-  this->port_ = string(token);
-
-  //init other members
+  //init members
   this->mi_ = this->core_->mi_;
   this->piece_ = 0;
   this->size_ = 0;
-  this->running_ = false;
-
-  //set up kepp alive time interval
-  this->tv_.tv_sec = core::ALIVE_PERD_;
-  this->tv_.tv_usec = 0;
 
-  //init a timer for sending keep alive
-  this->timer_ = new timer(&receiver::keep_alive, this);
-
-  //launch receiver thread
-  thread t_recv(&receiver::run, this);
-  t_recv.detach();
+  //allocate peer with bitfield initialized
+  this->peer_ = new peer(this->core_->bflen_);
+  this->peer_->id = id;
 }
 
 /**
@@ -62,47 +38,96 @@ receiver::receiver(string remote, core* core) : core_(core)
  */
 receiver::~receiver()
 {
-  close(this->sock_);
+  delete this->peer_;
 }
 
 /**
- * Receiver thread job, controll communication with peer
+ * Handle a message of downloading side, the message
+ * id is read, its payload is read here.
+ *
+ * @id: message id
+ * @size: payload size
+ * Return: true if requesting a block is permitted,
+ *         otherwise false.
  */
-void receiver::run()
+bool receiver::handle(char id, uint32_t size)
 {
-  //set status
-  this->running_ = true;
+  if (id == BIT_FIELD) {  //get bitfield message
+    //get bitfield from peer
+    if (!this->recv_bitfield(size))
+      goto _EXIT;
 
-  //establish TCP connection with peer
-  this->peer_connect();
+    //perform the rarest first
+    this->core_->rarest_first();
+  }
+  else if (id == UNCHOKE) {  //get unchoke message
+    //set peer unchoked
+    this->peer_->choking = false;
+    trace::record(trace::UNCHOKED, this->piece_);
+
+    //nothing to request yet
+    if (!this->peer_->interested)
+      goto _EXIT;
+
+    //add piece to requesting set
+    if (this->add_request_piece())
+      goto _EXIT;
+
+    //piece is being requested by another thread
+    //this thread can uninterested to that piece
+    this->send_uninterested();
+  }
+  else if (id == CHOKE) {  //get choke message
+    //set peer choked
+    this->peer_->choking = true;
 
-  //handshake with peer
-  if (!this->send_handshake())
-    goto _EXIT;
+    //remove requesting piece from set
+    this->remove_request_piece();
+  }
+  else if (id == PIECE) {  //receive block
+    //write block data to file
+    if (!this->download(size-(PIC_LEN-ID_LEN)))
+      goto _EXIT;
 
-  while (this->running_) {
-    
-    if (!this->mesg_handle()) continue;
+    //check if piece has been completely downloaded
+    if (!this->complete_piece())
+      goto _EXIT;
+    trace::record(trace::LAST_BLOCK, this->piece_);
 
-    if (!this->running_)
+    //validate downloaded piece
+    if (!this->validate_piece())
       goto _EXIT;
+    metrics::add(metrics::PIECES_DONE, 1);
+    metrics::observe(metrics::PIECE_TIME,
+                     steady_clock::now()-this->piece_time_);
+
+    //update local bitfield
+    if (!this->core_->update_bf(this->piece_))
+      this->conn_->stop();
+    else
+      trace::record(trace::BF_UPDATED, this->piece_);
+
+    //tell every peer, connections carry both directions
+    this->broadcast_have();
+    trace::record(trace::HAVE_SENT, this->piece_);
 
-    //check if client interested to peer
-    if (!this->peer_->interested) continue;
+    //done with piece, we are uninterested in peer for the moment.
+    this->send_uninterested();
 
-    //check if peer is choking client
-    if (this->peer_->choking) continue;
+    //perform rarest first
+    this->core_->rarest_first();
 
-    //client is interested in peer
-    //peer is not choking client
-    //we can download blocks of interested
-    //piece now.
-    this->send_request();
+    //change temporary file name when finish, connection
+    //is kept to upload to peer
+    if (this->core_->full_downloaded())
+      this->core_->name_target();
   }
 
-_EXIT:
-  close(this->sock_);
-  this->terminate();
+  //return and wait for message
+  return false;
+
+_EXIT: //return and to send requests
+  return true;
 }
 
 /**
@@ -123,8 +148,8 @@ void receiver::send_interested()
   memset(buff+PF_LEN, INTERESTED, ID_LEN);
 
   //send request to peer
-  if (write(this->sock_, buff, PF_LEN+ID_LEN) < 0)
-    fail_handle(FAL_SYS);
+  this->conn_->send(buff, PF_LEN+ID_LEN);
+  metrics::mesg(metrics::OUT, INTERESTED);
 }
 
 /**
@@ -136,293 +161,43 @@ peer* receiver::get_peer()
 }
 
 /**
- * Interface to retrieve peer's IP
+ * Interface to get download limit of peer
  */
-string receiver::get_ip()
+rate_limit* receiver::get_limit()
 {
-  return this->ip_;
+  return &this->limit_;
 }
 
 /**
- * Interface to set piece client to request
+ * Interface to get connection with peer
  */
-void receiver::set_piece(uint32_t p)
+connection* receiver::get_conn()
 {
-  this->piece_ = p;
+  return this->conn_;
 }
 
 /**
- * Establish a TCP connection with peer
+ * Interface to retrieve peer's IP
  */
-void receiver::peer_connect()
+string receiver::get_ip()
 {
-  struct addrinfo hint;           //address hint info
-  struct addrinfo *result, *rp;   //result for getaddrinfo()
-  int rv;                         //return val from getaddrinfo
-  string dest = this->ip_ +       //remote ip:port     
-                *DELIM +
-                this->port_;
-
-  memset(&hint, 0, sizeof(struct addrinfo));
-  
-  //set hint info
-  hint.ai_family = AF_INET;       //set for IPv4
-  hint.ai_socktype = SOCK_STREAM; //TCP connection
-  hint.ai_flags = AI_ADDRCONFIG;  //IPv4 configuration
-  hint.ai_protocol = 0;
-  
-  //retrieve peer address info to result
-  rv = getaddrinfo(this->ip_.c_str(), this->port_.c_str(), 
-                   &hint, &result);
-  if (rv != 0)
-    fail_handle(FAL_CONN, dest);
-  
-  //find address from result to establish connection
-  for (rp = result; rp != nullptr; rp = rp->ai_next) {
-    this->sock_ = socket(rp->ai_family, 
-                         rp->ai_socktype, 
-                         rp->ai_protocol);
-    if(this->sock_ == -1) 
-      continue;
-    if(connect(this->sock_, rp->ai_addr, 
-               rp->ai_addrlen) != -1)
-      break;
-    if(close(this->sock_) < 0) {
-      fail_handle(FAL_SYS);
-    }
-  }
-
-  if (rp == nullptr)
-    fail_handle(FAL_CONN, dest);
-  
-  //free result objects
-  freeaddrinfo(result);
-
-  //set read fd set
-  FD_ZERO(&this->rfds_);
-  FD_SET(this->sock_, &this->rfds_);
-  this->nfds_ = this->sock_+1;
+  return this->conn_->get_ip();
 }
 
 /**
- * Handshake with remote peer.
- *
- * Return: if handshake succeed return true, otherwise
- *         return false
- */
-bool receiver::send_handshake()
-{
-  char hs_mesg[HS_LEN] = {};  //handshake message buffer
-  char rt_hs[HS_LEN] = {};    //return handshake buffer
-  int rdsz;                   //data read size
-  string info_hash;           //info hash return by peer
-  string version;             //peer version
-  string peer_id;             //remote peer id
-
-  //construct handshake message
-  hs_message(hs_mesg, this->mi_->get_infohash(), 
-             this->mi_->get_peerid());
-
-  //send handshake to peer
-  if (write(this->sock_, hs_mesg, HS_LEN) < 0) {
-    fail_handle(FAL_SYS);
-    goto _FAIL;
-  }
-
-  //read return handshake
-  if ((rdsz = read(this->sock_, rt_hs, HS_LEN)) < 0) {
-    fail_handle(FAL_SYS);
-    goto _FAIL;
-  }
-
-  //connection closed by peer
-  if (!rdsz)
-    goto _FAIL;
-
-  //check peer's version
-  version = string(rt_hs+VERSION_OFFSET, VERSION_LEN);
-  if (version != string(HANDSHAKE)) {
-    fail_handle(FAL_HS);
-    goto _FAIL;
-  }
-
-  //check info hash
-  info_hash = string(rt_hs+HASH_OFFSET, SHA_DIGEST_LENGTH);
-  if (info_hash != this->mi_->get_infohash()) {
-    fail_handle(FAL_IHASH);
-    goto _FAIL;
-  }
-
-  //retrieve peer id in last 20 bytes
-  peer_id = string(rt_hs+HASH_OFFSET+SHA_DIGEST_LENGTH);
-
-  //allocate peer with bitfield initialized
-  this->peer_ = new peer(this->core_->bflen_);
-  this->peer_->id = peer_id;
- 
-  //create receiver hash map entry
-  if (!this->create_peer(peer_id))
-    goto _FAIL;
-
-  //send bitfield
-  this->send_bf();
-
-  return true;
-
-_FAIL:  //handshake failure return
-  return false;
-}
-
-/**
- * Create peer in <peer_id, receiver> hash map
- * @id: peer id;
- * Return true on success, otherwise false
+ * Interface to set piece client to request
  */
-bool receiver::create_peer(string id)
+void receiver::set_piece(uint32_t p)
 {
-  //acquire hash map writer lock
-  if (!acquire_writer(&this->core_->rmlock_))
-    goto _FAIL;
-
-  //add entry into hash map
-  this->core_->rmap_[id] = this;
-
-  //release hash map writer lock
-  if (!release_rwlock(&this->core_->rmlock_))
-    goto _FAIL;
-
-  return true;
-_FAIL:
-  return false;
+  this->piece_ = p;
 }
 
 /**
- * Handle incomming message sent by peer
- * Return: true if requesting a block is permitted,
- *         otherwise false.
+ * Interface to get piece client is requesting
  */
-bool receiver::mesg_handle()
+uint32_t receiver::get_piece()
 {
-  uint32_t mesg_size = 0;  //message size
-  int rdsz = 0;            //read size
-  int retval;              //return value from select()
-  char mesg_id = 0;        //buffer to store message id
-
-  //start keep alive count down
-  this->timer_->start(core::ALIVE_PERD_);
-
-  retval = select(this->nfds_, &this->rfds_, nullptr,
-                  nullptr, &this->tv_);
-
-  //stop timer
-  this->timer_->stop();
-
-  if (retval == -1) {  //select syscall failed
-    this->running_ = false;
-    fail_handle(FAL_SYS);
-    goto _EXIT;
-  }
-
-  if (!retval) {  //timeout
-    this->running_ = false;
-    goto _EXIT;
-  }
-
-  //fetch message size
-  if ((rdsz = read(this->sock_, &mesg_size, PF_LEN)) < 0) {   
-    fail_handle(FAL_SYS);
-    this->running_ = false;
-    goto _EXIT;
-  }
-
-  //connection closed by peer
-  if (!rdsz) {
-    this->running_ = false;
-    goto _EXIT;
-  }
-
-  //convert message size to local oreder
-  mesg_size = ntohl(mesg_size);
-
-  //check if it is keep-alive message
-  if (mesg_size == KEEP_ALIVE)
-    goto _EXIT;
-
-  //fetch message ID
-  if (read(this->sock_, &mesg_id, ID_LEN) < 0) {
-    fail_handle(FAL_SYS);
-    this->running_ = false;
-    goto _EXIT;
-  }
-
-  if (mesg_id == BIT_FIELD) {  //get bitfield message
-    //get bitfield from peer
-    if (!this->recv_bitfield(mesg_size-(uint32_t)ID_LEN))
-      goto _EXIT;
-
-    //perform the rarest first
-    this->core_->rarest_first();
-  }
-  else if (mesg_id == UNCHOKE) {  //get unchoke message
-    //set peer unchoked
-    this->peer_->choking = false;
-
-    //add piece to requesting set
-    if (this->add_request_piece())
-      goto _EXIT;
-
-    //piece is being requested by another thread
-    //this thread can uninterested to that piece
-    this->send_uninterested();
-  }
-  else if (mesg_id == CHOKE) {  //get choke message
-    //set peer choked
-    this->peer_->choking = true;
-
-    //remove requesting piece from set
-    this->remove_request_piece();
-  }
-  else if (mesg_id == PIECE) {  //receive block
-    //write block data to file
-    if (!this->download(mesg_size-PIC_LEN))
-      goto _EXIT;
-
-    //check if piece has been completely downloaded
-    if (!this->complete_piece())
-      goto _EXIT;
-
-    //validate downloaded piece
-    if (!this->validate_piece())
-      goto _EXIT;
-
-    //update local bitfield
-    if (!this->core_->update_bf(this->piece_))
-      this->running_ = false;
-
-    //sending have request to sender
-    send_have(this->sock_, this->piece_);
-
-    //done with piece, we are uninterested in peer for the moment.
-    this->send_uninterested();
-
-    //perform rarest first
-    this->core_->rarest_first();
-
-    //change temporary file name when finish
-    if (this->core_->full_downloaded()) {
-      this->core_->name_target();
-      this->running_ = false;
-    }
-  }
-  else if (mesg_id == HAVE) { //receive have message
-    this->do_update_pbf();
-  }
-
-  //return and wait for message
-  return false;
-
-_EXIT: //return and to send requests
-  return true;
+  return this->piece_;
 }
 
 /**
@@ -437,8 +212,14 @@ bool receiver::recv_bitfield(uint32_t size)
 {
   char* pbf = this->peer_->bitfield;  //peer bitfield buffer
 
+  //message must fit bitfield
+  if (size != (uint32_t)this->core_->bflen_) {
+    fail_handle(FAL_BIT);
+    goto _FAIL;
+  }
+
   //retrieve bitfield from peer
-  if (read(this->sock_, pbf, size) <= 0)
+  if (this->conn_->receive(pbf, size) != (ssize_t)size)
     goto _FAIL;
 
   //validate bitfield by checking spare bits
@@ -453,20 +234,23 @@ bool receiver::recv_bitfield(uint32_t size)
   return true;
 
 _FAIL:
-  this->running_ = false;
+  this->conn_->stop();
   return false;
 }
 
 /**
- * Send request for blocks to peer
+ * Send request for blocks to peer. Download limits
+ * not ready defer the request, reads of connection
+ * never wait on limits.
+ *
+ * Return: true if request is sent, false if deferred
  */
-void receiver::send_request()
+bool receiver::send_request()
 {
-  uint32_t len_prefix;   //length prefix in network order
-  uint32_t index;        //index in network order
-  uint32_t begin;        //begin offset of block in network order
-  uint32_t length;       //length to request in network order
-  int offset = 0;        //offset in request buffer          
+  uint32_t index;        //piece index
+  uint32_t begin;        //begin offset of block
+  uint32_t length;       //length to request
+  size_t len;            //message length
   char buff[REQ_LEN+PF_LEN] = {}; //request buffer
 
   //request block sequence after previously downloaded
@@ -478,37 +262,25 @@ void receiver::send_request()
     length = min(BLOCK_SIZE, this->core_->lplen_-begin);
   else
     length = BLOCK_SIZE;
-  this->size_ = length;
-
-  //convert integers to network order
-  len_prefix = htonl(REQ_LEN);
-  index = htonl(index);
-  begin = htonl(begin);
-  length = htonl(length);
 
-  //bytes: 3:0 length prefix
-  memcpy(buff, &len_prefix, PF_LEN);
-  offset += PF_LEN;
-
-  //byte: 4 request ID
-  memset(buff+offset, REQUEST, ID_LEN);
-  offset += ID_LEN;
-
-  //bytes: 8:5 piece index
-  memcpy(buff+offset, &index, IBL_LEN);
-  offset += IBL_LEN;
+  //pace requests by download limits, block arrives after
+  if (!this->limit_.try_consume(length))
+    return false;
+  this->size_ = length;
 
-  //bytes: 12:9 block begin offset
-  memcpy(buff+offset, &begin, IBL_LEN);
-  offset += IBL_LEN;
+  //piece latency counts from its first block
+  this->req_time_ = steady_clock::now();
+  if (!begin)
+    this->piece_time_ = this->req_time_;
+  trace::record(trace::REQUESTED, index, begin);
 
-  //bytes: 16:13 requested length
-  memcpy(buff+offset, &length, IBL_LEN);
-  offset += IBL_LEN;
+  //compose request
+  len = request_message(buff, index, begin, length);
 
   //send request
-  if (write(this->sock_, buff, offset) < 0)
-    fail_handle(FAL_SYS);
+  this->conn_->send(buff, len);
+  metrics::mesg(metrics::OUT, REQUEST);
+  return true;
 }
 
 /**
@@ -526,17 +298,28 @@ bool receiver::download(uint32_t size)
   microseconds dura;              //downloading duration
 
   //get piece from message
-  if (read(this->sock_, &piece, IBL_LEN) <= 0)
+  if (this->conn_->receive(&piece, IBL_LEN) != IBL_LEN)
     goto _FAIL;
 
   //get offset from message
-  if (read(this->sock_, &begin, IBL_LEN) <= 0)
+  if (this->conn_->receive(&begin, IBL_LEN) != IBL_LEN)
     goto _FAIL;
 
   //convert intergers to local order
   piece = ntohl(piece);
   begin = ntohl(begin);
 
+  //only the block requested is written to file
+  if (piece != this->piece_ || size != this->size_ ||
+      begin != this->core_->progress_[piece]) {
+    fail_handle(FAL_MESG);
+    goto _FAIL;
+  }
+
+  //piece message header arrived
+  metrics::observe(metrics::REQUEST_RTT,
+                   steady_clock::now()-this->req_time_);
+
   //retrieve block region
   block = find_block(begin);
 
@@ -544,23 +327,28 @@ bool receiver::download(uint32_t size)
   epoch = steady_clock::now();
 
   //download block to file region
-  if (read(this->sock_, block, size) <= 0)
+  if (this->conn_->receive(block, size) != (ssize_t)size)
     goto _FAIL;
 
   //compute download duration
   dura = duration_cast<microseconds>(steady_clock::now() - epoch);
+  metrics::observe(metrics::BLOCK_WRITE, dura);
 
   //get download rate
   this->peer_->rate = (size/(double)dura.count())*MIC_PER_SEC;
 
   //update progress
+  if (!this->core_->progress_[this->piece_])
+    trace::record(trace::FIRST_BLOCK, this->piece_, begin);
   this->core_->progress_[this->piece_] += this->size_;
   this->core_->update_dwn(this->size_);
+  this->peer_->bytes.fetch_add(this->size_, memory_order_relaxed);
+  metrics::add(metrics::BYTES_DOWN, this->size_);
 
   return true;
 
 _FAIL:
-  this->running_ = false;
+  this->conn_->stop();
   return false;
 }
 
@@ -616,10 +404,9 @@ void receiver::send_uninterested()
   memset(buff+PF_LEN, NO_INTERESTED, ID_LEN);
 
   //send request to peer
-  if (write(this->sock_, buff, PF_LEN+ID_LEN) < 0) {
-    fail_handle(FAL_SYS);
-    this->running_ = false;
-  }
+  if (!this->conn_->send(buff, PF_LEN+ID_LEN))
+    this->conn_->stop();
+  metrics::mesg(metrics::OUT, NO_INTERESTED);
 
   this->peer_->interested = false;
 }
@@ -660,8 +447,8 @@ bool receiver::complete_piece()
 }
 
 /**
- * Broadcast have message to other receivers
- * via local sender.
+ * Broadcast have message to every peer
+ * via its sender.
  */
 void receiver::broadcast_have()
 {
@@ -680,21 +467,6 @@ void receiver::broadcast_have()
   release_rwlock(&this->core_->smlock_);
 }
 
-/**
- * Update receiver's peer's bitfield
- */
-void receiver::do_update_pbf()
-{
-  uint32_t index;   //index to update
-
-  //read index
-  if (read(this->sock_, &index, IBL_LEN) <= 0)
-    return;
-
-  //perform update
-  update_pbf(&index, this->peer_->bitfield);
-}
-
 /**
  * Validate piece just donwloaded.
  * If the content is invalid, then the piece
@@ -706,20 +478,27 @@ bool receiver::validate_piece()
   unsigned char hash[SHA_DIGEST_LENGTH];  //buffer store piece hash
   unsigned int offset = 0;                //piece offset
   unsigned int length = 0;                //length of piece
+  steady_clock::time_point epoch;         //hash start time
 
   //get piece offset and length
   offset = this->piece_*this->core_->plen_;
   length = (this->piece_ == this->core_->pnum_-1) ? 
             this->core_->lplen_ : this->core_->plen_;
 
-  //compute SHA-1 hash of downloaded piece
-  SHA1(this->core_->file_+offset, length, hash);
+  //compute SHA-1 hash of downloaded piece on executor,
+  //hashing of every torrent shares its workers
+  trace::record(trace::HASH_START, this->piece_);
+  executor::run(executor::HASH, [&] {
+    epoch = steady_clock::now();
+    SHA1(this->core_->file_+offset, length, hash);
+    metrics::observe(metrics::HASH_TIME, steady_clock::now()-epoch);
+  });
+  trace::record(trace::HASH_END, this->piece_);
 
   //validate hash
-  if (string(reinterpret_cast<char*>(hash), 
-             SHA_DIGEST_LENGTH) == 
-      this->mi_->get_piecehash(this->piece_))
+  if (this->mi_->match_piecehash(this->piece_, hash))
     return true;
+  metrics::add(metrics::HASH_FAILS, 1);
 
   //piece is invalid, clear downloaded piece
   memset(this->core_->file_+offset, 0, length);
@@ -730,88 +509,3 @@ bool receiver::validate_piece()
 
   return false;
 }
-
-/**
- * Sending keep alive message to peer
- * @sock: socket to send message
- * Return: true when communication succeed, otherwise false.
- */
-void receiver::keep_alive()
-{
-  //send message
-  write(this->sock_, &KEEP_ALIVE, PF_LEN);
-
-  //start new countdown
-  this->timer_->start(core::ALIVE_PERD_);
-}
-
-/**
- * terminating receiver by clear related objects
- */
-void receiver::terminate()
-{
-  //delete timer
-  delete this->timer_;
-
-
-  //acquire piece count writer lock
-  if (!acquire_writer(&this->core_->pclock_))
-    return;
-
-  //decrease piece count
-  for (uint32_t i = 0; i < this->core_->pnum_; i++) {
-    if (this->core_->pcount_[i])
-      this->core_->pcount_[i]--;
-  }
-
-  //acquire receiver lock
-  if (!acquire_writer(&this->core_->rmlock_))
-    return;
-
-  //remove entry from receiver map
-  this->core_->rmap_.erase(this->peer_->id);
-
-  //delete peer
-  delete this->peer_;
-
-  //release lock
-  if (!release_rwlock(&this->core_->rmlock_))
-    return;
-
-  //release piece count lock
-  if (!release_rwlock(&this->core_->pclock_))
-    return;
-
-  //accquire peer address set lock
-  lock_guard<mutex> lock(this->core_->rslock_);
-
-  //remove record from peer address set
-  this->core_->pset_.erase(this->ip_+":"+this->port_);
-
-  //remove entry from receiver array
-  this->core_->receivers_.erase(this);
-
-  //keep downloading alive
-  this->core_->rarest_first();
-}
-
-void receiver::send_bf()
-{
-  uint32_t len = 1+this->core_->bflen_;
-  int offset = 0;
-  char buff[HD_LEN+this->core_->bflen_] = {}; //interested bitfield
-
-  //convert length to network order
-  len = htonl(len);
-
-  //construct buffer
-  memcpy(buff, &len, PF_LEN);
-  offset += PF_LEN;
-
-  memset(buff+offset, (int) BIT_FIELD, ID_LEN);
-  offset += ID_LEN;
-
-  //send request to peer
-  if (write(this->sock_, buff, HD_LEN+this->core_->bflen_) < 0)
-    fail_handle(FAL_SYS);
-}
@@ -5,83 +5,55 @@
 
 #include <sender.h>
 #include <core.h>       /* class core */
+#include <connection.h> /* class connection */
 
 /**
- * Constructor - initiate members and launch
- * a thread communicating with peer
- * @sock: client socket
- * @remote: client ip string
+ * Constructor - initiate members, peer is
+ * identified by its handshake
+ * @conn: connection with peer
+ * @id: peer id
  * @core: core component
  */
-sender::sender(int sock, string remote, 
-               core* core) : sock_(sock),
-                             ip_(remote),
-                             core_(core)
+sender::sender(connection* conn, string id,
+               core* core) : conn_(conn),
+                             core_(core),
+                             limit_(&core->up_limit_,
+                                    core->peer_up_rate_)
 {
   //init members
   this->mi_ = this->core_->mi_;
-  this->piece_ = 0;
-  this->begin_ = 0;
-  this->size_ = 0;
-  this->running_ = false;
-
-  //set up kepp alive time interval
-  this->tv_.tv_sec = core::ALIVE_PERD_;
-  this->tv_.tv_usec = 0;
-
-  //set up fd set
-  FD_ZERO(&this->rfds_);
-  FD_SET(this->sock_, &this->rfds_);
-  this->nfds_ = this->sock_+1;
-
-  //init a timer for sending keep alive
-  this->timer_ = new timer(&sender::keep_alive, this);
-
-  //launch sender thread
-  thread t_send(&sender::run, this);
-  t_send.detach();
+  this->deficit_ = 0;
+  this->queued_ = false;
+  this->choke_told_ = false;
+  this->last_up_ = steady_clock::now();
+
+  //create peer
+  this->peer_ = new peer(this->core_->bflen_);
+  this->peer_->id = id;
 }
 
 /**
- * Destructor
+ * Destructor - deallocate memory
  */
 sender::~sender()
 {
-  close(this->sock_);
+  delete this->peer_;
 }
 
 /**
- * Sender thread job, control communication
- * with peer
+ * Interface to get sender's peer
  */
-void sender::run()
+peer* sender::get_peer()
 {
-  //set status
-  this->running_ = true;
-
-  //waiting handshake
-  if (!this->recv_handshake())
-    goto _EXIT;
-
-  //send bitfield message
-  if (!this->send_bitfield())
-    goto _EXIT;
-
-  while (this->running_) {
-    req_handler();
-  }
-
-_EXIT:  //thread termination
-  close(this->sock_);
-  this->terminate();
+  return this->peer_;
 }
 
 /**
- * Interface to get sender's peer
+ * Interface to get connection with peer
  */
-peer* sender::get_peer()
+connection* sender::get_conn()
 {
-  return this->peer_;
+  return this->conn_;
 }
 
 /**
@@ -89,7 +61,15 @@ peer* sender::get_peer()
  */
 string sender::get_ip()
 {
-  return this->ip_;
+  return this->conn_->get_ip();
+}
+
+/**
+ * Interface to get upload limit of peer
+ */
+rate_limit* sender::get_limit()
+{
+  return &this->limit_;
 }
 
 /**
@@ -109,9 +89,12 @@ void sender::send_unchoke()
   //byte: 4, message ID
   memset(buff+PF_LEN, UNCHOKE, ID_LEN);
 
+  //peer is told again once choked again
+  this->choke_told_ = false;
+
   //send request to peer
-  if (write(this->sock_, buff, PF_LEN+ID_LEN) < 0)
-    fail_handle(FAL_SYS);
+  this->conn_->send(buff, PF_LEN+ID_LEN);
+  metrics::mesg(metrics::OUT, UNCHOKE);
 }
 
 /**
@@ -119,141 +102,35 @@ void sender::send_unchoke()
  */
 void sender::do_send_have(uint32_t index)
 {
-  send_have(this->sock_, index);
-}
-
-
-/**
- * Handle handshake request.
- * Receive incomming handshake and send back
- * a handshake message.
- * Return: true if handshake succeed, otherwise false
- */
-bool sender::recv_handshake()
-{
-  char hs_req[HS_LEN] = {};  //handshake request buffer
-  char hs_mesg[HS_LEN] = {}; //return handshake buffer
-  int rdsz;                  //data read size
-  string info_hash;          //info hash received
-  string version;            //peer's version
-  string peer_id;            //requesting peer's id
-
-  //fetch handshake message
-  if ((rdsz = read(this->sock_, hs_req, HS_LEN)) < 0) {
-    fail_handle(FAL_SYS);
-    goto _FAIL;
-  }
+  char buff[PF_LEN+HAV_LEN] = {};  //have message buffer
 
-  //connection closed by peer
-  if (!rdsz)
-    goto _FAIL;
-
-  //check peer version
-  version = string(hs_req+VERSION_OFFSET, VERSION_LEN);
-  if (version != string(HANDSHAKE)) {
-    fail_handle(FAL_HS);
-    goto _FAIL;
-  }
-
-  //skip 28 bytes to retrieve 20 bytes info hash
-  info_hash = string(hs_req+HASH_OFFSET, SHA_DIGEST_LENGTH);
-
-  //identify peer
-  if (info_hash != this->mi_->get_infohash()) {
-    fail_handle(FAL_IHASH);
-    goto _FAIL;
-  }
-
-  //retrieve peer id in last 20 bytes
-  peer_id = string(hs_req+HASH_OFFSET+SHA_DIGEST_LENGTH);
-
-  //create peer
-  this->peer_ = new peer(this->core_->bflen_);
-  this->peer_->id = peer_id;
-  
-  //add entry in sender hash map
-  if (!this->create_peer(peer_id))
-    goto _FAIL;
-
-  //generate return handshake
-  hs_message(hs_mesg, this->mi_->get_infohash(), 
-             this->mi_->get_peerid());
-
-  //send return handshake
-  if (write(this->sock_, hs_mesg, HS_LEN) < 0) {
-    close(this->sock_);
-    goto _FAIL;
-  }
-
-  return true;
-
-_FAIL: //return for failed handshake
-  return false;
+  this->conn_->send(buff, have_message(buff, index));
+  metrics::mesg(metrics::OUT, HAVE);
 }
 
 /**
- * Block waiting peer's request, the handle
- * of request is based on request types
- * defined in '../include/types.h'.
+ * Handle a message of uploading side, the message
+ * id is read, its payload is read here.
+ *
+ * @id: message id
+ * @size: payload size
  */
-void sender::req_handler()
+void sender::handle(char id, uint32_t size)
 {
-  uint32_t req_size;   //buffer size for request
-  int rdsz;            //data read size
-  int retval;          //return value from select()
-  char* req_buff;      //request buffer
-
-  //start keep alive count down
-  this->timer_->start(core::ALIVE_PERD_);
-
-  retval = select(this->nfds_, &this->rfds_, nullptr, 
-                  nullptr, &this->tv_);
-
-  //stop timer
-  this->timer_->stop();
-
-  if (retval == -1) {  //select syscall failed
-    this->running_ = false;
-    fail_handle(FAL_SYS);
-    return;
-  }
-
-  if (!retval) {  //timeout
-    this->running_ = false;
-    return;
-  }
-
-  //fetch request size
-  if ((rdsz = read(this->sock_, &req_size, PF_LEN)) < 0) {   
-    fail_handle(FAL_SYS);
-    this->running_ = false;
-    return;
-  }
-
-  //connection closed by peer
-  if (!rdsz) {
-    this->running_ = false;
-    return;
-  }
-
-  //convert request size to local order
-  req_size = ntohl(req_size);
-
-  //check if is keep-alive request
-  if (req_size == KEEP_ALIVE)
-    return;
+  char* req_buff;      //request payload buffer
+  Request req;         //block requested
 
   //allocate request buffer
-  req_buff = new char[req_size]();
+  req_buff = new char[size+1]();
 
   //fetch request
-  if (read(this->sock_, req_buff, req_size) < 0) {
+  if (this->conn_->receive(req_buff, size) != (ssize_t)size) {
     fail_handle(FAL_SYS);
-    this->running_ = false;
+    this->conn_->stop();
     goto _EXIT;
   }
 
-  if (*req_buff == INTERESTED) {  //get interested request
+  if (id == INTERESTED) {  //get interested request
     //set peer interested
     this->peer_->interested = true;
 
@@ -263,12 +140,14 @@ void sender::req_handler()
     //send unchoke message
     this->send_unchoke();
   }
-  else if (*req_buff == NO_INTERESTED) {  //get not interested request
+  else if (id == NO_INTERESTED) {  //get not interested request
     //acquire choked set lock
     this->core_->cklock_.lock();
 
     //remove peer from unchoked set
     this->core_->unchoked_.erase(this->peer_);
+    if (!this->peer_->choking)
+      metrics::add(metrics::CHOKES, 1);
 
     //set peer status to not interested and choked
     this->peer_->interested = false;
@@ -280,21 +159,28 @@ void sender::req_handler()
     //choke peer
     this->send_choke();
   }
-  else if (*req_buff == REQUEST) {  //get block request
-    //prepare sender to upload
-    this->prepare_upload(req_buff+ID_LEN);
-
-    //upload block to peer
-    this->upload();
-
-    //check if peer needs to be choked
-    if (this->peer_->choking)
+  else if (id == REQUEST) {  //get block request
+    //check requested block
+    if (!this->prepare_upload(req_buff, req)) {
+      fail_handle(FAL_MESG);
+      this->conn_->stop();
+      goto _EXIT;
+    }
+
+    //requests of choked peer are discarded, peer is told once
+    if (this->peer_->choking) {
+      metrics::add(metrics::UPLOAD_DROPS, 1);
       this->send_choke();
+      goto _EXIT;
+    }
+
+    //wait for turn of peer
+    if (!this->core_->queue_upload(this, req))
+      metrics::add(metrics::UPLOAD_DROPS, 1);
   }
-  else if (*req_buff == HAVE) { //get have request
-    //update peer's bitfield
-    update_pbf((uint32_t*) (req_buff+ID_LEN), 
-               this->peer_->bitfield);
+  else if (id == CANCEL) {  //get cancel of block request
+    parse_request(req_buff, req.piece, req.begin, req.size);
+    this->core_->cancel_upload(this, req);
   }
 
 _EXIT:
@@ -302,33 +188,6 @@ _EXIT:
   delete[] req_buff;
 }
 
-/**
- * Create an entry in <peer_id, sender> hash map
- * @id: peer id.
- * Return: true on success, otherwise false
- */
-bool sender::create_peer(string id)
-{
-  //acquire hash map writer lock
-  if (!acquire_writer(&this->core_->smlock_))
-    goto _FAIL;
-
-  //add entry in hash map
-  this->core_->smap_[id] = this;
-
-  //release hash map reader lock
-  if (!release_rwlock(&this->core_->smlock_)) {
-    //delete entry
-    this->core_->smap_.erase(id);
-
-    goto _FAIL;
-  }
-
-  return true;
-_FAIL:
-  return false;
-}
-
 /**
  * Tell peer which pieces this client has.
  * If the client doesn't have any piece,
@@ -347,18 +206,22 @@ bool sender::send_bitfield()
   }
 
   //don't send bitfield if no bit is set
-  if (bit_str == string(this->core_->pnum_, 0))
+  if (bit_str == string(this->core_->bflen_, 0))
     goto _SUCC;
 
+  //super seeding, peer is told pieces one by one
+  if (this->core_->super_) {
+    this->core_->reveal(this->peer_->id);
+    goto _SUCC;
+  }
+
   //compose bitfield message
   compose_bfmesg(mesg_buff);
 
   //send bitfield message to peer
-  if (write(this->sock_, mesg_buff, 
-            HD_LEN+this->core_->bflen_) < 0) {
-    fail_handle(FAL_SYS);
+  if (!this->conn_->send(mesg_buff, HD_LEN+this->core_->bflen_))
     goto _FAIL;
-  }
+  metrics::mesg(metrics::OUT, BIT_FIELD);
     
 _SUCC:  //return for succeed communication
   return true;
@@ -416,6 +279,7 @@ bool sender::need_unchoke()
 
     //add peer into unchoked set
     this->core_->unchoked_.insert(this->peer_);
+    metrics::add(metrics::UNCHOKES, 1);
     return true;
   }
 
@@ -424,13 +288,17 @@ bool sender::need_unchoke()
 }
 
 /**
- * Compose and send choke message to peer.
+ * Compose and send choke message to peer, a peer
+ * already told since its last unchoke is skipped.
  */
 void sender::send_choke()
 {
   uint32_t mesg_size;                 //message size in network order
   char mesg_buff[PF_LEN+ID_LEN] = {}; //message buffer
 
+  if (this->choke_told_.exchange(true))
+    return;
+
   //convert length prefix to network order
   mesg_size = htonl(COMM_LEN);
 
@@ -441,165 +309,125 @@ void sender::send_choke()
   memset(mesg_buff+PF_LEN, CHOKE, ID_LEN);
 
   //send message to peer
-  if (write(this->sock_, mesg_buff, PF_LEN+ID_LEN) < 0)
-    fail_handle(FAL_SYS);
+  this->conn_->send(mesg_buff, PF_LEN+ID_LEN);
+  metrics::mesg(metrics::OUT, CHOKE);
 }
 
 /**
- * Set sender status for requested piece
+ * Parse a block request and check it
  * @buff: block request buffer
+ * @req: block requested
+ * Return: true if block lies in a piece, otherwise false
  */
-void sender::prepare_upload(char* buff)
+bool sender::prepare_upload(char* buff, Request& req)
 {
-  int offset = 0;   //offset in request buffer
+  uint64_t plen;  //length of requested piece
 
-  //retrieve piece index
-  memcpy(&this->piece_, buff, IBL_LEN);
-  offset += IBL_LEN;
+  //retrieve piece index, block offset and block size
+  parse_request(buff, req.piece, req.begin, req.size);
 
-  //convert piece index to locl order
-  this->piece_ = ntohl(this->piece_);
+  //block must lie in a piece of file
+  if (req.piece >= this->core_->pnum_)
+    return false;
+  plen = (req.piece == this->core_->pnum_-1) ?
+         this->core_->lplen_ : this->core_->plen_;
+  if ((uint64_t)req.begin+req.size > plen)
+    return false;
 
-  //retrieve block offset
-  memcpy(&this->begin_, buff+offset, IBL_LEN);
-  offset += IBL_LEN;
-
-  //convert block offset to local order
-  this->begin_ = ntohl(this->begin_);
-
-  //retrieve block size
-  memcpy(&this->size_, buff+offset, IBL_LEN);
-
-  //convert block size to local order
-  this->size_ = ntohl(this->size_);
+  return true;
+}
 
-  //update upload progress
-  this->core_->update_upl(this->size_);
+/**
+ * Check if peer takes a block now, i.e. the peer's
+ * own limit has tokens and its connection sent every
+ * byte queued before. Limits of torrent and process
+ * are checked when the block is sent.
+ *
+ * Return: true if peer is served in this round
+ */
+bool sender::ready()
+{
+  return this->limit_.ready() && this->conn_->writable();
 }
 
 /**
- * Upload a requested block to peer by
- * sending piece request.
+ * Upload a requested block to peer by sending piece
+ * message. Nothing waits: limits without tokens refuse
+ * the block, bytes the socket does not take now stay
+ * queued in the connection.
+ *
+ * @req: block requested
+ * Return: true if block was sent or connection is gone,
+ *         false if limits refuse it now
  */
-void sender::upload()
+bool sender::upload(const Request& req)
 {
   uint32_t mesg_size = 0; //size of message
-  uint32_t index = 0;     //piece index
-  uint32_t begin = 0;     //block offset   
   char* buff = nullptr;   //message buffer
-  unsigned char* block = nullptr;  //pointer to block data
-  int offset = 0;         //offset in message buffer
+  const unsigned char* block = nullptr;  //pointer to block data
+  piece_cache::Piece piece; //cached piece holding block
 
-  time_point<steady_clock> epoch; //upload start time
-  microseconds dura;              //upload duration
+  time_point<steady_clock> now;  //upload time
+  microseconds dura;             //time since last block
 
   //compute message size
-  mesg_size = PF_LEN + PIC_LEN + this->size_;
+  mesg_size = PF_LEN + PIC_LEN + req.size;
+
+  //take upload tokens before reading block
+  if (!this->limit_.try_consume(mesg_size))
+    return false;
 
   //allocate message buffer
   buff = new char[mesg_size]();
 
   //find block data
-  block = this->find_block(this->begin_);
-
-  //convert integers to network order
-  mesg_size = htonl(mesg_size);
-  index = htonl(this->piece_);
-  begin = htonl(this->begin_);
-
-  //bytes: 3:0 prefix length
-  memcpy(buff, &mesg_size, PF_LEN);
-  offset += PF_LEN;
-
-  //byte: 4 message id
-  memset(buff+offset, PIECE, ID_LEN);
-  offset += ID_LEN;
-
-  //bytes: 8:5 piece index
-  memcpy(buff+offset, &index, IBL_LEN);
-  offset += IBL_LEN;
-
-  //bytes: 12:9 block offset
-  memcpy(buff+offset, &begin, IBL_LEN);
-  offset += IBL_LEN;
+  block = this->find_block(req, piece);
 
-  //bytes: L:13 block data
-  memcpy(buff+offset, block, this->size_);
-  offset += this->size_;
-
-  //record upload start time
-  epoch = steady_clock::now();
+  //compose piece message
+  mesg_size = piece_message(buff, req.piece, req.begin,
+                            block, req.size);
 
   //send block to peer
-  if (write(this->sock_, buff, PF_LEN + PIC_LEN + this->size_) < 0)
-    fail_handle(FAL_SYS);
-
-  //compute upload duration
-  dura = duration_cast<microseconds>(steady_clock::now()-epoch);
+  if (this->conn_->send(buff, mesg_size)) {
+    this->core_->update_upl(req.size);
+    this->peer_->bytes.fetch_add(req.size, memory_order_relaxed);
+    metrics::add(metrics::BYTES_UP, req.size);
+    metrics::mesg(metrics::OUT, PIECE);
+  }
 
-  //get rate
-  this->peer_->rate = ((PF_LEN + PIC_LEN + this->size_)/
-                       (double)dura.count()) * MIC_PER_SEC;
+  //get rate over time since last block
+  now = steady_clock::now();
+  dura = duration_cast<microseconds>(now-this->last_up_);
+  this->last_up_ = now;
+  if (dura.count() > 0)
+    this->peer_->rate = (mesg_size/(double)dura.count()) * MIC_PER_SEC;
 
   //clean memory
   delete[] buff;
+  return true;
 }
 
 /**
- * Find location of block data
- * @offset: block offset in piece
+ * Find location of block data, read cache is
+ * consulted before the mapped file
+ *
+ * @req: block requested
+ * @piece: cached piece holding block, kept while block is used
  * Return: pointer to block
  */
-unsigned char* sender::find_block(uint32_t offset)
+const unsigned char* sender::find_block(const Request& req,
+                                        piece_cache::Piece& piece)
 {
-  unsigned char* block = nullptr;  //pointer to block
+  const unsigned char* block = nullptr;  //pointer to block
+
+  piece = this->core_->read_piece(req.piece);
+  if (piece)
+    return (const unsigned char*)piece->data()+req.begin;
 
   //adding offset to block
   block = this->core_->file_ + 
           this->mi_->get_piece_size() * 
-          this->piece_ + offset;
+          req.piece + req.begin;
 
   return block;
 }
-
-/**
- * Sending keep alive message to peer
- * @sock: socket to send message
- * Return: true when communication succeed, otherwise false.
- */
-void sender::keep_alive()
-{
-  //send message
-  write(this->sock_, &KEEP_ALIVE, PF_LEN);
-
-  //start new countdown
-  this->timer_->start(core::ALIVE_PERD_);
-}
-
-/**
- * terminating sender by clean associated objects
- */
-void sender::terminate()
-{
-  delete this->timer_;
- 
-  //acquire sender lock
-  if (!acquire_writer(&this->core_->smlock_))
-    return;
-
-  //remove self from sender map
-  this->core_->smap_.erase(this->peer_->id);
-
-  //clean memory
-  delete this->peer_;
-
-  //relase lock
-  if (!release_rwlock(&this->core_->smlock_))
-    return;
-
-  //acquire lock to access sender set
-  lock_guard<mutex>(this->core_->sslock_);
-
-  //remove entry from sender set
-  this->core_->senders_.erase(this);
-}
@@ -99,3 +99,11 @@ int server::accept_peer(string& ip)
 
 	return newsockfd;
 }
+
+/**
+ * Interface to get listening socket
+ */
+int server::get_sock()
+{
+	return this->sockfd_;
+}
@@ -0,0 +1,785 @@
+/**
+ * Implementation of session hosting many torrents.
+ * See class defination: '../include/session.h'
+ *
+ * A connection is counted against the budget from accept until
+ * the connection terminates.
+ *
+ */
+
+#include <session.h>
+#include <executor.h> /* work-stealing executor */
+#include <fstream>   /* std::ofstream */
+#include <sstream>   /* std::ostringstream */
+#include <cstdio>    /* rename() */
+#include <map>       /* std::map */
+#include <poll.h>    /* poll() */
+#include <fcntl.h>   /* fcntl() */
+
+/***************** Constants *****************/
+static const string TMP_SUFFIX = ".tmp";  /* metrics file being written */
+static const int POLL_MS = 1000;          /* dispatcher wakes to drop silent peers */
+static const char* const JOB_CLASS[] = {  /* label of executor job classes */
+  "net", "hash", "disk"
+};
+
+/********** Internal Function **********/
+static string tracker_key(metainfo* mi);
+
+/**
+ * Constructor - setup curl environment shared by tracker agents,
+ * bind listening port, launch dispatcher thread, render first
+ * snapshot and start the maintenance timer which timeout every 10s.
+ *
+ * @port: port to listen on
+ * @advert: port announced to trackers
+ * @metrics_file: file snapshot is written to on every timeout
+ */
+session::session(string port, string advert,
+                 string metrics_file) : advert_(advert),
+                                        metrics_file_(metrics_file),
+                                        lsd_(nullptr),
+                                        running_(true),
+                                        conns_(0),
+                                        max_conns_(0),
+                                        dumping_(false),
+                                        super_seed_(false),
+                                        cache_size_(0),
+                                        cache_(nullptr),
+                                        owners_(0)
+{
+  //setup curl global environment once for every torrent
+  if (curl_global_init(CURL_GLOBAL_ALL))
+    error_handle(ERR_CURL);
+
+  //establish P2P server
+  this->server_ = new server(port);
+
+  //launch a dispatcher thread
+  this->dispatcher_ = thread(&session::dispatch, this);
+
+  //stats readable before first timeout
+  this->dump_metrics();
+
+  //register a timer with session::timeout as handler
+  this->timer_ = new timer(&session::timeout, this);
+  this->timer_->start(core::TO_UNIT_);
+}
+
+/**
+ * Destructor - stop timer and dispatcher, stop and
+ * clean up torrents
+ */
+session::~session()
+{
+  delete this->timer_;
+  delete this->lsd_;
+
+  //no connection is routed to torrents deleted below
+  this->running_ = false;
+  this->dispatcher_.join();
+
+  //wait for metrics dump
+  while (this->dumping_)
+    this_thread::yield();
+
+  for (unsigned int i = 0; i < this->torrents_.size(); i++) {
+    this->stop(this->torrents_[i]->pwp);
+    delete this->torrents_[i]->pwp;
+    delete this->torrents_[i]->agent;
+    delete this->torrents_[i]->mi;
+    delete this->torrents_[i];
+  }
+
+  delete this->server_;
+  delete this->cache_;
+
+  //clean curl environment
+  curl_global_cleanup();
+}
+
+/**
+ * Add a torrent, announce it and start its peer
+ * connections. A torrent already hosted or being
+ * added by another thread is not added again.
+ *
+ * The info hash is routed before the first announce,
+ * peers arriving before the core is built wait in
+ * waiting_ and are handed over once it is.
+ *
+ * @torrent: metainfo file
+ * @reason: failure reason
+ * Return: index of torrent, -1 if metainfo is malformed
+ *         or no tracker replied
+ */
+int session::add(string torrent, string& reason)
+{
+  Torrent* t = new Torrent();  //torrent components
+  int index;                   //index of torrent
+  string hash;                 //info hash of torrent
+  vector<Waiting> early;       //peers arrived while adding
+
+  //generate metainfo, tracker learns the advertised port
+  t->mi = new metainfo(torrent, this->advert_);
+  if (!t->mi->valid()) {
+    reason = t->mi->get_error();
+    delete t->mi;
+    delete t;
+    return -1;
+  }
+  hash = t->mi->get_infohash();
+
+  {
+    unique_lock<mutex> lock(this->lock_);
+    while (true) {
+      for (unsigned int i = 0; i < this->torrents_.size(); i++) {
+        if (this->torrents_[i]->mi->get_infohash() == hash) {
+          delete t->mi;
+          delete t;
+          return i;
+        }
+      }
+
+      //same torrent being added by another thread
+      if (!this->routes_.count(hash))
+        break;
+      this->added_.wait(lock);
+    }
+    this->routes_[hash] = nullptr;
+  }
+
+  //launch tracker agent, nothing can be done without any tracker
+  t->agent = new tracker_agent(t->mi);
+  if (!t->agent->start()) {
+    reason = "tracker not responding";
+    this->drop_waiting(hash);
+    delete t->agent;
+    delete t->mi;
+    delete t;
+    return -1;
+  }
+
+  //fire core functionality
+  t->pwp = new core(this, t->mi, t->agent);
+
+  //route incoming peers of torrent
+  {
+    lock_guard<mutex> lock(this->lock_);
+    this->torrents_.push_back(t);
+    this->routes_[hash] = t->pwp;
+    index = this->torrents_.size()-1;
+    early.swap(this->waiting_[hash]);
+    this->waiting_.erase(hash);
+  }
+  this->added_.notify_all();
+
+  //connections give themselves back to budget
+  for (unsigned int i = 0; i < early.size(); i++)
+    t->pwp->accept_peer(early[i].sock, early[i].ip, early[i].hs);
+
+  //stats show torrent before next timeout
+  this->refresh(true);
+  return index;
+}
+
+/**
+ * Unroute a torrent whose adding failed, peers waiting
+ * for it are closed and given back to budget.
+ *
+ * @infohash: info hash of torrent
+ */
+void session::drop_waiting(const string& infohash)
+{
+  vector<Waiting> early;  //peers arrived while adding
+
+  {
+    lock_guard<mutex> lock(this->lock_);
+    this->routes_.erase(infohash);
+    early.swap(this->waiting_[infohash]);
+    this->waiting_.erase(infohash);
+  }
+  this->added_.notify_all();
+
+  for (unsigned int i = 0; i < early.size(); i++) {
+    close(early[i].sock);
+    this->release_conn();
+  }
+}
+
+/**
+ * Stop and remove a torrent. The torrent is unrouted first,
+ * then its connections are shut down and awaited, it is
+ * deleted once no timeout or metrics dump drives it.
+ *
+ * @index: torrent index
+ */
+void session::remove(int index)
+{
+  Torrent* t;  //torrent removed
+
+  {
+    lock_guard<mutex> lock(this->lock_);
+    t = this->torrents_[index];
+    this->torrents_.erase(this->torrents_.begin()+index);
+    this->routes_.erase(t->mi->get_infohash());
+  }
+
+  this->stop(t->pwp);
+
+  {
+    //wait for timeout and dump still holding torrent
+    lock_guard<mutex> lock(this->drive_);
+    delete t->pwp;
+    delete t->agent;
+    delete t->mi;
+    delete t;
+  }
+
+  this->refresh(true);
+}
+
+/**
+ * Pause a torrent and wait until every connection
+ * of it terminates on the executor.
+ *
+ * @pwp: core of torrent
+ */
+void session::stop(core* pwp)
+{
+  pwp->pause();
+
+  while (true) {
+    {
+      lock_guard<mutex> lock(pwp->cnlock_);
+      if (pwp->conns_.empty())
+        break;
+    }
+    this_thread::sleep_for(milliseconds((int)session::STOP_WAIT_));
+  }
+}
+
+/**
+ * Interface to get number of torrents
+ */
+int session::size()
+{
+  lock_guard<mutex> lock(this->lock_);
+  return this->torrents_.size();
+}
+
+/**
+ * Interface to get core of a torrent
+ * @index: torrent index
+ */
+core* session::get_core(int index)
+{
+  lock_guard<mutex> lock(this->lock_);
+  return this->torrents_[index]->pwp;
+}
+
+/**
+ * Interface to get metainfo of a torrent
+ * @index: torrent index
+ */
+metainfo* session::get_meta(int index)
+{
+  lock_guard<mutex> lock(this->lock_);
+  return this->torrents_[index]->mi;
+}
+
+/**
+ * Interface to get tracker agent of a torrent
+ * @index: torrent index
+ */
+tracker_agent* session::get_agent(int index)
+{
+  lock_guard<mutex> lock(this->lock_);
+  return this->torrents_[index]->agent;
+}
+
+/**
+ * Interface to get upload limit of process
+ */
+rate_limit* session::get_up_limit()
+{
+  return &this->up_limit_;
+}
+
+/**
+ * Interface to get download limit of process
+ */
+rate_limit* session::get_down_limit()
+{
+  return &this->down_limit_;
+}
+
+/**
+ * Set connection budget, connections already
+ * over a lowered budget are kept.
+ *
+ * @max: connections allowed, 0 for unlimited
+ */
+void session::set_max_conns(int max)
+{
+  this->max_conns_ = (max > 0) ? max : 0;
+}
+
+/**
+ * Interface to get connection budget
+ */
+int session::get_max_conns()
+{
+  return this->max_conns_;
+}
+
+/**
+ * Interface to get connections in use
+ */
+int session::get_conns()
+{
+  return this->conns_;
+}
+
+/**
+ * Implementation of command metrics, global metrics of
+ * registry followed by gauges of session and torrents.
+ *
+ * @os: output stream
+ */
+void session::do_metrics(ostream& os)
+{
+  vector<core*> cores;  //hosted torrents
+
+  //torrents are not deleted while written
+  lock_guard<mutex> drive(this->drive_);
+
+  {
+    lock_guard<mutex> lock(this->lock_);
+    for (unsigned int i = 0; i < this->torrents_.size(); i++)
+      cores.push_back(this->torrents_[i]->pwp);
+  }
+
+  metrics::write_text(os);
+
+  os << "# HELP urtorrent_connections Peer connections of session.\n"
+     << "# TYPE urtorrent_connections gauge\n"
+     << "urtorrent_connections " << this->conns_ << "\n";
+
+  os << "# HELP urtorrent_executor_workers Worker threads of executor.\n"
+     << "# TYPE urtorrent_executor_workers gauge\n"
+     << "urtorrent_executor_workers " << executor::get_workers() << "\n";
+
+  os << "# HELP urtorrent_executor_pending Jobs queued or running on executor.\n"
+     << "# TYPE urtorrent_executor_pending gauge\n";
+  for (int c = 0; c < executor::CLASS_NUM; c++)
+    os << "urtorrent_executor_pending{class=\"" << JOB_CLASS[c] << "\"} "
+       << executor::get_pending((executor::Class)c) << "\n";
+
+  core::write_gauges(os, cores);
+}
+
+/**
+ * Interface to get metrics rendered on last timeout
+ */
+string session::get_snapshot()
+{
+  lock_guard<mutex> lock(this->snlock_);
+  return this->snapshot_;
+}
+
+/**
+ * Incoming connection dispatcher, performed by a
+ * dedicated thread. A connection over budget is
+ * closed at once, otherwise its handshake is read
+ * here as bytes arrive. A peer sending no handshake
+ * within HS_WAIT_ is dropped.
+ */
+void session::dispatch()
+{
+  int sock;                      //socket with remote peer
+  string ip;                     //client ip
+  int listen = this->server_->get_sock(); //listening socket
+  map<int, Greeting> greets;     //connections waiting handshake
+  vector<struct pollfd> fds;     //sockets polled
+  steady_clock::time_point now;  //current time
+
+  //accept requests until session is destroyed
+  while (this->running_) {
+    fds.assign(1, {listen, POLLIN, 0});
+    for (auto it = greets.begin(); it != greets.end(); it++)
+      fds.push_back({it->first, POLLIN, 0});
+
+    if (poll(fds.data(), fds.size(), POLL_MS) < 0) {
+      if (errno != EINTR)
+        fail_handle(FAL_SYS);
+      continue;
+    }
+
+    //read handshakes
+    for (unsigned int i = 1; i < fds.size(); i++) {
+      if (!fds[i].revents)
+        continue;
+
+      sock = fds[i].fd;
+      if (this->greet(sock, greets[sock]))
+        greets.erase(sock);
+    }
+
+    //drop peers silent too long
+    now = steady_clock::now();
+    for (auto it = greets.begin(); it != greets.end(); ) {
+      if (it->second.end > now) {
+        it++;
+        continue;
+      }
+      close(it->first);
+      this->release_conn();
+      it = greets.erase(it);
+    }
+
+    if (!(fds[0].revents & POLLIN))
+      continue;
+
+    sock = this->server_->accept_peer(ip);
+    if (sock < 0)
+      continue;
+
+    if (!this->acquire_conn()) {
+      close(sock);
+      continue;
+    }
+
+    //handshake is collected without blocking dispatcher
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+      fail_handle(FAL_SYS);
+      close(sock);
+      this->release_conn();
+      continue;
+    }
+
+    greets[sock] = {ip, "", now+seconds((int)session::HS_WAIT_)};
+  }
+
+  //drop handshakes still partial
+  for (auto it = greets.begin(); it != greets.end(); it++) {
+    close(it->first);
+    this->release_conn();
+  }
+}
+
+/**
+ * Read handshake bytes arrived on a connection, a
+ * full handshake is routed to its torrent.
+ *
+ * @sock: socket with remote peer
+ * @g: greeting of connection
+ * Return: true if connection is routed or dropped,
+ *         false if handshake is still partial
+ */
+bool session::greet(int sock, Greeting& g)
+{
+  char buff[HS_LEN] = {};   //handshake bytes
+  ssize_t rdsz;             //read size
+
+  rdsz = read(sock, buff, HS_LEN-g.hs.size());
+  if (rdsz < 0 && (errno == EAGAIN || errno == EINTR))
+    return false;
+
+  //connection closed before handshake
+  if (rdsz <= 0) {
+    close(sock);
+    this->release_conn();
+    return true;
+  }
+
+  g.hs.append(buff, rdsz);
+  if (g.hs.size() < (size_t)HS_LEN)
+    return false;
+
+  //connections block on reads
+  if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK) < 0) {
+    fail_handle(FAL_SYS);
+    close(sock);
+    this->release_conn();
+    return true;
+  }
+
+  this->route(sock, g.ip, g.hs);
+  return true;
+}
+
+/**
+ * Hand a connection to the torrent of its info hash,
+ * a torrent still being added keeps it waiting.
+ *
+ * @sock: socket with remote peer
+ * @ip: peer's ip
+ * @hs: handshake sent by peer
+ */
+void session::route(int sock, string ip, string hs)
+{
+  unordered_map<string, core*>::iterator it; //route of info hash
+
+  {
+    lock_guard<mutex> lock(this->lock_);
+
+    //find torrent by info hash
+    it = this->routes_.find(hs.substr(HASH_OFFSET, SHA_DIGEST_LENGTH));
+    if (it != this->routes_.end()) {
+      if (!it->second)
+        this->waiting_[it->first].push_back({sock, ip, hs});
+      else
+        //connection gives itself back to budget
+        it->second->accept_peer(sock, ip, hs);
+      return;
+    }
+  }
+  fail_handle(FAL_IHASH);
+
+  //connection not handed over
+  close(sock);
+  this->release_conn();
+}
+
+/**
+ * Start local service discovery, every torrent hosted
+ * now or later is announced on group
+ *
+ * @group: multicast group as ip:port
+ */
+void session::discover(string group)
+{
+  this->lsd_ = new lsd(group, this->advert_, [this] {
+    vector<string> hashes;  //info hashes of torrents
+    lock_guard<mutex> lock(this->lock_);
+
+    for (unsigned int i = 0; i < this->torrents_.size(); i++)
+      hashes.push_back(this->torrents_[i]->mi->get_infohash());
+    return hashes;
+  }, [this] (const string& infohash, const string& addr) {
+    this->lan_peer(infohash, addr);
+  });
+}
+
+/**
+ * Hand a peer found on local network to torrent of
+ * its info hash, torrents not hosted are ignored
+ *
+ * @infohash: info hash announced
+ * @addr: peer address as ip:port
+ */
+void session::lan_peer(const string& infohash, const string& addr)
+{
+  lock_guard<mutex> lock(this->lock_);
+  unordered_map<string, core*>::iterator it; //route of info hash
+
+  it = this->routes_.find(infohash);
+  if (it != this->routes_.end() && it->second)
+    it->second->add_lan_peer(addr);
+}
+
+/**
+ * Take a connection from budget
+ * Return: true if budget allows, otherwise false
+ */
+bool session::acquire_conn()
+{
+  int used = this->conns_;  //connections in use
+  int max;                  //connection budget
+
+  do {
+    max = this->max_conns_;
+    if (max && used >= max)
+      return false;
+  } while (!this->conns_.compare_exchange_weak(used, used+1));
+
+  return true;
+}
+
+/**
+ * Return a connection to budget
+ */
+void session::release_conn()
+{
+  this->conns_--;
+}
+
+/**
+ * Super seed torrents added from now on which are
+ * complete, torrents hosted already keep their mode
+ *
+ * @on: super seeding on or off
+ */
+void session::set_super_seed(bool on)
+{
+  this->super_seed_ = on;
+}
+
+/**
+ * Size read cache shared by every torrent, -R bounds
+ * the process rather than each torrent. Torrents keep
+ * the cache they started with, so it is only sized
+ * before the first torrent is added.
+ *
+ * @bytes: cache size of process, 0 for none
+ */
+void session::set_cache_size(long long bytes)
+{
+  lock_guard<mutex> lock(this->lock_);
+
+  if (this->cache_ || !this->routes_.empty())
+    return;
+
+  this->cache_size_ = bytes;
+  this->cache_ = bytes ? new piece_cache(bytes) : nullptr;
+}
+
+/**
+ * Timeout event handler, drive periodic work of
+ * every torrent and refresh snapshot.
+ */
+void session::timeout()
+{
+  vector<core*> cores;  //hosted torrents
+
+  {
+    //torrents are not deleted while driven
+    lock_guard<mutex> drive(this->drive_);
+
+    {
+      lock_guard<mutex> lock(this->lock_);
+      for (unsigned int i = 0; i < this->torrents_.size(); i++)
+        cores.push_back(this->torrents_[i]->pwp);
+    }
+
+    //swarm checks read statistics of last scrapes
+    this->scrape_swarms();
+
+    //chokers and swarm checks of torrents
+    for (unsigned int i = 0; i < cores.size(); i++)
+      cores[i]->timeout();
+  }
+
+  this->refresh();
+
+  //restart timer
+  this->timer_->start(core::TO_UNIT_);
+}
+
+/**
+ * Scrape swarms of torrents sharing trackers together.
+ * Torrents are grouped by their announce-list, the agent
+ * of the first torrent of a group scrapes every stale
+ * hash of the group by one request per tracker and keeps
+ * the replies, which are handed to the other agents of
+ * the group. Torrents are driven, none is deleted.
+ */
+void session::scrape_swarms()
+{
+  map<string, vector<Torrent*>> groups;  //torrents by trackers
+  vector<string> hashes;                 //stale hashes of a group
+  tracker_agent::Stats stats;            //statistics of a swarm
+  tracker_agent* lead;                   //agent scraping for group
+  string hash;                           //info hash of torrent
+
+  {
+    lock_guard<mutex> lock(this->lock_);
+    for (unsigned int i = 0; i < this->torrents_.size(); i++)
+      groups[tracker_key(this->torrents_[i]->mi)].push_back(this->torrents_[i]);
+  }
+
+  for (auto it = groups.begin(); it != groups.end(); it++) {
+    lead = it->second[0]->agent;
+
+    for (unsigned int i = 0; i < it->second.size(); i++) {
+      hash = it->second[i]->mi->get_infohash();
+      if (lead->stale(hash))
+        hashes.push_back(hash);
+      else if (i && lead->get_stats(hash, stats))
+        it->second[i]->agent->put_stats(hash, stats);
+    }
+
+    if (!hashes.empty())
+      lead->scrape(hashes, false);
+    hashes.clear();
+  }
+}
+
+/**
+ * Refresh snapshot on a disk worker, a dump still
+ * running is not queued again. A caller changing
+ * state renders the snapshot itself and waits, stats
+ * asked after its reply show the change.
+ *
+ * @wait: render on calling thread
+ */
+void session::refresh(bool wait)
+{
+  if (wait) {
+    this->dump_metrics();
+    return;
+  }
+
+  if (this->dumping_.exchange(true))
+    return;
+
+  executor::submit(executor::DISK, [this] {
+    this->dump_metrics();
+    this->dumping_ = false;
+  });
+}
+
+/**
+ * Render snapshot and write metrics file if configured.
+ * The file is written aside and renamed, scrapers never
+ * read a partial file.
+ */
+void session::dump_metrics()
+{
+  ostringstream text;  //metrics rendered
+  string tmp;          //file being written
+
+  //a later dump renders later state, files are not interleaved
+  lock_guard<mutex> dump(this->dmlock_);
+
+  this->do_metrics(text);
+  {
+    lock_guard<mutex> lock(this->snlock_);
+    this->snapshot_ = text.str();
+  }
+
+  if (this->metrics_file_.empty())
+    return;
+
+  tmp = this->metrics_file_+TMP_SUFFIX;
+  ofstream out(tmp, ios::trunc);
+  if (!out) {
+    fail_handle(FAL_SYS);
+    return;
+  }
+
+  out << text.str();
+  out.close();
+  if (rename(tmp.c_str(), this->metrics_file_.c_str()))
+    fail_handle(FAL_SYS);
+}
+
+/**
+ * Key of trackers a torrent announces to, torrents
+ * with the same key are scraped together
+ *
+ * @mi: metainfo of torrent
+ */
+static string tracker_key(metainfo* mi)
+{
+  vector<vector<string>> tiers = mi->get_announce_list();  //tiers of URLs
+  string key;                                              //URLs by tier
+
+  for (unsigned int i = 0; i < tiers.size(); i++) {
+    for (unsigned int j = 0; j < tiers[i].size(); j++)
+      key += tiers[i][j]+" ";
+    key += "\n";
+  }
+
+  return key;
+}
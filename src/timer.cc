@@ -3,47 +3,83 @@
  * std::chrono::steady_clock has been used to keep program
  * time in monotonic.
  *
- * The time unit is std::chrono::seconds.
+ * The time unit is std::chrono::seconds, short waits are
+ * counted in std::chrono::milliseconds.
  *
- * The actually timer is tracked by a dedicated thread when a
- * timer is triggered to start
+ * Started timers are kept in one queue ordered by end, a
+ * single countdown thread sleeps until the earliest end and
+ * hands expired timers to the executor.
  *
  * Note: the constructor is defined in '../include/timer.h'.
  */
 
 #include <timer.h>
+#include <vector>      /* std::vector */
+#include <executor.h>  /* work-stealing executor */
 
 /**
- * Destructor - wait until all timer thread terminate
+ * Constructor - launch countdown thread
+ */
+timer::Service::Service()
+{
+  thread t_count(&timer::countdown, this);
+  t_count.detach();
+}
+
+/**
+ * Destructor - stop timer and wait until
+ * its handler finishes
  */
 timer::~timer()
 {
-  //spinning wait thread to terminate
-  do {
-    this->stop();
-  } while (this->running_);
+  {
+    lock_guard<mutex> lock(service()->lock);
+    this->dead_ = true;
+  }
+  this->stop();
+
+  //spinning wait handler to terminate
+  while (this->running_ > 0)
+    this_thread::yield();
 }
 
 /**
- * Start a timer by setting a epoch and end timepoint.
- * A dedicated tracking thread will be created
+ * Start a timer by setting its end timepoint,
+ * a started timer is restarted.
  *
  * @dura: duration for which this timer will count down
  */
 void timer::start(int dura)
 {
-  seconds wait_t(dura); //timeout duration in seconds
+  this->start(milliseconds(seconds(dura)));
+}
+
+/**
+ * Start a timer counting down in milliseconds,
+ * a started timer is restarted.
+ *
+ * @dura: duration for which this timer will count down
+ */
+void timer::start(milliseconds dura)
+{
+  Service* svc = service();  //process wide countdown
+
+  lock_guard<mutex> lock(svc->lock);
+
+  //timer being destroyed by its handler
+  if (this->dead_)
+    return;
+
+  if (this->started_)
+    svc->queue.erase(this->pos_);
 
-  //set current time as epoch
-  this->epoch_ = steady_clock::now();
-  //set timeout timepoint
-  this->end_ = epoch_+wait_t;
-  //reset start status
+  this->pos_ = svc->queue.insert(make_pair(steady_clock::now()+dura,
+                                           this));
   this->started_ = true;
 
-  //launch a thread to count down timer
-  thread t_job(&timer::countdown, this);
-  t_job.detach();
+  //countdown sleeps until a later end
+  if (this->pos_ == svc->queue.begin())
+    svc->cv.notify_one();
 }
 
 /**
@@ -51,42 +87,68 @@ void timer::start(int dura)
  */
 void timer::stop()
 {
-  unique_lock<mutex> lk(this->t_lock_);
+  Service* svc = service();  //process wide countdown
+
+  lock_guard<mutex> lock(svc->lock);
+
+  if (this->started_)
+    svc->queue.erase(this->pos_);
   this->started_ = false;
-  this->cv_.notify_one();
 }
 
 /**
- * Continuously checking current timepoint against the
- * end timepoint.
- * On timeout, a handler setted in previous will be invoked
+ * Process wide countdown, created on first use
  */
-void timer::countdown()
+timer::Service* timer::service()
 {
-  //indicate a running thread
-  this->running_ = true;
+  static Service* svc = new Service();  //never freed
 
-  //check timer not stopped
-  if (!this->started_) {
-    //indicate thread termination
-    this->running_ = false;
-    return;
-  }
+  return svc;
+}
+
+/**
+ * Countdown thread job. Sleep until the earliest end,
+ * then run handlers of expired timers on the executor.
+ *
+ * @svc: countdown of process
+ */
+void timer::countdown(Service* svc)
+{
+  vector<timer*> expired;  //timers reaching their end
+  timer* t;                //timer expired
 
-  //check time between each second
-  while (steady_clock::now() < this->end_) {
-    //terminate coutdown thread when stopped
-    if (!this->started_) {
-      //indicate thread termination
-      this->running_ = false;
-      return;
+  while (true) {
+    {
+      unique_lock<mutex> lk(svc->lock);
+
+      //sleep until the earliest end
+      while (svc->queue.empty() ||
+             svc->queue.begin()->first > steady_clock::now()) {
+        if (svc->queue.empty())
+          svc->cv.wait(lk);
+        else
+          svc->cv.wait_until(lk, svc->queue.begin()->first);
+      }
+
+      //take expired timers, destructor waits for handlers
+      while (!svc->queue.empty() &&
+             svc->queue.begin()->first <= steady_clock::now()) {
+        t = svc->queue.begin()->second;
+        svc->queue.erase(svc->queue.begin());
+        t->started_ = false;
+        t->running_++;
+        expired.push_back(t);
+      }
     }
 
-    //wait for a while
-    unique_lock<mutex> lk(this->t_lock_);
-    this->cv_.wait_for(lk, this->interv_);
+    //trigger timeout events, submit may wait for room
+    for (unsigned int i = 0; i < expired.size(); i++) {
+      t = expired[i];
+      executor::submit(executor::NET, [t] {
+        t->handler_();
+        t->running_--;
+      });
+    }
+    expired.clear();
   }
-
-  //trigger timeout event here
-  this->handler_();
 }
@@ -0,0 +1,244 @@
+/**
+ * Implementation of piece lifecycle tracer.
+ *
+ * A reader copies a ring while its owner may keep writing, entries
+ * overwritten during the copy are detected from the head index and
+ * dropped. Like the metrics registry, the tracer registry is never
+ * freed so that detached threads record into valid memory.
+ *
+ */
+
+#include <trace.h>
+#include <algorithm>   /* std::find() and std::sort() */
+#include <iomanip>     /* std::setprecision() */
+
+/***************** Constants *****************/
+static const double NS_PER_US = 1000;  /* nanoseconds in a microsecond */
+static const int PID = 1;              /* process id in trace */
+
+//Event names, same order as enum
+static const char* const EVENT_NAME[] = {
+  "picked", "unchoked", "requested", "first_block", "last_block",
+  "hash", "hash", "bitfield_updated", "have_sent"
+};
+
+/**
+ * Constructor - empty ring of a thread
+ * @id: thread number in trace
+ */
+trace::Ring::Ring(int id) : tid(id), head(0)
+{
+}
+
+/**
+ * Constructor - ring is allocated on first event,
+ * threads never recording cost nothing.
+ */
+trace::Local::Local() : ring(nullptr)
+{
+}
+
+/**
+ * Destructor - retire ring of exiting thread,
+ * the oldest retired ring is freed when too many
+ */
+trace::Local::~Local()
+{
+  Registry* reg = registry();  //process wide registry
+
+  if (!this->ring)
+    return;
+
+  lock_guard<mutex> lock(reg->lock);
+  reg->rings.erase(find(reg->rings.begin(), reg->rings.end(),
+                        this->ring));
+  reg->retired.push_back(this->ring);
+  if (reg->retired.size() > (size_t)RETIRED_MAX) {
+    delete reg->retired.front();
+    reg->retired.pop_front();
+  }
+}
+
+/**
+ * Constructor - tracing disabled, epoch at creation
+ */
+trace::Registry::Registry() : next_tid(1), on(false)
+{
+  this->epoch = steady_clock::now();
+}
+
+/**
+ * Start or stop recording
+ * @on: true to record events
+ */
+void trace::enable(bool on)
+{
+  registry()->on.store(on, memory_order_relaxed);
+}
+
+/**
+ * Check if tracer is recording
+ */
+bool trace::enabled()
+{
+  return registry()->on.load(memory_order_relaxed);
+}
+
+/**
+ * Record an event into ring of calling thread
+ *
+ * @e: event
+ * @piece: piece index
+ * @arg: block offset for block events
+ */
+void trace::record(Event e, uint32_t piece, uint32_t arg)
+{
+  Registry* reg = registry();  //process wide registry
+  Ring* ring;                  //ring of thread
+  Entry* entry;                //slot to write
+  uint64_t head;               //events written by thread
+
+  if (!reg->on.load(memory_order_relaxed))
+    return;
+
+  ring = local();
+  head = ring->head.load(memory_order_relaxed);
+  entry = &ring->entries[head&(RING_SIZE-1)];
+  entry->ns = duration_cast<nanoseconds>(steady_clock::now()-reg->epoch).count();
+  entry->piece = piece;
+  entry->arg = arg;
+  entry->event = e;
+
+  //publish entry to readers
+  ring->head.store(head+1, memory_order_release);
+}
+
+/**
+ * Write events of every ring as Chrome trace JSON
+ *
+ * @os: output stream
+ */
+void trace::write_json(ostream& os)
+{
+  Registry* reg = registry();     //process wide registry
+  vector<pair<int, Entry>> events; //events with thread number
+  vector<Entry> copy;              //events of a ring
+  vector<Ring*> rings;             //rings to dump
+
+  {
+    lock_guard<mutex> lock(reg->lock);
+    rings = reg->rings;
+    rings.insert(rings.end(), reg->retired.begin(), reg->retired.end());
+
+    //rings stay allocated while lock is held
+    for (unsigned int i = 0; i < rings.size(); i++) {
+      copy.clear();
+      snapshot(rings[i], copy);
+      for (unsigned int j = 0; j < copy.size(); j++)
+        events.push_back(make_pair(rings[i]->tid, copy[j]));
+    }
+  }
+
+  //viewers expect time order of slices
+  sort(events.begin(), events.end(),
+    [](const pair<int, Entry>& a, const pair<int, Entry>& b)
+    {return a.second.ns < b.second.ns;});
+
+  os << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+  for (unsigned int i = 0; i < events.size(); i++) {
+    os << (i ? ",\n" : "\n");
+    write_entry(os, events[i].first, events[i].second);
+  }
+  os << "\n]}\n" << flush;
+}
+
+/**
+ * Ring of calling thread, registered on first event
+ */
+trace::Ring* trace::local()
+{
+  static thread_local Local local;  //ring owner of thread
+  Registry* reg;                    //process wide registry
+
+  if (!local.ring) {
+    reg = registry();
+    lock_guard<mutex> lock(reg->lock);
+    local.ring = new Ring(reg->next_tid++);
+    reg->rings.push_back(local.ring);
+  }
+  return local.ring;
+}
+
+/**
+ * Process wide registry
+ */
+trace::Registry* trace::registry()
+{
+  static Registry* reg = new Registry();  //never freed
+
+  return reg;
+}
+
+/**
+ * Copy events still held by a ring. Entries the owner
+ * overwrote while copying are dropped.
+ *
+ * @ring: ring to copy
+ * @out: copied events in write order
+ */
+void trace::snapshot(Ring* ring, vector<Entry>& out)
+{
+  uint64_t head;   //events written before copy
+  uint64_t first;  //oldest event held
+  uint64_t after;  //events written after copy
+
+  head = ring->head.load(memory_order_acquire);
+  first = (head > (uint64_t)RING_SIZE) ? head-RING_SIZE : 0;
+  for (uint64_t i = first; i < head; i++)
+    out.push_back(ring->entries[i&(RING_SIZE-1)]);
+
+  //slots reused since the copy started hold newer events
+  after = ring->head.load(memory_order_acquire);
+  if (after > first+RING_SIZE)
+    out.erase(out.begin(),
+              out.begin()+min((uint64_t)out.size(), after-first-RING_SIZE));
+}
+
+/**
+ * Write one event in Chrome trace format
+ *
+ * @os: output stream
+ * @tid: thread number
+ * @e: event
+ */
+void trace::write_entry(ostream& os, int tid, const Entry& e)
+{
+  const char* ph;  //event phase
+
+  //piece lifetime is an async slice keyed by piece index
+  if (e.event == PICKED)
+    ph = "b";
+  else if (e.event == HAVE_SENT)
+    ph = "e";
+  else if (e.event == HASH_START)
+    ph = "B";
+  else if (e.event == HASH_END)
+    ph = "E";
+  else
+    ph = "n";
+
+  os << "{\"name\": \"";
+  if (e.event == PICKED || e.event == HAVE_SENT)
+    os << "piece " << e.piece;
+  else
+    os << EVENT_NAME[e.event];
+  os << "\", \"cat\": \"piece\", \"ph\": \"" << ph << "\""
+     << ", \"ts\": " << fixed << setprecision(3) << e.ns/NS_PER_US
+     << ", \"pid\": " << PID << ", \"tid\": " << tid;
+  if (e.event != HASH_START && e.event != HASH_END)
+    os << ", \"id\": " << e.piece;
+  os << ", \"args\": {\"piece\": " << e.piece;
+  if (e.event == REQUESTED || e.event == FIRST_BLOCK || e.event == LAST_BLOCK)
+    os << ", \"begin\": " << e.arg;
+  os << ", \"event\": \"" << EVENT_NAME[e.event] << "\"}}";
+}
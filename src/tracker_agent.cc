@@ -2,12 +2,15 @@
  * Implementation of class tracker_agent.
  *
  * The declaration of tracker_agent is located at "../include/tracker_agent.h".
- * The communication performed by class is undertaken by libcurl.
+ * HTTP communication is undertaken by libcurl, UDP trackers are
+ * driven through class udp_tracker on the same I/O thread.
  *
  */
 
 #include <tracker_agent.h>
 #include <arpa/inet.h>     /* ntohl() and ntohs() */
+#include <algorithm>       /* shuffle(), sort() and unique() */
+#include <random>          /* std::mt19937 and std::random_device */
 
 /********** Constants **********/
 static const string PARA_INFO = "?info_hash=";   /* parameter key info_hash */
@@ -31,172 +34,384 @@ static const char* TKID = "tracker id";          /* response tracker id field ke
 static const char* CMPT = "complete";            /* response complete field key */
 static const char* INCMPT = "incomplete";        /* response incomplete field key */
 static const char* PEERS = "peers";              /* response peers field key */
+static const char* FILES = "files";              /* scrape files field key */
+static const char* DWNED = "downloaded";         /* scrape downloaded field key */
+static const string ANN_PATH = "/announce";      /* announce path, scrape path by convention */
+static const string SCRP_PATH = "/scrape";       /* scrape path */
 static const char* DELIM = "\r";                 /* HTTP response line delimiter */
+static const char* UDP_OK = "UDP OK";            /* status of UDP reply */
 static const char* SEP = "| ";                   /* table cell delimiter */
 static const int PEER_LEN = 6;                   /* bytes represent single peer in response */
 static const int PEER_WIDTH = 31;                /* peers list table width */
 static const int IP_LEN = 4;                     /* length of IPv4 address */
 static const int IP_WIDTH = 17;                  /* IP cell length */
 
-/****** Global Variables ******/
-static char error_msg[CURL_ERROR_SIZE];          /* curl error message buffer */
-static CURLcode status;                          /* curl status code */
-
 /***** Internal Functions *****/
-static void
+static bool
 be_node_parser(be_node* node, char* key, 
                tracker_agent::Message* resp);
 
 static string convert_order(char* bytes);
 
 /**
- * Constructor - initialize class members and notify the tracker
- * which specified in metainfo file by sending an initial request.
- * Start timer which on time out event will send request to tracker.
+ * Constructor - initialize class members and launch the I/O
+ * thread which performs every request, including the
+ * periodical ones. The tracker is notified by start().
  *
  * @mi: metainfo object
  */
-tracker_agent::tracker_agent(metainfo* mi) : mi_(mi)
+tracker_agent::tracker_agent(metainfo* mi) : mi_(mi),
+                                             rng_(random_device()())
 {
-  char* encoded_hash; //urlencoded info_hash
-  char* encoded_id;   //urlencoded peer_id
-
-  //setup curl global environment
-  if(curl_global_init(CURL_GLOBAL_ALL)) {
+  char* encoded_hash;      //urlencoded info_hash
+  char* encoded_id;        //urlencoded peer_id
+  vector<vector<string>> tiers;  //tiers of tracker URLs
+  Tracker* tracker;        //tracker of tier
+  size_t pos;              //position of announce in URL
+
+  //initialize curl multi session, global environment
+  //is set up by the session
+  this->multi_ = curl_multi_init();
+  if (!this->multi_)
     error_handle(ERR_CURL);
-  }
-
-  //initialize curl easy session
-  this->handle_ = curl_easy_init();
 
   //urlencode info hash
   encoded_hash = 
-  curl_easy_escape(this->handle_,
+  curl_easy_escape(nullptr,
                    this->mi_->get_infohash().c_str(), 
-                   0);
+                   this->mi_->get_infohash().size());
 
   //urlencode peer_id
   encoded_id = 
-  curl_easy_escape(this->handle_,
+  curl_easy_escape(nullptr,
                    this->mi_->get_peerid().c_str(), 
-                   0);
+                   this->mi_->get_peerid().size());
+
+  //build tiers of trackers, order within tier is randomized (BEP 12)
+  tiers = this->mi_->get_announce_list();
+  for (unsigned int i = 0; i < tiers.size(); i++) {
+    this->tiers_.push_back(vector<Tracker*>());
+
+    for (unsigned int j = 0; j < tiers[i].size(); j++) {
+      tracker = new Tracker();
+      tracker->url = tiers[i][j];
+      tracker->fails = 0;
+      tracker->retry_at = steady_clock::now();
+      tracker->udp = udp_tracker::is_udp(tracker->url) ?
+                     new udp_tracker(tracker->url, this->rng_, [this] {
+                       curl_multi_wakeup(this->multi_);
+                     }) : nullptr;
+
+      //scrape URL replaces last /announce in path (BEP 48)
+      pos = tracker->url.find('?');
+      pos = tracker->url.rfind(ANN_PATH, pos);
+      if (tracker->udp)
+        tracker->scrape_url = tracker->url;
+      else if (pos != string::npos &&
+               tracker->url.find('/', pos+1) == string::npos)
+        tracker->scrape_url = tracker->url.substr(0, pos)+SCRP_PATH+
+                              tracker->url.substr(pos+ANN_PATH.size());
+
+      //the URL part of GET request
+      tracker->static_info = tracker->url;
+
+      //parameter info_hash, URL may carry its own query
+      tracker->static_info += (tracker->url.find('?') == string::npos) ?
+                              PARA_INFO : "&"+PARA_INFO.substr(1);
+      tracker->static_info += string(encoded_hash);
+
+      //parameter peer_id
+      tracker->static_info += PARA_ID;
+      tracker->static_info += string(encoded_id);
+
+      //parameter port
+      tracker->static_info += PARA_PORT;
+      tracker->static_info += this->mi_->get_port();
+
+      this->tiers_[i].push_back(tracker);
+    }
+    shuffle(this->tiers_[i].begin(), this->tiers_[i].end(), this->rng_);
+  }
 
-  //set callback getting response headers
-  curl_easy_setopt(this->handle_, CURLOPT_HEADERFUNCTION, 
-                   &tracker_agent::get_header);
+  //init other members
+  this->upload_ = 0;
+  this->download_ = 0;
+  this->regular_busy_ = false;
+  this->next_regular_ = steady_clock::time_point::max();
+  this->last_regular_ = steady_clock::now();
+  this->filename_ = this->mi_->get_filename();
 
-  //store headers in callback
-  curl_easy_setopt(this->handle_, CURLOPT_HEADERDATA, &(this->headers_));
+  //launch I/O thread
+  this->running_ = true;
+  this->worker_ = thread(&tracker_agent::run_service, this);
 
+  //free allocated string
+  curl_free(encoded_hash);
+  curl_free(encoded_id);
+}
 
-  //set response callback function
-  curl_easy_setopt(this->handle_, CURLOPT_WRITEFUNCTION,
-                   &tracker_agent::_receive);
+/**
+ * Send initial request to trackers specified in metainfo
+ * file and wait for the reply. Nothing can be done without
+ * any tracker, the caller drops the torrent on failure.
+ *
+ * Return: true if a tracker replied
+ */
+bool tracker_agent::start()
+{
+  return this->announce(tracker_agent::EVNT_START, true, 0)->ok;
+}
 
-  //pass Response struct to callback
-  curl_easy_setopt(this->handle_, CURLOPT_WRITEDATA, &(this->mesg_));
+/**
+ * Destructor - stop I/O thread and cleanup
+ * curl sessions.
+ */
+tracker_agent::~tracker_agent()
+{
+  //stop I/O thread
+  this->running_ = false;
+  curl_multi_wakeup(this->multi_);
+  this->worker_.join();
+
+  //drop requests never finished, their announces are dropped below
+  for (auto it = this->inflight_.begin();
+       it != this->inflight_.end(); it++) {
+    if ((*it)->easy) {
+      curl_multi_remove_handle(this->multi_, (*it)->easy);
+      curl_easy_cleanup((*it)->easy);
+    }
+    this->pending_.push_back((*it)->round);
+    delete *it;
+  }
 
-  //set curl handle perform HTTP GET
-  status = 
-  curl_easy_setopt(this->handle_, CURLOPT_HTTPGET, 1L);
+  //drop announces, a round may be referenced by several requests
+  sort(this->pending_.begin(), this->pending_.end());
+  this->pending_.erase(unique(this->pending_.begin(), this->pending_.end()),
+                       this->pending_.end());
+  for (auto it = this->pending_.begin();
+       it != this->pending_.end(); it++)
+    delete *it;
+
+  //drop trackers
+  for (unsigned int i = 0; i < this->tiers_.size(); i++)
+    for (unsigned int j = 0; j < this->tiers_[i].size(); j++) {
+      delete this->tiers_[i][j]->udp;
+      delete this->tiers_[i][j];
+    }
+
+  //clean curl multi session
+  curl_multi_cleanup(this->multi_);
+}
 
-  if(status != CURLE_OK)
-    error_handle(ERR_CURL);
+/**
+ * Interface to explicitly perform a HTTP GET request to tracker.
+ * The calling thread waits for the reply and prints out status
+ * returned by tracker, other threads are never blocked.
+ */
+void tracker_agent::do_announce()
+{
+  shared_ptr<Result> res;  //outcome of request
 
-  //set error message buffer
-  curl_easy_setopt(this->handle_, CURLOPT_ERRORBUFFER, error_msg);
+  res = this->announce(tracker_agent::EVNT_EMPTY, true, 0);
+  if (!res->ok) {
+    cerr << "\tTracker not responding\n";
+    return;
+  }
 
-  //the URL part of GET request
-  this->static_info_ += this->mi_->get_announce();
+  //print out status
+  cout << "\tTracker responsed: " << res->status << endl;
+  this->show_info(true);
+}
 
-  //parameter info_hash
-  this->static_info_ += PARA_INFO;
-  this->static_info_ += string(encoded_hash);
-  
-  //parameter peer_id
-  this->static_info_ += PARA_ID;
-  this->static_info_ += string(encoded_id);
-  
-  //parameter port
-  this->static_info_ += PARA_PORT;
-  this->static_info_ += this->mi_->get_port();
+/**
+ * Interface to scrape trackers for the swarm of this torrent.
+ * The calling thread waits for the reply and prints out swarm
+ * statistics.
+ */
+void tracker_agent::do_scrape()
+{
+  string hash = this->mi_->get_infohash();  //info hash of torrent
+  Stats stats;                              //swarm statistics
 
-  //init other members
-  this->upload_ = 0;
-  this->download_ = 0;
-  this->event_ = tracker_agent::EVNT_START;
-  this->filename_ = this->mi_->get_filename();
+  if (!this->scrape(vector<string>(1, hash), true) ||
+      !this->get_stats(hash, stats)) {
+    cerr << "\tScrape not supported or tracker not responding\n";
+    return;
+  }
 
-  //send initial request
-  this->_send(this->compose_request());
+  cout << "\tseeders | completed | leechers\n";
+  cout << "\t" << setw(8) << left << stats.seeders << "| "
+       << setw(10) << left << stats.completed << "| "
+       << stats.leechers << endl;
+}
 
-  //reset event to regular request
-  this->event_ = tracker_agent::EVNT_EMPTY;
+/**
+ * Queue a scrape of one or many info hashes, split in rounds
+ * of at most SCRAPE_BATCH_ hashes. A round sends a single
+ * request per tracker, it fits a UDP datagram and keeps HTTP
+ * URLs short. Replies are kept in a cache read through
+ * get_stats().
+ *
+ * @hashes: 20 bytes info hashes
+ * @wait: block until every round finished
+ *
+ * Return: true if scrape succeeded, or queued when not waiting
+ */
+bool tracker_agent::scrape(const vector<string>& hashes, bool wait)
+{
+  vector<shared_ptr<Result>> results;  //outcome of each round
+  size_t end;                          //end of batch
+  bool ok = true;                      //every round succeeded
 
-  //register a timer for periodical tracking
-  this->timer_ 
-  = new timer(&tracker_agent::run_service, this);
+  {
+    lock_guard<mutex> lock(this->stats_lock_);
+    this->scraping_.insert(hashes.begin(), hashes.end());
+  }
 
-  //start tracking timer
-  timer_->start(min(this->mesg_.interv, 
-                    this->mesg_.min_interv));
+  //hand over to I/O thread
+  unique_lock<mutex> lock(this->queue_lock_);
+  for (size_t i = 0; i < hashes.size(); i = end) {
+    Round* round = new Round();            //new scrape
+    shared_ptr<Result> res(new Result());  //outcome of scrape
+
+    end = min(hashes.size(), i+tracker_agent::SCRAPE_BATCH_);
+    round->scrape = true;
+    round->hashes.assign(hashes.begin()+i, hashes.begin()+end);
+    round->event = tracker_agent::EVNT_EMPTY;
+    round->regular = false;
+    round->due = steady_clock::now();
+    round->result = res;
+
+    this->pending_.push_back(round);
+    results.push_back(res);
+  }
+  curl_multi_wakeup(this->multi_);
 
-  //free allocated string
-  curl_free(encoded_hash);
-  curl_free(encoded_id);
+  if (!wait)
+    return true;
+
+  //wait for outcome
+  for (unsigned int i = 0; i < results.size(); i++) {
+    shared_ptr<Result>& res = results[i];
+    this->done_cv_.wait(lock, [&res] {return res->done;});
+    ok = ok && res->ok;
+  }
+  return ok;
 }
 
 /**
- * Destructor - delete timer object and
- * cleanup curl easy session and environment.
+ * Interface for retrieving cached swarm statistics, the
+ * session refreshes them by scrapes of many torrents.
+ *
+ * @hash: info hash of swarm
+ * @stats: receives statistics, possibly stale
+ *
+ * Return: true if statistics were ever fetched
  */
-tracker_agent::~tracker_agent()
+bool tracker_agent::get_stats(const string& hash, Stats& stats)
 {
-  delete this->timer_;
-  
-  //clean curl easy session
-  curl_easy_cleanup(this->handle_);
+  lock_guard<mutex> lock(this->stats_lock_);
+  auto it = this->stats_.find(hash);
+
+  if (it == this->stats_.end())
+    return false;
 
-  //clean curl environment
-  curl_global_cleanup();
+  stats = it->second;
+  return true;
 }
 
 /**
- * Interface to explicitly perform a HTTP GET request to tracker.
- * And print out status returned by tracker.
+ * Store swarm statistics scraped by the agent of another
+ * torrent on the same trackers, older ones are ignored.
+ *
+ * @hash: info hash of swarm
+ * @stats: statistics scraped
  */
-void tracker_agent::do_announce()
+void tracker_agent::put_stats(const string& hash, const Stats& stats)
 {
-  //stop tracking timer
-  this->timer_->stop();
+  lock_guard<mutex> lock(this->stats_lock_);
+  auto it = this->stats_.find(hash);
 
-  //reset headers
-  this->headers_.clear();
+  if (it == this->stats_.end() || it->second.fetched < stats.fetched)
+    this->stats_[hash] = stats;
+}
 
-  //acquire message lock
-  lock_guard<mutex> lock(this->mesg_lock_);
+/**
+ * Check if statistics of a swarm need a scrape, i.e. they
+ * are missing or older than STATS_TTL_, not being scraped
+ * and not backing off after a failed scrape of the hash.
+ *
+ * @hash: info hash of swarm
+ */
+bool tracker_agent::stale(const string& hash)
+{
+  lock_guard<mutex> lock(this->stats_lock_);
+  auto it = this->stats_.find(hash);
+  auto retry = this->scrape_retry_.find(hash);
 
-  //reset peers
-  this->mesg_.peers.clear();
+  if (this->scraping_.count(hash) ||
+      (retry != this->scrape_retry_.end() &&
+       steady_clock::now() < retry->second))
+    return false;
 
-  //request tracker
-  this->_send(this->compose_request());
+  return it == this->stats_.end() || !tracker_agent::fresh(it->second);
+}
 
-  //get response status from header
-  char *header_buff = new char[this->headers_.size()+1]();
-  memcpy(header_buff, this->headers_.c_str(), this->headers_.size());
-  char* status = strtok(header_buff, DELIM);
-  if(!status)
-    error_handle(ERR_RESP);
+/**
+ * Check if statistics were scraped within STATS_TTL_
+ *
+ * @stats: swarm statistics
+ */
+bool tracker_agent::fresh(const Stats& stats)
+{
+  return steady_clock::now()-stats.fetched <
+         seconds((int)tracker_agent::STATS_TTL_);
+}
 
-  //print out status
-  cout << "\tTracker responsed: " << status << endl;
-  this->show_info(false);
+/**
+ * Bring the next periodical announce forward to the
+ * minimum interval allowed by the tracker, used when
+ * the swarm is known to hold more peers than connected.
+ */
+void tracker_agent::reannounce()
+{
+  steady_clock::time_point early;  //earliest allowed announce
+  int min_interv;                  //minimum interval of tracker
+
+  {
+    lock_guard<mutex> lock(this->mesg_lock_);
+    min_interv = this->mesg_.min_interv;
+  }
 
-  //restart tracking timer
-  this->timer_->start(min(this->mesg_.interv, 
-                          this->mesg_.min_interv));
-  delete[] header_buff;
+  lock_guard<mutex> lock(this->queue_lock_);
+  early = this->last_regular_ + seconds(min_interv);
+  if (early < this->next_regular_) {
+    this->next_regular_ = early;
+    curl_multi_wakeup(this->multi_);
+  }
+}
+
+/**
+ * Push the next periodical announce out by a share of
+ * the interval, used when fresh statistics show every
+ * peer of the swarm is known already. The announce is
+ * deferred once, its time counts from the last announce.
+ */
+void tracker_agent::defer()
+{
+  steady_clock::time_point late;  //deferred announce
+  int interv = this->next_interval();  //periodical interval
+
+  lock_guard<mutex> lock(this->queue_lock_);
+
+  //no announce scheduled yet
+  if (this->next_regular_ == steady_clock::time_point::max())
+    return;
+
+  late = this->last_regular_ +
+         seconds(interv+interv/tracker_agent::DEFER_SHARE_);
+  if (late > this->next_regular_)
+    this->next_regular_ = late;
 }
 
 /**
@@ -217,8 +432,9 @@ void tracker_agent::show_info(bool exclu)
   int sepos;  //position of ':' in string
 
   //check if mutual exclusion is needed
+  unique_lock<mutex> lock(this->mesg_lock_, defer_lock);
   if (exclu)
-    lock_guard<mutex> lock(this->mesg_lock_);
+    lock.lock();
 
   //display table bar
   cout << "\t" << BAR_CMP << BAR_DWN << BAR_ICP <<
@@ -261,87 +477,62 @@ void tracker_agent::show_info(bool exclu)
 }
 
 /**
- * Inform tracker client's downloading is completed
+ * Inform tracker client's downloading is completed,
+ * the request is sent in background.
  */
 void
 tracker_agent::complete()
 {
-  //acquire message lock
-  lock_guard<mutex> lock(this->mesg_lock_);
-
-  //reset peers
-  this->mesg_.peers.clear();
-
-  //set event to complete
-  this->event_ = tracker_agent::EVNT_COMP;
-
-  //send message to tracker
-  this->_send(this->compose_request());
-
-  //reset event
-  this->event_ = tracker_agent::EVNT_EMPTY;
+  this->announce(tracker_agent::EVNT_COMP, false, 0);
 }
 
 /**
- * Terminate communication with tracker
+ * Terminate communication with tracker, wait a
+ * bounded time for the stopped event to be delivered.
  */
 void
 tracker_agent::terminate()
 {
-  //acquire message lock
-  lock_guard<mutex> lock(this->mesg_lock_);
-
-  //set event to stopped
-  this->event_ = tracker_agent::EVNT_STOP;
-
-  //send message to trakcer
-  this->_send(this->compose_request());
-}
+  this->announce(tracker_agent::EVNT_STOP, true,
+                 tracker_agent::STOP_WAIT_);
 
-/**
- * Block waiting for peer's renew.
- */
-void
-tracker_agent::waiting_peer_update()
-{
-  //wait for conditional variable
-  unique_lock<mutex> lock(this->pslk_);
-  this->cv_.wait(lock);
+  //no more periodical request
+  this->running_ = false;
+  curl_multi_wakeup(this->multi_);
 }
 
 /**
- * notify thread waiting peer list to wake up
+ * Register consumer of tracker replies. The callback is
+ * invoked on the I/O thread after every successful announce,
+ * setting it to nullptr guarantees no invocation is running
+ * once this returns.
+ *
+ * @cb: callback taking the parsed tracker message
  */
 void
-tracker_agent::do_notify()
+tracker_agent::set_callback(Callback cb)
 {
-  unique_lock<mutex> lock(this->pslk_);
-  this->cv_.notify_one();
+  lock_guard<mutex> lock(this->cb_lock_);
+  this->callback_ = cb;
 }
 
 /**
  * Interface for updating number of uploaded bytes.
- * Thread safe
+ * Thread safe, lock free.
  */
 void 
 tracker_agent::update_upload(long long bytes)
 {
-  //acquire message lock
-  lock_guard<mutex> lock(this->mesg_lock_);
-
   this->upload_ += bytes;
 }
 
 /**
  * Interface for updating number of downloaded bytes.
- * Thread safe.
+ * Thread safe, lock free.
  */
 void 
 tracker_agent::update_download(long long bytes)
 {
-  //acquire message lock
-  lock_guard<mutex> lock(this->mesg_lock_);
-
   this->download_ += bytes;
 }
 
@@ -350,6 +541,8 @@ tracker_agent::update_download(long long bytes)
  */
 string tracker_agent::get_ip()
 {
+  lock_guard<mutex> lock(this->mesg_lock_);
+
   return this->ip_;
 }
 
@@ -408,59 +601,226 @@ vector<string> tracker_agent::get_peers()
 }
 
 /**
- * Send a HTTP GET request to remote tracker.
+ * Queue an announce for the I/O thread.
+ *
+ * @event: announce event
+ * @wait: block until the announce finished
+ * @wait_sec: upper bound of waiting in seconds, 0 for no bound
+ *
+ * Return: shared outcome of the announce, only meaningful
+ *         after done is set.
+ */
+shared_ptr<tracker_agent::Result>
+tracker_agent::announce(Event event, bool wait, int wait_sec)
+{
+  Round* round = new Round();               //new announce
+  shared_ptr<Result> res(new Result());     //outcome of announce
+
+  //prepare announce
+  round->event = event;
+  round->regular = false;
+  round->due = steady_clock::now();
+  round->result = res;
+
+  //hand over to I/O thread
+  unique_lock<mutex> lock(this->queue_lock_);
+  this->pending_.push_back(round);
+  curl_multi_wakeup(this->multi_);
+
+  if (!wait)
+    return res;
+
+  //wait for outcome
+  if (wait_sec)
+    this->done_cv_.wait_for(lock, seconds(wait_sec),
+                            [&res] {return res->done;});
+  else
+    this->done_cv_.wait(lock, [&res] {return res->done;});
+
+  return res;
+}
+
+/**
+ * Send announce to every tracker of the first tier, starting
+ * at round->tier, which has a tracker out of failure backoff.
+ * Trackers of the same tier are requested concurrently.
  *
- * The function can be triggerd either by main thread
- * via user command or thread perform periodical re-
- * questing. Thus, a mutual exclusion for accessing Me-
- * ssage is necessary.
+ * NOTE: called by I/O thread only.
  *
- * By sending, the function will also probe local
- * IP address and store it without data race.
+ * @round: announce to send
  *
- * @request: the HTTP GET request string
+ * Return: true if requests are launched, false if no tier is
+ *         left to try.
  */
-void tracker_agent::_send(string request)
+bool tracker_agent::start_round(Round* round)
 {
-  //set destination URL
-  status = 
-  curl_easy_setopt(this->handle_, CURLOPT_URL, request.c_str());
+  steady_clock::time_point now = steady_clock::now();  //current time
+  Request* req;                                        //tracker request
+  vector<Tracker*>* tier;                              //tier to try
+
+  //reset outcome of previous tier
+  round->ok = false;
+  round->waiting = 0;
+  round->mesg = Message();
+  round->seen.clear();
+  round->stats.clear();
+
+  for (; round->tier < this->tiers_.size(); round->tier++) {
+    tier = &this->tiers_[round->tier];
+
+    for (unsigned int i = 0; i < tier->size(); i++) {
+      //skip tracker still backing off
+      if ((*tier)[i]->retry_at > now) continue;
+
+      //skip tracker which cannot scrape
+      if (round->scrape && (*tier)[i]->scrape_url.empty()) continue;
+
+      if ((*tier)[i]->udp)
+        req = this->setup_udp((*tier)[i], round);
+      else {
+        req = this->setup_request((*tier)[i], round);
+        curl_multi_add_handle(this->multi_, req->easy);
+      }
+      lock_guard<mutex> lock(this->queue_lock_);
+      this->inflight_.insert(req);
+      round->waiting++;
+    }
+
+    if (round->waiting)
+      return true;
+  }
+  return false;
+}
 
+/**
+ * Create and configure curl easy handle of request.
+ * The GET parameters are fixed when request is created.
+ *
+ * @tracker: tracker to request
+ * @round: announce the request belongs to
+ *
+ * Return: request ready to be added to multi handle
+ */
+tracker_agent::Request*
+tracker_agent::setup_request(Tracker* tracker, Round* round)
+{
+  Request* req = new Request();  //new request
+  CURLcode status;               //curl status code
+
+  req->tracker = tracker;
+  req->round = round;
+  req->easy = curl_easy_init();
+  if (!req->easy)
+    error_handle(ERR_CURL);
+
+  //set destination URL
+  status =
+  curl_easy_setopt(req->easy, CURLOPT_URL,
+                   round->scrape ?
+                   this->compose_scrape(tracker, round->hashes).c_str() :
+                   this->compose_request(tracker, round->event).c_str());
   if (status != CURLE_OK)
     error_handle(ERR_CURL);
 
-  //perform request
-  status = 
-  curl_easy_perform(this->handle_);
+  //set curl handle perform HTTP GET
+  curl_easy_setopt(req->easy, CURLOPT_HTTPGET, 1L);
+
+  //set callback getting response headers
+  curl_easy_setopt(req->easy, CURLOPT_HEADERFUNCTION, 
+                   &tracker_agent::get_header);
+  curl_easy_setopt(req->easy, CURLOPT_HEADERDATA, &(req->headers));
+
+  //set response callback function
+  curl_easy_setopt(req->easy, CURLOPT_WRITEFUNCTION,
+                   &tracker_agent::_receive);
+  curl_easy_setopt(req->easy, CURLOPT_WRITEDATA, &(req->body));
+
+  //bound request time
+  curl_easy_setopt(req->easy, CURLOPT_TIMEOUT, tracker_agent::TIMEOUT_);
+  curl_easy_setopt(req->easy, CURLOPT_CONNECTTIMEOUT,
+                   tracker_agent::CONN_TIMEOUT_);
+  curl_easy_setopt(req->easy, CURLOPT_NOSIGNAL, 1L);
+
+  //set error message buffer
+  req->error[0] = 0;
+  curl_easy_setopt(req->easy, CURLOPT_ERRORBUFFER, req->error);
+
+  //link request to its handle
+  curl_easy_setopt(req->easy, CURLOPT_PRIVATE, req);
+
+  return req;
+}
+
+/**
+ * Start UDP announce or scrape of request, the reply is
+ * collected by serve_udp().
+ *
+ * @tracker: UDP tracker to request
+ * @round: announce the request belongs to
+ *
+ * Return: request waiting for UDP reply
+ */
+tracker_agent::Request*
+tracker_agent::setup_udp(Tracker* tracker, Round* round)
+{
+  Request* req = new Request();  //new request
+  udp_tracker::Announce para;    //announce parameters
+
+  req->easy = nullptr;
+  req->tracker = tracker;
+  req->round = round;
+  req->error[0] = 0;
 
-  if (status != CURLE_OK) {
-    cerr << error_msg << endl;
-    error_handle(ERR_TRACK);
+  if (round->scrape) {
+    tracker->udp->scrape(round->hashes, req);
+    return req;
   }
 
-  //notify thread waiting on peer list
-  this->do_notify();
+  para.info_hash = this->mi_->get_infohash();
+  para.peer_id = this->mi_->get_peerid();
+  para.downloaded = this->download_;
+  para.left = this->get_left();
+  para.uploaded = this->upload_;
+  para.port = stoi(this->mi_->get_port());
 
-  //store local IP
-  status =
-  curl_easy_getinfo(this->handle_, CURLINFO_LOCAL_IP, &this->ip_);
+  //map announce event
+  switch(round->event) {
+    case tracker_agent::EVNT_START:
+      para.event = udp_tracker::UEVNT_STARTED;
+      break;
+
+    case tracker_agent::EVNT_COMP:
+      para.event = udp_tracker::UEVNT_COMPLETED;
+      break;
+
+    case tracker_agent::EVNT_STOP:
+      para.event = udp_tracker::UEVNT_STOPPED;
+      break;
+
+    default:
+      para.event = udp_tracker::UEVNT_NONE;
+      break;
+  }
 
-  if(status != CURLE_OK && !this->ip_)
-    error_handle(ERR_IP);
+  tracker->udp->announce(para, req);
+  return req;
 }
 
 /**
  * Generate HTTP GET request string by appending parameters to the 
  * static URL string
  *
+ * @tracker: tracker to request
+ * @event: announce event
+ *
  * Return: URL with full GET parameters
  */
-string tracker_agent::compose_request()
+string tracker_agent::compose_request(Tracker* tracker, Event event)
 {
   string request;      //full GET request URL
 
   //compose request string
-  request = static_info_ + PARA_UPLD;
+  request = tracker->static_info + PARA_UPLD;
   request += to_string(this->upload_);
   request += PARA_DWLD;
   request += to_string(this->download_);
@@ -470,13 +830,13 @@ string tracker_agent::compose_request()
   request += string(tracker_agent::CMPAT_);
 
   //return if event is not specified
-  if (this->event_ == tracker_agent::EVNT_EMPTY) {
+  if (event == tracker_agent::EVNT_EMPTY) {
     return request;
   }
   request += PARA_EVNT;
 
   //check event
-  switch(this->event_) {
+  switch(event) {
     case tracker_agent::EVNT_START:
       //event start
       request += tracker_agent::START_;
@@ -500,26 +860,530 @@ string tracker_agent::compose_request()
 }
 
 /**
- * Peridocally request tracker to update local status,
- * the request interval is determined by last response
- * from tracker.
+ * Generate HTTP scrape request string carrying every info
+ * hash, so that one request covers many torrents.
+ *
+ * @tracker: tracker to request
+ * @hashes: info hashes to scrape
  *
- * NOTE: this member function is invoked by a timer
+ * Return: URL with full GET parameters
+ */
+string tracker_agent::compose_scrape(Tracker* tracker,
+                                     const vector<string>& hashes)
+{
+  string request = tracker->scrape_url;  //full GET request URL
+  char* encoded;                         //urlencoded info hash
+
+  for (unsigned int i = 0; i < hashes.size(); i++) {
+    encoded = curl_easy_escape(nullptr, hashes[i].c_str(), hashes[i].size());
+    request += (!i && request.find('?') == string::npos) ? "?" : "&";
+    request += PARA_INFO.substr(1) + string(encoded);
+    curl_free(encoded);
+  }
+  return request;
+}
+
+/**
+ * I/O thread job. Drive all transfers on the multi handle,
+ * collect finished ones and sleep until the next transfer
+ * activity, queued announce or periodical announce.
  */
 void tracker_agent::run_service()
 {
-  //acquire message lock
-  lock_guard<mutex> lock(this->mesg_lock_);
+  int active;         //number of running transfers
+  int left;           //messages left in queue
+  CURLMsg* msg;       //transfer message
+  CURLcode code;      //transfer result
+  Request* req;       //request of finished transfer
+  vector<curl_waitfd> udp_fds;  //UDP sockets to poll
+  udp_tracker* udp;             //UDP client of tracker
+  steady_clock::time_point deadline; //next UDP retransmit
+  int wait;                     //poll timeout in ms
+
+  while (this->running_) {
+    //start announces whose time has come
+    this->launch_due();
+
+    //perform transfers
+    curl_multi_perform(this->multi_, &active);
+
+    //handle finished transfers
+    while ((msg = curl_multi_info_read(this->multi_, &left))) {
+      if (msg->msg != CURLMSG_DONE) continue;
+
+      code = msg->data.result;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &req);
+      curl_multi_remove_handle(this->multi_, msg->easy_handle);
+      {
+        lock_guard<mutex> lock(this->queue_lock_);
+        this->inflight_.erase(req);
+      }
+      this->finish_request(req, code);
+    }
+
+    //drive UDP trackers
+    deadline = this->serve_udp();
+
+    //collect UDP sockets waiting for replies
+    udp_fds.clear();
+    for (unsigned int i = 0; i < this->tiers_.size(); i++)
+      for (unsigned int j = 0; j < this->tiers_[i].size(); j++) {
+        udp = this->tiers_[i][j]->udp;
+        if (!udp || !udp->busy() || udp->get_fd() < 0) continue;
+        udp_fds.push_back({udp->get_fd(), CURL_WAIT_POLLIN, 0});
+      }
+
+    //sleep no longer than next UDP retransmit
+    wait = tracker_agent::IDLE_WAIT_;
+    if (deadline != steady_clock::time_point::max())
+      wait = max(0L, min((long)wait,
+                 (long)duration_cast<milliseconds>(
+                 deadline-steady_clock::now()).count()+1));
+
+    //wait for activity, woken up by curl_multi_wakeup()
+    curl_multi_poll(this->multi_, udp_fds.data(), udp_fds.size(),
+                    wait, nullptr);
+  }
+}
+
+/**
+ * Receive and retransmit on UDP trackers, then handle
+ * finished UDP transactions.
+ *
+ * Return: earliest time a UDP transaction needs service
+ */
+steady_clock::time_point tracker_agent::serve_udp()
+{
+  steady_clock::time_point deadline = steady_clock::time_point::max();
+  vector<udp_tracker::Reply> replies;  //finished transactions
+  udp_tracker* udp;                    //UDP client of tracker
+
+  for (unsigned int i = 0; i < this->tiers_.size(); i++)
+    for (unsigned int j = 0; j < this->tiers_[i].size(); j++) {
+      udp = this->tiers_[i][j]->udp;
+      if (!udp) continue;
+
+      udp->on_readable();
+      udp->on_timer();
+      udp->take_done(replies);
+    }
+
+  //finishing may start next tier, so deadlines are taken afterwards
+  for (unsigned int i = 0; i < replies.size(); i++)
+    this->finish_udp(replies[i]);
+
+  for (unsigned int i = 0; i < this->tiers_.size(); i++)
+    for (unsigned int j = 0; j < this->tiers_[i].size(); j++) {
+      udp = this->tiers_[i][j]->udp;
+      if (udp)
+        deadline = min(deadline, udp->get_deadline());
+    }
+  return deadline;
+}
+
+/**
+ * Start announces whose due time has passed, and queue a
+ * periodical announce when it is time.
+ */
+void tracker_agent::launch_due()
+{
+  steady_clock::time_point now = steady_clock::now();  //current time
+  vector<Round*> due;                                  //announces to start
+  Round* round;                                        //periodical announce
+
+  {
+    lock_guard<mutex> lock(this->queue_lock_);
+
+    //periodical announce
+    if (!this->regular_busy_ && now >= this->next_regular_) {
+      round = new Round();
+      round->event = tracker_agent::EVNT_EMPTY;
+      round->regular = true;
+      round->due = now;
+      round->result = shared_ptr<Result>(new Result());
+      this->pending_.push_back(round);
+      this->regular_busy_ = true;
+    }
+
+    for (auto it = this->pending_.begin(); it != this->pending_.end();) {
+      if ((*it)->due > now) {
+        it++;
+        continue;
+      }
+      due.push_back(*it);
+      it = this->pending_.erase(it);
+    }
+  }
+
+  for (unsigned int i = 0; i < due.size(); i++) {
+    due[i]->tier = 0;
+    if (this->start_round(due[i])) continue;
+
+    //no tracker can scrape
+    if (due[i]->scrape) {
+      this->settle(due[i], false);
+      continue;
+    }
+
+    //every tracker is backing off, retry when the first one recovers
+    due[i]->due = steady_clock::time_point::max();
+    for (unsigned int t = 0; t < this->tiers_.size(); t++)
+      for (unsigned int j = 0; j < this->tiers_[t].size(); j++)
+        due[i]->due = min(due[i]->due, this->tiers_[t][j]->retry_at);
+
+    lock_guard<mutex> lock(this->queue_lock_);
+    this->pending_.push_back(due[i]);
+  }
+}
+
+/**
+ * Handle a finished HTTP transfer, decode the reply and
+ * account it to its announce.
+ *
+ * @req: finished request
+ * @code: transfer result
+ */
+void tracker_agent::finish_request(Request* req, CURLcode code)
+{
+  Message mesg = {};         //parsed reply
+  be_node* node;             //bencode nodes
+  char* local_ip;            //local address of connection
+  bool ok = false;           //reply is valid
+
+  if (code == CURLE_OK && req->round->scrape) {
+    //decode scrape response
+    ok = this->parse_scrape(req->round, req->body);
+    if (!ok)
+      snprintf(req->error, CURL_ERROR_SIZE, "malformatted scrape response");
+  }
+  else if (code == CURLE_OK) {
+    //decode response
+    node = be_decoden(req->body.c_str(), (long long)req->body.size());
+    if (node && node->type == BE_DICT)
+      ok = be_node_parser(node, nullptr, &mesg);
+    if (node)
+      be_free(node);
+    if (!ok)
+      snprintf(req->error, CURL_ERROR_SIZE, "malformatted response");
+    else if (!mesg.failure.empty()) {
+      //tracker refused announce, fail over like any failure
+      snprintf(req->error, CURL_ERROR_SIZE, "failure reason: %s",
+               mesg.failure.c_str());
+      ok = false;
+    }
+  }
+
+  //status line and local address of reply
+  req->status = req->headers.substr(0, req->headers.find_first_of(DELIM));
+  if (curl_easy_getinfo(req->easy, CURLINFO_LOCAL_IP,
+                        &local_ip) == CURLE_OK && local_ip)
+    req->ip = string(local_ip);
+
+  curl_easy_cleanup(req->easy);
+  req->easy = nullptr;
+  this->conclude(req, ok, mesg);
+}
+
+/**
+ * Handle a finished UDP transaction and account it
+ * to its announce or scrape.
+ *
+ * @reply: outcome of transaction, cookie is the request
+ */
+void tracker_agent::finish_udp(udp_tracker::Reply& reply)
+{
+  Message mesg = {};                       //converted reply
+  Request* req = (Request*)reply.cookie;   //request of transaction
 
-  //reset peers
-  this->mesg_.peers.clear();
+  {
+    lock_guard<mutex> lock(this->queue_lock_);
+    this->inflight_.erase(req);
+  }
 
-  //perform a request
-  this->_send(this->compose_request());
+  if (reply.ok && req->round->scrape) {
+    //swarms are listed in order of requested hashes
+    for (unsigned int i = 0; i < reply.swarms.size() &&
+         i < req->round->hashes.size(); i++) {
+      Stats& stats = req->round->stats[req->round->hashes[i]];
+      stats.seeders = max(stats.seeders, reply.swarms[i].seeders);
+      stats.completed = max(stats.completed, reply.swarms[i].completed);
+      stats.leechers = max(stats.leechers, reply.swarms[i].leechers);
+    }
+    req->round->ok = true;
+  }
+  else if (reply.ok) {
+    mesg.interv = reply.interval;
+    mesg.min_interv = reply.interval;
+    mesg.cmpt = reply.seeders;
+    mesg.incmpt = reply.leechers;
+    for (unsigned int i = 0; i < reply.peers.size(); i++)
+      mesg.peers.push_back(convert_order(&reply.peers[i][0]));
+    req->status = UDP_OK;
+    req->ip = req->tracker->udp->get_ip();
+  }
+  else
+    snprintf(req->error, CURL_ERROR_SIZE, "%s", reply.error.c_str());
 
-  //start a new tracking timer
-  this->timer_->start(min(this->mesg_.interv, 
-                          this->mesg_.min_interv));
+  this->conclude(req, reply.ok, mesg);
+}
+
+/**
+ * Account a tracker reply to its announce. A valid reply
+ * is merged into the announce, a failed tracker backs off
+ * exponentially. When the whole tier has answered, the
+ * merged reply is published, or the next tier is tried
+ * when none replied. Scrapes merge into round->stats and
+ * never put a tracker into backoff. After every tier failed the announce
+ * is retried from the first tier up to MAX_RETRY_ times.
+ *
+ * @req: finished request, released here
+ * @ok: tracker replied with a valid message
+ * @mesg: parsed reply
+ */
+void tracker_agent::conclude(Request* req, bool ok, Message& mesg)
+{
+  Round* round = req->round;        //announce of request
+  Tracker* tracker = req->tracker;  //tracker requested
+
+  if (round->scrape) {
+    //a tracker without scrape support must not delay announces
+    if (!ok)
+      cerr << "scrape " << tracker->url << ": " << req->error << endl;
+  }
+  else if (ok) {
+    tracker->fails = 0;
+    this->merge_reply(round, mesg, req);
+  }
+  else {
+    //back off this tracker
+    cerr << "tracker " << tracker->url << ": " << req->error << endl;
+    tracker->retry_at = steady_clock::now() +
+                        seconds(tracker_agent::RETRY_BASE_ <<
+                                min(tracker->fails,
+                                    (int)tracker_agent::MAX_BACKOFF_));
+    tracker->fails++;
+  }
+
+  delete req;
+
+  //wait for the rest of tier
+  if (--round->waiting) return;
+
+  if (round->ok) {
+    if (round->scrape)
+      this->store_stats(round);
+    else
+      this->publish(round);
+    this->settle(round, true);
+    return;
+  }
+
+  //fail over to next tier
+  round->tier++;
+  if (this->start_round(round)) return;
+
+  //every tier failed, scrapes are not retried
+  if (round->scrape || ++round->attempt > tracker_agent::MAX_RETRY_ ||
+      !this->running_) {
+    this->settle(round, false);
+    return;
+  }
+
+  //retry from first tier, launch_due() waits for backoff
+  lock_guard<mutex> lock(this->queue_lock_);
+  round->due = steady_clock::now();
+  this->pending_.push_back(round);
+}
+
+/**
+ * Merge a tracker reply into its announce. Peers are
+ * deduplicated, swarm sizes take the largest report and
+ * intervals follow the first tracker which replied. The
+ * tracker is moved to the front of its tier (BEP 12).
+ *
+ * @round: announce being answered
+ * @mesg: parsed reply of tracker
+ * @req: request carrying the reply
+ */
+void tracker_agent::merge_reply(Round* round, Message& mesg, Request* req)
+{
+  vector<Tracker*>* tier = &this->tiers_[round->tier]; //tier of tracker
+
+  if (!round->ok) {
+    //first reply of tier sets intervals and status
+    round->mesg.interv = mesg.interv;
+    round->mesg.min_interv = mesg.min_interv;
+    round->mesg.track_id = mesg.track_id;
+
+    round->result->status = req->status;
+    round->ip = req->ip;
+  }
+  round->ok = true;
+
+  round->mesg.cmpt = max(round->mesg.cmpt, mesg.cmpt);
+  round->mesg.incmpt = max(round->mesg.incmpt, mesg.incmpt);
+
+  //deduplicate peers across trackers
+  for (unsigned int i = 0; i < mesg.peers.size(); i++) {
+    if (!round->seen.insert(mesg.peers[i]).second) continue;
+    round->mesg.peers.push_back(mesg.peers[i]);
+  }
+
+  //prefer responsive tracker next time
+  for (auto it = tier->begin(); it != tier->end(); it++) {
+    if (*it != req->tracker) continue;
+    tier->erase(it);
+    tier->insert(tier->begin(), req->tracker);
+    break;
+  }
+}
+
+/**
+ * Parse a HTTP scrape reply and merge it into the scrape,
+ * counts take the largest report among trackers.
+ *
+ * @round: scrape being answered
+ * @body: bencoded reply
+ *
+ * Return: true if reply is valid
+ */
+bool tracker_agent::parse_scrape(Round* round, const string& body)
+{
+  be_node* node;     //reply dictionary
+  be_node* files;    //files dictionary
+  be_node* file;     //statistics of one hash
+  string hash;       //info hash of entry
+  bool ok = false;   //reply is valid
+
+  node = be_decoden(body.c_str(), (long long)body.size());
+  if (!node) return false;
+  if (node->type != BE_DICT) goto _EXIT;
+
+  for (int i = 0; node->val.d[i].val; i++) {
+    if (strcmp(node->val.d[i].key, FILES)) continue;
+    files = node->val.d[i].val;
+    if (files->type != BE_DICT) goto _EXIT;
+
+    for (int j = 0; files->val.d[j].val; j++) {
+      file = files->val.d[j].val;
+      if (file->type != BE_DICT) continue;
+      hash = string(files->val.d[j].key, be_key_len(files->val.d[j].key));
+      Stats& stats = round->stats[hash];
+
+      for (int k = 0; file->val.d[k].val; k++) {
+        if (file->val.d[k].val->type != BE_INT) continue;
+        if (!strcmp(file->val.d[k].key, CMPT))
+          stats.seeders = max(stats.seeders, (int)file->val.d[k].val->val.i);
+        else if (!strcmp(file->val.d[k].key, DWNED))
+          stats.completed = max(stats.completed, (int)file->val.d[k].val->val.i);
+        else if (!strcmp(file->val.d[k].key, INCMPT))
+          stats.leechers = max(stats.leechers, (int)file->val.d[k].val->val.i);
+      }
+    }
+    ok = true;
+    round->ok = true;
+  }
+
+_EXIT:
+  be_free(node);
+  return ok;
+}
+
+/**
+ * Store merged scrape reply in cache
+ *
+ * @round: finished scrape
+ */
+void tracker_agent::store_stats(Round* round)
+{
+  steady_clock::time_point now = steady_clock::now();  //time of scrape
+  lock_guard<mutex> lock(this->stats_lock_);
+
+  for (auto it = round->stats.begin(); it != round->stats.end(); it++) {
+    it->second.fetched = now;
+    this->stats_[it->first] = it->second;
+  }
+}
+
+/**
+ * Store merged reply and local IP, then publish the
+ * reply to consumer.
+ *
+ * @round: finished announce
+ */
+void tracker_agent::publish(Round* round)
+{
+  {
+    lock_guard<mutex> lock(this->mesg_lock_);
+    this->mesg_ = round->mesg;
+    if (!round->ip.empty())
+      this->ip_ = round->ip;
+  }
+
+  lock_guard<mutex> lock(this->cb_lock_);
+  if (this->callback_)
+    this->callback_(round->mesg);
+}
+
+/**
+ * Finish an announce, schedule the next periodical announce
+ * and wake up threads waiting on it.
+ *
+ * @round: finished announce
+ * @ok: announce outcome
+ */
+void tracker_agent::settle(Round* round, bool ok)
+{
+  //allow hashes to be scraped again, a hash left unanswered
+  //is backed off like a failed scrape
+  if (round->scrape) {
+    lock_guard<mutex> lock(this->stats_lock_);
+    for (unsigned int i = 0; i < round->hashes.size(); i++) {
+      const string& hash = round->hashes[i];
+      this->scraping_.erase(hash);
+      if (ok && round->stats.count(hash))
+        this->scrape_retry_.erase(hash);
+      else
+        this->scrape_retry_[hash] = steady_clock::now() +
+                                    seconds((int)tracker_agent::STATS_TTL_);
+    }
+  }
+
+  lock_guard<mutex> lock(this->queue_lock_);
+
+  //every announce restarts periodical countdown
+  if (round->regular)
+    this->regular_busy_ = false;
+  if (!round->scrape && round->event != tracker_agent::EVNT_STOP) {
+    this->last_regular_ = steady_clock::now();
+    this->next_regular_ = this->last_regular_ +
+                          seconds(this->next_interval());
+  }
+
+  round->result->ok = ok;
+  round->result->done = true;
+  this->done_cv_.notify_all();
+
+  delete round;
+}
+
+/**
+ * Compute the interval of periodical announce from
+ * last reply of tracker.
+ *
+ * Return: interval in seconds
+ */
+int tracker_agent::next_interval()
+{
+  lock_guard<mutex> lock(this->mesg_lock_);
+
+  if (this->mesg_.interv > 0 && this->mesg_.min_interv > 0)
+    return min(this->mesg_.interv, this->mesg_.min_interv);
+  if (this->mesg_.interv > 0)
+    return this->mesg_.interv;
+  if (this->mesg_.min_interv > 0)
+    return this->mesg_.min_interv;
+  return tracker_agent::DEF_INTERV_;
 }
 
 /**
@@ -547,35 +1411,23 @@ tracker_agent::get_header(char *buffer, size_t size,
 
 /**
  * Callback function for receiving reponse body.
- * The response message are bencoded.
+ * The body may arrive in several pieces, it is
+ * collected here and decoded once complete.
  *
  * @buffer: ptr to response
  * @size: size of one data item
  * @nmemb: number of data items
- * @message: passed tracker_agent::Message pointer
+ * @body: passed string to store body
  *
  * Return: bytes processed.
  */
 size_t 
 tracker_agent::_receive(void *buffer, size_t size, 
-                        size_t nmemb, void *message)
+                        size_t nmemb, void *body)
 {
   size_t len = size*nmemb;  //response length
-  be_node* node;            //bencode nodes
-
-  //decode resposne
-  node = be_decoden((char*)buffer, (long long)len);
-  if (!node)
-    return len;
 
-  //check response format
-  if (node->type != BE_DICT)
-    error_handle(ERR_RESP);
-
-  be_node_parser(node, nullptr, (Message*) message);
-
-  //clean up nodes
-  be_free(node);
+  ((string*) body)->append((char*) buffer, len);
   return len;
 }
 
@@ -585,9 +1437,10 @@ tracker_agent::_receive(void *buffer, size_t size,
  * @node: be_node pointer
  * @key: be_node dictionary key
  * @resp: pointer to tracker_agent::Message
- * @peer_ptr: pointer to a peer, used by internal recursive
+ *
+ * Return: false if the reply is malformatted
  */
-static void
+static bool
 be_node_parser(be_node* node, char* key,
                tracker_agent::Message* resp)
 {
@@ -601,7 +1454,7 @@ be_node_parser(be_node* node, char* key,
       if (!strcmp(key, PEERS)) {  //tracker reply binary mode
         //validate peer field
         if (msg.size()%PEER_LEN)
-          error_handle(ERR_RESP);
+          return false;
 
         //store each peer in vector
         while (!msg.empty()) {
@@ -619,7 +1472,8 @@ be_node_parser(be_node* node, char* key,
         resp->track_id = msg;
       }
       else if (!strcmp(key, FAIL)) {
-        cerr << "error: " << msg << endl;
+        //the announce failed, reason is reported by caller
+        resp->failure = msg;
       }
       else if (!strcmp(key, WARNING)) {
         cout << "warning: " << msg << endl << flush;
@@ -644,16 +1498,18 @@ be_node_parser(be_node* node, char* key,
 
     case BE_LIST:
       //should never reach here
-      error_handle(ERR_RESP);
+      return false;
 
     case BE_DICT:
       //iterate through bencode dictionary
       for (int i = 0; node->val.d[i].val; ++i)
-        be_node_parser(node->val.d[i].val, 
-                       node->val.d[i].key, 
-                       resp);
+        if (!be_node_parser(node->val.d[i].val, 
+                            node->val.d[i].key, 
+                            resp))
+          return false;
       break;
   }
+  return true;
 }
 
 /**
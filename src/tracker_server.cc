@@ -0,0 +1,694 @@
+/**
+ * Implementation of class tracker_server.
+ * See class defination: '../include/tracker_server.h'
+ *
+ */
+
+#include <tracker_server.h>
+#include <iomanip>        /* std::setw() */
+#include <cstring>        /* memcpy() */
+#include <cstdlib>        /* strtoll() */
+#include <random>         /* std::random_device */
+#include <endian.h>       /* htobe64() and be64toh() */
+#include <unistd.h>       /* close(), pipe(), read() and write() */
+#include <fcntl.h>        /* fcntl() */
+#include <poll.h>         /* poll() */
+#include <netdb.h>        /* getaddrinfo() */
+#include <arpa/inet.h>    /* htonl(), ntohl() and inet_ntop() */
+#include <sys/socket.h>   /* socket syscalls */
+
+/************* Constants *************/
+static const string HTTP_OK = "HTTP/1.0 200 OK\r\n";            /* HTTP status line */
+static const string HTTP_BAD = "HTTP/1.0 400 Bad Request\r\n";  /* HTTP error status line */
+static const string HTTP_TYPE = "Content-Type: text/plain\r\n"; /* HTTP content type */
+static const string HTTP_LEN = "Content-Length: ";              /* HTTP content length */
+static const string HTTP_END = "\r\n\r\n";                      /* end of HTTP header */
+static const string ANNOUNCE = "/announce";                     /* announce path */
+static const string SCRAPE = "/scrape";                         /* scrape path */
+static const string PARA_INFO = "info_hash=";                   /* info hash parameter */
+static const char* FAIL = "failure reason";                     /* reply failure reason key */
+static const char* INTERV = "interval";                         /* reply interval key */
+static const char* MIN_INTERV = "min interval";                 /* reply min interval key */
+static const char* CMPT = "complete";                           /* reply complete key */
+static const char* INCMPT = "incomplete";                       /* reply incomplete key */
+static const char* PEERS = "peers";                             /* reply peers key */
+static const char* FILES = "files";                             /* scrape reply files key */
+static const char* DWNED = "downloaded";                        /* scrape reply downloaded key */
+static const string COMPLETED = "completed";                    /* event completed */
+static const string STOPPED = "stopped";                        /* event stopped */
+static const long long PROTOCOL_ID = 0x41727101980LL;           /* UDP connect magic */
+static const int ACT_CONNECT = 0;                               /* UDP connect action */
+static const int ACT_ANNOUNCE = 1;                              /* UDP announce action */
+static const int ACT_SCRAPE = 2;                                /* UDP scrape action */
+static const int ACT_ERROR = 3;                                 /* UDP error action */
+static const int CONN_EPOCH = 60;                               /* seconds a UDP connection id lives */
+static const int UDP_CONN_LEN = 16;                             /* UDP connect request length */
+static const int UDP_ANN_LEN = 98;                              /* UDP announce request length */
+static const int MAX_SCRAPE = 74;                               /* info hashes per UDP scrape */
+static const int HASH_LEN = 20;                                 /* length of info hash */
+static const int PEER_LEN = 6;                                  /* bytes of compact peer */
+
+/********** Internal Function **********/
+static string url_decode(const string& str);
+static string query_value(const string& query, const string& key);
+static bool ends_with(const string& str, const string& suffix);
+static void put32(unsigned char* buff, unsigned int val);
+static unsigned int get32(const unsigned char* buff);
+static string hex_string(const string& bytes);
+static unsigned long long peer_key(const char* addr);
+
+/**
+ * Constructor - bind HTTP and UDP sockets on port and
+ * launch the service thread.
+ *
+ * @port: port to serve on, for both TCP and UDP
+ * @interval: announce interval handed out to peers
+ */
+tracker_server::tracker_server(string port, int interval)
+               : port_(port), interval_(interval)
+{
+  random_device rd;  //seed of connection id secret
+
+  if (this->interval_ <= 0)
+    this->interval_ = tracker_server::DEF_INTERV_;
+  this->secret_ = ((unsigned long long)rd() << 32) | rd();
+  this->announces_ = 0;
+
+  this->setup();
+
+  this->running_ = true;
+  this->worker_ = thread(&tracker_server::run_service, this);
+}
+
+/**
+ * Destructor - stop service thread and close sockets
+ */
+tracker_server::~tracker_server()
+{
+  char byte = 0;  //wake up byte
+
+  this->running_ = false;
+  if (write(this->wake_[1], &byte, 1) < 0)
+    fail_handle(FAL_SYS);
+  this->worker_.join();
+
+  for (auto it = this->clients_.begin(); it != this->clients_.end(); it++)
+    close(it->first);
+  close(this->tcpfd_);
+  close(this->udpfd_);
+  close(this->wake_[0]);
+  close(this->wake_[1]);
+}
+
+/**
+ * Print out every swarm with its peer counts
+ */
+void tracker_server::show_info()
+{
+  lock_guard<mutex> lock(this->swarm_lock_);
+
+  cout << "\tinfo hash                                | seeders | leechers | completed\n";
+  for (auto it = this->swarms_.begin(); it != this->swarms_.end(); it++) {
+    cout << "\t" << hex_string(it->first) << " | ";
+    cout << setw(7) << left << it->second.seeders << " | ";
+    cout << setw(8) << left <<
+         it->second.peers.size()-it->second.seeders << " | ";
+    cout << it->second.completed << endl;
+  }
+  cout << "\t" << this->announces_ << " announces served" << endl;
+}
+
+/**
+ * Interface for retrieving number of swarms
+ */
+size_t tracker_server::get_swarms()
+{
+  lock_guard<mutex> lock(this->swarm_lock_);
+  return this->swarms_.size();
+}
+
+/**
+ * Interface for retrieving number of announces served
+ */
+long long tracker_server::get_announces()
+{
+  return this->announces_;
+}
+
+/**
+ * Bind TCP and UDP sockets on port, every socket
+ * watched by service thread is non-blocking.
+ */
+void tracker_server::setup()
+{
+  addrinfo hint = {};     //hint info for getaddrinfo(), zero initialized
+  addrinfo *result;       //address result
+  int yes = 1;            //option val for setsockopt()
+
+  hint.ai_family = AF_INET;
+  hint.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(nullptr, this->port_.c_str(), &hint, &result))
+    error_handle(ERR_BIND, this->port_);
+
+  //HTTP listener
+  this->tcpfd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (this->tcpfd_ < 0)
+    error_handle(ERR_SYS);
+  if (setsockopt(this->tcpfd_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)))
+    error_handle(ERR_SYS);
+  if (bind(this->tcpfd_, result->ai_addr, result->ai_addrlen) ||
+      listen(this->tcpfd_, tracker_server::QUEUE_LEN_))
+    error_handle(ERR_BIND, this->port_);
+
+  //UDP socket
+  this->udpfd_ = socket(AF_INET, SOCK_DGRAM, 0);
+  if (this->udpfd_ < 0)
+    error_handle(ERR_SYS);
+  if (bind(this->udpfd_, result->ai_addr, result->ai_addrlen))
+    error_handle(ERR_BIND, this->port_);
+
+  freeaddrinfo(result);
+
+  //self pipe to stop service thread
+  if (pipe(this->wake_))
+    error_handle(ERR_SYS);
+
+  fcntl(this->tcpfd_, F_SETFL, fcntl(this->tcpfd_, F_GETFL) | O_NONBLOCK);
+  fcntl(this->udpfd_, F_SETFL, fcntl(this->udpfd_, F_GETFL) | O_NONBLOCK);
+}
+
+/**
+ * Service thread job. Poll sockets and serve ready ones,
+ * idle HTTP clients are dropped after CLIENT_TO_ seconds.
+ */
+void tracker_server::run_service()
+{
+  vector<struct pollfd> fds;   //descriptors to poll
+  steady_clock::time_point now; //current time
+  bool keep;                   //client connection still open
+
+  while (this->running_) {
+    //listener, UDP socket, wake up pipe and clients
+    fds.clear();
+    fds.push_back({this->tcpfd_, POLLIN, 0});
+    fds.push_back({this->udpfd_, POLLIN, 0});
+    fds.push_back({this->wake_[0], POLLIN, 0});
+    for (auto it = this->clients_.begin(); it != this->clients_.end(); it++)
+      fds.push_back({it->first, POLLIN, 0});
+
+    if (poll(fds.data(), fds.size(), tracker_server::POLL_WAIT_) < 0)
+      continue;
+
+    if (fds[0].revents)
+      this->accept_clients();
+    if (fds[1].revents)
+      this->serve_udp();
+
+    //serve clients
+    now = steady_clock::now();
+    for (unsigned int i = 3; i < fds.size(); i++) {
+      Client& client = this->clients_[fds[i].fd];
+
+      keep = fds[i].revents ? this->serve_client(fds[i].fd, client) :
+             (now-client.since < seconds((int)tracker_server::CLIENT_TO_));
+      if (keep) continue;
+
+      close(fds[i].fd);
+      this->clients_.erase(fds[i].fd);
+    }
+  }
+}
+
+/**
+ * Accept every pending HTTP connection
+ */
+void tracker_server::accept_clients()
+{
+  int fd;  //client socket
+
+  while ((fd = accept(this->tcpfd_, nullptr, nullptr)) >= 0) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    this->clients_[fd].since = steady_clock::now();
+  }
+}
+
+/**
+ * Read available bytes of a HTTP client, reply and hang
+ * up once the request header is complete.
+ *
+ * @fd: client socket
+ * @client: client state
+ *
+ * Return: true if connection is kept open
+ */
+bool tracker_server::serve_client(int fd, Client& client)
+{
+  char buff[tracker_server::DGRAM_SIZE_]; //receive buffer
+  ssize_t rdsz;                           //bytes read
+  struct sockaddr_in peer = {};           //client address
+  socklen_t len = sizeof(peer);           //address length
+  string reply;                           //HTTP reply
+
+  while ((rdsz = recv(fd, buff, sizeof(buff), 0)) > 0)
+    client.buff.append(buff, rdsz);
+
+  //peer closed or request too large
+  if (!rdsz || client.buff.size() > (size_t)tracker_server::MAX_REQ_)
+    return false;
+
+  if (client.buff.find(HTTP_END) == string::npos)
+    return true;
+
+  getpeername(fd, (struct sockaddr*)&peer, &len);
+  reply = this->http_reply(client.buff, peer.sin_addr.s_addr);
+
+  //reply is small, a single send suffices on a fresh connection
+  if (send(fd, reply.data(), reply.size(), MSG_NOSIGNAL) < 0)
+    fail_handle(FAL_SYS);
+  return false;
+}
+
+/**
+ * Answer a HTTP GET announce with a compact bencoded reply.
+ *
+ * @request: HTTP request header
+ * @ip: client address, network order
+ *
+ * Return: full HTTP reply
+ */
+string tracker_server::http_reply(const string& request, unsigned int ip)
+{
+  Announce ann;          //decoded announce
+  string target;         //request target
+  string query;          //query string of target
+  string peers;          //compact peers
+  string body;           //bencoded body
+  string addr;           //client supplied address
+  be_node* dict;         //reply dictionary
+  char* encoded;         //bencoded reply
+  long long len = 0;     //length of bencoded reply
+  int seeders;           //number of seeds
+  int leechers;          //number of leechers
+  size_t sp;             //end of request target
+
+  //request line: GET <target> HTTP/1.x
+  if (request.compare(0, 4, "GET "))
+    return HTTP_BAD+HTTP_LEN+"0"+HTTP_END;
+  sp = request.find(' ', 4);
+  target = request.substr(4, sp-4);
+  if (target.find('?') != string::npos)
+    query = target.substr(target.find('?')+1);
+  target = target.substr(0, target.find('?'));
+
+  dict = be_create_dict();
+
+  //decode announce
+  ann.info_hash = url_decode(query_value(query, "info_hash"));
+  ann.port = atoi(query_value(query, "port").c_str());
+  ann.left = strtoll(query_value(query, "left").c_str(), nullptr, 10);
+  ann.event = query_value(query, "event");
+  ann.numwant = query_value(query, "numwant").empty() ? -1 :
+                atoi(query_value(query, "numwant").c_str());
+  ann.ip = ip;
+  addr = query_value(query, "ip");
+  if (!addr.empty())
+    inet_pton(AF_INET, addr.c_str(), &ann.ip);
+
+  if (ends_with(target, SCRAPE))
+    be_dict_add(dict, FILES, this->scrape_files(query));
+  else if (!ends_with(target, ANNOUNCE))
+    be_dict_add(dict, FAIL, be_create_str("unknown request", 15));
+  else if (ann.info_hash.size() != (size_t)HASH_LEN || !ann.port)
+    be_dict_add(dict, FAIL, be_create_str("invalid announce", 16));
+  else {
+    seeders = this->update_swarm(ann, peers, leechers);
+    be_dict_add(dict, CMPT, be_create_int(seeders));
+    be_dict_add(dict, INCMPT, be_create_int(leechers));
+    be_dict_add(dict, INTERV, be_create_int(this->interval_));
+    be_dict_add(dict, MIN_INTERV, be_create_int(this->interval_/2));
+    be_dict_add(dict, PEERS, be_create_str(peers.data(), peers.size()));
+  }
+
+  encoded = be_encode(dict, &len);
+  be_free(dict);
+  if (encoded) {
+    body.assign(encoded, len);
+    free(encoded);
+  }
+
+  return HTTP_OK+HTTP_TYPE+HTTP_LEN+to_string(body.size())+HTTP_END+body;
+}
+
+/**
+ * Build files dictionary of a HTTP scrape, every info_hash
+ * parameter is answered, unknown swarms are left out.
+ *
+ * @query: query string of request
+ *
+ * Return: files dictionary keyed by raw info hash
+ */
+be_node* tracker_server::scrape_files(const string& query)
+{
+  be_node* files = be_create_dict();  //files dictionary
+  be_node* file;                      //statistics of one swarm
+  string hash;                        //decoded info hash
+  size_t pos = 0;                     //start of current pair
+  size_t end;                         //end of current pair
+  int seeders, completed, leechers;   //swarm statistics
+
+  while (pos < query.size()) {
+    end = query.find('&', pos);
+    if (end == string::npos)
+      end = query.size();
+
+    if (!query.compare(pos, PARA_INFO.size(), PARA_INFO)) {
+      hash = url_decode(query.substr(pos+PARA_INFO.size(),
+                                     end-pos-PARA_INFO.size()));
+      if (this->swarm_stats(hash, seeders, completed, leechers)) {
+        file = be_create_dict();
+        be_dict_add(file, CMPT, be_create_int(seeders));
+        be_dict_add(file, DWNED, be_create_int(completed));
+        be_dict_add(file, INCMPT, be_create_int(leechers));
+        be_dict_addn(files, hash.data(), hash.size(), file);
+      }
+    }
+    pos = end+1;
+  }
+  return files;
+}
+
+/**
+ * Answer every queued UDP datagram. Connection ids are
+ * derived from the peer address and a secret, so no
+ * state is kept per UDP peer (BEP 15).
+ */
+void tracker_server::serve_udp()
+{
+  unsigned char buff[tracker_server::DGRAM_SIZE_]; //datagram buffer
+  unsigned char reply[tracker_server::DGRAM_SIZE_];//reply buffer
+  struct sockaddr_in from;             //sender address
+  socklen_t fromlen;                   //sender address length
+  ssize_t len;                         //datagram length
+  long long epoch;                     //current connection id epoch
+  unsigned long long cid;              //connection id of request
+  unsigned int action;                 //request action
+  Announce ann;                        //decoded announce
+  string peers;                        //compact peers
+  int seeders, leechers;               //swarm sizes
+  int completed;                       //completed downloads
+  int rlen;                            //reply length
+  static const char* EVENTS[] = {"", "completed", "started", "stopped"};
+
+  for (;;) {
+    fromlen = sizeof(from);
+    len = recvfrom(this->udpfd_, buff, sizeof(buff), 0,
+                   (struct sockaddr*)&from, &fromlen);
+    if (len < 0) break;
+    if (len < UDP_CONN_LEN) continue;
+
+    epoch = duration_cast<seconds>(
+            steady_clock::now().time_since_epoch()).count()/CONN_EPOCH;
+    memcpy(&cid, buff, sizeof(cid));
+    cid = be64toh(cid);
+    action = get32(buff+8);
+
+    //echo transaction id
+    memcpy(reply+4, buff+12, 4);
+
+    if (action == (unsigned int)ACT_CONNECT && cid == (unsigned long long)PROTOCOL_ID) {
+      put32(reply, ACT_CONNECT);
+      cid = htobe64(this->conn_id(from, epoch));
+      memcpy(reply+8, &cid, sizeof(cid));
+      rlen = UDP_CONN_LEN;
+    }
+    //id of this or previous epoch, a client caches it for a minute
+    else if (cid != this->conn_id(from, epoch) &&
+             cid != this->conn_id(from, epoch-1)) {
+      put32(reply, ACT_ERROR);
+      memcpy(reply+8, "bad connection id", 17);
+      rlen = 8+17;
+    }
+    else if (action == (unsigned int)ACT_ANNOUNCE && len >= UDP_ANN_LEN) {
+      ann.info_hash.assign((const char*)buff+16, HASH_LEN);
+      ann.left = be64toh(*(long long*)(buff+64));
+      ann.event = EVENTS[get32(buff+80) & 3];
+      ann.ip = get32(buff+84) ? htonl(get32(buff+84)) : from.sin_addr.s_addr;
+      ann.numwant = (int)get32(buff+92);
+      ann.port = (buff[96] << 8) | buff[97];
+
+      seeders = this->update_swarm(ann, peers, leechers);
+      put32(reply, ACT_ANNOUNCE);
+      put32(reply+8, this->interval_);
+      put32(reply+12, leechers);
+      put32(reply+16, seeders);
+      memcpy(reply+20, peers.data(), peers.size());
+      rlen = 20+peers.size();
+    }
+    else if (action == (unsigned int)ACT_SCRAPE) {
+      put32(reply, ACT_SCRAPE);
+      rlen = 8;
+
+      //unknown swarms are answered with zeros to keep order
+      for (int off = UDP_CONN_LEN; off+HASH_LEN <= len &&
+           rlen < 8+MAX_SCRAPE*12; off += HASH_LEN) {
+        ann.info_hash.assign((const char*)buff+off, HASH_LEN);
+        if (!this->swarm_stats(ann.info_hash, seeders, completed, leechers))
+          seeders = completed = leechers = 0;
+        put32(reply+rlen, seeders);
+        put32(reply+rlen+4, completed);
+        put32(reply+rlen+8, leechers);
+        rlen += 12;
+      }
+    }
+    else {
+      put32(reply, ACT_ERROR);
+      memcpy(reply+8, "unknown action", 14);
+      rlen = 8+14;
+    }
+
+    sendto(this->udpfd_, reply, rlen, 0, (struct sockaddr*)&from, fromlen);
+  }
+}
+
+/**
+ * Derive connection id of a UDP peer for an epoch
+ *
+ * @addr: peer address
+ * @epoch: connection id epoch
+ */
+unsigned long long
+tracker_server::conn_id(const struct sockaddr_in& addr, long long epoch)
+{
+  string key((const char*)&addr.sin_addr, sizeof(addr.sin_addr));
+
+  key.append((const char*)&addr.sin_port, sizeof(addr.sin_port));
+  key.append((const char*)&epoch, sizeof(epoch));
+  key.append((const char*)&this->secret_, sizeof(this->secret_));
+  return hash<string>()(key);
+}
+
+/**
+ * Record an announce in its swarm and pick peers for the
+ * reply. Peers silent for two intervals are dropped first.
+ * Replies start at a rotating offset so that every peer
+ * of a large swarm gets handed out.
+ *
+ * @ann: decoded announce
+ * @peers: receives compact peers, requester excluded
+ * @leechers: receives number of leechers
+ *
+ * Return: number of seeders
+ */
+int tracker_server::update_swarm(const Announce& ann,
+                                 string& peers, int& leechers)
+{
+  steady_clock::time_point now = steady_clock::now(); //current time
+  char addr[PEER_LEN];      //compact address of requester
+  unsigned long long key;   //packed address of requester
+  unsigned short nport;     //port in network order
+  size_t want;              //number of peers to reply
+  size_t slot;              //slot of peer
+  Peer peer;                //new peer slot
+
+  nport = htons(ann.port);
+  memcpy(addr, &ann.ip, 4);
+  memcpy(addr+4, &nport, 2);
+  key = peer_key(addr);
+  want = (ann.numwant < 0 || ann.numwant > tracker_server::MAX_PEERS_) ?
+         tracker_server::MAX_PEERS_ : ann.numwant;
+
+  this->announces_++;
+  lock_guard<mutex> lock(this->swarm_lock_);
+  Swarm& swarm = this->swarms_[ann.info_hash];
+
+  //drop peers gone silent, and the requester when it stops
+  for (size_t i = 0; i < swarm.peers.size();) {
+    if (now-swarm.peers[i].seen < seconds(2*this->interval_) &&
+        !(ann.event == STOPPED && peer_key(swarm.peers[i].addr) == key)) {
+      i++;
+      continue;
+    }
+
+    //swap with last slot
+    swarm.seeders -= swarm.peers[i].seed;
+    swarm.index.erase(peer_key(swarm.peers[i].addr));
+    swarm.peers[i] = swarm.peers.back();
+    swarm.peers.pop_back();
+    if (i < swarm.peers.size())
+      swarm.index[peer_key(swarm.peers[i].addr)] = i;
+  }
+
+  if (ann.event == COMPLETED)
+    swarm.completed++;
+
+  //insert or refresh requester
+  if (ann.event != STOPPED) {
+    auto it = swarm.index.find(key);
+    if (it == swarm.index.end()) {
+      memcpy(peer.addr, addr, PEER_LEN);
+      peer.seed = false;
+      swarm.index[key] = swarm.peers.size();
+      swarm.peers.push_back(peer);
+      slot = swarm.peers.size()-1;
+    }
+    else
+      slot = it->second;
+
+    swarm.seeders += (!ann.left) - swarm.peers[slot].seed;
+    swarm.peers[slot].seed = !ann.left;
+    swarm.peers[slot].seen = now;
+  }
+
+  //copy peers from rotating offset, skipping requester
+  peers.clear();
+  for (size_t i = 0; i < swarm.peers.size() &&
+       peers.size() < want*PEER_LEN; i++) {
+    slot = (swarm.cursor+i) % swarm.peers.size();
+    if (!memcmp(swarm.peers[slot].addr, addr, PEER_LEN))
+      continue;
+    peers.append(swarm.peers[slot].addr, PEER_LEN);
+  }
+  if (!swarm.peers.empty())
+    swarm.cursor = (swarm.cursor+want) % swarm.peers.size();
+
+  leechers = swarm.peers.size()-swarm.seeders;
+  return swarm.seeders;
+}
+
+/**
+ * Read statistics of a swarm
+ *
+ * @hash: info hash of swarm
+ * @seeders: receives number of seeds
+ * @completed: receives completed events seen
+ * @leechers: receives number of leechers
+ *
+ * Return: true if swarm is known
+ */
+bool tracker_server::swarm_stats(const string& hash, int& seeders,
+                                 int& completed, int& leechers)
+{
+  lock_guard<mutex> lock(this->swarm_lock_);
+  auto it = this->swarms_.find(hash);
+
+  if (it == this->swarms_.end())
+    return false;
+
+  seeders = it->second.seeders;
+  completed = it->second.completed;
+  leechers = it->second.peers.size()-it->second.seeders;
+  return true;
+}
+
+/**
+ * Check if string ends with suffix
+ */
+static bool ends_with(const string& str, const string& suffix)
+{
+  return str.size() >= suffix.size() &&
+         !str.compare(str.size()-suffix.size(), string::npos, suffix);
+}
+
+/**
+ * Decode %XX escapes and '+' of a query value
+ */
+static string url_decode(const string& str)
+{
+  string retval;  //decoded string
+
+  for (size_t i = 0; i < str.size(); i++) {
+    if (str[i] == '%' && i+2 < str.size()) {
+      retval += (char)strtol(str.substr(i+1, 2).c_str(), nullptr, 16);
+      i += 2;
+    }
+    else
+      retval += (str[i] == '+') ? ' ' : str[i];
+  }
+  return retval;
+}
+
+/**
+ * Find value of key in a query string, empty if absent
+ */
+static string query_value(const string& query, const string& key)
+{
+  size_t pos = 0;  //start of current pair
+  size_t end;      //end of current pair
+
+  while (pos <= query.size()) {
+    end = query.find('&', pos);
+    if (end == string::npos)
+      end = query.size();
+
+    if (!query.compare(pos, key.size()+1, key+"="))
+      return query.substr(pos+key.size()+1, end-pos-key.size()-1);
+    pos = end+1;
+  }
+  return string();
+}
+
+/**
+ * Write 32 bits integer in network order
+ */
+static void put32(unsigned char* buff, unsigned int val)
+{
+  val = htonl(val);
+  memcpy(buff, &val, sizeof(val));
+}
+
+/**
+ * Read 32 bits integer in network order
+ */
+static unsigned int get32(const unsigned char* buff)
+{
+  unsigned int val;  //host order value
+
+  memcpy(&val, buff, sizeof(val));
+  return ntohl(val);
+}
+
+/**
+ * Pack compact peer address into an integer key
+ */
+static unsigned long long peer_key(const char* addr)
+{
+  unsigned long long key = 0;  //packed address
+
+  memcpy(&key, addr, PEER_LEN);
+  return key;
+}
+
+/**
+ * Format bytes as hexdecimal string
+ */
+static string hex_string(const string& bytes)
+{
+  static const char* DIGITS = "0123456789abcdef";
+  string retval;  //hexdecimal string
+
+  for (size_t i = 0; i < bytes.size(); i++) {
+    retval += DIGITS[(unsigned char)bytes[i] >> 4];
+    retval += DIGITS[(unsigned char)bytes[i] & 0xf];
+  }
+  return retval;
+}
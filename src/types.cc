@@ -9,7 +9,10 @@
 
 #include <types.h>
 #include <mutex>          /* std::mutex */
-#include <cstring>        /* strlen() */
+#include <cstring>        /* strlen() and memcpy() */
+#include <cstdlib>        /* atoi() */
+#include <cstdint>        /* UINT16_MAX */
+#include <climits>        /* INT_MAX */
 #include <unistd.h>       /* close() */
 #include <error_handle.h> /* fail_handle */
 
@@ -20,6 +23,7 @@
 peer::peer()
 {
   rate = 0;
+  bytes = 0;
   choking = true;
   interested = false;
   bitfield = nullptr;
@@ -66,8 +70,9 @@ void hs_message(char* buff, string info_hash, string id)
   memcpy(buff+offset, HANDSHAKE, VERSION_LEN);
   offset += VERSION_LEN;
 
-  //bytes 26:19 reserved
+  //bytes 26:19 reserved, extension protocol supported
   memset(buff+offset, 0, HS_RESV);
+  buff[offset+EXT_RESV] |= EXT_BIT;
   offset += HS_RESV;
 
   //bytes 46:27 info hash
@@ -79,16 +84,90 @@ void hs_message(char* buff, string info_hash, string id)
 }
 
 /**
- * Sending have request to update
- * peer's knowledge of this client's piece
- * @sock: socket to send message
+ * Compose an extended message.
+ * message format:
+ *   (len=2+size)(id=20)(extended id)(payload)
+ *
+ * @ext_id: extended message id agreed in handshake
+ * @payload: bencoded payload
+ *
+ * Return: whole message
+ */
+string ext_message(char ext_id, const string& payload)
+{
+  uint32_t len_prefix = htonl(ID_LEN+1+payload.size()); //prefix does not count itself
+  string mesg;                                           //message
+
+  mesg.append((char*)&len_prefix, PF_LEN);
+  mesg += EXTENDED;
+  mesg += ext_id;
+  mesg += payload;
+
+  return mesg;
+}
+
+/**
+ * Pack an ip:port address in compact form, 4 bytes of
+ * IPv4 address and 2 bytes of port in network order.
+ *
+ * @addr: address as ip:port
+ * Return: 6 bytes, empty if address is not IPv4
+ */
+string compact_addr(const string& addr)
+{
+  char bytes[ADDR_LEN];   //compact address
+  size_t colon;           //port delimiter
+  uint16_t port;          //port in network order
+  int value;              //port value
+
+  colon = addr.rfind(':');
+  if (colon == string::npos)
+    return "";
+
+  value = atoi(addr.c_str()+colon+1);
+  if (value <= 0 || value > UINT16_MAX)
+    return "";
+
+  if (inet_pton(AF_INET, addr.substr(0, colon).c_str(), bytes) != 1)
+    return "";
+
+  port = htons((uint16_t)value);
+  memcpy(bytes+ADDR_LEN-sizeof(port), &port, sizeof(port));
+  return string(bytes, ADDR_LEN);
+}
+
+/**
+ * Unpack a compact address
+ *
+ * @bytes: 6 bytes of IPv4 address and port in network order
+ * Return: address as ip:port
+ */
+string parse_addr(const char* bytes)
+{
+  char ip[INET_ADDRSTRLEN] = {};  //dotted address
+  uint16_t port;                  //port in network order
+
+  inet_ntop(AF_INET, bytes, ip, INET_ADDRSTRLEN);
+  memcpy(&port, bytes+ADDR_LEN-sizeof(port), sizeof(port));
+
+  return string(ip)+":"+to_string(ntohs(port));
+}
+
+/**
+ * Compose a have message to update
+ * peer's knowledge of this client's piece.
+ * message format:
+ *   (len=5)(id=4)(index)
+ *
+ * @buff: buffer of at least PF_LEN+HAV_LEN bytes
  * @index: piece index to claim have, in local byte order
+ *
+ * Return: message length
  */
-void send_have(int sock, uint32_t index)
+size_t have_message(char* buff, uint32_t index)
 {
   uint32_t req_size;  //request size
   int offset = 0;     //offset in request buffer
-  char buff[PF_LEN+HAV_LEN] = {};  //request buffer
 
   //convert integers to network order
   req_size = htonl(HAV_LEN);
@@ -105,9 +184,7 @@ void send_have(int sock, uint32_t index)
   //bytes 8:5 piece index
   memcpy(buff+offset, &index, IBL_LEN);
 
-  //send request
-  if (write(sock, buff, PF_LEN+HAV_LEN) < 0)
-    fail_handle(FAL_SYS);
+  return PF_LEN+HAV_LEN;
 }
 
 /**
@@ -126,6 +203,177 @@ void update_pbf(uint32_t* index_ptr, char* bf)
   bf[index/BYTE_LEN] |= (1 << (BYTE_LEN-index%BYTE_LEN-1));
 }
 
+/**
+ * Compose a request message for a block.
+ * message format:
+ *   (len=13)(id=6)(index)(begin)(length)
+ *
+ * @buff: buffer of at least PF_LEN+REQ_LEN bytes
+ * @index: piece index
+ * @begin: block offset in piece
+ * @length: block length
+ *
+ * Return: message length
+ */
+size_t request_message(char* buff, uint32_t index,
+                       uint32_t begin, uint32_t length)
+{
+  uint32_t len_prefix = htonl(REQ_LEN);  //length prefix in network order
+  int offset = 0;                        //offset in request buffer
+
+  //convert integers to network order
+  index = htonl(index);
+  begin = htonl(begin);
+  length = htonl(length);
+
+  //bytes: 3:0 length prefix
+  memcpy(buff, &len_prefix, PF_LEN);
+  offset += PF_LEN;
+
+  //byte: 4 request ID
+  memset(buff+offset, REQUEST, ID_LEN);
+  offset += ID_LEN;
+
+  //bytes: 8:5 piece index
+  memcpy(buff+offset, &index, IBL_LEN);
+  offset += IBL_LEN;
+
+  //bytes: 12:9 block begin offset
+  memcpy(buff+offset, &begin, IBL_LEN);
+  offset += IBL_LEN;
+
+  //bytes: 16:13 requested length
+  memcpy(buff+offset, &length, IBL_LEN);
+  offset += IBL_LEN;
+
+  return offset;
+}
+
+/**
+ * Decode payload of a request message, the part
+ * following message ID.
+ *
+ * @buff: index, begin and length in network order
+ * @index: piece index
+ * @begin: block offset in piece
+ * @length: block length
+ */
+void parse_request(const char* buff, uint32_t& index,
+                   uint32_t& begin, uint32_t& length)
+{
+  memcpy(&index, buff, IBL_LEN);
+  memcpy(&begin, buff+IBL_LEN, IBL_LEN);
+  memcpy(&length, buff+2*IBL_LEN, IBL_LEN);
+
+  //convert integers to local order
+  index = ntohl(index);
+  begin = ntohl(begin);
+  length = ntohl(length);
+}
+
+/**
+ * Compose a piece message carrying a block.
+ * message format:
+ *   (len=9+size)(id=7)(index)(begin)(block)
+ *
+ * @buff: buffer of at least PF_LEN+PIC_LEN+size bytes
+ * @index: piece index
+ * @begin: block offset in piece
+ * @block: block data
+ * @size: block length
+ *
+ * Return: message length
+ */
+size_t piece_message(char* buff, uint32_t index, uint32_t begin,
+                     const unsigned char* block, uint32_t size)
+{
+  uint32_t len_prefix = htonl(PIC_LEN+size);  //prefix does not count itself
+  int offset = 0;                             //offset in message buffer
+
+  //convert integers to network order
+  index = htonl(index);
+  begin = htonl(begin);
+
+  //bytes: 3:0 prefix length
+  memcpy(buff, &len_prefix, PF_LEN);
+  offset += PF_LEN;
+
+  //byte: 4 message id
+  memset(buff+offset, PIECE, ID_LEN);
+  offset += ID_LEN;
+
+  //bytes: 8:5 piece index
+  memcpy(buff+offset, &index, IBL_LEN);
+  offset += IBL_LEN;
+
+  //bytes: 12:9 block offset
+  memcpy(buff+offset, &begin, IBL_LEN);
+  offset += IBL_LEN;
+
+  //bytes: L:13 block data
+  memcpy(buff+offset, block, size);
+  offset += size;
+
+  return offset;
+}
+
+/**
+ * Add pieces a peer holds to piece counts, counts of
+ * pieces at local are INT_MAX and left untouched.
+ *
+ * @pcount: count of each piece
+ * @pbf: peer bitfield
+ * @pnum: number of pieces
+ */
+void count_pieces(int* pcount, const char* pbf, uint32_t pnum)
+{
+  for (uint32_t i = 0; i < pnum; i++) {
+    //count of pieces already at local are set to INT_MAX, ignore them
+    if (pcount[i] == INT_MAX) continue;
+
+    //increase piece count if piece bit is set
+    if (*(pbf+i/BYTE_LEN) & (1<<(BYTE_LEN-i%BYTE_LEN-1)))
+      pcount[i]++;
+  }
+}
+
+/**
+ * Find the rarest pieces held by some peer.
+ *
+ * @pcount: count of each piece, INT_MAX if at local
+ * @pnum: number of pieces
+ * @seqs: sequences of the rarest pieces
+ *
+ * Return: count of the rarest piece, INT_MAX when
+ *         every piece is at local, 0 when missing
+ *         pieces are held by no peer
+ */
+int rarest_pieces(const int* pcount, uint32_t pnum, vector<uint32_t>& seqs)
+{
+  int rn = INT_MAX;      //rarest piece number
+  bool missing = false;  //piece neither at local nor at peers
+
+  seqs.clear();
+
+  //find the number of the rarest piece
+  for (uint32_t i = 0; i < pnum; i++) {
+    if (!pcount[i])
+      missing = true;
+    else if (pcount[i] < rn)
+      rn = pcount[i];
+  }
+
+  if (rn == INT_MAX)
+    return missing ? 0 : rn;
+
+  //find the sequences of pieces which are the rarest
+  for (uint32_t i = 0; i < pnum; i++) {
+    if (pcount[i] == rn)
+      seqs.push_back(i);
+  }
+
+  return rn;
+}
 
 /**
  * Acqurie reader locker, if
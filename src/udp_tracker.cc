@@ -0,0 +1,550 @@
+/**
+ * Implementation of class udp_tracker.
+ * See class defination: '../include/udp_tracker.h'
+ *
+ */
+
+#include <udp_tracker.h>
+#include <cstring>       /* memcpy() */
+#include <algorithm>     /* std::min() */
+#include <endian.h>      /* htobe64() and be64toh() */
+#include <unistd.h>      /* close() */
+#include <fcntl.h>       /* fcntl() */
+#include <netdb.h>       /* getaddrinfo() */
+#include <arpa/inet.h>   /* htonl(), ntohl() and inet_ntoa() */
+#include <sys/socket.h>  /* socket(), send() and recv() */
+#include <executor.h>    /* work-stealing executor */
+
+/************* Constants *************/
+static const char* SCHEME = "udp://";     /* URL scheme of UDP trackers */
+static const int CONN_LEN = 16;           /* length of connect request and reply */
+static const int ANN_LEN = 98;            /* length of announce request */
+static const int ANN_HEAD = 20;           /* length of announce reply header */
+static const int SCRP_HEAD = 16;          /* length of scrape request header */
+static const int SWARM_LEN = 12;          /* length of a scrape reply entry */
+static const int ERR_HEAD = 8;            /* length of error reply header */
+static const int PEER_LEN = 6;            /* bytes represent single peer in reply */
+static const int HASH_LEN = 20;           /* length of info hash and peer id */
+
+/********** Internal Function **********/
+static void put32(unsigned char* buff, unsigned int val);
+static void put64(unsigned char* buff, long long val);
+static unsigned int get32(const unsigned char* buff);
+static long long get64(const unsigned char* buff);
+
+/**
+ * Constructor - split URL, the tracker is resolved
+ * lazily by the first transaction.
+ *
+ * @url: tracker URL in form udp://host:port[/path]
+ * @rng: random engine of owner, used on its I/O thread
+ * @wake: wakes owner's I/O thread after resolution
+ */
+udp_tracker::udp_tracker(string url, mt19937& rng,
+                         Wake wake) : url_(url),
+                                      rng_(rng),
+                                      wake_(wake)
+{
+  string hostport;   //host:port portion of URL
+  size_t colon;      //position of port separator
+
+  hostport = url.substr(strlen(SCHEME));
+  hostport = hostport.substr(0, hostport.find('/'));
+  colon = hostport.find_last_of(':');
+  this->host_ = hostport.substr(0, colon);
+  this->port_ = (colon == string::npos) ? "" : hostport.substr(colon+1);
+
+  this->fd_ = -1;
+  this->conn_id_ = 0;
+  this->conn_expire_ = steady_clock::time_point::min();
+  this->key_ = this->rng_();
+  this->resolve_fails_ = 0;
+  this->resolve_retry_ = steady_clock::time_point::min();
+}
+
+/**
+ * Destructor - close socket and drop transactions, a
+ * resolution still running no longer wakes owner
+ */
+udp_tracker::~udp_tracker()
+{
+  if (this->resolve_) {
+    lock_guard<mutex> lock(this->resolve_->lock);
+    this->resolve_->wake = nullptr;
+  }
+
+  for (unsigned int i = 0; i < this->trans_.size(); i++)
+    delete this->trans_[i];
+
+  if (this->fd_ >= 0)
+    close(this->fd_);
+}
+
+/**
+ * Check if URL names a UDP tracker
+ *
+ * @url: tracker URL
+ */
+bool udp_tracker::is_udp(const string& url)
+{
+  return !url.compare(0, strlen(SCHEME), SCHEME);
+}
+
+/**
+ * Start an announce transaction.
+ *
+ * @para: announce parameters
+ * @cookie: owner's handle returned with the reply
+ */
+void udp_tracker::announce(const Announce& para, void* cookie)
+{
+  Trans* trans = new Trans();  //new transaction
+
+  trans->cookie = cookie;
+  trans->action = udp_tracker::ACT_ANNOUNCE;
+  trans->para = para;
+  this->start(trans);
+}
+
+/**
+ * Start a scrape transaction.
+ *
+ * @hashes: 20 bytes info hashes, at most MAX_HASHES_
+ * @cookie: owner's handle returned with the reply
+ */
+void udp_tracker::scrape(const vector<string>& hashes, void* cookie)
+{
+  Trans* trans = new Trans();  //new transaction
+
+  trans->cookie = cookie;
+  trans->action = udp_tracker::ACT_SCRAPE;
+  trans->hashes = hashes;
+  if (trans->hashes.size() > (size_t)udp_tracker::MAX_HASHES_)
+    trans->hashes.resize(udp_tracker::MAX_HASHES_);
+  this->start(trans);
+}
+
+/**
+ * Send first datagram of a transaction, or let it wait
+ * for the tracker address. Fails at once while a failed
+ * resolution is backed off.
+ *
+ * @trans: new transaction
+ */
+void udp_tracker::start(Trans* trans)
+{
+  this->trans_.push_back(trans);
+
+  if (this->fd_ >= 0) {
+    this->transmit(trans);
+    return;
+  }
+
+  if (!this->resolve_ && steady_clock::now() < this->resolve_retry_) {
+    this->fail(trans, "cannot resolve "+this->host_);
+    return;
+  }
+
+  //sent once resolved, no retransmit before
+  trans->deadline = steady_clock::time_point::max();
+  if (!this->resolve_)
+    this->resolve();
+}
+
+/**
+ * Resolve tracker host on a disk worker, a slow name
+ * server never holds up the I/O thread. The outcome is
+ * picked up by resolved() after the owner is woken.
+ */
+void udp_tracker::resolve()
+{
+  shared_ptr<Resolve> res(new Resolve());  //resolution state
+  string host = this->host_;              //tracker host
+  string port = this->port_;              //tracker port
+
+  res->done = false;
+  res->ok = false;
+  res->wake = this->wake_;
+  this->resolve_ = res;
+
+  executor::submit(executor::DISK, [res, host, port] {
+    struct addrinfo hints = {};  //resolve hints
+    struct addrinfo* ai;         //resolve result
+    bool ok;                     //host resolved
+
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    ok = !getaddrinfo(host.c_str(), port.c_str(), &hints, &ai);
+
+    lock_guard<mutex> lock(res->lock);
+    if (ok) {
+      memcpy(&res->addr, ai->ai_addr, sizeof(res->addr));
+      freeaddrinfo(ai);
+    }
+    res->ok = ok;
+    res->done = true;
+    if (res->wake)
+      res->wake();
+  });
+}
+
+/**
+ * Open socket once resolution finished and send the
+ * waiting transactions, or fail them and back off
+ * the next resolution.
+ */
+void udp_tracker::resolved()
+{
+  struct sockaddr_in addr;  //resolved address
+  bool ok;                  //socket ready
+  vector<Trans*> waiting;   //transactions waiting for address
+
+  if (!this->resolve_)
+    return;
+
+  {
+    lock_guard<mutex> lock(this->resolve_->lock);
+    if (!this->resolve_->done)
+      return;
+    ok = this->resolve_->ok;
+    addr = this->resolve_->addr;
+  }
+  this->resolve_.reset();
+
+  ok = ok && this->open_socket(addr);
+  waiting = this->trans_;
+
+  if (ok) {
+    this->resolve_fails_ = 0;
+    for (unsigned int i = 0; i < waiting.size(); i++)
+      this->transmit(waiting[i]);
+    return;
+  }
+
+  this->resolve_retry_ = steady_clock::now() +
+                         seconds(udp_tracker::RESOLVE_BASE_ <<
+                                 min(this->resolve_fails_,
+                                     (int)udp_tracker::MAX_BACKOFF_));
+  this->resolve_fails_++;
+  for (unsigned int i = 0; i < waiting.size(); i++)
+    this->fail(waiting[i], "cannot resolve "+this->host_);
+}
+
+/**
+ * Drain datagrams queued on socket, called when
+ * the socket is readable.
+ */
+void udp_tracker::on_readable()
+{
+  unsigned char buff[udp_tracker::DGRAM_SIZE_]; //datagram buffer
+  ssize_t len;                                  //datagram length
+
+  if (this->fd_ < 0) return;
+
+  while ((len = recv(this->fd_, buff, sizeof(buff), 0)) >= 0)
+    this->dispatch(buff, len);
+}
+
+/**
+ * Retransmit transactions whose reply is late, the wait
+ * doubles with every attempt. A transaction fails after
+ * MAX_ATTEMPT_ datagrams, connect requests included.
+ */
+void udp_tracker::on_timer()
+{
+  steady_clock::time_point now = steady_clock::now();  //current time
+  vector<Trans*> late;                                 //transactions timed out
+
+  //transactions waiting for address go first
+  this->resolved();
+
+  for (unsigned int i = 0; i < this->trans_.size(); i++)
+    if (this->trans_[i]->deadline <= now)
+      late.push_back(this->trans_[i]);
+
+  for (unsigned int i = 0; i < late.size(); i++) {
+    if (late[i]->attempt >= udp_tracker::MAX_ATTEMPT_) {
+      this->fail(late[i], "timed out");
+      continue;
+    }
+    this->transmit(late[i]);
+  }
+}
+
+/**
+ * Hand finished transactions over to owner
+ *
+ * @out: receives replies of finished transactions
+ */
+void udp_tracker::take_done(vector<Reply>& out)
+{
+  out.insert(out.end(), this->done_.begin(), this->done_.end());
+  this->done_.clear();
+}
+
+/**
+ * Interface for retrieving socket descriptor, -1 if
+ * the tracker is not resolved yet
+ */
+int udp_tracker::get_fd()
+{
+  return this->fd_;
+}
+
+/**
+ * Check if any transaction is in progress
+ */
+bool udp_tracker::busy()
+{
+  return !this->trans_.empty();
+}
+
+/**
+ * Interface for retrieving local address of socket
+ */
+string udp_tracker::get_ip()
+{
+  struct sockaddr_in local = {};      //local address
+  socklen_t len = sizeof(local);      //address length
+
+  if (this->fd_ < 0 ||
+      getsockname(this->fd_, (struct sockaddr*)&local, &len))
+    return string();
+  return string(inet_ntoa(local.sin_addr));
+}
+
+/**
+ * Interface for retrieving earliest retransmit time
+ */
+steady_clock::time_point udp_tracker::get_deadline()
+{
+  steady_clock::time_point deadline = steady_clock::time_point::max();
+
+  for (unsigned int i = 0; i < this->trans_.size(); i++)
+    deadline = min(deadline, this->trans_[i]->deadline);
+  return deadline;
+}
+
+/**
+ * Open a connected non-blocking datagram socket to the
+ * resolved tracker, only done once.
+ *
+ * @addr: tracker address
+ * Return: true if socket is ready
+ */
+bool udp_tracker::open_socket(const struct sockaddr_in& addr)
+{
+  int fd;  //new socket
+
+  memcpy(&this->addr_, &addr, sizeof(this->addr_));
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return false;
+
+  //only datagrams from tracker are received on a connected socket
+  if (connect(fd, (struct sockaddr*)&this->addr_, sizeof(this->addr_)) ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+    close(fd);
+    return false;
+  }
+
+  this->fd_ = fd;
+  return true;
+}
+
+/**
+ * Send next datagram of transaction, a connect request
+ * if no valid connection id is cached.
+ *
+ * @trans: transaction to send
+ */
+void udp_tracker::transmit(Trans* trans)
+{
+  unsigned char buff[udp_tracker::DGRAM_SIZE_]; //datagram buffer
+  int len;                                      //datagram length
+
+  trans->tid = this->rng_();
+  trans->connecting = (steady_clock::now() >= this->conn_expire_);
+
+  if (trans->connecting) {
+    //connect request
+    put64(buff, udp_tracker::PROTOCOL_ID_);
+    put32(buff+8, udp_tracker::ACT_CONNECT);
+    put32(buff+12, trans->tid);
+    len = CONN_LEN;
+  }
+  else if (trans->action == udp_tracker::ACT_ANNOUNCE) {
+    //announce request
+    put64(buff, this->conn_id_);
+    put32(buff+8, udp_tracker::ACT_ANNOUNCE);
+    put32(buff+12, trans->tid);
+    memcpy(buff+16, trans->para.info_hash.data(), HASH_LEN);
+    memcpy(buff+36, trans->para.peer_id.data(), HASH_LEN);
+    put64(buff+56, trans->para.downloaded);
+    put64(buff+64, trans->para.left);
+    put64(buff+72, trans->para.uploaded);
+    put32(buff+80, trans->para.event);
+    put32(buff+84, 0);            //IP chosen by tracker
+    put32(buff+88, this->key_);
+    put32(buff+92, -1);           //default number of peers
+    buff[96] = trans->para.port >> 8;
+    buff[97] = trans->para.port & 0xff;
+    len = ANN_LEN;
+  }
+  else {
+    //scrape request
+    put64(buff, this->conn_id_);
+    put32(buff+8, udp_tracker::ACT_SCRAPE);
+    put32(buff+12, trans->tid);
+    len = SCRP_HEAD;
+    for (unsigned int i = 0; i < trans->hashes.size(); i++) {
+      memcpy(buff+len, trans->hashes[i].data(), HASH_LEN);
+      len += HASH_LEN;
+    }
+  }
+
+  //a lost datagram is recovered by retransmission
+  send(this->fd_, buff, len, 0);
+
+  trans->deadline = steady_clock::now() +
+                    seconds(udp_tracker::RETRANS_BASE_ << trans->attempt);
+  trans->attempt++;
+}
+
+/**
+ * Match a datagram to its transaction and advance it.
+ * Datagrams not matching any transaction are ignored.
+ *
+ * @buff: datagram
+ * @len: datagram length
+ */
+void udp_tracker::dispatch(const unsigned char* buff, int len)
+{
+  Trans* trans = nullptr;  //matched transaction
+  Reply reply = {};        //parsed reply
+  unsigned int action;     //action of reply
+  unsigned int tid;        //transaction id of reply
+
+  if (len < ERR_HEAD) return;
+  action = get32(buff);
+  tid = get32(buff+4);
+
+  for (unsigned int i = 0; i < this->trans_.size(); i++)
+    if (this->trans_[i]->tid == tid)
+      trans = this->trans_[i];
+  if (!trans) return;
+
+  //error reply, connection id may be refused, reconnect next time
+  if (action == udp_tracker::ACT_ERROR) {
+    this->conn_expire_ = steady_clock::time_point::min();
+    this->fail(trans, string((const char*)buff+ERR_HEAD, len-ERR_HEAD));
+    return;
+  }
+
+  //connect reply, cache id and send the actual request
+  if (trans->connecting) {
+    if (action != udp_tracker::ACT_CONNECT || len < CONN_LEN) return;
+    this->conn_id_ = get64(buff+8);
+    this->conn_expire_ = steady_clock::now() +
+                         seconds((int)udp_tracker::CONN_TTL_);
+    this->transmit(trans);
+    return;
+  }
+
+  if (action != (unsigned int)trans->action) return;
+
+  if (action == udp_tracker::ACT_ANNOUNCE) {
+    //announce reply
+    if (len < ANN_HEAD) return;
+    reply.interval = get32(buff+8);
+    reply.leechers = get32(buff+12);
+    reply.seeders = get32(buff+16);
+    for (int off = ANN_HEAD; off+PEER_LEN <= len; off += PEER_LEN)
+      reply.peers.push_back(string((const char*)buff+off, PEER_LEN));
+  }
+  else {
+    //scrape reply
+    for (int off = ERR_HEAD; off+SWARM_LEN <= len; off += SWARM_LEN)
+      reply.swarms.push_back({(int)get32(buff+off),
+                              (int)get32(buff+off+4),
+                              (int)get32(buff+off+8)});
+  }
+
+  this->finish(trans, reply);
+}
+
+/**
+ * Move transaction to finished list
+ *
+ * @trans: finished transaction
+ * @reply: outcome of transaction
+ */
+void udp_tracker::finish(Trans* trans, Reply& reply)
+{
+  reply.cookie = trans->cookie;
+  reply.ok = true;
+  this->done_.push_back(reply);
+
+  for (auto it = this->trans_.begin(); it != this->trans_.end(); it++) {
+    if (*it != trans) continue;
+    this->trans_.erase(it);
+    break;
+  }
+  delete trans;
+}
+
+/**
+ * Finish transaction with a failure
+ *
+ * @trans: failed transaction
+ * @reason: reason of failure
+ */
+void udp_tracker::fail(Trans* trans, string reason)
+{
+  Reply reply = {};  //failed reply
+
+  this->finish(trans, reply);
+  this->done_.back().ok = false;
+  this->done_.back().error = reason;
+}
+
+/**
+ * Write 32 bits integer in network order
+ */
+static void put32(unsigned char* buff, unsigned int val)
+{
+  val = htonl(val);
+  memcpy(buff, &val, sizeof(val));
+}
+
+/**
+ * Write 64 bits integer in network order
+ */
+static void put64(unsigned char* buff, long long val)
+{
+  val = htobe64(val);
+  memcpy(buff, &val, sizeof(val));
+}
+
+/**
+ * Read 32 bits integer in network order
+ */
+static unsigned int get32(const unsigned char* buff)
+{
+  unsigned int val;  //host order value
+
+  memcpy(&val, buff, sizeof(val));
+  return ntohl(val);
+}
+
+/**
+ * Read 64 bits integer in network order
+ */
+static long long get64(const unsigned char* buff)
+{
+  long long val;  //host order value
+
+  memcpy(&val, buff, sizeof(val));
+  return be64toh(val);
+}
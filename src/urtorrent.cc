@@ -4,18 +4,25 @@
  * Specific details are at <bittorrent.org>.
  *
  * Program launcher, performs following jobs:
- * - setup componets including:
- *   metainfo handle, tracker agent, TCP server,
- *   request dispatcher etc.
+ * - setup a session hosting every torrent given,
+ *   each with its metainfo handle, tracker agent
+ *   and core, sharing one TCP server
  *
- * - interact with user commands
+ * - interact with user commands, on the prompt or
+ *   on a control socket when run as a daemon
  *
  * - cleanup objects on finish
  *
  */
 
-#include <core.h>   /* Peer Wire Protocol core components */
-#include <signal.h> /* signal() */
+#include <session.h> /* session of Peer Wire Protocol cores */
+#include <creator.h> /* metainfo file creator */
+#include <tracker_server.h> /* embedded tracker */
+#include <executor.h> /* work-stealing executor */
+#include <control.h> /* daemon control socket */
+#include <signal.h>  /* signal() */
+#include <unistd.h>  /* pause() */
+#include <fstream>   /* std::ofstream */
 
 /***************** Constants *****************/
 static const string PROMPT = "urtorrent> "; /* urtorrent command prompt */
@@ -25,21 +32,73 @@ static const string _ANNOUCE = "announce";  /* announce command */
 static const string _INFO = "trackerinfo";  /* trackerinfo command */
 static const string _SHOW = "show";         /* show command */
 static const string _STATUS = "status";     /* status command */
+static const string _SCRAPE = "scrape";     /* scrape command */
+static const string _METRICS = "metrics";   /* metrics command */
+static const string _TRACE = "trace";       /* trace command */
+static const string _LIMIT = "limit";       /* rate limit command */
+static const string _LIST = "torrents";     /* torrent list command */
+static const string _SELECT = "torrent";    /* torrent selection command */
+static const string _ADD = "add";           /* torrent adding command */
+static const string _CREATE = "create";     /* metainfo creation mode */
+static const string _TRACKER = "tracker";   /* tracker mode and command */
+static const string _EMBED = "-t";          /* embedded tracker option */
+static const string _ADVERT = "-a";         /* advertised port option */
+static const string _MFILE = "-m";          /* metrics file option */
+static const string _TFILE = "-T";          /* trace file option */
+static const string TRACE_FILE = "trace.json"; /* default trace file */
+static const string _ULIMIT = "-U";         /* global upload limit option */
+static const string _DLIMIT = "-D";         /* global download limit option */
+static const string _CLIMIT = "-C";         /* connection budget option */
+static const string _WORKERS = "-w";        /* executor workers option */
+static const string _DAEMON = "-d";         /* daemon control socket option */
+static const string _LSD = "-L";            /* local discovery group option */
+static const string _SUPER = "-S";          /* super seeding option, no value */
+static const string _CACHE = "-R";          /* read cache size option */
+static const string _UP = "up";             /* upload direction */
+static const string _DOWN = "down";         /* download direction */
+static const string _GLOBAL = "global";     /* limit of process */
+static const string _TORRENT = "torrent";   /* limit of torrent */
+static const string _PEER = "peer";         /* limit of each peer */
+static const long long BYTES_PER_KB = 1024; /* bytes in a kilobyte */
+static const double BYTES_PER_MB = 1048576; /* bytes in a megabyte */
 
 /************** Global Variables **************/
 string port;          /* client port number */
-string torrent;       /* torrent file */
+string advert;        /* port announced to tracker */
+string mfile;         /* metrics file, empty if none */
+string tfile;         /* trace file, empty if not tracing */
+string cfile;         /* control socket, empty if not a daemon */
+string tport;         /* embedded tracker port, empty if none */
+string lgroup;        /* local discovery group, empty if off */
+vector<string> torrents; /* torrent files */
 string command;       /* user input command */
-server* serv;         /* P2P sender */
-metainfo* mi;         /* metainfo manipulator */
-tracker_agent* agent; /* tracker local agent */
-core* _core;          /* PWP control */
+session* sess;        /* session hosting torrents */
+int cur;              /* index of selected torrent */
+metainfo* mi;         /* metainfo of selected torrent */
+tracker_agent* agent; /* tracker agent of selected torrent */
+core* _core;          /* PWP control of selected torrent */
+tracker_server* trk;  /* embedded tracker */
+control* ctl;         /* control socket of daemon */
+long long up_rate;    /* global upload limit at start */
+long long down_rate;  /* global download limit at start */
+int max_conns;        /* connection budget at start */
+long long cache_size; /* read cache of process in bytes */
+int workers;          /* executor workers, 0 for one per core */
+bool super_seed;      /* super seed complete torrents */
 bool quit;            /* exit signal */
 
 
 /************ Internal Functions **************/
 void initialize();
 void finalize();
+void dump_trace();
+void set_limit();
+void select_torrent(int index);
+void list_torrents();
+void add_torrent();
+int create(int argc, char **argv);
+int run_tracker(int argc, char **argv);
+int run_daemon();
 
 /**
  * main - urtorrent driver function
@@ -52,13 +111,92 @@ void finalize();
  */
 int main(int argc, char **argv) 
 {
-	//input argument check
-	if (argc != 3)
+	//metainfo creation mode
+	if (argc > 1 && string(argv[1]) == _CREATE)
+		return create(argc, argv);
+
+	//standalone tracker mode
+	if (argc > 1 && string(argv[1]) == _TRACKER)
+		return run_tracker(argc, argv);
+
+	//leading options, each followed by a value but -S
+	trk = nullptr;
+	while (argc > 2 && argv[1][0] == '-') {
+		//pieces revealed one by one, the only option without value
+		if (string(argv[1]) == _SUPER) {
+			super_seed = true;
+			argc--;
+			argv++;
+			continue;
+		}
+		//embedded tracker
+		if (string(argv[1]) == _EMBED && tport.empty()) {
+			tport = argv[2];
+		}
+		//commands read from a control socket instead of the prompt
+		else if (string(argv[1]) == _DAEMON && cfile.empty()) {
+			cfile = argv[2];
+		}
+		//peers on local network found by multicast announces
+		else if (string(argv[1]) == _LSD && lgroup.empty()) {
+			lgroup = argv[2];
+		}
+		//port peers reach this client on, e.g. a proxy in front of it
+		else if (string(argv[1]) == _ADVERT && advert.empty()) {
+			advert = argv[2];
+		}
+		//file rewritten with Prometheus metrics every timeout
+		else if (string(argv[1]) == _MFILE && mfile.empty()) {
+			mfile = argv[2];
+		}
+		//global rate limits in KB/s
+		else if (string(argv[1]) == _ULIMIT) {
+			up_rate = atoll(argv[2])*BYTES_PER_KB;
+		}
+		else if (string(argv[1]) == _DLIMIT) {
+			down_rate = atoll(argv[2])*BYTES_PER_KB;
+		}
+		//peer connections of every torrent together
+		else if (string(argv[1]) == _CLIMIT) {
+			max_conns = atoi(argv[2]);
+		}
+		//verified pieces kept in memory for upload, MB per torrent
+		else if (string(argv[1]) == _CACHE) {
+			cache_size = atoll(argv[2])*BYTES_PER_KB*BYTES_PER_KB;
+		}
+		//threads running timers, hashing and disk jobs
+		else if (string(argv[1]) == _WORKERS) {
+			workers = atoi(argv[2]);
+		}
+		//piece lifecycle traced from start, written on quit
+		else if (string(argv[1]) == _TFILE && tfile.empty()) {
+			tfile = argv[2];
+			trace::enable(true);
+		}
+		else {
+			error_handle(ERR_USAGE);
+		}
+		argc -= 2;
+		argv += 2;
+	}
+
+	//input argument check, a daemon may start without torrents
+	if (argc < (cfile.empty() ? 3 : 2))
 		error_handle(ERR_USAGE);
 
-	//retrieve port and torrent from argument list
+	//retrieve port and torrents from argument list
 	port = argv[1];
-	torrent = argv[2];
+	torrents.assign(argv+2, argv+argc);
+	if (advert.empty())
+		advert = port;
+
+	//daemon waits for stop signals
+	if (!cfile.empty())
+		return run_daemon();
+
+	//embedded tracker, started before the tracker agent announces
+	if (!tport.empty())
+		trk = new tracker_server(tport, 0);
 
 	//start up environments
 	initialize();
@@ -88,11 +226,48 @@ int main(int argc, char **argv)
 		else if (command == _STATUS) {
 			_core->do_status();
 		}
+		else if (command == _SCRAPE) {
+			agent->do_scrape();
+		}
+		else if (command == _METRICS) {
+			sess->do_metrics(cout);
+		}
+		else if (command == _TRACE) {
+			dump_trace();
+		}
+		else if (command == _LIMIT) {
+			set_limit();
+		}
+		else if (command == _LIST) {
+			list_torrents();
+		}
+		else if (command == _SELECT) {
+			int index;  //torrent index
+
+			cin >> index;
+			if (!cin || index < 0 || index >= sess->size()) {
+				cin.clear();
+				cout << "usage: torrent <index>, type torrents to list" << endl;
+			}
+			else {
+				select_torrent(index);
+			}
+		}
+		else if (command == _ADD) {
+			add_torrent();
+		}
+		else if (command == _TRACKER && trk) {
+			trk->show_info();
+		}
 		else {
 			help();
 		}
 	}
 
+	//write trace of whole session
+	if (trace::enabled())
+		dump_trace();
+
 	//clean up
 	finalize();
 	return 0;
@@ -103,20 +278,246 @@ int main(int argc, char **argv)
  */
 void initialize()
 {
+	string reason;  //failure adding a torrent
+
 	//ignore SIGPIPE signal
 	signal(SIGPIPE, SIG_IGN);
+
+	//size executor before any job
+	executor::init(max(workers, 0));
 	
-	//establish P2P server
-	serv = new server(port);
+	//establish session listening on port
+	sess = new session(port, advert, mfile);
+	sess->get_up_limit()->set_rate(up_rate);
+	sess->get_down_limit()->set_rate(down_rate);
+	sess->set_max_conns(max_conns);
+	sess->set_super_seed(super_seed);
+	sess->set_cache_size(cache_size);
+	if (!lgroup.empty())
+		sess->discover(lgroup);
+
+	//host every torrent, commands apply to the first one
+	for (unsigned int i = 0; i < torrents.size(); i++) {
+		if (sess->add(torrents[i], reason) < 0) {
+			cerr << torrents[i] << ": " << reason << endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (sess->size())
+		select_torrent(0);
+}
+
+/**
+ * Select torrent user commands apply to
+ * @index: torrent index
+ */
+void select_torrent(int index)
+{
+	cur = index;
+	mi = sess->get_meta(index);
+	agent = sess->get_agent(index);
+	_core = sess->get_core(index);
+}
+
+/**
+ * List hosted torrents, selected one marked,
+ * followed by connections of session.
+ */
+void list_torrents()
+{
+	for (int i = 0; i < sess->size(); i++)
+		cout << (i == cur ? "* " : "  ") << i << " "
+		     << sess->get_meta(i)->get_filename()
+		     << ", left " << sess->get_agent(i)->get_left() << endl;
+
+	cout << "connections " << sess->get_conns();
+	if (sess->get_max_conns())
+		cout << " of " << sess->get_max_conns();
+	cout << endl;
+}
+
+/**
+ * Host one more torrent and select it.
+ * usage: add <torrent>
+ */
+void add_torrent()
+{
+	string file;    //torrent file
+	string reason;  //failure adding torrent
+	int index;      //index of torrent
+
+	cin >> file;
+	index = sess->add(file, reason);
+	if (index < 0) {
+		cerr << "\t" << reason << endl;
+		return;
+	}
+	select_torrent(index);
+	cout << "torrent " << cur << " " << mi->get_filename() << endl;
+}
+
+/**
+ * Create a metainfo file and report hashing throughput.
+ * usage: urtorrent create <file> <announce URL> <torrent> [piece length]
+ *
+ * @argc: argument count
+ * @argv: argument vector
+ *
+ * return: 0 on success, the program is terminated on error
+ */
+int create(int argc, char **argv)
+{
+	long long plen = 0;  //piece length, 0 for automatic
+	double mb;           //payload size in MB
+
+	if (argc != 5 && argc != 6)
+		error_handle(ERR_USAGE);
+
+	if (argc == 6)
+		plen = atoll(argv[5]);
 
-	//generate metainfo
-	mi = new metainfo(torrent, port);
+	creator maker(argv[2], argv[3], plen);
+	maker.make(argv[4]);
+
+	mb = maker.get_size()/BYTES_PER_MB;
+	cout << "created " << argv[4] << ": "
+	     << maker.get_piece_num() << " pieces of "
+	     << maker.get_piece_size() << " bytes\n";
+	cout << "hashed " << fixed << setprecision(1) << mb << " MB in "
+	     << setprecision(3) << maker.get_seconds() << " s ("
+	     << setprecision(1) << mb/maker.get_seconds() << " MB/s, "
+	     << maker.get_threads() << " threads)" << endl;
+	return 0;
+}
+
+/**
+ * Run a standalone tracker until 'quit' is entered,
+ * or until killed once standard input is closed.
+ * usage: urtorrent tracker <port> [interval]
+ *
+ * @argc: argument count
+ * @argv: argument vector
+ *
+ * return: 0 on success, the program is terminated on error
+ */
+int run_tracker(int argc, char **argv)
+{
+	if (argc != 3 && argc != 4)
+		error_handle(ERR_USAGE);
+
+	port = argv[2];
+	trk = new tracker_server(port, (argc == 4) ? atoi(argv[3]) : 0);
+
+	while (cin >> command && command != _EXIT) {
+		if (command == _SHOW)
+			trk->show_info();
+	}
+
+	//serve forever when detached from terminal
+	if (!cin)
+		for (;;) pause();
+
+	delete trk;
+	return 0;
+}
+
+/**
+ * Run as a daemon, commands arrive on the control socket
+ * until 'quit' is sent or SIGINT or SIGTERM is received.
+ *
+ * return: 0 on success, the program is terminated on error
+ */
+int run_daemon()
+{
+	sigset_t stops;  //signals stopping daemon
+	int sig;         //signal received
+
+	//every thread started later inherits the mask,
+	//stop signals are only taken below
+	sigemptyset(&stops);
+	sigaddset(&stops, SIGINT);
+	sigaddset(&stops, SIGTERM);
+	if (pthread_sigmask(SIG_BLOCK, &stops, nullptr))
+		error_handle(ERR_SYS);
+
+	if (!tport.empty())
+		trk = new tracker_server(tport, 0);
+
+	initialize();
+	ctl = new control(cfile, sess);
+
+	sigwait(&stops, &sig);
+
+	//no command runs once control is gone
+	delete ctl;
+
+	if (trace::enabled())
+		dump_trace();
+
+	finalize();
+	return 0;
+}
+
+/**
+ * Start tracing when disabled, otherwise write events
+ * recorded so far and keep tracing.
+ */
+void dump_trace()
+{
+	if (!trace::enabled()) {
+		if (tfile.empty())
+			tfile = TRACE_FILE;
+		trace::enable(true);
+		cout << "tracing, type trace again to write " << tfile << endl;
+		return;
+	}
+
+	ofstream out(tfile);
+	trace::write_json(out);
+	if (!out.good())
+		fail_handle(FAL_SYS);
+	else
+		cout << "trace written to " << tfile << endl;
+}
+
+/**
+ * Set a rate limit and display every limit.
+ * usage: limit <up|down> <global|torrent|peer> <KB/s>
+ */
+void set_limit()
+{
+	string dir;      //direction
+	string scope;    //limit level
+	long long rate;  //bytes per second, 0 for unlimited
+	bool up;         //upload limit
+
+	cin >> dir >> scope >> rate;
+	up = (dir == _UP);
+	rate *= BYTES_PER_KB;
+
+	if (!cin || rate < 0 || (!up && dir != _DOWN)) {
+		cin.clear();
+		cout << "usage: limit <up|down> <global|torrent|peer> <KB/s>, "
+		     << "0 for unlimited" << endl;
+		return;
+	}
 
-	//launch tracker agent
-	agent = new tracker_agent(mi);
+	if (scope == _GLOBAL)
+		(up ? sess->get_up_limit() : sess->get_down_limit())->set_rate(rate);
+	else if (scope == _TORRENT)
+		_core->set_limit(up ? core::TORRENT_UP : core::TORRENT_DOWN, rate);
+	else if (scope == _PEER)
+		_core->set_limit(up ? core::PEER_UP : core::PEER_DOWN, rate);
+	else
+		cout << "unknown limit " << scope << endl;
 
-	//fire core functionality
-	_core = new core(serv, mi, agent);
+	cout << "KB/s up: global " << sess->get_up_limit()->get_rate()/BYTES_PER_KB
+	     << ", torrent " << _core->get_limit(core::TORRENT_UP)/BYTES_PER_KB
+	     << ", peer " << _core->get_limit(core::PEER_UP)/BYTES_PER_KB
+	     << "; down: global " << sess->get_down_limit()->get_rate()/BYTES_PER_KB
+	     << ", torrent " << _core->get_limit(core::TORRENT_DOWN)/BYTES_PER_KB
+	     << ", peer " << _core->get_limit(core::PEER_DOWN)/BYTES_PER_KB
+	     << " (0 unlimited)" << endl;
 }
 
 /**
@@ -124,8 +525,6 @@ void initialize()
  */
 void finalize() 
 {
-	delete _core;
-	delete agent;
-	delete mi;
-	delete serv;
+	delete sess;
+	delete trk;
 }